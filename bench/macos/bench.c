@@ -0,0 +1,457 @@
+/*
+ * bench - launch-latency and output-throughput benchmarks for runasuser (macOS).
+ *
+ * Must be run as root, like runasuser itself:
+ *
+ *   bench <runasuser> [-n iterations] [-m megabytes] [-b baseline] [-r megabytes]
+ *
+ * Launch latency: runs a trivial command (/usr/bin/true) through runasuser
+ * n times per mode and reports p50/p95/p99.  Modes cover the cold path with
+ * and without --wait/--session, a running broker (--via-broker, skipped if
+ * none is listening), the session helper (--helper) and --batch, where the
+ * figure is per command.
+ *
+ * With -b, the cold path and --wait are also timed against a baseline build
+ * of runasuser (e.g. the previous release), alternating one run of each so
+ * both see the same system load, and the change in p50 is reported.  Startup
+ * is dominated by console user detection and the user lookup, so this is the
+ * before/after figure for changes to either.
+ *
+ * Spawn primitive: times fork()+execve() against posix_spawn() of the same
+ * command straight from this process, first as it is and then with r MB
+ * (default 1024) of touched memory, the case of a broker handler forked from
+ * a large daemon.  fork() has to copy the page tables of everything mapped;
+ * posix_spawn() does not, which is why runasuser spawns its children with it.
+ *
+ * Throughput: runs this binary as the user in emitter mode under --wait and
+ * measures how fast m MB on stdout, then on stderr, arrive here.
+ *
+ *   bench --emit <megabytes> <stdout|stderr>    (child side of the test)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS  200
+#define DEFAULT_MEGABYTES   256
+#define DEFAULT_BALLAST_MB  1024
+#define EMIT_CHUNK          (64 * 1024)
+
+#define BROKER_SOCKET_PATH  "/var/run/runasuser.sock"
+#define TRIVIAL_COMMAND     "/usr/bin/true"
+
+extern char **environ;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted sample, in microseconds. */
+static double percentile_us(const uint64_t *sorted, int n, int p)
+{
+    int rank = (p * n + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return (double)sorted[rank - 1] / 1e3;
+}
+
+/*
+ * Spawn argv with stdout/stderr on /dev/null (or out_fd for stdout when
+ * >= 0) and wait for it.  Returns the exit status, or -1 if it did not run.
+ */
+static int run(char *const argv[], int out_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (out_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "bench: spawn %s: %s\n", argv[0], strerror(rc));
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Time n runs of argv and print one result line. */
+static void bench_launch(const char *label, char *const argv[], int n)
+{
+    uint64_t *samples = calloc((size_t)n, sizeof(uint64_t));
+    if (!samples) {
+        fprintf(stderr, "bench: memory allocation failed\n");
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int rc = run(argv, -1);
+        samples[i] = now_ns() - t;
+        if (rc != 0) {
+            printf("  %-28s skipped (exit %d)\n", label, rc);
+            free(samples);
+            return;
+        }
+    }
+
+    qsort(samples, (size_t)n, sizeof(uint64_t), cmp_u64);
+    printf("  %-28s p50 %9.1f us  p95 %9.1f us  p99 %9.1f us\n", label,
+           percentile_us(samples, n, 50), percentile_us(samples, n, 95),
+           percentile_us(samples, n, 99));
+    free(samples);
+}
+
+/* Spawn argv with fork() and execve(), output on /dev/null, and wait for it. */
+static int run_forked(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "bench: fork: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Time n runs of the trivial command with fork()+execve() and with
+ * posix_spawn(), alternating, and print both with the change in p50.
+ */
+static void bench_spawn(const char *label, int n)
+{
+    char *argv[] = { TRIVIAL_COMMAND, NULL };
+    uint64_t *samples = calloc((size_t)n * 2, sizeof(uint64_t));
+    if (!samples) {
+        fprintf(stderr, "bench: memory allocation failed\n");
+        return;
+    }
+    uint64_t *a = samples, *b = samples + n;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int rc = run_forked(argv);
+        a[i] = now_ns() - t;
+        if (rc == 0) {
+            t = now_ns();
+            rc = run(argv, -1);
+            b[i] = now_ns() - t;
+        }
+        if (rc != 0) {
+            printf("  %-28s skipped (exit %d)\n", label, rc);
+            free(samples);
+            return;
+        }
+    }
+
+    qsort(a, (size_t)n, sizeof(uint64_t), cmp_u64);
+    qsort(b, (size_t)n, sizeof(uint64_t), cmp_u64);
+    double pa = percentile_us(a, n, 50), pb = percentile_us(b, n, 50);
+    printf("  %-28s fork+execve p50 %9.1f us  p99 %9.1f us\n", label,
+           pa, percentile_us(a, n, 99));
+    printf("  %-28s posix_spawn p50 %9.1f us  p99 %9.1f us  (%+.1f%%)\n", "",
+           pb, percentile_us(b, n, 99), (pb - pa) / pa * 100.0);
+    free(samples);
+}
+
+/*
+ * Time n runs each of before and after, interleaved, and print both with the
+ * change in p50.
+ */
+static void bench_compare(const char *label, char *const before[],
+                          char *const after[], int n)
+{
+    uint64_t *samples = calloc((size_t)n * 2, sizeof(uint64_t));
+    if (!samples) {
+        fprintf(stderr, "bench: memory allocation failed\n");
+        return;
+    }
+    uint64_t *a = samples, *b = samples + n;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int rc = run(before, -1);
+        a[i] = now_ns() - t;
+        if (rc == 0) {
+            t = now_ns();
+            rc = run(after, -1);
+            b[i] = now_ns() - t;
+        }
+        if (rc != 0) {
+            printf("  %-28s skipped (exit %d)\n", label, rc);
+            free(samples);
+            return;
+        }
+    }
+
+    qsort(a, (size_t)n, sizeof(uint64_t), cmp_u64);
+    qsort(b, (size_t)n, sizeof(uint64_t), cmp_u64);
+    double pa = percentile_us(a, n, 50), pb = percentile_us(b, n, 50);
+    printf("  %-28s baseline p50 %9.1f us  p95 %9.1f us\n", label,
+           pa, percentile_us(a, n, 95));
+    printf("  %-28s this     p50 %9.1f us  p95 %9.1f us  (%+.1f%%)\n", "",
+           pb, percentile_us(b, n, 95), (pb - pa) / pa * 100.0);
+    free(samples);
+}
+
+/* One --batch run of n trivial commands; reports the cost per command. */
+static void bench_batch(const char *runasuser, int n, int jobs)
+{
+    char path[] = "/tmp/runasuser-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "bench: mkstemp: %s\n", strerror(errno));
+        return;
+    }
+    FILE *fp = fdopen(fd, "w");
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "[\"" TRIVIAL_COMMAND "\"]\n");
+    fclose(fp);
+    chmod(path, 0644);
+
+    char jobs_str[16];
+    snprintf(jobs_str, sizeof(jobs_str), "%d", jobs);
+    char *argv[] = { (char *)runasuser, "--batch", path, "-j", jobs_str, NULL };
+
+    uint64_t t = now_ns();
+    int rc = run(argv, -1);
+    uint64_t elapsed = now_ns() - t;
+    unlink(path);
+
+    char label[32];
+    snprintf(label, sizeof(label), "--batch -j %d", jobs);
+    if (rc != 0)
+        printf("  %-28s skipped (exit %d)\n", label, rc);
+    else
+        printf("  %-28s %9.1f us per command (%d commands)\n", label,
+               (double)elapsed / 1e3 / n, n);
+}
+
+/* Read everything stream `which` of the emitter produces under --wait. */
+static void bench_throughput(const char *runasuser, const char *self,
+                             int megabytes, const char *which)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "bench: pipe: %s\n", strerror(errno));
+        return;
+    }
+
+    char mb_str[16];
+    snprintf(mb_str, sizeof(mb_str), "%d", megabytes);
+    char *argv[] = { (char *)runasuser, "--wait", (char *)self, "--emit",
+                     mb_str, (char *)which, NULL };
+    int target = strcmp(which, "stderr") == 0 ? STDERR_FILENO : STDOUT_FILENO;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], target);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+    uint64_t t = now_ns();
+    pid_t pid;
+    int rc = posix_spawn(&pid, runasuser, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0) {
+        fprintf(stderr, "bench: spawn %s: %s\n", runasuser, strerror(rc));
+        close(fds[0]);
+        return;
+    }
+
+    static char buf[EMIT_CHUNK];
+    uint64_t total = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        total += (uint64_t)n;
+    }
+    close(fds[0]);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    double secs = (double)(now_ns() - t) / 1e9;
+
+    printf("  --wait %-21s %9.1f MB/s (%.1f MB in %.3f s)\n", which,
+           (double)total / (1024.0 * 1024.0) / secs,
+           (double)total / (1024.0 * 1024.0), secs);
+}
+
+/* Child side of the throughput test: write megabytes of data to one stream. */
+static int emit(int megabytes, const char *which)
+{
+    static char buf[EMIT_CHUNK];
+    memset(buf, 'x', sizeof(buf));
+    int fd = strcmp(which, "stderr") == 0 ? STDERR_FILENO : STDOUT_FILENO;
+
+    uint64_t remaining = (uint64_t)megabytes * 1024 * 1024;
+    while (remaining > 0) {
+        size_t len = remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf);
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        remaining -= (uint64_t)n;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: bench <runasuser> [-n iterations] [-m megabytes] [-b baseline]\n"
+        "             [-r megabytes]\n"
+        "       bench --emit <megabytes> <stdout|stderr>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "--emit") == 0)
+        return emit(atoi(argv[2]), argv[3]);
+
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 5;
+    }
+
+    const char *runasuser = argv[1];
+    int iterations = DEFAULT_ITERATIONS;
+    int megabytes = DEFAULT_MEGABYTES;
+    const char *baseline = NULL;
+    int ballast_mb = DEFAULT_BALLAST_MB;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0)
+            iterations = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-m") == 0)
+            megabytes = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-b") == 0)
+            baseline = argv[i + 1];
+        else if (strcmp(argv[i], "-r") == 0)
+            ballast_mb = atoi(argv[i + 1]);
+    }
+    if (iterations < 1 || megabytes < 1 || ballast_mb < 1) {
+        usage();
+        return 5;
+    }
+
+    if (getuid() != 0) {
+        fprintf(stderr, "bench: must be run as root\n");
+        return 1;
+    }
+
+    /* The emitter runs as the console user, so it needs an absolute path */
+    char self[PATH_MAX];
+    if (!realpath(argv[0], self)) {
+        fprintf(stderr, "bench: realpath %s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    char *r = (char *)runasuser;
+    char *cold[]         = { r, TRIVIAL_COMMAND, NULL };
+    char *wait[]         = { r, "--wait", TRIVIAL_COMMAND, NULL };
+    char *session[]      = { r, "--session", TRIVIAL_COMMAND, NULL };
+    char *session_wait[] = { r, "--session", "--wait", TRIVIAL_COMMAND, NULL };
+    char *broker_wait[]  = { r, "--via-broker", "--wait", TRIVIAL_COMMAND, NULL };
+    char *helper_wait[]  = { r, "--helper", "--wait", TRIVIAL_COMMAND, NULL };
+
+    printf("launch latency (%d iterations, %s)\n", iterations, TRIVIAL_COMMAND);
+    bench_launch("(no flags)", cold, iterations);
+    bench_launch("--wait", wait, iterations);
+    bench_launch("--session", session, iterations);
+    bench_launch("--session --wait", session_wait, iterations);
+
+    struct stat st;
+    if (stat(BROKER_SOCKET_PATH, &st) == 0 && S_ISSOCK(st.st_mode))
+        bench_launch("--via-broker --wait", broker_wait, iterations);
+    else
+        printf("  %-28s skipped (no broker at %s)\n", "--via-broker --wait",
+               BROKER_SOCKET_PATH);
+    /* An untimed first run starts the session helper; the percentiles are warm */
+    (void)run(helper_wait, -1);
+    bench_launch("--helper --wait", helper_wait, iterations);
+
+    bench_batch(runasuser, iterations, 1);
+    bench_batch(runasuser, iterations, 8);
+
+    if (baseline) {
+        char *b = (char *)baseline;
+        char *base_cold[] = { b, TRIVIAL_COMMAND, NULL };
+        char *base_wait[] = { b, "--wait", TRIVIAL_COMMAND, NULL };
+        printf("startup against %s (%d iterations each)\n", baseline, iterations);
+        bench_compare("(no flags)", base_cold, cold, iterations);
+        bench_compare("--wait", base_wait, wait, iterations);
+    }
+
+    printf("spawn primitive (%d iterations each, %s from this process)\n",
+           iterations, TRIVIAL_COMMAND);
+    bench_spawn("(as is)", iterations);
+    char label[32];
+    snprintf(label, sizeof(label), "+%d MB resident", ballast_mb);
+    size_t ballast_len = (size_t)ballast_mb * 1024 * 1024;
+    char *ballast = malloc(ballast_len);
+    if (ballast) {
+        memset(ballast, 1, ballast_len);    /* resident, not just reserved */
+        bench_spawn(label, iterations);
+        free(ballast);
+    } else {
+        printf("  %-28s skipped (out of memory)\n", label);
+    }
+
+    printf("output throughput (%d MB)\n", megabytes);
+    bench_throughput(runasuser, self, megabytes, "stdout");
+    bench_throughput(runasuser, self, megabytes, "stderr");
+
+    return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * bench - launch-latency, output-throughput and build_command_line()
+ *         benchmarks for runasuser (Windows).
+ *
+ * Must be run as SYSTEM, like runasuser itself:
+ *
+ *   bench.exe <runasuser.exe> [-n iterations] [-m megabytes]
+ *
+ * Launch latency: runs a trivial command (cmd /c exit 0) through runasuser
+ * n times per mode and reports p50/p95/p99. Modes cover the cold path with
+ * and without --wait/--session, a running broker (--via-broker, skipped if
+ * none is listening), the session helper (--helper) and --batch, where the
+ * figure is per command.
+ *
+ * Throughput: runs this binary as the user in emitter mode under --wait and
+ * measures how fast m MB on stdout, then on stderr, come through the relay.
+ *
+ * build_command_line(): the real function, compiled in from
+ * src/windows/main.c, timed on large argument vectors.
+ *
+ *   bench.exe --emit <megabytes> <stdout|stderr>    (child side of the test)
+ */
+
+/* Pull in runasuser itself for build_command_line(), without its wmain */
+#define RUNASUSER_LIBRARY
+#include "../../src/windows/main.c"
+
+#define BENCH_DEFAULT_ITERATIONS  200
+#define BENCH_DEFAULT_MEGABYTES   256
+#define BENCH_EMIT_CHUNK          (64 * 1024)
+#define BENCH_TRIVIAL_COMMAND     L"cmd /c exit 0"
+
+static LONGLONG bench_frequency;
+
+static LONGLONG bench_now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+static double bench_us(LONGLONG ticks)
+{
+    return (double)ticks * 1e6 / (double)bench_frequency;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    LONGLONG x = *(const LONGLONG *)a, y = *(const LONGLONG *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted sample, in microseconds. */
+static double bench_percentile(const LONGLONG *sorted, int n, int p)
+{
+    int rank = (p * n + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return bench_us(sorted[rank - 1]);
+}
+
+/*
+ * Run a command line with stdout/stderr on hOutput/hError (NUL if NULL) and
+ * wait for it. Returns its exit code, or -1 if it could not be started.
+ */
+static int bench_run(const WCHAR *cmdLine, HANDLE hOutput, HANDLE hError)
+{
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    HANDLE hNul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                              OPEN_EXISTING, 0, NULL);
+
+    STARTUPINFOW si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags    = STARTF_USESTDHANDLES;
+    si.hStdInput  = hNul;
+    si.hStdOutput = hOutput ? hOutput : hNul;
+    si.hStdError  = hError ? hError : hNul;
+
+    PROCESS_INFORMATION pi;
+    WCHAR *mutableCmd = _wcsdup(cmdLine);
+    BOOL ok = mutableCmd && CreateProcessW(NULL, mutableCmd, NULL, NULL, TRUE,
+                                           CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
+    DWORD err = GetLastError();
+    free(mutableCmd);
+    CloseHandle(hNul);
+    if (!ok) {
+        print_error(L"bench: CreateProcessW failed", err);
+        return -1;
+    }
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return (int)exitCode;
+}
+
+/* Time n runs of "<runasuser> <args>" and print one result line. */
+static void bench_launch(const WCHAR *label, const WCHAR *runasuser,
+                         const WCHAR *args, int n)
+{
+    WCHAR cmdLine[1024];
+    _snwprintf(cmdLine, 1024, L"\"%ls\" %ls", runasuser, args);
+    cmdLine[1023] = L'\0';
+
+    LONGLONG *samples = (LONGLONG *)calloc((size_t)n, sizeof(LONGLONG));
+    if (!samples) {
+        print_message(L"bench: memory allocation failed");
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        LONGLONG t = bench_now();
+        int rc = bench_run(cmdLine, NULL, NULL);
+        samples[i] = bench_now() - t;
+        if (rc != 0) {
+            wprintf(L"  %-30ls skipped (exit %d)\n", label, rc);
+            free(samples);
+            return;
+        }
+    }
+
+    qsort(samples, (size_t)n, sizeof(LONGLONG), bench_cmp);
+    wprintf(L"  %-30ls p50 %9.1f us  p95 %9.1f us  p99 %9.1f us\n", label,
+            bench_percentile(samples, n, 50), bench_percentile(samples, n, 95),
+            bench_percentile(samples, n, 99));
+    free(samples);
+}
+
+/* One --batch run of n trivial commands; reports the cost per command. */
+static void bench_batch(const WCHAR *runasuser, int n, int jobs)
+{
+    WCHAR dir[MAX_PATH], path[MAX_PATH];
+    if (!GetTempPathW(MAX_PATH, dir) || !GetTempFileNameW(dir, L"rau", 0, path)) {
+        print_error(L"bench: cannot create a temp manifest", GetLastError());
+        return;
+    }
+
+    FILE *fp = _wfopen(path, L"wb");
+    if (!fp) {
+        print_message(L"bench: cannot write the temp manifest");
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        fputs("[\"cmd\", \"/c\", \"exit 0\"]\n", fp);
+    fclose(fp);
+
+    WCHAR cmdLine[1024];
+    _snwprintf(cmdLine, 1024, L"\"%ls\" --batch \"%ls\" -j %d", runasuser, path, jobs);
+    cmdLine[1023] = L'\0';
+
+    LONGLONG t = bench_now();
+    int rc = bench_run(cmdLine, NULL, NULL);
+    LONGLONG elapsed = bench_now() - t;
+    DeleteFileW(path);
+
+    WCHAR label[32];
+    _snwprintf(label, 32, L"--batch -j %d", jobs);
+    label[31] = L'\0';
+    if (rc != 0)
+        wprintf(L"  %-30ls skipped (exit %d)\n", label, rc);
+    else
+        wprintf(L"  %-30ls %9.1f us per command (%d commands)\n", label,
+                bench_us(elapsed) / n, n);
+}
+
+typedef struct {
+    HANDLE    hRead;
+    ULONGLONG total;
+} BenchDrain;
+
+static DWORD WINAPI bench_drain_thread(LPVOID lpParam)
+{
+    BenchDrain *d = (BenchDrain *)lpParam;
+    static char buf[BENCH_EMIT_CHUNK];
+    DWORD n;
+    while (ReadFile(d->hRead, buf, sizeof(buf), &n, NULL) && n > 0)
+        d->total += n;
+    return 0;
+}
+
+/* Read everything one stream of the emitter produces through the --wait relay. */
+static void bench_throughput(const WCHAR *runasuser, const WCHAR *self,
+                             int megabytes, const WCHAR *which)
+{
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    HANDLE hRead, hWrite;
+    if (!CreatePipe(&hRead, &hWrite, &sa, 1024 * 1024)) {
+        print_error(L"bench: CreatePipe failed", GetLastError());
+        return;
+    }
+    SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+    WCHAR cmdLine[1024];
+    _snwprintf(cmdLine, 1024, L"\"%ls\" --wait \"%ls\" --emit %d %ls",
+               runasuser, self, megabytes, which);
+    cmdLine[1023] = L'\0';
+
+    BenchDrain drain = { hRead, 0 };
+    HANDLE hThread = CreateThread(NULL, 0, bench_drain_thread, &drain, 0, NULL);
+    if (!hThread) {
+        print_error(L"bench: CreateThread failed", GetLastError());
+        CloseHandle(hRead);
+        CloseHandle(hWrite);
+        return;
+    }
+
+    BOOL isStderr = wcscmp(which, L"stderr") == 0;
+    LONGLONG t = bench_now();
+    bench_run(cmdLine, isStderr ? NULL : hWrite, isStderr ? hWrite : NULL);
+    CloseHandle(hWrite);
+    WaitForSingleObject(hThread, INFINITE);
+    double secs = bench_us(bench_now() - t) / 1e6;
+    CloseHandle(hThread);
+    CloseHandle(hRead);
+
+    double mb = (double)drain.total / (1024.0 * 1024.0);
+    wprintf(L"  --wait %-23ls %9.1f MB/s (%.1f MB in %.3f s)\n",
+            which, mb / secs, mb, secs);
+}
+
+/* Time build_command_line() on argc copies of a quoting-heavy argument. */
+static void bench_command_line(int argc, int iterations)
+{
+    static WCHAR sample[] = L"C:\\Program Files\\Some \"Vendor\"\\tool dir\\";
+    WCHAR **argv = (WCHAR **)calloc((size_t)argc, sizeof(WCHAR *));
+    if (!argv) {
+        print_message(L"bench: memory allocation failed");
+        return;
+    }
+    for (int i = 0; i < argc; i++)
+        argv[i] = sample;
+
+    size_t outLen = 0;
+    LONGLONG *samples = (LONGLONG *)calloc((size_t)iterations, sizeof(LONGLONG));
+    for (int i = 0; samples && i < iterations; i++) {
+        LONGLONG t = bench_now();
+        WCHAR *cmdLine = build_command_line(argc, argv);
+        samples[i] = bench_now() - t;
+        if (cmdLine)
+            outLen = wcslen(cmdLine);
+        free(cmdLine);
+    }
+
+    if (samples) {
+        qsort(samples, (size_t)iterations, sizeof(LONGLONG), bench_cmp);
+        wprintf(L"  %6d args -> %8lu chars   p50 %9.1f us  p99 %9.1f us\n",
+                argc, (unsigned long)outLen, bench_percentile(samples, iterations, 50),
+                bench_percentile(samples, iterations, 99));
+    }
+    free(samples);
+    free(argv);
+}
+
+/* Child side of the throughput test: write megabytes of data to one stream. */
+static int bench_emit(int megabytes, const WCHAR *which)
+{
+    static char buf[BENCH_EMIT_CHUNK];
+    memset(buf, 'x', sizeof(buf));
+    HANDLE h = GetStdHandle(wcscmp(which, L"stderr") == 0 ? STD_ERROR_HANDLE
+                                                          : STD_OUTPUT_HANDLE);
+
+    ULONGLONG remaining = (ULONGLONG)megabytes * 1024 * 1024;
+    while (remaining > 0) {
+        DWORD len = remaining < sizeof(buf) ? (DWORD)remaining : (DWORD)sizeof(buf);
+        DWORD written = 0;
+        if (!WriteFile(h, buf, len, &written, NULL) || written == 0)
+            return 1;
+        remaining -= written;
+    }
+    return 0;
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    if (argc == 4 && wcscmp(argv[1], L"--emit") == 0)
+        return bench_emit(_wtoi(argv[2]), argv[3]);
+
+    if (argc < 2 || argv[1][0] == L'-') {
+        fwprintf(stderr, L"Usage: bench <runasuser.exe> [-n iterations] [-m megabytes]\n"
+                         L"       bench --emit <megabytes> <stdout|stderr>\n");
+        return EXIT_USAGE_ERROR;
+    }
+
+    const WCHAR *runasuser = argv[1];
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    int megabytes  = BENCH_DEFAULT_MEGABYTES;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (wcscmp(argv[i], L"-n") == 0)
+            iterations = _wtoi(argv[i + 1]);
+        else if (wcscmp(argv[i], L"-m") == 0)
+            megabytes = _wtoi(argv[i + 1]);
+    }
+    if (iterations < 1 || megabytes < 1) {
+        fwprintf(stderr, L"bench: iterations and megabytes must be positive\n");
+        return EXIT_USAGE_ERROR;
+    }
+
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    bench_frequency = f.QuadPart;
+
+    /* The emitter runs as the session user, so it needs an absolute path */
+    WCHAR self[MAX_PATH];
+    if (!GetModuleFileNameW(NULL, self, MAX_PATH)) {
+        print_error(L"bench: GetModuleFileNameW failed", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    WCHAR args[128];
+    wprintf(L"launch latency (%d iterations, %ls)\n", iterations, BENCH_TRIVIAL_COMMAND);
+    bench_launch(L"(no flags)", runasuser, BENCH_TRIVIAL_COMMAND, iterations);
+    bench_launch(L"--wait", runasuser, L"--wait " BENCH_TRIVIAL_COMMAND, iterations);
+
+    DWORD console = WTSGetActiveConsoleSessionId();
+    _snwprintf(args, 128, L"--session %lu " BENCH_TRIVIAL_COMMAND, (unsigned long)console);
+    args[127] = L'\0';
+    bench_launch(L"--session <console>", runasuser, args, iterations);
+    _snwprintf(args, 128, L"--session %lu --wait " BENCH_TRIVIAL_COMMAND,
+               (unsigned long)console);
+    args[127] = L'\0';
+    bench_launch(L"--session <console> --wait", runasuser, args, iterations);
+
+    if (WaitNamedPipeW(BROKER_PIPE_NAME, 0) || GetLastError() != ERROR_FILE_NOT_FOUND)
+        bench_launch(L"--via-broker --wait", runasuser,
+                     L"--via-broker --wait " BENCH_TRIVIAL_COMMAND, iterations);
+    else
+        wprintf(L"  %-30ls skipped (no broker at %ls)\n", L"--via-broker --wait",
+                BROKER_PIPE_NAME);
+    /* An untimed first run starts the session helper; the percentiles are warm */
+    {
+        WCHAR cmdLine[1024];
+        _snwprintf(cmdLine, 1024, L"\"%ls\" --helper --wait " BENCH_TRIVIAL_COMMAND, runasuser);
+        cmdLine[1023] = L'\0';
+        (void)bench_run(cmdLine, NULL, NULL);
+    }
+    bench_launch(L"--helper --wait", runasuser, L"--helper --wait " BENCH_TRIVIAL_COMMAND,
+                 iterations);
+
+    bench_batch(runasuser, iterations, 1);
+    bench_batch(runasuser, iterations, 8);
+
+    wprintf(L"output throughput (%d MB)\n", megabytes);
+    bench_throughput(runasuser, self, megabytes, L"stdout");
+    bench_throughput(runasuser, self, megabytes, L"stderr");
+
+    wprintf(L"build_command_line\n");
+    bench_command_line(16, 1000);
+    bench_command_line(1024, 200);
+    bench_command_line(16384, 20);
+
+    return EXIT_SUCCESS_CODE;
+}
@@ -0,0 +1,103 @@
+/*
+ * runasuser.h - C API of librunasuser, the launch engine behind runasuser.
+ *
+ * Lets a root daemon (macOS) or SYSTEM service (Windows) start commands as
+ * the logged-in user in-process, instead of spawning runasuser to spawn the
+ * command. The caller must have the same privileges the CLI needs.
+ *
+ *   runasuser_context *ctx;
+ *   const char *opts[] = { "--stdout", "/tmp/out.log", NULL };
+ *   if (runasuser_open(opts, &ctx) == RUNASUSER_OK) {
+ *       const char *cmd[] = { "/usr/bin/defaults", "read", "com.apple.dock", NULL };
+ *       runasuser_process *proc;
+ *       int code;
+ *       if (runasuser_spawn(ctx, cmd, &proc) == RUNASUSER_OK) {
+ *           runasuser_wait(proc, 0, &code);
+ *           runasuser_release(proc);
+ *       }
+ *       runasuser_close(ctx);
+ *   }
+ *
+ * A context resolves the user once (session, token or passwd entry,
+ * environment, groups) and can spawn any number of commands, from any
+ * thread, until it is closed. Options are the CLI's own flags, so they are
+ * parsed and validated exactly as on the command line; options that only
+ * make sense for the CLI process (--wait, --batch, --all-sessions, --detach,
+ * --broker, --via-broker, --helper, --max-output, --stdin, --trace-*,
+ * --rusage, --result-*, and --session on macOS) are rejected with
+ * RUNASUSER_ERR_USAGE. Strings are UTF-8.
+ *
+ * Functions return RUNASUSER_OK or one of the CLI's exit codes below.
+ * Diagnostics are written to stderr, as the CLI does.
+ */
+
+#ifndef RUNASUSER_H
+#define RUNASUSER_H
+
+#ifdef _WIN32
+#include <wchar.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RUNASUSER_OK                0
+#define RUNASUSER_ERR_GENERAL       1
+#define RUNASUSER_ERR_NO_SESSION    2   /* no user logged in */
+#define RUNASUSER_ERR_USER          3   /* privilege drop (macOS), user token (Windows) */
+#define RUNASUSER_ERR_LAUNCH        4   /* the command could not be started */
+#define RUNASUSER_ERR_USAGE         5   /* invalid or unsupported option */
+#define RUNASUSER_PENDING           8   /* runasuser_wait(): still running */
+
+#define RUNASUSER_USER_MAX          514 /* "DOMAIN\name" plus NUL */
+
+typedef struct runasuser_session {
+    unsigned long id;                   /* macOS: uid; Windows: session ID */
+    char          user[RUNASUSER_USER_MAX];   /* name (macOS), DOMAIN\name (Windows) */
+} runasuser_session;
+
+typedef struct runasuser_context runasuser_context;
+typedef struct runasuser_process runasuser_process;
+
+/* Find the session a launch without options would target. */
+int runasuser_find_session(runasuser_session *session);
+
+/*
+ * Resolve the user context for a NULL-terminated list of CLI options
+ * (NULL for none). With --wait-for-session this blocks until a user logs in.
+ */
+int runasuser_open(const char *const *options, runasuser_context **ctx);
+void runasuser_close(runasuser_context *ctx);
+
+/*
+ * Start argv (NULL-terminated; argv[0] is looked up in PATH if it has no
+ * slash on macOS, as by CreateProcess on Windows) as the context's user.
+ * Returns once the command is running; *proc must be released.
+ */
+int runasuser_spawn(runasuser_context *ctx, const char *const *argv,
+                    runasuser_process **proc);
+
+unsigned long runasuser_pid(const runasuser_process *proc);
+
+/*
+ * Wait for the command to exit and store its exit code (128 + signal on
+ * macOS). With nohang, return RUNASUSER_PENDING at once if it is running.
+ */
+int runasuser_wait(runasuser_process *proc, int nohang, int *exit_code);
+
+/* Free the handle. A command that was not waited for keeps running. */
+void runasuser_release(runasuser_process *proc);
+
+/* The whole CLI, in-process: what the runasuser executable's main() runs. */
+#ifdef _WIN32
+int runasuser_main(int argc, wchar_t *argv[]);
+#else
+int runasuser_main(int argc, char *argv[]);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RUNASUSER_H */
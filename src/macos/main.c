@@ -1,16 +1,20 @@
 /*
  * runasuser - Execute a command as the currently logged-in macOS console user.
  *
- * Must be run as root. Detects the console user via SystemConfiguration,
- * drops privileges, and exec's the requested command.
+ * Must be run as root. Detects the console user (from the owner of
+ * /dev/console, or via SystemConfiguration), drops privileges, and exec's
+ * the requested command.
  *
  * Exit codes:
- *   0 - Success (execvp doesn't return) / child success (--wait)
+ *   0 - Success (execve doesn't return) / child success (--wait)
  *   1 - General failure (not root, etc.)
  *   2 - No interactive user session found
  *   3 - Failed to drop privileges
  *   4 - Failed to execute command
  *   5 - Invalid arguments / usage error
+ *   6 - One or more batch commands or users failed (--batch, --all-sessions)
+ *   7 - Timed out; the command was terminated (--timeout)
+ *   8 - Detached command still running (--collect)
  */
 
 #include <stdio.h>
@@ -21,22 +25,75 @@
 #include <grp.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/qos.h>
+#include <sys/event.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <mach-o/dyld.h>
 #include <SystemConfiguration/SystemConfiguration.h>
 #include <CoreFoundation/CoreFoundation.h>
 
+#include "runasuser.h"
+
 #define EXIT_GENERAL       1
 #define EXIT_NO_SESSION    2
 #define EXIT_PRIV_DROP     3
 #define EXIT_EXEC_FAIL     4
 #define EXIT_USAGE         5
+#define EXIT_BATCH_FAIL    6
+#define EXIT_TIMEOUT       7
+#define EXIT_PENDING       8
+
+#define BATCH_MAX_JOBS     256
+#define MAX_OUTPUT_LIMIT   (1024ULL * 1024 * 1024)    /* --max-output cap */
+#define RELAY_CHUNK        (64 * 1024)
+
+#define KEEP_HEAD          0    /* --keep= policies for --max-output */
+#define KEEP_TAIL          1
+#define KEEP_BOTH          2
+#define FANOUT_MAX_USERS   64
+
+#define TIMEOUT_MAX        4294967      /* --timeout, seconds (as on Windows) */
+#define GRACE_DEFAULT      5            /* --grace: SIGTERM to SIGKILL, seconds */
+#define GRACE_MAX          3600
+
+#define BROKER_SOCKET_PATH "/var/run/runasuser.sock"
+
+#define HELPER_SOCKET_FMT        "/var/run/runasuser-helper.%u.sock"   /* --helper */
+#define HELPER_LOCK_FMT          "/var/run/runasuser-helper.%u.lock"
+#define HELPER_DEFAULT_IDLE      600
+#define HELPER_MAX_IDLE          86400
+#define HELPER_START_MS          5000
+
+#define GROUP_CACHE_DIR          "/var/db/runasuser"   /* --group-cache */
+#define GROUP_CACHE_DEFAULT_TTL  300
+#define GROUP_CACHE_MAX_TTL      86400
 
 #define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin:/usr/sbin:/sbin"
+#define ENV_OPTION_MAX     16   /* --env and --env-allow, each */
+
+extern char **environ;
 
 static void usage(void)
 {
     fprintf(stderr,
-        "Usage: runasuser [--wait] [--session] <command> [args...]\n"
+        "Usage: runasuser [--wait] [--session] [--all-sessions] <command> [args...]\n"
+        "       runasuser [--session] --batch <manifest|-> [-j N]\n"
+        "       runasuser --detach --status-file <path> <command> [args...]\n"
+        "       runasuser --collect <path>\n"
+        "       runasuser --broker [--broker-socket <path>]\n"
+        "       runasuser --helper[=sec] [--wait] <command> [args...]\n"
         "\n"
         "Run a command as the currently logged-in user (must be run as root).\n"
         "\n"
@@ -44,320 +101,4328 @@ static void usage(void)
         "  --wait      Wait for the command to exit and propagate its exit code\n"
         "  --session   Run in the user's GUI session (Mach bootstrap namespace).\n"
         "              Required for GUI apps, osascript, Keychain access, etc.\n"
+        "  --all-sessions\n"
+        "              Launch in every GUI-logged-in user's context at once (fast\n"
+        "              user switching); with --wait, report each user's exit code\n"
+        "  --batch <manifest|->\n"
+        "              Run every command in the manifest (or stdin) as the user,\n"
+        "              resolving the user once. One JSON array of strings per\n"
+        "              line, or NUL-terminated args with an empty arg ending\n"
+        "              each command. Reports each command's exit code.\n"
+        "  -j, --jobs N\n"
+        "              Run up to N batch commands at once (default 1)\n"
+        "  --stdout <path>, --stderr <path>\n"
+        "              Give the command the file (created/truncated) or FIFO as\n"
+        "              its stdout/stderr directly, opened before the privilege\n"
+        "              drop; the same path for both merges the streams\n"
+        "  --qos <class>\n"
+        "              Start the command at QoS class user-interactive,\n"
+        "              user-initiated, default, utility or background; the\n"
+        "              lower classes run on the efficiency cores\n"
+        "  --nice <n>  Start the command at scheduling priority n (-20 to 20)\n"
+        "  --io-policy <policy>\n"
+        "              Disk I/O policy for the command: important, standard,\n"
+        "              utility, throttle or passive (see setiopolicy_np(3))\n"
+        "  --env NAME=value\n"
+        "              Set NAME in the command's environment (repeatable)\n"
+        "  --env-allow NAME\n"
+        "              Pass NAME through from runasuser's own environment\n"
+        "              (repeatable); nothing else is inherited\n"
+        "  --max-output <bytes>\n"
+        "              With --wait, pass on at most this many bytes of stdout\n"
+        "              and of stderr; the rest is drained and dropped\n"
+        "  --keep=<head|tail|both>\n"
+        "              Which part --max-output keeps (default head)\n"
+        "  --timeout <sec>\n"
+        "              With --wait or --batch, terminate a command's process\n"
+        "              group after sec seconds and exit with code 7\n"
+        "  --grace <sec>\n"
+        "              Seconds between SIGTERM and SIGKILL (default %d, 0 for\n"
+        "              SIGKILL at once); also applied after a cancelling signal\n"
+        "  --group-cache[=sec]\n"
+        "              Take the user's supplementary groups from a root-only\n"
+        "              cache, re-resolved once older than sec (default %d)\n"
+        "  --refresh-groups\n"
+        "              With --group-cache, re-resolve the groups now\n"
+        "  --wait-for-session[=sec]\n"
+        "              If nobody is logged in at the console, wait (up to sec\n"
+        "              seconds) for a user session instead of exiting with 2\n"
+        "  --detach --status-file <path>\n"
+        "              Return at once; a supervisor waits for the command and\n"
+        "              atomically writes its PID, exit code, times and\n"
+        "              resource usage to path as JSON\n"
+        "  --collect <path>\n"
+        "              Print a --status-file record; exit with the command's\n"
+        "              exit code, or 8 while it is still running\n"
+        "  --trace-timings[=json]\n"
+        "              Report how long each launch phase took, one line per\n"
+        "              phase or a single JSON object\n"
+        "  --trace-fd N\n"
+        "              Write the --trace-timings report to descriptor N\n"
+        "              (default 2, stderr)\n"
+        "  --rusage    With --wait, write a JSON result record once the command\n"
+        "              exits: PID, user, exit code, wall and CPU time, peak RSS\n"
+        "              and the launch phases\n"
+        "  --result-fd N, --result-file <path>\n"
+        "              Write the --rusage record to descriptor N or to path\n"
+        "              instead of stderr (implies --rusage)\n"
+        "  --broker    Run as the resident launch broker (launchd daemon) serving\n"
+        "              requests on a root-only Unix socket\n"
+        "  --via-broker\n"
+        "              Send this launch to a running broker; falls back to a\n"
+        "              direct launch if no broker is listening\n"
+        "  --broker-socket <path>\n"
+        "              Broker socket path (default " BROKER_SOCKET_PATH ")\n"
+        "  --helper[=sec]\n"
+        "              Launch through a helper resident in the user's session,\n"
+        "              starting it if needed; it exits at logout or after sec\n"
+        "              idle seconds (default %d)\n"
         "\n"
         "Examples:\n"
         "  runasuser whoami\n"
         "  runasuser --wait /usr/bin/python3 script.py\n"
         "  runasuser --session osascript -e 'display dialog \"Hello\"'\n"
         "  runasuser --wait --session open -a Safari\n"
+        "  runasuser --wait --stdout /tmp/inv.log --stderr /tmp/inv.log inventory.sh\n"
+        "  runasuser --wait --qos background --io-policy throttle inventory.sh\n"
+        "  runasuser --all-sessions --wait /usr/local/bin/refresh-config\n"
+        "  runasuser --batch jobs.jsonl -j 8\n"
+        "  runasuser --wait --timeout 600 --grace 10 inventory.sh\n"
+        "  runasuser --via-broker --wait /usr/bin/python3 script.py\n"
+        "  runasuser --helper --wait defaults read com.apple.dock\n",
+        GRACE_DEFAULT, GROUP_CACHE_DEFAULT_TTL, HELPER_DEFAULT_IDLE
     );
 }
 
+/* Convert a waitpid() status to the exit code conventions used by --wait. */
+static int status_to_exit_code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return EXIT_GENERAL;
+}
+
 /*
- * Get the absolute path of this executable using _NSGetExecutablePath.
- * Caller must free the returned string.  Returns NULL on failure.
+ * Per-phase timings (--trace-timings[=json], --trace-fd).  Phases are timed
+ * with the monotonic clock and reported when the launch finishes, always
+ * before this process execs (so a no-wait launch is reported too), as one
+ * line per phase or a single JSON object.  With fd -1 they are only
+ * collected, for the --rusage record.
  */
-static char *get_self_path(void)
+#define TRACE_MAX_EVENTS 64
+
+static struct {
+    int       enabled;
+    int       json;
+    int       fd;
+    uint64_t  origin;
+    int       count;
+    struct {
+        const char *phase;
+        uint64_t    start;
+        uint64_t    end;
+    } events[TRACE_MAX_EVENTS];
+} g_trace;
+
+static uint64_t trace_now(void)
 {
-    uint32_t size = 0;
-    _NSGetExecutablePath(NULL, &size);        /* get required buffer size */
+    struct timespec ts;
+    if (!g_trace.enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    char *buf = malloc(size);
-    if (!buf)
-        return NULL;
+static void trace_init(int json, int fd)
+{
+    g_trace.enabled = 1;
+    g_trace.json    = json;
+    g_trace.fd      = fd;
+    g_trace.count   = 0;
+    g_trace.origin  = trace_now();
+}
 
-    if (_NSGetExecutablePath(buf, &size) != 0) {
-        free(buf);
-        return NULL;
-    }
+/* Record a phase that began at start (a trace_now() value) and ends now. */
+static void trace_phase(const char *phase, uint64_t start)
+{
+    if (!g_trace.enabled || g_trace.count >= TRACE_MAX_EVENTS)
+        return;
+    g_trace.events[g_trace.count].phase = phase;
+    g_trace.events[g_trace.count].end   = trace_now();
+    g_trace.events[g_trace.count].start = start ? start : g_trace.events[g_trace.count].end;
+    g_trace.count++;
+}
 
-    /* Resolve symlinks so launchctl gets the real path */
-    char *resolved = realpath(buf, NULL);
-    free(buf);
-    return resolved;    /* may be NULL if realpath fails */
+/* Emit the report (once); times are in microseconds since the first phase. */
+static void trace_report(void)
+{
+    if (!g_trace.enabled)
+        return;
+
+    uint64_t total = trace_now() - g_trace.origin;
+    int fd = g_trace.fd;
+    g_trace.enabled = 0;
+    if (fd < 0)
+        return;
+
+    if (g_trace.json) {
+        dprintf(fd, "{\"runasuser_trace\":{\"pid\":%d,\"unit\":\"us\",\"phases\":[",
+                (int)getpid());
+        for (int i = 0; i < g_trace.count; i++) {
+            dprintf(fd, "%s{\"phase\":\"%s\",\"start\":%.3f,\"duration\":%.3f}",
+                    i ? "," : "", g_trace.events[i].phase,
+                    (double)(g_trace.events[i].start - g_trace.origin) / 1e3,
+                    (double)(g_trace.events[i].end - g_trace.events[i].start) / 1e3);
+        }
+        dprintf(fd, "],\"total\":%.3f}}\n", (double)total / 1e3);
+    } else {
+        for (int i = 0; i < g_trace.count; i++) {
+            dprintf(fd, "runasuser: trace: %-30s at %10.3f us  took %10.3f us\n",
+                    g_trace.events[i].phase,
+                    (double)(g_trace.events[i].start - g_trace.origin) / 1e3,
+                    (double)(g_trace.events[i].end - g_trace.events[i].start) / 1e3);
+        }
+        dprintf(fd, "runasuser: trace: %-30s    %10.3f us\n", "total", (double)total / 1e3);
+    }
 }
 
 /*
- * Handle --session: re-invoke ourselves through `launchctl asuser <uid>`
- * so the command runs inside the user's Mach bootstrap namespace.
+ * Result record (--rusage, --result-fd, --result-file), written once a
+ * --wait command has been reaped:
  *
- * We build:  launchctl asuser <uid> <self> [--wait] <command> [args...]
- * (--session is stripped to avoid infinite recursion)
+ *   {"runasuser_result":{"pid":<pid>,"uid":<uid>,"user":"<name>",
+ *    "exit_code":<code>,"signal":<n>,"wall_us":<us>,"user_time_us":<us>,
+ *    "system_time_us":<us>,"max_rss_bytes":<bytes>,"phases":[{"phase":
+ *    "<name>","start":<us>,"duration":<us>},...]}}
  *
- * Always waits for launchctl to finish and propagates the exit code.
+ * wall_us runs from the spawn to the reap; the phases are the ones
+ * --trace-timings=json reports, collected up to that point.
  */
-static int handle_session(uid_t uid, int flag_wait, int cmd_argc, char **cmd_argv)
+static void write_result(int fd, pid_t pid, const struct passwd *pw, int status,
+                         uint64_t wall_ns, const struct rusage *ru)
 {
-    char *self_path = get_self_path();
-    if (!self_path) {
-        fprintf(stderr, "runasuser: failed to determine own executable path\n");
-        return EXIT_GENERAL;
+    dprintf(fd, "{\"runasuser_result\":{\"pid\":%d,\"uid\":%u,\"user\":\"%s\","
+                "\"exit_code\":%d,\"signal\":%d,\"wall_us\":%llu,"
+                "\"user_time_us\":%lld,\"system_time_us\":%lld,\"max_rss_bytes\":%ld,"
+                "\"phases\":[",
+            (int)pid, (unsigned)pw->pw_uid, pw->pw_name, status_to_exit_code(status),
+            WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+            (unsigned long long)(wall_ns / 1000),
+            (long long)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec,
+            (long long)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec,
+            (long)ru->ru_maxrss);       /* bytes on macOS */
+    for (int i = 0; i < g_trace.count; i++) {
+        dprintf(fd, "%s{\"phase\":\"%s\",\"start\":%.3f,\"duration\":%.3f}",
+                i ? "," : "", g_trace.events[i].phase,
+                (double)(g_trace.events[i].start - g_trace.origin) / 1e3,
+                (double)(g_trace.events[i].end - g_trace.events[i].start) / 1e3);
     }
+    dprintf(fd, "]}}\n");
+}
 
-    char uid_str[32];
-    snprintf(uid_str, sizeof(uid_str), "%u", (unsigned)uid);
+/*
+ * Direct output redirection (--stdout / --stderr).  The targets are opened
+ * before the privilege drop and only become descriptors 1/2 of the command
+ * itself, so the command writes straight to the file or FIFO while
+ * runasuser's diagnostics stay on the caller's stderr.  -1 means the stream
+ * is not redirected; the same path for both shares one descriptor (2>&1).
+ */
+typedef struct {
+    int out_fd;
+    int err_fd;
+} redirects;
 
-    /*
-     * argv for execvp:
-     *   "launchctl" "asuser" "<uid>" "<self>" ["--wait"] <cmd> [args...] NULL
-     *
-     * Slot count: 4 (launchctl, asuser, uid, self)
-     *           + 1 if --wait
-     *           + cmd_argc (command + its args)
-     *           + 1 (NULL terminator)
-     */
-    int nargs = 4 + (flag_wait ? 1 : 0) + cmd_argc + 1;
-    char **args = calloc(nargs, sizeof(char *));
-    if (!args) {
-        fprintf(stderr, "runasuser: memory allocation failed\n");
-        free(self_path);
-        return EXIT_GENERAL;
+/*
+ * Open path for writing as root on behalf of uid.  It may be in a
+ * directory others can write to (/tmp), so it must not lead root elsewhere:
+ * a symlink is refused (O_NOFOLLOW), and so is anything but a regular file
+ * with no other hard links, a FIFO or a device, the first two owned by root
+ * or uid.  A file is truncated only once it has passed.  O_NONBLOCK keeps
+ * an unchecked FIFO from stalling the open; one with no reader yet is
+ * checked first and then waited for, as a plain open would.
+ */
+static int open_redirect(const char *path, uid_t uid)
+{
+    struct stat st;
+    int fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENXIO && lstat(path, &st) == 0 && S_ISFIFO(st.st_mode) &&
+        (st.st_uid == 0 || st.st_uid == uid))
+        fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "runasuser: open %s: %s\n", path, strerror(errno));
+        return -1;
     }
 
-    int i = 0;
-    args[i++] = "launchctl";
-    args[i++] = "asuser";
-    args[i++] = uid_str;
-    args[i++] = self_path;
-    if (flag_wait)
-        args[i++] = "--wait";
-    for (int j = 0; j < cmd_argc; j++)
-        args[i++] = cmd_argv[j];
-    args[i] = NULL;
-
-    /* Fork so we can wait for launchctl and propagate its exit code */
-    pid_t pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "runasuser: fork: %s\n", strerror(errno));
-        free(args);
-        free(self_path);
-        return EXIT_EXEC_FAIL;
+    int ok = fstat(fd, &st) == 0 &&
+             (S_ISCHR(st.st_mode) ||
+              ((st.st_uid == 0 || st.st_uid == uid) &&
+               (S_ISFIFO(st.st_mode) || (S_ISREG(st.st_mode) && st.st_nlink == 1))));
+    if (!ok) {
+        fprintf(stderr, "runasuser: open %s: refused: not a FIFO or a file with one "
+                        "link, owned by root or the user\n", path);
+    } else if ((S_ISREG(st.st_mode) && ftruncate(fd, 0) != 0) ||
+               fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0) {
+        fprintf(stderr, "runasuser: open %s: %s\n", path, strerror(errno));
+        ok = 0;
     }
-
-    if (pid == 0) {
-        /* child: exec launchctl */
-        execvp("launchctl", args);
-        fprintf(stderr, "runasuser: exec launchctl: %s\n", strerror(errno));
-        _exit(EXIT_EXEC_FAIL);
+    if (!ok) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    /* parent: wait for launchctl */
-    free(args);
-    free(self_path);
+static void close_redirects(redirects *r)
+{
+    if (r->err_fd >= 0 && r->err_fd != r->out_fd)
+        close(r->err_fd);
+    if (r->out_fd >= 0)
+        close(r->out_fd);
+    r->out_fd = r->err_fd = -1;
+}
 
-    int status;
-    while (waitpid(pid, &status, 0) == -1) {
-        if (errno != EINTR) {
-            fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
-            return EXIT_GENERAL;
+static int open_redirects(const char *out_path, const char *err_path, uid_t uid,
+                          redirects *r)
+{
+    r->out_fd = r->err_fd = -1;
+
+    if (out_path && (r->out_fd = open_redirect(out_path, uid)) < 0)
+        return -1;
+
+    if (err_path) {
+        if (out_path && strcmp(out_path, err_path) == 0) {
+            r->err_fd = r->out_fd;
+        } else if ((r->err_fd = open_redirect(err_path, uid)) < 0) {
+            close_redirects(r);
+            return -1;
         }
     }
+    return 0;
+}
 
-    if (WIFEXITED(status))
-        return WEXITSTATUS(status);
-    if (WIFSIGNALED(status))
-        return 128 + WTERMSIG(status);
-    return EXIT_GENERAL;
+/* For the no-wait path, right before this process execs the command. */
+static void apply_redirects(const redirects *r)
+{
+    if (r->out_fd >= 0)
+        dup2(r->out_fd, STDOUT_FILENO);
+    if (r->err_fd >= 0)
+        dup2(r->err_fd, STDERR_FILENO);
 }
 
 /*
- * Drop privileges to the target user.
+ * Bounded output capture (--max-output, --keep=).  Normally the command
+ * writes straight to our stdout/stderr; with a limit, each of its streams
+ * goes to a pipe instead and the supervisor forwards at most limit bytes,
+ * draining the pipe to the end so the command never blocks on a full pipe:
  *
- * Order matters for security:
- *   1. initgroups() - set supplementary groups (requires root)
- *   2. setgid()     - set real/effective/saved GID (requires root)
- *   3. setuid()     - set real/effective/saved UID (irreversible)
+ *   KEEP_HEAD  the first limit bytes are relayed as they arrive
+ *   KEEP_TAIL  the last limit bytes are kept in a ring buffer and written
+ *              when the stream ends
+ *   KEEP_BOTH  half of each
  *
- * After dropping, verify we cannot regain root.
+ * Where bytes were dropped, a marker line with the byte counts is written
+ * in their place.
  */
-static int drop_privileges(const struct passwd *pw)
+typedef struct {
+    int       fd;               /* read end of the command's pipe, -1 at EOF */
+    int       out_fd;           /* where the data goes */
+    uint64_t  limit;
+    uint64_t  total;            /* bytes read from the pipe */
+    uint64_t  head_left;        /* bytes still relayed live */
+    char     *ring;             /* last ring_size bytes (tail) */
+    size_t    ring_size;
+    size_t    ring_pos;         /* next write position */
+    size_t    ring_len;         /* bytes held, <= ring_size */
+} capped_stream;
+
+/* Write all of data; a caller that went away is ignored (keep draining). */
+static void relay_write(int fd, const char *data, size_t len)
 {
-    /* 1. Set supplementary group list (must happen while still root) */
-    if (initgroups(pw->pw_name, pw->pw_gid) != 0) {
-        fprintf(stderr, "runasuser: initgroups: %s\n", strerror(errno));
-        return -1;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len  -= (size_t)n;
     }
+}
 
-    /* 2. Set GID before UID (setgid requires root) */
-    if (setgid(pw->pw_gid) != 0) {
-        fprintf(stderr, "runasuser: setgid(%u): %s\n",
-                (unsigned)pw->pw_gid, strerror(errno));
+static int capped_init(capped_stream *c, int fd, int out_fd, uint64_t limit, int keep)
+{
+    memset(c, 0, sizeof(*c));
+    c->fd        = fd;
+    c->out_fd    = out_fd;
+    c->limit     = limit;
+    c->ring_size = keep == KEEP_HEAD ? 0
+                 : keep == KEEP_TAIL ? (size_t)limit : (size_t)(limit / 2);
+    c->head_left = limit - c->ring_size;
+    if (c->ring_size && !(c->ring = malloc(c->ring_size))) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
         return -1;
     }
+    return 0;
+}
 
-    /* 3. Set UID last (this is irreversible) */
-    if (setuid(pw->pw_uid) != 0) {
-        fprintf(stderr, "runasuser: setuid(%u): %s\n",
-                (unsigned)pw->pw_uid, strerror(errno));
-        return -1;
+/* Pass one chunk of command output through the stream's limit. */
+static void capped_deliver(capped_stream *c, const char *data, size_t len)
+{
+    c->total += len;
+
+    size_t live = c->head_left < len ? (size_t)c->head_left : len;
+    if (live) {
+        relay_write(c->out_fd, data, live);
+        c->head_left -= live;
+        data += live;
+        len  -= live;
     }
+    if (!c->ring_size)
+        return;                 /* head only: the rest is dropped */
 
-    /*
-     * Verify: attempting to regain root must fail.
-     * If setuid(0) succeeds, the privilege drop was incomplete.
-     */
-    if (setuid(0) == 0) {
-        fprintf(stderr, "runasuser: privilege drop verification failed "
-                        "(was able to regain root)\n");
-        return -1;
+    /* Only the last ring_size bytes of this chunk can survive */
+    if (len > c->ring_size) {
+        data += len - c->ring_size;
+        len   = c->ring_size;
     }
+    while (len > 0) {
+        size_t n = c->ring_size - c->ring_pos;
+        if (n > len)
+            n = len;
+        memcpy(c->ring + c->ring_pos, data, n);
+        c->ring_pos = (c->ring_pos + n) % c->ring_size;
+        c->ring_len = c->ring_len + n > c->ring_size ? c->ring_size : c->ring_len + n;
+        data += n;
+        len  -= n;
+    }
+}
 
-    return 0;
+/* At the end of a stream: the marker, if anything was dropped, and the tail. */
+static void capped_finish(capped_stream *c)
+{
+    uint64_t kept = (c->limit - c->ring_size - c->head_left) + c->ring_len;
+    if (kept < c->total) {
+        char marker[128];
+        int n = snprintf(marker, sizeof(marker),
+                         "\n[runasuser: output truncated, %llu of %llu bytes dropped]\n",
+                         (unsigned long long)(c->total - kept),
+                         (unsigned long long)c->total);
+        if (n > 0)
+            relay_write(c->out_fd, marker, (size_t)n);
+    }
+
+    /* Ring contents, oldest first (until it first fills, ring_pos == ring_len) */
+    if (c->ring_len < c->ring_size) {
+        relay_write(c->out_fd, c->ring, c->ring_len);
+    } else {
+        relay_write(c->out_fd, c->ring + c->ring_pos, c->ring_size - c->ring_pos);
+        relay_write(c->out_fd, c->ring, c->ring_pos);
+    }
+    free(c->ring);
+    c->ring = NULL;
 }
 
 /*
- * Set a clean environment for the target user.
+ * Signal forwarding.  While runasuser waits for what it started (--wait,
+ * --batch, --all-sessions), the signals a job controller uses to cancel or
+ * poke a job — SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 — are
+ * passed on instead of killing runasuser and orphaning the command.  Each
+ * command spawned meanwhile leads a process group of its own, and the
+ * signal goes to the whole group, so one cancel reaches the commands'
+ * children too.
  *
- * The inherited environment is cleared entirely before setting user
- * variables.  Without this, every variable from the root/calling process
- * leaks into the child — including possible secrets (API keys, tokens)
- * and variables that can influence runtime behaviour
- * (DYLD_FRAMEWORK_PATH, PYTHONPATH, LD_PRELOAD, etc.).
+ * The exception is a runasuser in the foreground of a terminal: there the
+ * commands stay in its process group, so they can still read the terminal
+ * and get ^C and ^\ from it directly; SIGINT and SIGQUIT are then not
+ * forwarded, which would deliver them twice.  Signals that were ignored
+ * when runasuser started (nohup) stay ignored.
  */
-static void setup_environment(const struct passwd *pw)
-{
-    extern char **environ;
+static const int forwarded_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 };
+#define FORWARDED_SIGNALS ((int)(sizeof(forwarded_signals) / sizeof(forwarded_signals[0])))
 
-    /* Strip the inherited environment completely */
-    while (environ != NULL && environ[0] != NULL) {
-        const char *entry = environ[0];
-        const char *eq = strchr(entry, '=');
-        if (!eq)
-            break;   /* malformed entry — stop to avoid infinite loop */
+static struct {
+    const pid_t *volatile pids;     /* what to signal; 0 entries are skipped */
+    volatile sig_atomic_t count;
+    int                   groups;   /* pids lead process groups: signal those */
+    int                   tty_fg;   /* in the foreground of a terminal */
+    volatile sig_atomic_t cancelled;    /* a signal other than SIGUSR1/2 came */
+} g_forward;
 
-        size_t len = (size_t)(eq - entry);
-        char *name = strndup(entry, len);
-        if (!name)
-            break;
-        unsetenv(name);
-        free(name);
+static void forward_signal(int sig)
+{
+    int saved_errno = errno;
+    if (sig != SIGUSR1 && sig != SIGUSR2)
+        g_forward.cancelled = 1;
+    if (!g_forward.tty_fg || (sig != SIGINT && sig != SIGQUIT)) {
+        for (int i = 0; i < g_forward.count; i++) {
+            pid_t pid = g_forward.pids[i];
+            if (pid > 0)
+                kill(g_forward.groups ? -pid : pid, sig);
+        }
     }
+    errno = saved_errno;
+}
 
-    /* Build a minimal, known-safe environment */
-    setenv("HOME",    pw->pw_dir,   1);
-    setenv("USER",    pw->pw_name,  1);
-    setenv("LOGNAME", pw->pw_name,  1);
-    setenv("SHELL",   pw->pw_shell, 1);
-    setenv("PATH",    DEFAULT_PATH, 1);
+/* Block (hold) or unblock the forwarded signals, e.g. around spawn-and-record. */
+static void forward_hold(int hold)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    for (int i = 0; i < FORWARDED_SIGNALS; i++)
+        sigaddset(&set, forwarded_signals[i]);
+    sigprocmask(hold ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
 }
 
-int main(int argc, char *argv[])
+/*
+ * Forward to pids[0..count) from now on.  commands: the pids are commands
+ * spawned from now on, which get process groups of their own (unless in a
+ * terminal's foreground); otherwise they are our own workers.  count 0
+ * stops forwarding and restores the default dispositions.
+ */
+static void forward_signals(const pid_t *pids, int count, int commands)
 {
-    int flag_wait    = 0;
-    int flag_session = 0;
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags   = SA_RESTART;
+    sa.sa_handler = count > 0 ? forward_signal : SIG_DFL;
 
-    /* --- Parse flags (stop at first non-flag argument) --- */
-    int argi = 1;
-    while (argi < argc) {
-        if (strcmp(argv[argi], "--wait") == 0) {
-            flag_wait = 1;
-            argi++;
-        } else if (strcmp(argv[argi], "--session") == 0) {
-            flag_session = 1;
-            argi++;
-        } else if (strcmp(argv[argi], "--help") == 0 || strcmp(argv[argi], "-h") == 0) {
-            usage();
-            return 0;
-        } else {
-            break;    /* first non-flag = start of command */
-        }
+    g_forward.count     = 0;
+    g_forward.pids      = pids;
+    g_forward.tty_fg    = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    g_forward.groups    = commands && !g_forward.tty_fg;
+    g_forward.cancelled = 0;
+    for (int i = 0; i < FORWARDED_SIGNALS; i++) {
+        if (sigaction(forwarded_signals[i], NULL, &old) == 0 && old.sa_handler != SIG_IGN)
+            sigaction(forwarded_signals[i], &sa, NULL);
     }
+    g_forward.count = count;
+}
 
-    if (argi >= argc) {
-        usage();
-        return EXIT_USAGE;
-    }
+/*
+ * Supervision.  What runasuser waits for itself (the --wait command, each
+ * --batch command) is watched from one kqueue on this thread, so no wait
+ * blocks on any single child:
+ *
+ *   EVFILT_PROC    NOTE_EXIT of each child, which is then reaped
+ *   EVFILT_READ    the --max-output pipes, drained as data arrives
+ *   EVFILT_TIMER   per child: its --timeout, then its --grace period
+ *   EVFILT_SIGNAL  SIGHUP, SIGINT, SIGQUIT and SIGTERM, which
+ *                  forward_signal() has already passed on; with --grace,
+ *                  the grace period of every child starts then
+ *
+ * A child past its --timeout gets SIGTERM, then SIGKILL if it is still
+ * there --grace seconds later (default GRACE_DEFAULT, 0 for SIGKILL at
+ * once), each sent to its process group -- or only to it, in a terminal's
+ * foreground, where it shares ours (see forward_signals()).  The timeout
+ * also covers the --max-output pipes: a child that exits while something
+ * it started still holds them keeps its timer, and when that fires its
+ * group gets the same treatment and the relay stops.
+ */
+typedef struct {
+    pid_t pid;
+    int   stage;                /* 0 running, 1 SIGTERM sent, 2 SIGKILL sent */
+    int   timed_out;
+} supervised;
 
-    char **cmd_argv = &argv[argi];
-    int    cmd_argc = argc - argi;
+typedef struct {
+    int            kq;
+    unsigned       timeout_s;       /* per child, 0 = none */
+    unsigned       grace_s;
+    supervised    *kids;            /* nkids of max_kids, in any order */
+    int            nkids;
+    int            max_kids;
+    capped_stream *streams;         /* --max-output pipes */
+    int            nstreams;
+    int            open_streams;
+    supervised     lingering;       /* reaped, its pipes still open (pid 0: none) */
+} supervisor;
 
-    /* --- Must be root --- */
-    if (getuid() != 0) {
-        fprintf(stderr, "runasuser: must be run as root\n");
-        return EXIT_GENERAL;
+/*
+ * Set up supervision of at most max_kids children (kids is their storage).
+ * grace_on_cancel: --grace was given, so a cancelling signal starts it too.
+ */
+static int supervisor_open(supervisor *sv, supervised *kids, int max_kids,
+                           unsigned timeout_s, unsigned grace_s, int grace_on_cancel)
+{
+    memset(sv, 0, sizeof(*sv));
+    sv->kids      = kids;
+    sv->max_kids  = max_kids;
+    sv->timeout_s = timeout_s;
+    sv->grace_s   = grace_s;
+    if ((sv->kq = kqueue()) < 0) {
+        fprintf(stderr, "runasuser: kqueue: %s\n", strerror(errno));
+        return -1;
     }
 
-    /* --- Detect the console (GUI-session) user --- */
-    uid_t uid = 0;
-    gid_t gid = 0;
-    CFStringRef cf_user = SCDynamicStoreCopyConsoleUser(NULL, &uid, &gid);
+    struct kevent ev[4];
+    int n = 0;
+    for (int i = 0; grace_on_cancel && i < FORWARDED_SIGNALS; i++) {
+        if (forwarded_signals[i] != SIGUSR1 && forwarded_signals[i] != SIGUSR2)
+            EV_SET(&ev[n++], forwarded_signals[i], EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    }
+    if (n > 0 && kevent(sv->kq, ev, n, NULL, 0, NULL) != 0) {
+        fprintf(stderr, "runasuser: kevent: %s\n", strerror(errno));
+        close(sv->kq);
+        return -1;
+    }
+    return 0;
+}
 
-    if (cf_user == NULL) {
-        fprintf(stderr, "runasuser: no console user found "
-                        "(no interactive session)\n");
-        return EXIT_NO_SESSION;
+/* Relay streams[0..count) (capped_init()ed) as part of the loop. */
+static int supervisor_relay(supervisor *sv, capped_stream *streams, int count)
+{
+    sv->streams = streams;
+    sv->nstreams = count;
+    for (int i = 0; i < count; i++) {
+        struct kevent ev;
+        EV_SET(&ev, streams[i].fd, EVFILT_READ, EV_ADD, 0, 0, &streams[i]);
+        if (kevent(sv->kq, &ev, 1, NULL, 0, NULL) != 0) {
+            fprintf(stderr, "runasuser: kevent: %s\n", strerror(errno));
+            return -1;
+        }
+        sv->open_streams++;
     }
+    return 0;
+}
 
-    /* Convert CFString to C string for the "loginwindow" check */
-    char username_buf[256];
-    Boolean ok = CFStringGetCString(cf_user, username_buf, sizeof(username_buf),
-                                    kCFStringEncodingUTF8);
-    CFRelease(cf_user);
+/* Arm pid's timer: its timeout, or its grace period. */
+static int supervisor_arm(supervisor *sv, pid_t pid, unsigned seconds)
+{
+    struct kevent ev;
+    EV_SET(&ev, pid, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, (intptr_t)seconds * 1000, NULL);
+    return kevent(sv->kq, &ev, 1, NULL, 0, NULL);
+}
 
-    if (!ok || strcmp(username_buf, "loginwindow") == 0) {
-        fprintf(stderr, "runasuser: no interactive user session found "
-                        "(login window is active)\n");
-        return EXIT_NO_SESSION;
+/*
+ * Watch a child just spawned.  One that has already exited is a zombie the
+ * kernel will not attach a knote to (ESRCH), so a user event stands in for
+ * its NOTE_EXIT.  Callers spawn only while fewer than max_kids are watched.
+ * On failure the child is killed and reaped, and -1 is returned.
+ */
+static int supervisor_watch(supervisor *sv, pid_t pid)
+{
+    int rc = -1;
+    if (sv->nkids == sv->max_kids) {
+        fprintf(stderr, "runasuser: too many supervised children\n");
+    } else {
+        struct kevent ev;
+        EV_SET(&ev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+        rc = kevent(sv->kq, &ev, 1, NULL, 0, NULL);
+        if (rc != 0 && errno == ESRCH) {
+            EV_SET(&ev, pid, EVFILT_USER, EV_ADD | EV_ONESHOT, NOTE_TRIGGER, 0, NULL);
+            rc = kevent(sv->kq, &ev, 1, NULL, 0, NULL);
+        }
+        if (rc == 0 && sv->timeout_s)
+            rc = supervisor_arm(sv, pid, sv->timeout_s);
+        if (rc != 0)
+            fprintf(stderr, "runasuser: kevent: %s\n", strerror(errno));
     }
-
-    /* --- If --session, re-invoke via launchctl asuser --- */
-    if (flag_session) {
-        return handle_session(uid, flag_wait, cmd_argc, cmd_argv);
+    if (rc != 0) {
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        return -1;
     }
 
-    /* --- Resolve user details from UID --- */
-    struct passwd *pw = getpwuid(uid);
-    if (!pw) {
-        fprintf(stderr, "runasuser: getpwuid(%u): %s\n",
-                (unsigned)uid, strerror(errno));
-        return EXIT_GENERAL;
+    supervised *k = &sv->kids[sv->nkids++];
+    k->pid       = pid;
+    k->stage     = 0;
+    k->timed_out = 0;
+    return 0;
+}
+
+/* Move k one step along SIGTERM -> grace period -> SIGKILL. */
+static void supervisor_escalate(supervisor *sv, supervised *k)
+{
+    if (k->stage == 0 && sv->grace_s > 0) {
+        k->stage = 1;
+        kill(g_forward.groups ? -k->pid : k->pid, SIGTERM);
+        if (supervisor_arm(sv, k->pid, sv->grace_s) == 0)
+            return;
+    }
+    if (k->stage < 2) {
+        k->stage = 2;
+        kill(g_forward.groups ? -k->pid : k->pid, SIGKILL);
     }
+}
 
-    /* --- Drop privileges (root -> console user) --- */
-    if (drop_privileges(pw) != 0)
-        return EXIT_PRIV_DROP;
+/*
+ * The timer of the lingering child fired: its pipes outlived its --timeout.
+ * Its group is taken through the same steps; without a group of its own,
+ * or once that is at SIGKILL, the relay stops instead of waiting for EOF.
+ */
+static void supervisor_expire(supervisor *sv)
+{
+    supervised *k = &sv->lingering;
+    if (k->stage == 0)
+        k->timed_out = 1;
+    if (g_forward.groups) {
+        supervisor_escalate(sv, k);
+        if (k->stage < 2)
+            return;
+    }
+    for (int i = 0; i < sv->nstreams; i++) {
+        if (sv->streams[i].fd >= 0) {
+            close(sv->streams[i].fd);
+            sv->streams[i].fd = -1;
+            sv->open_streams--;
+        }
+    }
+}
 
-    /* --- Set clean environment --- */
-    setup_environment(pw);
+/* Stream c has data or is at EOF. */
+static void supervisor_read(supervisor *sv, capped_stream *c)
+{
+    static char buf[RELAY_CHUNK];
+    ssize_t len = read(c->fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+        return;
+    if (len <= 0) {
+        close(c->fd);               /* which also removes its knote */
+        c->fd = -1;
+        sv->open_streams--;
+        return;
+    }
+    capped_deliver(c, buf, (size_t)len);
+}
 
-    /* --- Execute the command --- */
-    if (flag_wait) {
-        /* Fork, exec in child, wait in parent */
-        pid_t pid = fork();
-        if (pid < 0) {
-            fprintf(stderr, "runasuser: fork: %s\n", strerror(errno));
-            return EXIT_EXEC_FAIL;
+/*
+ * Run the loop until a child exits, reap it and return 1 with its pid,
+ * wait4() status, resource usage (ru may be NULL) and whether it timed out.
+ * Returns 0 once no child is left and every stream is at EOF (timed_out:
+ * whether the pipes outlived a --timeout), -1 on error.
+ */
+static int supervisor_next(supervisor *sv, pid_t *pid, int *status,
+                           struct rusage *ru, int *timed_out)
+{
+    while (sv->nkids > 0 || sv->open_streams > 0) {
+        struct kevent ev[8];
+        int n = kevent(sv->kq, NULL, 0, ev, 8, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "runasuser: kevent: %s\n", strerror(errno));
+            return -1;
         }
 
-        if (pid == 0) {
-            /* Child: exec the command */
-            execvp(cmd_argv[0], cmd_argv);
-            fprintf(stderr, "runasuser: exec %s: %s\n",
-                    cmd_argv[0], strerror(errno));
-            _exit(EXIT_EXEC_FAIL);
+        for (int i = 0; i < n; i++) {
+            if (ev[i].filter == EVFILT_READ) {
+                supervisor_read(sv, (capped_stream *)ev[i].udata);
+            } else if (ev[i].filter == EVFILT_SIGNAL) {
+                for (int k = 0; k < sv->nkids; k++) {
+                    if (sv->kids[k].stage == 0)
+                        supervisor_escalate(sv, &sv->kids[k]);
+                }
+            } else if (ev[i].filter == EVFILT_TIMER) {
+                for (int k = 0; k < sv->nkids; k++) {
+                    if (sv->kids[k].pid != (pid_t)ev[i].ident)
+                        continue;
+                    if (sv->kids[k].stage == 0)
+                        sv->kids[k].timed_out = 1;
+                    supervisor_escalate(sv, &sv->kids[k]);
+                }
+                if (sv->lingering.pid == (pid_t)ev[i].ident)
+                    supervisor_expire(sv);
+            }
         }
 
-        /* Parent: wait and propagate exit code */
-        int status;
-        while (waitpid(pid, &status, 0) == -1) {
-            if (errno != EINTR) {
-                fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
-                return EXIT_GENERAL;
+        /* Exits last, so a batch has refilled nothing before this round's signals */
+        for (int i = 0; i < n; i++) {
+            if (ev[i].filter != EVFILT_PROC && ev[i].filter != EVFILT_USER)
+                continue;
+            for (int k = 0; k < sv->nkids; k++) {
+                if (sv->kids[k].pid != (pid_t)ev[i].ident)
+                    continue;
+                struct rusage unused;
+                while (wait4(sv->kids[k].pid, status, 0, ru ? ru : &unused) == -1) {
+                    if (errno != EINTR) {
+                        fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
+                        return -1;
+                    }
+                }
+                if (sv->open_streams > 0 && sv->timeout_s) {
+                    sv->lingering = sv->kids[k];    /* its timer stays armed */
+                } else {
+                    struct kevent del;
+                    EV_SET(&del, sv->kids[k].pid, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+                    (void)kevent(sv->kq, &del, 1, NULL, 0, NULL);   /* ENOENT: none */
+                }
+
+                *pid = sv->kids[k].pid;
+                *timed_out = sv->kids[k].timed_out;
+                sv->kids[k] = sv->kids[--sv->nkids];
+                /* The other exits of this round come back from the next kevent() */
+                for (int j = i + 1; j < n; j++) {
+                    if (ev[j].filter == EVFILT_PROC || ev[j].filter == EVFILT_USER) {
+                        struct kevent again;
+                        EV_SET(&again, ev[j].ident, EVFILT_USER, EV_ADD | EV_ONESHOT,
+                               NOTE_TRIGGER, 0, NULL);
+                        (void)kevent(sv->kq, &again, 1, NULL, 0, NULL);
+                    }
+                }
+                return 1;
             }
         }
+    }
+    *timed_out = sv->lingering.timed_out;
+    return 0;
+}
 
-        if (WIFEXITED(status))
-            return WEXITSTATUS(status);
+/* Close the queue; streams still open are closed, and all are finished. */
+static void supervisor_close(supervisor *sv)
+{
+    for (int i = 0; i < sv->nstreams; i++) {
+        if (sv->streams[i].fd >= 0)
+            close(sv->streams[i].fd);
+        capped_finish(&sv->streams[i]);
+    }
+    close(sv->kq);
+}
 
-        /* Killed by signal */
-        if (WIFSIGNALED(status))
-            return 128 + WTERMSIG(status);
+/*
+ * Scheduling policy for launched commands (--qos, --nice, --io-policy).
+ * The QoS class is a spawn attribute of each child.  The nice value and
+ * the disk I/O policy are process attributes that children inherit, so
+ * apply_launch_policy() sets them on this process, once, before anything
+ * is started; runasuser itself does no work after that but wait.
+ */
+typedef struct {
+    qos_class_t qos;            /* QOS_CLASS_UNSPECIFIED: leave as is */
+    int         nice_set;
+    int         nice;
+    int         iopolicy;       /* IOPOL_*, or -1 to leave as is */
+} launch_policy;
 
-        return EXIT_GENERAL;
-    }
+static const struct {
+    const char *name;
+    qos_class_t qos;
+} qos_names[] = {
+    { "user-interactive", QOS_CLASS_USER_INTERACTIVE },
+    { "user-initiated",   QOS_CLASS_USER_INITIATED },
+    { "default",          QOS_CLASS_DEFAULT },
+    { "utility",          QOS_CLASS_UTILITY },
+    { "background",       QOS_CLASS_BACKGROUND },
+};
 
-    /* No --wait: replace this process entirely */
-    execvp(cmd_argv[0], cmd_argv);
-    fprintf(stderr, "runasuser: exec %s: %s\n", cmd_argv[0], strerror(errno));
-    return EXIT_EXEC_FAIL;
+static const struct {
+    const char *name;
+    int         iopolicy;
+} iopolicy_names[] = {
+    { "important", IOPOL_IMPORTANT },
+    { "standard",  IOPOL_STANDARD },
+    { "utility",   IOPOL_UTILITY },
+    { "throttle",  IOPOL_THROTTLE },
+    { "passive",   IOPOL_PASSIVE },
+};
+
+/*
+ * Set the inherited parts of the policy on this process.  Called as root,
+ * before the privilege drop, so a negative --nice is allowed.
+ */
+static int apply_launch_policy(const launch_policy *lp)
+{
+    if (lp->nice_set && setpriority(PRIO_PROCESS, 0, lp->nice) != 0) {
+        fprintf(stderr, "runasuser: setpriority(%d): %s\n", lp->nice, strerror(errno));
+        return -1;
+    }
+    if (lp->iopolicy >= 0 &&
+        setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, lp->iopolicy) != 0) {
+        fprintf(stderr, "runasuser: setiopolicy_np: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build the spawn attributes and file actions for spawn_command(); setexec
+ * makes posix_spawn() replace the calling process.  Both must be destroyed
+ * by the caller on success.
+ */
+static int prepare_spawn(const redirects *r, const launch_policy *lp, int setexec,
+                         posix_spawnattr_t *attrp, posix_spawn_file_actions_t *actionsp)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    sigset_t mask;
+    int rc;
+
+    if ((rc = posix_spawnattr_init(&attr)) != 0)
+        return rc;
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0) {
+        posix_spawnattr_destroy(&attr);
+        return rc;
+    }
+
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    /* A command we forward signals to leads its own process group */
+    if (!setexec && g_forward.count > 0 && g_forward.groups) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+    flags |= POSIX_SPAWN_CLOEXEC_DEFAULT;
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        if (fcntl(fd, F_GETFD) != -1)
+            posix_spawn_file_actions_addinherit_np(&actions, fd);
+    }
+#endif
+    if (r && r->out_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, r->out_fd, STDOUT_FILENO);
+    if (r && r->err_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, r->err_fd, STDERR_FILENO);
+#ifdef POSIX_SPAWN_SETEXEC
+    if (setexec)
+        flags |= POSIX_SPAWN_SETEXEC;
+#else
+    (void)setexec;
+#endif
+    if (lp && lp->qos != QOS_CLASS_UNSPECIFIED)
+        posix_spawnattr_set_qos_class_np(&attr, lp->qos);
+    posix_spawnattr_setflags(&attr, flags);
+
+    *attrp    = attr;
+    *actionsp = actions;
+    return 0;
+}
+
+/*
+ * Find file in the PATH of envp (DEFAULT_PATH if it has none), the PATH the
+ * command gets, unless it has a slash.  As for execvp(), an empty element
+ * is the current directory, and only a regular file is a match: a directory
+ * of the same name earlier in PATH does not hide the command.
+ */
+static int resolve_command(const char *file, char *const envp[], char *path, size_t len)
+{
+    if (strchr(file, '/')) {
+        snprintf(path, len, "%s", file);
+        return 0;
+    }
+    const char *dir = DEFAULT_PATH;
+    for (int i = 0; envp[i]; i++) {
+        if (strncmp(envp[i], "PATH=", 5) == 0) {
+            dir = envp[i] + 5;
+            break;
+        }
+    }
+    for (;;) {
+        size_t n = strcspn(dir, ":");
+        struct stat st;
+        if ((size_t)snprintf(path, len, "%.*s/%s", n ? (int)n : 1, n ? dir : ".", file) < len &&
+            stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+            return 0;
+        if (dir[n] == '\0')
+            return ENOENT;
+        dir += n + 1;
+    }
+}
+
+/*
+ * Start file (searched in the PATH of envp) with argv and envp in the
+ * current credentials via posix_spawn() rather than fork()+execve(): no
+ * copy of this process is made, and the child is set up entirely by the
+ * spawn attributes:
+ *
+ *   - signal mask:  cleared, as for a freshly started process
+ *   - descriptors:  redirects (may be NULL) dup2()ed onto stdout/stderr; on
+ *                   macOS every descriptor other than 0/1/2 is closed
+ *                   (POSIX_SPAWN_CLOEXEC_DEFAULT), so nothing of ours, such
+ *                   as a broker connection, leaks into the command
+ *   - environment:  envp: environ for root's own helpers (launchctl), the
+ *                   user's from setup_environment() for commands
+ *   - QoS class:    lp->qos, if set (lp may be NULL)
+ *
+ * With pid NULL the command replaces this process instead (on macOS,
+ * POSIX_SPAWN_SETEXEC), so a no-wait launch can carry the QoS class too.
+ *
+ * Returns 0 and the child's pid, or an errno value; exec failures such as
+ * ENOENT are reported here rather than by the child.
+ */
+static int spawn_command(const char *file, char *const argv[], char *const envp[],
+                         const redirects *r, const launch_policy *lp,
+                         pid_t *pid)
+{
+    char path[PATH_MAX];
+    int rc = resolve_command(file, envp, path, sizeof(path));
+    if (rc != 0)
+        return rc;
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    rc = prepare_spawn(r, lp, !pid, &attr, &actions);
+    if (rc != 0)
+        return rc;
+
+    pid_t child;
+    rc = posix_spawn(pid ? pid : &child, path, &actions, &attr, argv, envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return rc;
+}
+
+/*
+ * Get the absolute path of this executable using _NSGetExecutablePath.
+ * Caller must free the returned string.  Returns NULL on failure.
+ */
+static char *get_self_path(void)
+{
+    uint32_t size = 0;
+    _NSGetExecutablePath(NULL, &size);        /* get required buffer size */
+
+    char *buf = malloc(size);
+    if (!buf)
+        return NULL;
+
+    if (_NSGetExecutablePath(buf, &size) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    /* Resolve symlinks so launchctl gets the real path */
+    char *resolved = realpath(buf, NULL);
+    free(buf);
+    return resolved;    /* may be NULL if realpath fails */
+}
+
+/*
+ * The --resolved-user spec for pw: name:uid:gid:dir:shell, as in passwd(5).
+ * Caller must free it.  NULL if a field contains a ':' (or out of memory).
+ */
+static char *format_resolved_user(const struct passwd *pw)
+{
+    char *spec = NULL;
+    if (strchr(pw->pw_name, ':') || strchr(pw->pw_dir, ':') || strchr(pw->pw_shell, ':') ||
+        asprintf(&spec, "%s:%u:%u:%s:%s", pw->pw_name, (unsigned)pw->pw_uid,
+                 (unsigned)pw->pw_gid, pw->pw_dir, pw->pw_shell) < 0)
+        return NULL;
+    return spec;
+}
+
+/*
+ * Handle --session: re-invoke ourselves through `launchctl asuser <uid>`
+ * so the command runs inside the user's Mach bootstrap namespace.
+ *
+ * We build:
+ *   launchctl asuser <uid> <self> --resolved-user <spec> [flags...] <command> [args...]
+ *
+ * Every flag in argv[1..argi) is forwarded except --session and
+ * --all-sessions (stripped to avoid infinite recursion) and the broker
+ * client flags.  --resolved-user
+ * hands the already resolved user to the inner copy, which then skips
+ * SystemConfiguration and getpwuid() entirely (see parse_resolved_user()).
+ *
+ * Nothing is left for this process to do once launchctl runs, so it execs
+ * launchctl in place; launchctl carries the inner copy's exit code back to
+ * our caller.  Only a broker handler serving --wait spawns launchctl
+ * instead, since it must collect the exit code to reply with it.
+ */
+static int handle_session(const struct passwd *pw, int wait, int argc,
+                          char **argv, int argi, int reply_fd)
+{
+    char *self_path = get_self_path();
+    if (!self_path) {
+        fprintf(stderr, "runasuser: failed to determine own executable path\n");
+        return EXIT_GENERAL;
+    }
+
+    char uid_str[32];
+    snprintf(uid_str, sizeof(uid_str), "%u", (unsigned)pw->pw_uid);
+
+    /* Omitted if it cannot be expressed; the inner copy then looks it up */
+    char *spec = format_resolved_user(pw);
+
+    /*
+     * argv for launchctl:
+     *   "launchctl" "asuser" "<uid>" "<self>" ["--resolved-user" "<spec>"]
+     *   [flags...] <cmd> [args...] NULL
+     *
+     * Slot count: 6 (launchctl, asuser, uid, self, --resolved-user, spec)
+     *           + argc - 1 (our flags and the command; upper bound)
+     *           + 1 (NULL terminator)
+     */
+    int nargs = 6 + (argc - 1) + 1;
+    char **args = calloc(nargs, sizeof(char *));
+    if (!args) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        free(spec);
+        free(self_path);
+        return EXIT_GENERAL;
+    }
+
+    int i = 0;
+    args[i++] = "launchctl";
+    args[i++] = "asuser";
+    args[i++] = uid_str;
+    args[i++] = self_path;
+    if (spec) {
+        args[i++] = "--resolved-user";
+        args[i++] = spec;
+    }
+    for (int j = 1; j < argi; j++) {
+        if (strcmp(argv[j], "--session") == 0 ||
+            strcmp(argv[j], "--all-sessions") == 0 ||
+            strcmp(argv[j], "--via-broker") == 0)
+            continue;
+        if (strcmp(argv[j], "--broker-socket") == 0 ||
+            strcmp(argv[j], "--resolved-user") == 0) {
+            j++;                    /* skip the value too */
+            continue;
+        }
+        args[i++] = argv[j];
+    }
+    for (int j = argi; j < argc; j++)
+        args[i++] = argv[j];
+    args[i] = NULL;
+
+    int rc;
+    if (!wait || reply_fd < 0) {
+        /* A broker reply_fd is close-on-exec: the exec itself answers */
+        trace_phase("exec launchctl", 0);
+        trace_report();
+        execvp("launchctl", args);
+        rc = errno;
+    } else {
+        /* Broker --wait: spawn launchctl so we can reply with its exit code */
+        pid_t pid = 0;
+        forward_hold(1);
+        forward_signals(&pid, 1, 1);
+        uint64_t t = trace_now();
+        rc = spawn_command("launchctl", args, environ, NULL, NULL, &pid);
+        trace_phase("posix_spawnp launchctl", t);
+        forward_hold(0);
+        if (rc == 0) {
+            free(args);
+            free(spec);
+            free(self_path);
+
+            int status;
+            while (waitpid(pid, &status, 0) == -1) {
+                if (errno != EINTR) {
+                    fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
+                    return EXIT_GENERAL;
+                }
+            }
+            forward_signals(NULL, 0, 0);
+            trace_phase("child_exit", t);
+            return status_to_exit_code(status);
+        }
+        forward_signals(NULL, 0, 0);
+    }
+
+    fprintf(stderr, "runasuser: exec launchctl: %s\n", strerror(rc));
+    free(args);
+    free(spec);
+    free(self_path);
+    return EXIT_EXEC_FAIL;
+}
+
+/*
+ * Parse the --resolved-user spec written by handle_session() into pw, in
+ * place (the fields point into spec).  Returns 0, or -1 if malformed.
+ */
+static int parse_resolved_user(char *spec, struct passwd *pw)
+{
+    char *field[5];
+    for (int i = 0; i < 5; i++) {
+        field[i] = strsep(&spec, ":");
+        if (!field[i] || (i < 4 && !spec))
+            return -1;
+    }
+    if (spec != NULL || field[0][0] == '\0')
+        return -1;
+
+    char *end;
+    unsigned long uid = strtoul(field[1], &end, 10);
+    if (end == field[1] || *end != '\0' || uid > UINT_MAX)
+        return -1;
+    unsigned long gid = strtoul(field[2], &end, 10);
+    if (end == field[2] || *end != '\0' || gid > UINT_MAX)
+        return -1;
+
+    memset(pw, 0, sizeof(*pw));
+    pw->pw_name  = field[0];
+    pw->pw_uid   = (uid_t)uid;
+    pw->pw_gid   = (gid_t)gid;
+    pw->pw_dir   = field[3];
+    pw->pw_shell = field[4];
+    return 0;
+}
+
+/*
+ * Supplementary group cache (--group-cache[=sec], --refresh-groups).
+ *
+ * On directory-bound (AD/LDAP) Macs, initgroups() asks opendirectoryd to
+ * expand nested groups, often over the network, on every launch.  With the
+ * cache, the list from getgrouplist() is kept per uid in a root-only
+ * directory and handed to setgroups() directly until it is sec seconds old.
+ *
+ * An entry is only trusted if the directory and file are root-owned and not
+ * writable by anyone else, and if it was resolved for the same user name and
+ * primary gid within the TTL (a clock that went backwards expires it too).
+ * Anything else -- including --refresh-groups -- resolves the list again and
+ * rewrites the entry atomically.  A list longer than NGROUPS_MAX is never
+ * cached: only initgroups() can register those with the kernel.
+ *
+ * Entry format, one line:  1 <uid> <gid> <resolved-at> <n> <gid>... <name>
+ */
+static int group_cache_dir_safe(void)
+{
+    struct stat st;
+    if (mkdir(GROUP_CACHE_DIR, 0700) != 0 && errno != EEXIST)
+        return 0;
+    return lstat(GROUP_CACHE_DIR, &st) == 0 && S_ISDIR(st.st_mode) &&
+           st.st_uid == 0 && (st.st_mode & 022) == 0;
+}
+
+/* Load a fresh entry for pw into groups; returns the count, or -1 on a miss. */
+static int group_cache_load(const struct passwd *pw, unsigned ttl, gid_t *groups)
+{
+    char path[64];
+    snprintf(path, sizeof(path), GROUP_CACHE_DIR "/groups.%u", (unsigned)pw->pw_uid);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    char buf[1024];
+    ssize_t len = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == 0 &&
+        (st.st_mode & 022) == 0)
+        len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+
+    char *p = buf, *end;
+    unsigned long field[5];
+    for (int i = 0; i < 5; i++) {
+        field[i] = strtoul(p, &end, 10);
+        if (end == p || *end != ' ')
+            return -1;
+        p = end + 1;
+    }
+    time_t now = time(NULL);
+    time_t resolved = (time_t)field[3];
+    if (field[0] != 1 || field[1] != pw->pw_uid || field[2] != pw->pw_gid ||
+        resolved > now || now - resolved >= (time_t)ttl ||
+        field[4] < 1 || field[4] > NGROUPS_MAX)
+        return -1;
+
+    int n = (int)field[4];
+    for (int i = 0; i < n; i++) {
+        unsigned long g = strtoul(p, &end, 10);
+        if (end == p || *end != ' ' || g > UINT_MAX)
+            return -1;
+        groups[i] = (gid_t)g;
+        p = end + 1;
+    }
+    end = strchr(p, '\n');
+    if (!end || (size_t)(end - p) != strlen(pw->pw_name) ||
+        strncmp(p, pw->pw_name, (size_t)(end - p)) != 0)
+        return -1;
+    return n;
+}
+
+static void group_cache_store(const struct passwd *pw, const gid_t *groups, int n)
+{
+    char line[1024];
+    int len = snprintf(line, sizeof(line), "1 %u %u %ld %d", (unsigned)pw->pw_uid,
+                       (unsigned)pw->pw_gid, (long)time(NULL), n);
+    for (int i = 0; i < n && len < (int)sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " %u", (unsigned)groups[i]);
+    if (len < (int)sizeof(line))
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " %s\n", pw->pw_name);
+    if (len >= (int)sizeof(line))
+        return;                     /* absurd name: just don't cache it */
+
+    char path[64], tmp[80];
+    snprintf(path, sizeof(path), GROUP_CACHE_DIR "/groups.%u", (unsigned)pw->pw_uid);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    int ok = write(fd, line, (size_t)len) == len;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+/*
+ * Resolve pw's supplementary groups into groups[NGROUPS_MAX]: from the
+ * cache when ttl > 0 (and not refresh), else with getgrouplist(), storing
+ * the result when ttl > 0.  Returns the count, or -1 if there are more
+ * than NGROUPS_MAX (groups then holds the first NGROUPS_MAX) or getgrouplist
+ * could not be called.
+ */
+static int resolve_groups(const struct passwd *pw, unsigned ttl, int refresh,
+                          gid_t *groups)
+{
+    int safe = ttl && group_cache_dir_safe();
+
+    uint64_t t = trace_now();
+    int n = safe && !refresh ? group_cache_load(pw, ttl, groups) : -1;
+    if (n >= 0) {
+        trace_phase("group_cache", t);
+        return n;
+    }
+
+    /* macOS getgrouplist() takes int gids and does not report the real size */
+    int *list = NULL;
+    for (int cap = NGROUPS_MAX; ; cap *= 4) {
+        int *grown = cap <= NGROUPS_MAX * 64 ? realloc(list, (size_t)cap * sizeof(int)) : NULL;
+        if (!grown) {
+            free(list);
+            return -1;
+        }
+        list = grown;
+        n = cap;
+        if (getgrouplist(pw->pw_name, (int)pw->pw_gid, list, &n) != -1)
+            break;
+    }
+    trace_phase("getgrouplist", t);
+
+    for (int i = 0; i < n && i < NGROUPS_MAX; i++)
+        groups[i] = (gid_t)list[i];
+    free(list);
+    if (n > NGROUPS_MAX)
+        return -1;
+
+    if (safe)
+        group_cache_store(pw, groups, n);
+    return n;
+}
+
+/*
+ * Set the supplementary groups for pw from the cache, resolving and storing
+ * them on a miss.  Returns 0, or -1 with errno set.
+ */
+static int set_cached_groups(const struct passwd *pw, unsigned ttl, int refresh)
+{
+    gid_t groups[NGROUPS_MAX];
+    int n = resolve_groups(pw, ttl, refresh, groups);
+    if (n < 0)
+        return initgroups(pw->pw_name, (int)pw->pw_gid);
+    return setgroups(n, groups);
+}
+
+/*
+ * Drop privileges to the target user.  group_ttl > 0 takes the
+ * supplementary groups from the group cache (refresh_groups re-resolves).
+ *
+ * Order matters for security:
+ *   1. initgroups() - set supplementary groups (requires root)
+ *   2. setgid()     - set real/effective/saved GID (requires root)
+ *   3. setuid()     - set real/effective/saved UID (irreversible)
+ *
+ * After dropping, verify we cannot regain root.
+ */
+static int drop_privileges(const struct passwd *pw, unsigned group_ttl, int refresh_groups)
+{
+    /* 1. Set supplementary group list (must happen while still root) */
+    uint64_t t = trace_now();
+    if (group_ttl) {
+        if (set_cached_groups(pw, group_ttl, refresh_groups) != 0) {
+            fprintf(stderr, "runasuser: setgroups: %s\n", strerror(errno));
+            return -1;
+        }
+    } else {
+        if (initgroups(pw->pw_name, pw->pw_gid) != 0) {
+            fprintf(stderr, "runasuser: initgroups: %s\n", strerror(errno));
+            return -1;
+        }
+        trace_phase("initgroups", t);
+    }
+    t = trace_now();
+
+    /* 2. Set GID before UID (setgid requires root) */
+    if (setgid(pw->pw_gid) != 0) {
+        fprintf(stderr, "runasuser: setgid(%u): %s\n",
+                (unsigned)pw->pw_gid, strerror(errno));
+        return -1;
+    }
+
+    /* 3. Set UID last (this is irreversible) */
+    if (setuid(pw->pw_uid) != 0) {
+        fprintf(stderr, "runasuser: setuid(%u): %s\n",
+                (unsigned)pw->pw_uid, strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Verify: attempting to regain root must fail.
+     * If setuid(0) succeeds, the privilege drop was incomplete.
+     */
+    if (setuid(0) == 0) {
+        fprintf(stderr, "runasuser: privilege drop verification failed "
+                        "(was able to regain root)\n");
+        return -1;
+    }
+    trace_phase("setgid/setuid", t);
+
+    return 0;
+}
+
+/*
+ * Build a clean environment for the target user.
+ *
+ * The command gets an explicit envp, never this process's environ.
+ * Without this, every variable from the root/calling process leaks into
+ * the child — including possible secrets (API keys, tokens) and variables
+ * that can influence runtime behaviour (DYLD_FRAMEWORK_PATH, PYTHONPATH,
+ * LD_PRELOAD, etc.).  Only what the caller names gets through: --env-allow
+ * NAME copies NAME from runasuser's own environment, and --env NAME=value
+ * sets it; both override the defaults, and --env wins.  The entries point
+ * into environ and argv, so building envp is one pass with one allocation.
+ */
+#define USER_ENV_COUNT 5
+#define USER_ENV_MAX   (USER_ENV_COUNT + 2 * ENV_OPTION_MAX)
+
+typedef struct {
+    const char *set[ENV_OPTION_MAX];        /* --env NAME=value */
+    int         nset;
+    const char *allow[ENV_OPTION_MAX];      /* --env-allow NAME */
+    int         nallow;
+} env_options;
+
+typedef struct {
+    char *envp[USER_ENV_MAX + 1];           /* NULL-terminated */
+    int   count;
+    char *defaults;                         /* the USER_ENV_COUNT entries */
+} user_env;
+
+/* The minimal, known-safe environment for pw, as name/value pairs. */
+static void user_environment(const struct passwd *pw,
+                             const char *name[USER_ENV_COUNT],
+                             const char *value[USER_ENV_COUNT])
+{
+    name[0] = "HOME";    value[0] = pw->pw_dir;
+    name[1] = "USER";    value[1] = pw->pw_name;
+    name[2] = "LOGNAME"; value[2] = pw->pw_name;
+    name[3] = "SHELL";   value[3] = pw->pw_shell;
+    name[4] = "PATH";    value[4] = DEFAULT_PATH;
+}
+
+/* Add "NAME=value" entry to env, replacing an earlier entry for NAME. */
+static void env_put(user_env *env, char *entry)
+{
+    size_t len = strcspn(entry, "=") + 1;
+    for (int i = 0; i < env->count; i++) {
+        if (strncmp(env->envp[i], entry, len) == 0) {
+            env->envp[i] = entry;
+            return;
+        }
+    }
+    env->envp[env->count++] = entry;
+    env->envp[env->count] = NULL;
+}
+
+/* Returns 0, or -1 if out of memory; free env->defaults when done. */
+static int setup_environment(const struct passwd *pw, const env_options *eo, user_env *env)
+{
+    const char *name[USER_ENV_COUNT], *value[USER_ENV_COUNT];
+    user_environment(pw, name, value);
+
+    size_t total = 0;
+    for (int i = 0; i < USER_ENV_COUNT; i++)
+        total += strlen(name[i]) + strlen(value[i]) + 2;
+    env->count = 0;
+    env->envp[0] = NULL;
+    env->defaults = malloc(total);
+    if (!env->defaults) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        return -1;
+    }
+    char *p = env->defaults;
+    for (int i = 0; i < USER_ENV_COUNT; i++) {
+        env->envp[env->count++] = p;
+        p += sprintf(p, "%s=%s", name[i], value[i]) + 1;
+    }
+    env->envp[env->count] = NULL;
+
+    for (int i = 0; i < eo->nallow; i++) {
+        size_t len = strlen(eo->allow[i]);
+        for (char **e = environ; *e; e++) {
+            if (strncmp(*e, eo->allow[i], len) == 0 && (*e)[len] == '=') {
+                env_put(env, *e);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < eo->nset; i++)
+        env_put(env, (char *)eo->set[i]);
+    return 0;
+}
+
+/*
+ * Batch manifest (--batch).
+ *
+ * A manifest lists many commands that all run as the same user, so session
+ * detection, getpwuid() and the privilege drop happen once per batch instead
+ * of once per command. Two encodings are accepted:
+ *
+ *   JSON lines:  one JSON array of strings per line, e.g.
+ *                  ["/usr/bin/defaults", "read", "com.apple.finder"]
+ *                Blank lines are ignored.
+ *   NUL-separated argv:  each argument is terminated by a NUL byte and each
+ *                command by an additional NUL (an empty argument).  This is
+ *                what `find -print0`-style producers emit; it cannot express
+ *                empty arguments, use JSON lines for those.
+ *
+ * The encoding is detected automatically: any NUL byte in the input selects
+ * the NUL-separated form.
+ */
+typedef struct {
+    char **argv;             /* NULL-terminated */
+    int    argc;
+} batch_cmd;
+
+typedef struct {
+    batch_cmd *cmds;
+    size_t     count;
+    size_t     cap;
+} batch_manifest;
+
+static void free_manifest(batch_manifest *m)
+{
+    for (size_t i = 0; i < m->count; i++) {
+        for (int j = 0; j < m->cmds[i].argc; j++)
+            free(m->cmds[i].argv[j]);
+        free(m->cmds[i].argv);
+    }
+    free(m->cmds);
+    m->cmds = NULL;
+    m->count = m->cap = 0;
+}
+
+static int manifest_add(batch_manifest *m, char **argv, int argc)
+{
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 16;
+        batch_cmd *cmds = realloc(m->cmds, cap * sizeof(*cmds));
+        if (!cmds)
+            return -1;
+        m->cmds = cmds;
+        m->cap  = cap;
+    }
+    m->cmds[m->count].argv = argv;
+    m->cmds[m->count].argc = argc;
+    m->count++;
+    return 0;
+}
+
+/* Append one argument to a growing NULL-terminated argv array. */
+static int argv_push(char ***argv, int *argc, int *cap, char *arg)
+{
+    if (*argc + 1 >= *cap) {
+        int ncap = *cap ? *cap * 2 : 8;
+        char **nargv = realloc(*argv, (size_t)ncap * sizeof(char *));
+        if (!nargv)
+            return -1;
+        *argv = nargv;
+        *cap  = ncap;
+    }
+    (*argv)[(*argc)++] = arg;
+    (*argv)[*argc] = NULL;
+    return 0;
+}
+
+static void argv_free(char **argv, int argc)
+{
+    for (int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+/* Read an entire stream into a malloc'd buffer. */
+static char *read_stream(FILE *fp, size_t *out_len)
+{
+    size_t cap = 65536, len = 0;
+    char *buf = malloc(cap + 1);
+    if (!buf)
+        return NULL;
+
+    size_t n;
+    while ((n = fread(buf + len, 1, cap - len, fp)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *nbuf = realloc(buf, cap * 2 + 1);
+            if (!nbuf) {
+                free(buf);
+                return NULL;
+            }
+            buf = nbuf;
+            cap *= 2;
+        }
+    }
+    if (ferror(fp)) {
+        free(buf);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+    *out_len = len;
+    return buf;
+}
+
+static size_t utf8_encode(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static int parse_hex4(const char *p, const char *end, uint32_t *out)
+{
+    if (end - p < 4)
+        return -1;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')      v |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (uint32_t)(c - 'A' + 10);
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * Parse a JSON string starting at *pp (which points at the opening quote).
+ * Returns a malloc'd UTF-8 string and advances *pp past the closing quote,
+ * or returns NULL on malformed input.
+ */
+static char *parse_json_string(const char **pp, const char *end)
+{
+    const char *p = *pp + 1;
+
+    /* Decoded output is never longer than the escaped input */
+    char *out = malloc((size_t)(end - p) + 1);
+    if (!out)
+        return NULL;
+    char *dst = out;
+
+    while (p < end && *p != '"') {
+        if ((unsigned char)*p < 0x20)
+            goto fail;                  /* raw control characters not allowed */
+        if (*p != '\\') {
+            *dst++ = *p++;
+            continue;
+        }
+        if (++p >= end)
+            goto fail;
+        switch (*p++) {
+        case '"':  *dst++ = '"';  break;
+        case '\\': *dst++ = '\\'; break;
+        case '/':  *dst++ = '/';  break;
+        case 'b':  *dst++ = '\b'; break;
+        case 'f':  *dst++ = '\f'; break;
+        case 'n':  *dst++ = '\n'; break;
+        case 'r':  *dst++ = '\r'; break;
+        case 't':  *dst++ = '\t'; break;
+        case 'u': {
+            uint32_t cp, lo;
+            if (parse_hex4(p, end, &cp) != 0)
+                goto fail;
+            p += 4;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                /* High surrogate: must be followed by \uDC00-\uDFFF */
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                    parse_hex4(p + 2, end, &lo) != 0 ||
+                    lo < 0xDC00 || lo > 0xDFFF)
+                    goto fail;
+                p += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                goto fail;
+            }
+            if (cp == 0)
+                goto fail;              /* NUL cannot appear in an argument */
+            dst += utf8_encode(cp, dst);
+            break;
+        }
+        default:
+            goto fail;
+        }
+    }
+    if (p >= end)
+        goto fail;
+
+    *dst = '\0';
+    *pp = p + 1;
+    return out;
+
+fail:
+    free(out);
+    return NULL;
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+/* Parse one JSON-lines entry: an array of one or more strings. */
+static int parse_json_argv(const char *p, const char *end,
+                           char ***out_argv, int *out_argc)
+{
+    char **argv = NULL;
+    int argc = 0, cap = 0;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '[')
+        return -1;
+    p = skip_ws(p + 1, end);
+
+    if (p < end && *p == ']') {
+        p++;                            /* empty array: rejected below */
+    } else {
+        for (;;) {
+            if (p >= end || *p != '"')
+                goto fail;
+            char *arg = parse_json_string(&p, end);
+            if (!arg)
+                goto fail;
+            if (argv_push(&argv, &argc, &cap, arg) != 0) {
+                free(arg);
+                goto fail;
+            }
+            p = skip_ws(p, end);
+            if (p < end && *p == ',') {
+                p = skip_ws(p + 1, end);
+                continue;
+            }
+            if (p < end && *p == ']') {
+                p++;
+                break;
+            }
+            goto fail;
+        }
+    }
+
+    if (skip_ws(p, end) != end || argc == 0)
+        goto fail;
+
+    *out_argv = argv;
+    *out_argc = argc;
+    return 0;
+
+fail:
+    argv_free(argv, argc);
+    return -1;
+}
+
+static int parse_manifest(const char *data, size_t len, batch_manifest *m)
+{
+    const char *end = data + len;
+
+    if (memchr(data, '\0', len) != NULL) {
+        /* NUL-separated argv; an empty argument ends the command */
+        char **argv = NULL;
+        int argc = 0, cap = 0;
+        const char *p = data;
+
+        while (p < end) {
+            const char *nul = memchr(p, '\0', (size_t)(end - p));
+            size_t alen = nul ? (size_t)(nul - p) : (size_t)(end - p);
+
+            if (alen == 0) {
+                if (argc > 0 && manifest_add(m, argv, argc) != 0) {
+                    argv_free(argv, argc);
+                    return -1;
+                }
+                argv = NULL;
+                argc = cap = 0;
+            } else {
+                char *arg = strndup(p, alen);
+                if (!arg || argv_push(&argv, &argc, &cap, arg) != 0) {
+                    free(arg);
+                    argv_free(argv, argc);
+                    return -1;
+                }
+            }
+            p += alen + 1;
+        }
+        /* Tolerate a missing terminator after the last command */
+        if (argc > 0 && manifest_add(m, argv, argc) != 0) {
+            argv_free(argv, argc);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* JSON lines */
+    size_t lineno = 0;
+    const char *p = data;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *eol = nl ? nl : end;
+        lineno++;
+
+        if (skip_ws(p, eol) != eol) {
+            char **argv;
+            int argc;
+            if (parse_json_argv(p, eol, &argv, &argc) != 0) {
+                fprintf(stderr, "runasuser: manifest line %zu: expected a "
+                                "JSON array of strings\n", lineno);
+                return -1;
+            }
+            if (manifest_add(m, argv, argc) != 0) {
+                argv_free(argv, argc);
+                return -1;
+            }
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/* Load a manifest from a file, or from stdin when path is "-". */
+static int load_manifest(const char *path, batch_manifest *m)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "runasuser: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size_t len = 0;
+    char *data = read_stream(fp, &len);
+    int saved_errno = errno;
+    if (fp != stdin)
+        fclose(fp);
+
+    if (!data) {
+        fprintf(stderr, "runasuser: read %s: %s\n", path, strerror(saved_errno));
+        return -1;
+    }
+
+    int rc = parse_manifest(data, len, m);
+    free(data);
+    if (rc != 0) {
+        free_manifest(m);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run every manifest entry with at most max_jobs children alive at once,
+ * each under the supervisor, so timeout_s applies to each command on its
+ * own.  Called after the privilege drop, so all commands share it.  Each
+ * command's result is reported on stderr as it completes:
+ *
+ *   runasuser: [<index>] exit <code> (PID <pid>): <command>
+ *   runasuser: [<index>] timed out, exit 7 (PID <pid>): <command>
+ */
+static int run_batch(const batch_manifest *m, int max_jobs, const redirects *r,
+                     const launch_policy *lp, char *const envp[],
+                     unsigned timeout_s, unsigned grace_s, int grace_set)
+{
+    pid_t *pids = calloc((size_t)max_jobs, sizeof(pid_t));
+    size_t *slot_cmd = calloc((size_t)max_jobs, sizeof(size_t));
+    supervised *kids = calloc((size_t)max_jobs, sizeof(supervised));
+    if (!pids || !slot_cmd || !kids) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        free(pids);
+        free(slot_cmd);
+        free(kids);
+        return EXIT_GENERAL;
+    }
+    supervisor sv;
+    if (supervisor_open(&sv, kids, max_jobs, timeout_s, grace_s, grace_set) != 0) {
+        free(pids);
+        free(slot_cmd);
+        free(kids);
+        return EXIT_GENERAL;
+    }
+
+    size_t next = 0, failed = 0;
+    int running = 0, rc = 0;
+    forward_signals(pids, max_jobs, 1);
+
+    while (next < m->count || running > 0) {
+        /* Fill free slots; a cancel starts nothing more */
+        while (next < m->count && running < max_jobs && !g_forward.cancelled) {
+            const batch_cmd *cmd = &m->cmds[next];
+            pid_t pid;
+            forward_hold(1);
+            int err = spawn_command(cmd->argv[0], cmd->argv, envp, r, lp, &pid);
+            if (err != 0 || supervisor_watch(&sv, pid) != 0) {
+                forward_hold(0);
+                if (err != 0)
+                    fprintf(stderr, "runasuser: [%zu] exec %s: %s\n",
+                            next, cmd->argv[0], strerror(err));
+                failed++;
+                next++;
+                continue;
+            }
+            for (int s = 0; s < max_jobs; s++) {
+                if (pids[s] == 0) {
+                    pids[s] = pid;
+                    slot_cmd[s] = next;
+                    break;
+                }
+            }
+            forward_hold(0);
+            running++;
+            next++;
+        }
+
+        if (running == 0)
+            break;
+
+        /* Reap whichever child finishes first */
+        int status, timed_out;
+        pid_t pid;
+        if (supervisor_next(&sv, &pid, &status, NULL, &timed_out) != 1) {
+            rc = EXIT_GENERAL;
+            break;
+        }
+
+        for (int s = 0; s < max_jobs; s++) {
+            if (pids[s] != pid)
+                continue;
+            int code = timed_out ? EXIT_TIMEOUT : status_to_exit_code(status);
+            fprintf(stderr, "runasuser: [%zu] %sexit %d (PID %d): %s\n",
+                    slot_cmd[s], timed_out ? "timed out, " : "", code, (int)pid,
+                    m->cmds[slot_cmd[s]].argv[0]);
+            if (code != 0)
+                failed++;
+            pids[s] = 0;
+            running--;
+            break;
+        }
+    }
+
+    forward_signals(NULL, 0, 0);
+    supervisor_close(&sv);
+    free(pids);
+    free(slot_cmd);
+    free(kids);
+    if (rc != 0)
+        return rc;
+
+    if (next < m->count) {
+        fprintf(stderr, "runasuser: batch cancelled: %zu commands not started\n",
+                m->count - next);
+        failed += m->count - next;
+    }
+    fprintf(stderr, "runasuser: batch complete: %zu commands, %zu failed\n",
+            m->count, failed);
+    return failed ? EXIT_BATCH_FAIL : 0;
+}
+
+/*
+ * Command-line options.  parse_options() is shared by the CLI and by the
+ * broker, which re-parses the argv forwarded by a --via-broker client.
+ */
+typedef struct {
+    int          wait;
+    int          session;
+    int          all_sessions;      /* --all-sessions */
+    const char  *batch_path;
+    int          batch_jobs;
+    int          broker;            /* --broker: serve launch requests */
+    int          via_broker;        /* --via-broker: forward to the broker */
+    const char  *socket_path;       /* --broker-socket */
+    int          helper;            /* --helper[=sec]: via the session helper */
+    unsigned     helper_idle_s;     /* its idle timeout */
+    int          helper_serve;      /* --helper-serve (internal) */
+    const char  *stdout_path;       /* --stdout */
+    const char  *stderr_path;       /* --stderr */
+    char        *resolved_user;     /* --resolved-user (internal) */
+    launch_policy policy;           /* --qos, --nice, --io-policy */
+    env_options  env;               /* --env, --env-allow */
+    unsigned long long max_output;  /* --max-output, per stream, 0 = none */
+    int          keep;              /* --keep=head|tail|both (KEEP_*) */
+    unsigned     timeout_s;         /* --timeout, per command, 0 = none */
+    unsigned     grace_s;           /* --grace: SIGTERM to SIGKILL */
+    int          grace_set;
+    unsigned     group_cache_ttl;   /* --group-cache[=sec], 0 = off */
+    int          refresh_groups;    /* --refresh-groups */
+    int          wait_session;      /* --wait-for-session[=sec] */
+    unsigned     wait_session_s;    /* its timeout, 0 = none */
+    int          detach;            /* --detach */
+    const char  *status_file;       /* --status-file */
+    const char  *collect_path;      /* --collect */
+    int          trace;             /* --trace-timings[=json] */
+    int          trace_json;
+    int          trace_fd;          /* --trace-fd */
+    int          rusage;            /* --rusage, --result-fd, --result-file */
+    int          result_fd;         /* --result-fd */
+    const char  *result_file;       /* --result-file */
+    int          argi;              /* index of the command in argv */
+    char       **cmd_argv;
+} options;
+
+/*
+ * Parse flags (stop at first non-flag argument).  Returns -1 if the caller
+ * should go on, otherwise the exit code to return (usage error, --help).
+ */
+static int parse_options(int argc, char **argv, options *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->batch_jobs  = 1;
+    opt->socket_path = BROKER_SOCKET_PATH;
+    opt->trace_fd    = STDERR_FILENO;
+    opt->result_fd   = STDERR_FILENO;
+    opt->grace_s     = GRACE_DEFAULT;
+    opt->policy.qos      = QOS_CLASS_UNSPECIFIED;
+    opt->policy.iopolicy = -1;
+
+    int argi = 1;
+    while (argi < argc) {
+        if (strcmp(argv[argi], "--wait") == 0) {
+            opt->wait = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--session") == 0) {
+            opt->session = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--all-sessions") == 0) {
+            opt->all_sessions = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--batch") == 0) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "runasuser: --batch requires a manifest path or '-'\n");
+                return EXIT_USAGE;
+            }
+            opt->batch_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "-j") == 0 || strcmp(argv[argi], "--jobs") == 0) {
+            char *end = NULL;
+            long val = argi + 1 < argc ? strtol(argv[argi + 1], &end, 10) : 0;
+            if (argi + 1 >= argc || end == argv[argi + 1] || *end != '\0' ||
+                val < 1 || val > BATCH_MAX_JOBS) {
+                fprintf(stderr, "runasuser: %s requires a job count (1-%d)\n",
+                        argv[argi], BATCH_MAX_JOBS);
+                return EXIT_USAGE;
+            }
+            opt->batch_jobs = (int)val;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--stdout") == 0 ||
+                   strcmp(argv[argi], "--stderr") == 0) {
+            if (argi + 1 >= argc || argv[argi + 1][0] == '\0') {
+                fprintf(stderr, "runasuser: %s requires a file or FIFO path\n",
+                        argv[argi]);
+                return EXIT_USAGE;
+            }
+            if (argv[argi][5] == 'o')
+                opt->stdout_path = argv[argi + 1];
+            else
+                opt->stderr_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--env") == 0) {
+            const char *var = argi + 1 < argc ? argv[argi + 1] : NULL;
+            if (!var || var[0] == '=' || !strchr(var, '=')) {
+                fprintf(stderr, "runasuser: --env requires NAME=value\n");
+                return EXIT_USAGE;
+            }
+            if (opt->env.nset >= ENV_OPTION_MAX) {
+                fprintf(stderr, "runasuser: at most %d --env options\n", ENV_OPTION_MAX);
+                return EXIT_USAGE;
+            }
+            opt->env.set[opt->env.nset++] = var;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--env-allow") == 0) {
+            const char *name = argi + 1 < argc ? argv[argi + 1] : NULL;
+            if (!name || name[0] == '\0' || strchr(name, '=')) {
+                fprintf(stderr, "runasuser: --env-allow requires a variable name\n");
+                return EXIT_USAGE;
+            }
+            if (opt->env.nallow >= ENV_OPTION_MAX) {
+                fprintf(stderr, "runasuser: at most %d --env-allow options\n",
+                        ENV_OPTION_MAX);
+                return EXIT_USAGE;
+            }
+            opt->env.allow[opt->env.nallow++] = name;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--group-cache") == 0 ||
+                   strncmp(argv[argi], "--group-cache=", 14) == 0) {
+            opt->group_cache_ttl = GROUP_CACHE_DEFAULT_TTL;
+            if (argv[argi][13] == '=') {
+                char *end = NULL;
+                unsigned long val = strtoul(argv[argi] + 14, &end, 10);
+                if (end == argv[argi] + 14 || *end != '\0' || val < 1 ||
+                    val > GROUP_CACHE_MAX_TTL) {
+                    fprintf(stderr, "runasuser: --group-cache= requires a TTL in "
+                                    "seconds (1-%d)\n", GROUP_CACHE_MAX_TTL);
+                    return EXIT_USAGE;
+                }
+                opt->group_cache_ttl = (unsigned)val;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--refresh-groups") == 0) {
+            opt->refresh_groups = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--wait-for-session") == 0 ||
+                   strncmp(argv[argi], "--wait-for-session=", 19) == 0) {
+            opt->wait_session = 1;
+            if (argv[argi][18] == '=') {
+                char *end = NULL;
+                unsigned long val = strtoul(argv[argi] + 19, &end, 10);
+                if (end == argv[argi] + 19 || *end != '\0' || val < 1 || val > 86400) {
+                    fprintf(stderr, "runasuser: --wait-for-session= requires "
+                                    "a timeout in seconds (1-86400)\n");
+                    return EXIT_USAGE;
+                }
+                opt->wait_session_s = (unsigned)val;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--detach") == 0) {
+            opt->detach = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--status-file") == 0 ||
+                   strcmp(argv[argi], "--collect") == 0) {
+            if (argi + 1 >= argc || argv[argi + 1][0] == '\0') {
+                fprintf(stderr, "runasuser: %s requires a path\n", argv[argi]);
+                return EXIT_USAGE;
+            }
+            if (argv[argi][2] == 's')
+                opt->status_file = argv[argi + 1];
+            else
+                opt->collect_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--max-output") == 0) {
+            char *end = NULL;
+            unsigned long long val = argi + 1 < argc ? strtoull(argv[argi + 1], &end, 10) : 0;
+            if (argi + 1 >= argc || end == argv[argi + 1] || *end != '\0' ||
+                argv[argi + 1][0] == '-' || val < 1 || val > MAX_OUTPUT_LIMIT) {
+                fprintf(stderr, "runasuser: --max-output requires a byte count (1-%llu)\n",
+                        MAX_OUTPUT_LIMIT);
+                return EXIT_USAGE;
+            }
+            opt->max_output = val;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--timeout") == 0 ||
+                   strcmp(argv[argi], "--grace") == 0) {
+            /* --timeout <sec>, --grace <sec> */
+            int is_timeout = argv[argi][2] == 't';
+            long min = is_timeout ? 1 : 0;
+            long max = is_timeout ? TIMEOUT_MAX : GRACE_MAX;
+            char *end = NULL;
+            long val = argi + 1 < argc ? strtol(argv[argi + 1], &end, 10) : 0;
+            if (argi + 1 >= argc || end == argv[argi + 1] || *end != '\0' ||
+                val < min || val > max) {
+                fprintf(stderr, "runasuser: %s requires a value (%ld-%ld)\n",
+                        argv[argi], min, max);
+                return EXIT_USAGE;
+            }
+            if (is_timeout) {
+                opt->timeout_s = (unsigned)val;
+            } else {
+                opt->grace_s   = (unsigned)val;
+                opt->grace_set = 1;
+            }
+            argi += 2;
+        } else if (strncmp(argv[argi], "--keep=", 7) == 0) {
+            if (strcmp(argv[argi] + 7, "head") == 0) {
+                opt->keep = KEEP_HEAD;
+            } else if (strcmp(argv[argi] + 7, "tail") == 0) {
+                opt->keep = KEEP_TAIL;
+            } else if (strcmp(argv[argi] + 7, "both") == 0) {
+                opt->keep = KEEP_BOTH;
+            } else {
+                fprintf(stderr, "runasuser: --keep= requires head, tail or both\n");
+                return EXIT_USAGE;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--qos") == 0) {
+            size_t k = 0, n = sizeof(qos_names) / sizeof(qos_names[0]);
+            while (argi + 1 < argc && k < n && strcmp(argv[argi + 1], qos_names[k].name) != 0)
+                k++;
+            if (argi + 1 >= argc || k == n) {
+                fprintf(stderr, "runasuser: --qos requires user-interactive, "
+                                "user-initiated, default, utility or background\n");
+                return EXIT_USAGE;
+            }
+            opt->policy.qos = qos_names[k].qos;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--io-policy") == 0) {
+            size_t k = 0, n = sizeof(iopolicy_names) / sizeof(iopolicy_names[0]);
+            while (argi + 1 < argc && k < n && strcmp(argv[argi + 1], iopolicy_names[k].name) != 0)
+                k++;
+            if (argi + 1 >= argc || k == n) {
+                fprintf(stderr, "runasuser: --io-policy requires important, "
+                                "standard, utility, throttle or passive\n");
+                return EXIT_USAGE;
+            }
+            opt->policy.iopolicy = iopolicy_names[k].iopolicy;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--nice") == 0) {
+            char *end = NULL;
+            long val = argi + 1 < argc ? strtol(argv[argi + 1], &end, 10) : 0;
+            if (argi + 1 >= argc || end == argv[argi + 1] || *end != '\0' ||
+                val < -20 || val > 20) {
+                fprintf(stderr, "runasuser: --nice requires a value (-20 to 20)\n");
+                return EXIT_USAGE;
+            }
+            opt->policy.nice_set = 1;
+            opt->policy.nice     = (int)val;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--trace-timings") == 0 ||
+                   strcmp(argv[argi], "--trace-timings=text") == 0) {
+            opt->trace = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--trace-timings=json") == 0) {
+            opt->trace = 1;
+            opt->trace_json = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--trace-fd") == 0 ||
+                   strcmp(argv[argi], "--result-fd") == 0) {
+            char *end = NULL;
+            long val = argi + 1 < argc ? strtol(argv[argi + 1], &end, 10) : -1;
+            if (argi + 1 >= argc || end == argv[argi + 1] || *end != '\0' ||
+                val < 0 || val > INT_MAX) {
+                fprintf(stderr, "runasuser: %s requires a descriptor number\n", argv[argi]);
+                return EXIT_USAGE;
+            }
+            if (argv[argi][2] == 't') {
+                opt->trace_fd = (int)val;
+            } else {
+                opt->rusage    = 1;
+                opt->result_fd = (int)val;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "--rusage") == 0) {
+            opt->rusage = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--result-file") == 0) {
+            if (argi + 1 >= argc || argv[argi + 1][0] == '\0') {
+                fprintf(stderr, "runasuser: --result-file requires a path\n");
+                return EXIT_USAGE;
+            }
+            opt->rusage      = 1;
+            opt->result_file = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--resolved-user") == 0) {
+            /* Internal: set by handle_session() for the inner invocation */
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "runasuser: --resolved-user requires a value\n");
+                return EXIT_USAGE;
+            }
+            opt->resolved_user = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--broker") == 0) {
+            opt->broker = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--via-broker") == 0) {
+            opt->via_broker = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--broker-socket") == 0) {
+            if (argi + 1 >= argc || argv[argi + 1][0] != '/') {
+                fprintf(stderr, "runasuser: --broker-socket requires an absolute path\n");
+                return EXIT_USAGE;
+            }
+            opt->socket_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--helper") == 0 ||
+                   strncmp(argv[argi], "--helper=", 9) == 0) {
+            opt->helper = 1;
+            opt->helper_idle_s = HELPER_DEFAULT_IDLE;
+            if (argv[argi][8] == '=') {
+                char *end = NULL;
+                unsigned long val = strtoul(argv[argi] + 9, &end, 10);
+                if (end == argv[argi] + 9 || *end != '\0' || val < 1 ||
+                    val > HELPER_MAX_IDLE) {
+                    fprintf(stderr, "runasuser: --helper= requires an idle timeout "
+                                    "in seconds (1-%d)\n", HELPER_MAX_IDLE);
+                    return EXIT_USAGE;
+                }
+                opt->helper_idle_s = (unsigned)val;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--helper-serve") == 0) {
+            /* Internal: set by start_helper() for the helper itself */
+            opt->helper_serve = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--help") == 0 || strcmp(argv[argi], "-h") == 0) {
+            usage();
+            return 0;
+        } else {
+            break;    /* first non-flag = start of command */
+        }
+    }
+
+    opt->argi     = argi;
+    opt->cmd_argv = &argv[argi];
+
+    if (opt->broker) {
+        if (argi < argc || opt->batch_path || opt->via_broker || opt->all_sessions ||
+            opt->stdout_path || opt->stderr_path || opt->resolved_user ||
+            opt->trace || opt->policy.qos != QOS_CLASS_UNSPECIFIED ||
+            opt->policy.nice_set || opt->policy.iopolicy >= 0 || opt->max_output ||
+            opt->detach || opt->status_file || opt->collect_path || opt->wait_session ||
+            opt->group_cache_ttl || opt->refresh_groups || opt->helper ||
+            opt->helper_serve || opt->rusage || opt->env.nset || opt->env.nallow ||
+            opt->timeout_s || opt->grace_set) {
+            fprintf(stderr, "runasuser: --broker does not take a command "
+                            "or launch options\n");
+            return EXIT_USAGE;
+        }
+    } else if (opt->helper_serve) {
+        if (argc != 5 || !opt->resolved_user || !opt->helper) {
+            fprintf(stderr, "runasuser: --helper-serve is internal to --helper\n");
+            return EXIT_USAGE;
+        }
+    } else if (opt->collect_path) {
+        if (argc != 3) {
+            fprintf(stderr, "runasuser: --collect takes only a status file path\n");
+            return EXIT_USAGE;
+        }
+    } else if (!opt->detach != !opt->status_file) {
+        fprintf(stderr, "runasuser: --detach and --status-file go together\n");
+        return EXIT_USAGE;
+    } else if (opt->detach && (opt->wait || opt->batch_path || opt->all_sessions ||
+                               opt->via_broker)) {
+        fprintf(stderr, "runasuser: --detach cannot be combined with --wait, "
+                        "--batch, --all-sessions or --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->refresh_groups && !opt->group_cache_ttl) {
+        fprintf(stderr, "runasuser: --refresh-groups requires --group-cache\n");
+        return EXIT_USAGE;
+    } else if (opt->wait_session && (opt->all_sessions || opt->via_broker)) {
+        fprintf(stderr, "runasuser: --wait-for-session cannot be combined with "
+                        "--all-sessions or --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->rusage && (!opt->wait || opt->batch_path || opt->all_sessions ||
+                               opt->helper)) {
+        fprintf(stderr, "runasuser: --rusage requires --wait and a single command, "
+                        "and cannot be combined with --all-sessions or --helper\n");
+        return EXIT_USAGE;
+    } else if (opt->rusage && opt->result_fd != STDERR_FILENO && opt->via_broker) {
+        fprintf(stderr, "runasuser: --result-fd cannot be combined with --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->env.nallow && opt->via_broker) {
+        /* The broker would copy from its own environment, not the caller's */
+        fprintf(stderr, "runasuser: --env-allow cannot be combined with --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->max_output && (!opt->wait || opt->batch_path)) {
+        fprintf(stderr, "runasuser: --max-output requires --wait and a single command\n");
+        return EXIT_USAGE;
+    } else if ((opt->timeout_s || opt->grace_set) && (!(opt->wait || opt->batch_path) ||
+                                                      opt->via_broker)) {
+        fprintf(stderr, "runasuser: --timeout and --grace require --wait (or --batch), "
+                        "and cannot be combined with --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->helper && (opt->batch_path || opt->all_sessions || opt->via_broker ||
+                               opt->detach || opt->max_output || opt->group_cache_ttl ||
+                               opt->policy.qos != QOS_CLASS_UNSPECIFIED ||
+                               opt->policy.nice_set || opt->policy.iopolicy >= 0 ||
+                               opt->env.nset || opt->env.nallow ||
+                               opt->timeout_s || opt->grace_set)) {
+        fprintf(stderr, "runasuser: --helper cannot be combined with --batch, "
+                        "--all-sessions, --via-broker, --detach, --max-output, "
+                        "--qos, --nice, --io-policy, --group-cache, --env, "
+                        "--timeout or --grace\n");
+        return EXIT_USAGE;
+    } else if (opt->all_sessions && (opt->batch_path || opt->via_broker)) {
+        fprintf(stderr, "runasuser: --all-sessions cannot be combined with "
+                        "--batch or --via-broker\n");
+        return EXIT_USAGE;
+    } else if (opt->batch_path ? argi < argc : argi >= argc) {
+        usage();
+        return EXIT_USAGE;
+    }
+
+    return -1;
+}
+
+/*
+ * Fast path for a one-shot launch: loginwindow hands /dev/console to the
+ * user who logs in at the GUI and takes it back at logout, so its owner is
+ * the console user, found with one stat() instead of a configd session.
+ * Returns 0 and fills uid, or -1 if root owns it (nobody, the login window,
+ * or a switch in progress) and SystemConfiguration has to decide.
+ */
+static int console_device_owner(uid_t *uid)
+{
+    uint64_t t = trace_now();
+    struct stat st;
+    int rc = stat("/dev/console", &st) == 0 && st.st_uid != 0 ? 0 : -1;
+    trace_phase("stat_console", t);
+    if (rc == 0)
+        *uid = st.st_uid;
+    return rc;
+}
+
+/*
+ * Look up the console user.  Returns NULL and fills uid if a real user
+ * owns the console, otherwise why not (nobody, or the login window).
+ * Callers that keep a store of their own (the broker, --wait-for-session)
+ * are told of changes by it and ask it directly: the device changes owner
+ * a moment after the store does.
+ */
+static const char *console_user_absent(SCDynamicStoreRef store, uid_t *uid)
+{
+    if (!store && console_device_owner(uid) == 0)
+        return NULL;
+
+    uint64_t t = trace_now();
+    CFStringRef cf_user = SCDynamicStoreCopyConsoleUser(store, uid, NULL);
+    trace_phase("SCDynamicStoreCopyConsoleUser", t);
+
+    if (cf_user == NULL)
+        return "no console user found (no interactive session)";
+
+    /* Convert CFString to C string for the "loginwindow" check */
+    char username_buf[256];
+    Boolean ok = CFStringGetCString(cf_user, username_buf, sizeof(username_buf),
+                                    kCFStringEncodingUTF8);
+    CFRelease(cf_user);
+
+    if (!ok || strcmp(username_buf, "loginwindow") == 0)
+        return "no interactive user session found (login window is active)";
+    return NULL;
+}
+
+/*
+ * Detect the console (GUI-session) user.  Returns 0 and fills uid,
+ * or EXIT_NO_SESSION if nobody is logged in at the console.
+ */
+static int detect_console_user(SCDynamicStoreRef store, uid_t *uid)
+{
+    const char *why = console_user_absent(store, uid);
+    if (why) {
+        fprintf(stderr, "runasuser: %s\n", why);
+        return EXIT_NO_SESSION;
+    }
+    return 0;
+}
+
+static void console_user_notified(SCDynamicStoreRef store, CFArrayRef keys, void *info)
+{
+    (void)store; (void)keys; (void)info;   /* waking the run loop is enough */
+}
+
+/*
+ * --wait-for-session[=sec]: like detect_console_user(), but if nobody is
+ * at the console, sleep until SystemConfiguration reports a change of
+ * State:/Users/ConsoleUser and look again -- no polling, and the launch
+ * follows a login within milliseconds.  timeout_s 0 waits indefinitely.
+ */
+static int wait_for_console_user(unsigned timeout_s, uid_t *uid)
+{
+    uint64_t t = trace_now();
+    SCDynamicStoreRef store = SCDynamicStoreCreate(NULL, CFSTR("runasuser"),
+                                                   console_user_notified, NULL);
+    CFStringRef key = store ? SCDynamicStoreKeyCreateConsoleUser(NULL) : NULL;
+    CFArrayRef keys = key ? CFArrayCreate(NULL, (const void **)&key, 1,
+                                          &kCFTypeArrayCallBacks) : NULL;
+    CFRunLoopSourceRef src = NULL;
+    if (keys && SCDynamicStoreSetNotificationKeys(store, keys, NULL))
+        src = SCDynamicStoreCreateRunLoopSource(NULL, store, 0);
+    if (!src) {
+        fprintf(stderr, "runasuser: cannot watch the console user\n");
+        return EXIT_GENERAL;
+    }
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopDefaultMode);
+
+    /* Check only once subscribed, so a login in between is not missed */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double deadline = (double)now.tv_sec + now.tv_nsec / 1e9 + timeout_s;
+    int announced = 0;
+    int rc = EXIT_NO_SESSION;
+    for (;;) {
+        const char *why = console_user_absent(store, uid);
+        if (!why) {
+            rc = 0;
+            break;
+        }
+        if (!announced) {
+            fprintf(stderr, "runasuser: %s; waiting for a user session\n", why);
+            announced = 1;
+        }
+
+        CFTimeInterval wait = 1e10;     /* CFRunLoop's "forever" */
+        if (timeout_s) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait = deadline - ((double)now.tv_sec + now.tv_nsec / 1e9);
+        }
+        if (wait <= 0 ||
+            CFRunLoopRunInMode(kCFRunLoopDefaultMode, wait, 1) == kCFRunLoopRunTimedOut) {
+            fprintf(stderr, "runasuser: no user session within %u s\n", timeout_s);
+            break;
+        }
+    }
+
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), src, kCFRunLoopDefaultMode);
+    CFRelease(src);
+    CFRelease(keys);
+    CFRelease(key);
+    CFRelease(store);
+    trace_phase("wait_for_session", t);
+    return rc;
+}
+
+/*
+ * Detached launch (--detach --status-file <path>).  Instead of exec'ing
+ * away or holding the caller for --wait, runasuser forks a supervisor that
+ * stays root, starts the command and waits for it, so the caller returns
+ * at once and collects the result later (--collect).  The status file is
+ * always replaced atomically (write a temporary file, then rename), so a
+ * reader sees one complete JSON record:
+ *
+ *   {"runasuser_status":{"state":"running","pid":<pid>,"started":<time>}}
+ *   {"runasuser_status":{"state":"exited","pid":<pid>,"started":<time>,
+ *    "ended":<time>,"exit_code":<code>,"signal":<n>,"user_time_us":<us>,
+ *    "system_time_us":<us>,"max_rss_bytes":<bytes>}}
+ *
+ * Times are Unix time in seconds.  state is "starting" until the
+ * supervisor has the command's pid.
+ */
+typedef struct {
+    const char    *state;
+    pid_t          pid;
+    struct timeval started;
+    struct timeval ended;
+    int            status;          /* waitpid() status, when exited */
+    struct rusage  ru;
+} job_status;
+
+static int write_status(const char *path, const job_status *js)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid()) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "runasuser: status file path too long\n");
+        return -1;
+    }
+
+    /* The directory may be writable by others: never follow or reuse a name */
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "runasuser: open %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf),
+                     "{\"runasuser_status\":{\"state\":\"%s\",\"pid\":%d,\"started\":%ld.%03d",
+                     js->state, (int)js->pid, (long)js->started.tv_sec,
+                     (int)(js->started.tv_usec / 1000));
+    if (strcmp(js->state, "exited") == 0) {
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n,
+                      ",\"ended\":%ld.%03d,\"exit_code\":%d,\"signal\":%d,"
+                      "\"user_time_us\":%lld,\"system_time_us\":%lld,\"max_rss_bytes\":%ld",
+                      (long)js->ended.tv_sec, (int)(js->ended.tv_usec / 1000),
+                      status_to_exit_code(js->status),
+                      WIFSIGNALED(js->status) ? WTERMSIG(js->status) : 0,
+                      (long long)js->ru.ru_utime.tv_sec * 1000000 + js->ru.ru_utime.tv_usec,
+                      (long long)js->ru.ru_stime.tv_sec * 1000000 + js->ru.ru_stime.tv_usec,
+                      (long)js->ru.ru_maxrss);     /* bytes on macOS */
+    }
+    n += snprintf(buf + n, sizeof(buf) - (size_t)n, "}}\n");
+
+    int ok = write(fd, buf, (size_t)n) == n;
+    if (close(fd) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "runasuser: write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fork the supervisor.  Returns -1 in the launch process (the supervisor's
+ * child), which goes on to drop privileges and exec the command exactly as
+ * a no-wait launch does; returns an exit code in the calling process.  The
+ * supervisor itself never returns.  Called as root, after the redirects
+ * are open; the command gets /dev/null for any stream not redirected, so
+ * nothing holds on to the caller's stdio.
+ */
+static int detach_supervisor(const char *status_path, const redirects *r, int reply_fd)
+{
+    job_status js;
+    memset(&js, 0, sizeof(js));
+    js.state = "starting";
+    gettimeofday(&js.started, NULL);
+    if (write_status(status_path, &js) != 0)
+        return EXIT_GENERAL;
+
+    int sync[2];
+    if (pipe(sync) != 0) {
+        fprintf(stderr, "runasuser: pipe: %s\n", strerror(errno));
+        return EXIT_GENERAL;
+    }
+
+    pid_t sup = fork();
+    if (sup < 0) {
+        fprintf(stderr, "runasuser: fork: %s\n", strerror(errno));
+        close(sync[0]);
+        close(sync[1]);
+        return EXIT_GENERAL;
+    }
+
+    if (sup > 0) {
+        /* Caller: wait only until the supervisor has started the command */
+        close(sync[1]);
+        pid_t child = 0;
+        ssize_t n;
+        do {
+            n = read(sync[0], &child, sizeof(child));
+        } while (n < 0 && errno == EINTR);
+        close(sync[0]);
+        if (n != (ssize_t)sizeof(child) || child <= 0) {
+            fprintf(stderr, "runasuser: detached launch failed\n");
+            return EXIT_EXEC_FAIL;
+        }
+        fprintf(stderr, "runasuser: detached (PID %d), status in %s\n",
+                (int)child, status_path);
+        return 0;
+    }
+
+    /* Supervisor: own session, no trace, none of the caller's descriptors */
+    close(sync[0]);
+    setsid();
+    g_trace.enabled = 0;
+    if (reply_fd >= 0)
+        close(reply_fd);
+
+    int devnull = open("/dev/null", O_RDWR);
+    pid_t child = fork();
+    if (child == 0) {
+        close(sync[1]);
+        dup2(devnull, STDIN_FILENO);
+        if (r->out_fd < 0)
+            dup2(devnull, STDOUT_FILENO);
+        if (r->err_fd < 0)
+            dup2(devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO)
+            close(devnull);
+        return -1;
+    }
+
+    gettimeofday(&js.started, NULL);
+    js.pid   = child;
+    js.state = "running";
+    if (child < 0 || write_status(status_path, &js) != 0)
+        child = -1;
+    (void)write(sync[1], &child, sizeof(child));
+    close(sync[1]);
+    if (child < 0)
+        _exit(EXIT_GENERAL);
+
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+        dup2(devnull, fd);
+
+    while (wait4(child, &js.status, 0, &js.ru) < 0) {
+        if (errno != EINTR)
+            _exit(EXIT_GENERAL);
+    }
+    gettimeofday(&js.ended, NULL);
+    js.state = "exited";
+    _exit(write_status(status_path, &js) == 0 ? 0 : EXIT_GENERAL);
+}
+
+/*
+ * --collect <path>: print the status record and exit with the command's
+ * exit code once it has exited, or EXIT_PENDING while it is still running.
+ */
+static int collect_status(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "runasuser: open %s: %s\n", path, strerror(errno));
+        return EXIT_GENERAL;
+    }
+    size_t len = 0;
+    char *data = read_stream(fp, &len);
+    fclose(fp);
+    if (!data) {
+        fprintf(stderr, "runasuser: read %s: %s\n", path, strerror(errno));
+        return EXIT_GENERAL;
+    }
+
+    fwrite(data, 1, len, stdout);
+    const char *code = strstr(data, "\"exit_code\":");
+    int rc = !strstr(data, "\"state\":\"exited\"") ? EXIT_PENDING
+           : code ? atoi(code + strlen("\"exit_code\":")) : EXIT_GENERAL;
+    free(data);
+    return rc;
+}
+
+/*
+ * Everything after user detection: --session re-invocation, privilege drop,
+ * environment and launch.  pw may be NULL, in which case it is looked up
+ * from uid (the broker and --resolved-user already have it).  reply_fd (or
+ * -1) is the broker connection.  It is close-on-exec, so a no-wait exec
+ * closes it without a reply, which tells the client the command started;
+ * any failure before that is returned and replied by the caller.
+ */
+static int run_as_user(const options *opt, int argc, char **argv,
+                       uid_t uid, const struct passwd *pw, int reply_fd)
+{
+    char **cmd_argv = opt->cmd_argv;
+
+    /* --- Resolve user details from UID --- */
+    if (!pw) {
+        uint64_t t = trace_now();
+        pw = getpwuid(uid);
+        if (!pw) {
+            fprintf(stderr, "runasuser: getpwuid(%u): %s\n",
+                    (unsigned)uid, strerror(errno));
+            return EXIT_GENERAL;
+        }
+        trace_phase("getpwuid", t);
+    }
+
+    /* --- If --session, re-invoke via launchctl asuser --- */
+    if (opt->session) {
+        return handle_session(pw, opt->wait, argc, argv, opt->argi, reply_fd);
+    }
+
+    /* --- Load the batch manifest while still root (it may be root-only) --- */
+    batch_manifest manifest = { NULL, 0, 0 };
+    if (opt->batch_path) {
+        uint64_t t = trace_now();
+        if (load_manifest(opt->batch_path, &manifest) != 0)
+            return EXIT_USAGE;
+        trace_phase("load_manifest", t);
+    }
+
+    /* --- Open --stdout/--stderr targets as root, like the manifest --- */
+    redirects redir;
+    if (open_redirects(opt->stdout_path, opt->stderr_path, pw->pw_uid, &redir) != 0) {
+        free_manifest(&manifest);
+        return EXIT_GENERAL;
+    }
+
+    /* --- And the --result-file, which the command must not inherit --- */
+    int result_fd = opt->rusage ? opt->result_fd : -1;
+    if (opt->result_file) {
+        result_fd = open_redirect(opt->result_file, pw->pw_uid);
+        if (result_fd < 0) {
+            free_manifest(&manifest);
+            close_redirects(&redir);
+            return EXIT_GENERAL;
+        }
+    }
+
+    /* --- Nice value and I/O policy, inherited by everything we start --- */
+    if (apply_launch_policy(&opt->policy) != 0) {
+        free_manifest(&manifest);
+        close_redirects(&redir);
+        if (opt->result_file)
+            close(result_fd);
+        return EXIT_GENERAL;
+    }
+
+    /* --- Detach: the rest runs in the supervisor's child --- */
+    if (opt->detach) {
+        int rc = detach_supervisor(opt->status_file, &redir, reply_fd);
+        if (rc >= 0) {
+            close_redirects(&redir);
+            if (opt->result_file)
+                close(result_fd);
+            return rc;
+        }
+        reply_fd = -1;
+    }
+
+    /* --- Drop privileges (root -> console user) --- */
+    if (drop_privileges(pw, opt->group_cache_ttl, opt->refresh_groups) != 0) {
+        if (opt->result_file)
+            close(result_fd);
+        return EXIT_PRIV_DROP;
+    }
+
+    /* --- Build the clean environment --- */
+    uint64_t t = trace_now();
+    user_env env;
+    if (setup_environment(pw, &opt->env, &env) != 0) {
+        if (opt->result_file)
+            close(result_fd);
+        return EXIT_GENERAL;
+    }
+    trace_phase("setup_environment", t);
+
+    /* --- Batch: run every manifest entry under the one privilege drop --- */
+    if (opt->batch_path) {
+        t = trace_now();
+        int rc = run_batch(&manifest, opt->batch_jobs, &redir, &opt->policy, env.envp,
+                           opt->timeout_s, opt->grace_s, opt->grace_set);
+        trace_phase("batch", t);
+        free_manifest(&manifest);
+        close_redirects(&redir);
+        free(env.defaults);
+        return rc;
+    }
+
+    /* --- Execute the command --- */
+    if (opt->wait) {
+        /* --max-output: streams not redirected to a file go through pipes */
+        capped_stream capped[2];
+        int ncapped = 0;
+        if (opt->max_output) {
+            int *targets[2] = { &redir.out_fd, &redir.err_fd };
+            for (int s = 0; s < 2; s++) {
+                int fds[2];
+                if (*targets[s] >= 0)
+                    continue;
+                if (pipe(fds) != 0 ||
+                    fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 ||
+                    fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0 ||
+                    capped_init(&capped[ncapped], fds[0], STDOUT_FILENO + s,
+                                opt->max_output, opt->keep) != 0) {
+                    fprintf(stderr, "runasuser: output pipe: %s\n", strerror(errno));
+                    close_redirects(&redir);
+                    for (int k = 0; k < ncapped; k++) {
+                        close(capped[k].fd);
+                        free(capped[k].ring);
+                    }
+                    if (opt->result_file)
+                        close(result_fd);
+                    return EXIT_GENERAL;
+                }
+                *targets[s] = fds[1];
+                ncapped++;
+            }
+        }
+
+        /* Spawn the command, then supervise it, passing on signals */
+        supervisor sv;
+        supervised kid;
+        if (supervisor_open(&sv, &kid, 1, opt->timeout_s, opt->grace_s, opt->grace_set) != 0) {
+            close_redirects(&redir);
+            for (int s = 0; s < ncapped; s++) {
+                close(capped[s].fd);
+                free(capped[s].ring);
+            }
+            if (opt->result_file)
+                close(result_fd);
+            return EXIT_GENERAL;
+        }
+        pid_t pid = 0;
+        forward_hold(1);
+        forward_signals(&pid, 1, 1);
+        t = trace_now();
+        int rc = spawn_command(cmd_argv[0], cmd_argv, env.envp, &redir, &opt->policy, &pid);
+        trace_phase("posix_spawnp", t);
+        forward_hold(0);
+        if (rc != 0) {
+            forward_signals(NULL, 0, 0);
+            close(sv.kq);
+            fprintf(stderr, "runasuser: exec %s: %s\n", cmd_argv[0], strerror(rc));
+            close_redirects(&redir);
+            for (int s = 0; s < ncapped; s++) {
+                close(capped[s].fd);
+                free(capped[s].ring);
+            }
+            if (opt->result_file)
+                close(result_fd);
+            return EXIT_EXEC_FAIL;
+        }
+
+        /* Wait and propagate exit code (128+N if killed by signal) */
+        close_redirects(&redir);
+        int status = 0, timed_out = 0;
+        struct rusage ru;
+        pid_t done;
+        rc = supervisor_watch(&sv, pid);
+        if (rc == 0 && supervisor_relay(&sv, capped, ncapped) != 0) {
+            kill(pid, SIGKILL);
+            rc = -1;
+        }
+        if (rc == 0)
+            rc = supervisor_next(&sv, &done, &status, &ru, &timed_out) == 1 ? 0 : -1;
+        if (rc == 0) {
+            int late = 0;
+            rc = supervisor_next(&sv, &done, &status, NULL, &late);  /* rest of the output */
+            timed_out |= late;
+        }
+        const char *killed = g_forward.groups ? "process group" : "command";
+        forward_signals(NULL, 0, 0);
+        supervisor_close(&sv);
+        if (rc != 0) {
+            if (opt->result_file)
+                close(result_fd);
+            return EXIT_GENERAL;
+        }
+        trace_phase("child_exit", t);
+
+        if (result_fd >= 0) {
+            write_result(result_fd, pid, pw, status, trace_now() - t, &ru);
+            if (opt->result_file)
+                close(result_fd);
+        }
+        free(env.defaults);
+        if (timed_out) {
+            fprintf(stderr, "runasuser: timed out after %u s; %s terminated\n",
+                    opt->timeout_s, killed);
+            return EXIT_TIMEOUT;
+        }
+        return status_to_exit_code(status);
+    }
+
+    /* No --wait: replace this process entirely */
+    trace_phase("exec", 0);
+    trace_report();
+
+#ifdef POSIX_SPAWN_SETEXEC
+    /* A QoS class is a spawn attribute: replace this process via posix_spawn */
+    if (opt->policy.qos != QOS_CLASS_UNSPECIFIED) {
+        int rc = spawn_command(cmd_argv[0], cmd_argv, env.envp, &redir, &opt->policy, NULL);
+        fprintf(stderr, "runasuser: exec %s: %s\n", cmd_argv[0], strerror(rc));
+        return EXIT_EXEC_FAIL;
+    }
+#endif
+
+    char path[PATH_MAX];
+    int saved_errno = resolve_command(cmd_argv[0], env.envp, path, sizeof(path));
+    if (saved_errno != 0) {
+        fprintf(stderr, "runasuser: exec %s: %s\n", cmd_argv[0], strerror(saved_errno));
+        return EXIT_EXEC_FAIL;
+    }
+
+    /* Keep the caller's stderr for the exec error below */
+    int saved_stderr = redir.err_fd >= 0 ? fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3) : -1;
+    apply_redirects(&redir);
+    execve(path, cmd_argv, env.envp);
+    saved_errno = errno;
+    if (saved_stderr >= 0)
+        dup2(saved_stderr, STDERR_FILENO);
+    fprintf(stderr, "runasuser: exec %s: %s\n", cmd_argv[0], strerror(saved_errno));
+    return EXIT_EXEC_FAIL;
+}
+
+/*
+ * --all-sessions: every user with a GUI login.  Under fast user switching
+ * several users can be logged in at once, but only one owns the console;
+ * State:/Users/ConsoleUser lists them all in its SessionInfo array (one
+ * dictionary per graphical session).  loginwindow sessions (uid 0) and
+ * sessions still logging in are skipped, as are duplicate users.
+ * list_gui_users() returns the count, or -1 if configd could not be read.
+ */
+typedef struct {
+    uid_t uid;
+    char  name[256];
+    pid_t pid;
+} gui_user;
+
+static int list_gui_users(gui_user *users, int max)
+{
+    SCDynamicStoreRef store = SCDynamicStoreCreate(NULL, CFSTR("runasuser"), NULL, NULL);
+    CFStringRef key = SCDynamicStoreKeyCreateConsoleUser(NULL);
+    CFPropertyListRef state = store && key ? SCDynamicStoreCopyValue(store, key) : NULL;
+    int n = state ? 0 : -1;
+
+    CFArrayRef sessions = NULL;
+    if (state && CFGetTypeID(state) == CFDictionaryGetTypeID())
+        sessions = CFDictionaryGetValue((CFDictionaryRef)state, CFSTR("SessionInfo"));
+
+    if (sessions && CFGetTypeID(sessions) == CFArrayGetTypeID()) {
+        CFIndex count = CFArrayGetCount(sessions);
+        for (CFIndex i = 0; i < count && n < max; i++) {
+            CFDictionaryRef info = CFArrayGetValueAtIndex(sessions, i);
+            if (!info || CFGetTypeID(info) != CFDictionaryGetTypeID())
+                continue;
+
+            CFNumberRef cf_uid = CFDictionaryGetValue(info, CFSTR("kCGSSessionUserIDKey"));
+            CFStringRef cf_name = CFDictionaryGetValue(info, CFSTR("kCGSSessionUserNameKey"));
+            CFBooleanRef cf_done = CFDictionaryGetValue(info, CFSTR("kCGSessionLoginDoneKey"));
+            int32_t uid;
+            if (!cf_uid || CFGetTypeID(cf_uid) != CFNumberGetTypeID() ||
+                !CFNumberGetValue(cf_uid, kCFNumberSInt32Type, &uid) || uid <= 0)
+                continue;
+            if (cf_done && CFGetTypeID(cf_done) == CFBooleanGetTypeID() &&
+                !CFBooleanGetValue(cf_done))
+                continue;
+
+            int dup = 0;
+            for (int j = 0; j < n; j++)
+                dup |= users[j].uid == (uid_t)uid;
+            if (dup)
+                continue;
+
+            users[n].uid = (uid_t)uid;
+            users[n].pid = -1;
+            if (!cf_name || CFGetTypeID(cf_name) != CFStringGetTypeID() ||
+                !CFStringGetCString(cf_name, users[n].name, sizeof(users[n].name),
+                                    kCFStringEncodingUTF8))
+                snprintf(users[n].name, sizeof(users[n].name), "%d", (int)uid);
+            n++;
+        }
+    }
+
+    if (state)
+        CFRelease(state);
+    if (key)
+        CFRelease(key);
+    if (store)
+        CFRelease(store);
+    return n;
+}
+
+/*
+ * Launch the command as every GUI user at once: one forked worker per user
+ * runs the normal single-user path (privilege drop, --session, exec), so
+ * all launches overlap.  With --wait each user's exit code is reported as
+ * it finishes:
+ *
+ *   runasuser: user <name> (uid <uid>) exit <code> (PID <pid>)
+ */
+static int run_all_sessions(const options *opt, int argc, char **argv)
+{
+    gui_user users[FANOUT_MAX_USERS];
+    uint64_t t = trace_now();
+    int n = list_gui_users(users, FANOUT_MAX_USERS);
+    trace_phase("list_gui_users", t);
+    if (n <= 0) {
+        fprintf(stderr, "runasuser: no GUI-logged-in users found\n");
+        return EXIT_NO_SESSION;
+    }
+
+    int failed = 0, running = 0;
+    fflush(NULL);
+
+    /* Workers forward to their own commands; pass signals on to the workers */
+    pid_t workers[FANOUT_MAX_USERS] = { 0 };
+    if (opt->wait)
+        forward_signals(workers, n, 0);
+
+    t = trace_now();
+    for (int i = 0; i < n; i++) {
+        forward_hold(1);
+        pid_t pid = fork();
+        if (pid < 0) {
+            forward_hold(0);
+            fprintf(stderr, "runasuser: user %s: fork: %s\n", users[i].name, strerror(errno));
+            failed++;
+            continue;
+        }
+        if (pid == 0) {
+            g_trace.enabled = 0;    /* one report, from the parent */
+            forward_signals(NULL, 0, 0);
+            forward_hold(0);
+            _exit(run_as_user(opt, argc, argv, users[i].uid, NULL, -1) & 0xFF);
+        }
+        workers[i] = pid;
+        forward_hold(0);
+        users[i].pid = pid;
+        running++;
+        if (!opt->wait)
+            fprintf(stderr, "runasuser: user %s (uid %u) PID %d\n",
+                    users[i].name, (unsigned)users[i].uid, (int)pid);
+    }
+    trace_phase("fork", t);
+
+    while (opt->wait && running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
+            failed += running;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (users[i].pid != pid)
+                continue;
+            int code = status_to_exit_code(status);
+            fprintf(stderr, "runasuser: user %s (uid %u) exit %d (PID %d)\n",
+                    users[i].name, (unsigned)users[i].uid, code, (int)pid);
+            if (code != 0)
+                failed++;
+            workers[i] = 0;
+            running--;
+            break;
+        }
+    }
+    if (opt->wait) {
+        forward_signals(NULL, 0, 0);
+        trace_phase("child_exit", t);
+    }
+
+    fprintf(stderr, "runasuser: all sessions complete: %d users, %d failed\n", n, failed);
+    return failed ? EXIT_BATCH_FAIL : 0;
+}
+
+/*
+ * Broker (--broker): a resident root daemon, normally run by launchd, that
+ * accepts launch requests on a root-only Unix socket.
+ *
+ * It caches the console user (uid/gid and passwd entry) and refreshes it
+ * only when SystemConfiguration reports a change of State:/Users/ConsoleUser,
+ * so a launch costs one socket round trip plus fork/exec instead of loading
+ * and querying SystemConfiguration and opendirectoryd each time.
+ *
+ * The broker itself is single-threaded (a CFRunLoop serving the store
+ * notification and the listening socket); every connection is handled in a
+ * forked child, so a slow or long-running (--wait) client never blocks
+ * others and the fork never races with other threads.
+ *
+ * Wire format (same host):
+ *   client -> broker:  broker_request header carrying SCM_RIGHTS for the
+ *                      client's stdin, stdout, stderr and working directory,
+ *                      then len bytes of NUL-terminated argv strings (the CLI
+ *                      argv without argv[0] and the broker client flags)
+ *   broker -> client:  int32 exit code, or nothing when the command was
+ *                      exec'd without --wait: the handler's connection is
+ *                      close-on-exec, so the exec closes it, and a failure
+ *                      short of the exec is still replied
+ *
+ * The handler dup2()s the received descriptors over 0/1/2 and fchdir()s to
+ * the client's directory, so the command behaves exactly as if the client
+ * had launched it itself, including output going straight to the client.
+ */
+#define BROKER_MAGIC        0x42554152u   /* "RAUB" */
+#define BROKER_VERSION      1
+#define BROKER_MAX_ARG_LEN  (1024 * 1024)
+#define BROKER_MAX_ARGS     32768
+#define BROKER_NFDS         4             /* stdin, stdout, stderr, cwd */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t argc;
+    uint32_t len;
+} broker_request;
+
+static struct {
+    int           valid;
+    int           status;           /* 0 or EXIT_NO_SESSION */
+    uid_t         uid;
+    struct passwd pw;               /* points into the buffers below */
+    char          name[256];
+    char          dir[PATH_MAX];
+    char          shell[PATH_MAX];
+} g_console;
+
+static SCDynamicStoreRef g_store;
+
+static void console_user_changed(SCDynamicStoreRef store, CFArrayRef keys, void *info)
+{
+    (void)store; (void)keys; (void)info;
+    g_console.valid = 0;
+}
+
+/* Re-detect the console user if a change was signalled since the last time. */
+static void refresh_console_user(void)
+{
+    if (g_console.valid)
+        return;
+
+    g_console.status = detect_console_user(g_store, &g_console.uid);
+    if (g_console.status == 0) {
+        struct passwd *pw = getpwuid(g_console.uid);
+        if (!pw) {
+            fprintf(stderr, "runasuser: getpwuid(%u): %s\n",
+                    (unsigned)g_console.uid, strerror(errno));
+            g_console.status = EXIT_GENERAL;
+            return;                 /* stay invalid: retry on the next request */
+        }
+        snprintf(g_console.name,  sizeof(g_console.name),  "%s", pw->pw_name);
+        snprintf(g_console.dir,   sizeof(g_console.dir),   "%s", pw->pw_dir);
+        snprintf(g_console.shell, sizeof(g_console.shell), "%s", pw->pw_shell);
+        g_console.pw        = *pw;
+        g_console.pw.pw_name  = g_console.name;
+        g_console.pw.pw_dir   = g_console.dir;
+        g_console.pw.pw_shell = g_console.shell;
+        g_console.pw.pw_passwd = NULL;
+        g_console.pw.pw_gecos  = NULL;
+    }
+    g_console.valid = 1;
+}
+
+static int read_exact(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_exact(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Read one request (see the wire format above) in a forked handler and
+ * become the client: its descriptors go to stdin/stdout/stderr and its
+ * working directory is entered.  Returns 0 with the argv (argv[0] is a
+ * dummy, argv[argc] NULL), or the exit code to reply with.
+ */
+static int receive_request(int fd, const char *who, char ***pargv, uint32_t *pargc)
+{
+    broker_request req;
+    int fds[BROKER_NFDS];
+    int nfds = 0;
+
+    /* Blocking I/O and no descriptor leaks into the launched command */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /* Header + descriptors */
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (nfds > BROKER_NFDS)
+                nfds = BROKER_NFDS;
+            memcpy(fds, CMSG_DATA(c), (size_t)nfds * sizeof(int));
+        }
+    }
+
+    if (n != (ssize_t)sizeof(req) ||
+        req.magic != BROKER_MAGIC || req.version != BROKER_VERSION ||
+        req.argc == 0 || req.argc > BROKER_MAX_ARGS ||
+        req.len > BROKER_MAX_ARG_LEN || nfds != BROKER_NFDS) {
+        fprintf(stderr, "runasuser: %s: malformed request\n", who);
+        return EXIT_USAGE;
+    }
+
+    /* Become the client: its stdio, its working directory */
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0)
+            return EXIT_GENERAL;
+    }
+    if (fchdir(fds[3]) != 0)
+        fprintf(stderr, "runasuser: %s: fchdir: %s\n", who, strerror(errno));
+    for (int i = 0; i < BROKER_NFDS; i++) {
+        if (fds[i] > 2)
+            close(fds[i]);
+    }
+
+    /* Arguments: NUL-terminated strings; rebuild argv with a dummy argv[0] */
+    char *args = malloc((size_t)req.len + 1);
+    char **argv = calloc((size_t)req.argc + 2, sizeof(char *));
+    if (!args || !argv || read_exact(fd, args, req.len) != 0)
+        return EXIT_GENERAL;
+    args[req.len] = '\0';
+
+    uint32_t argc = 0;
+    argv[argc++] = "runasuser";
+    for (char *p = args; p < args + req.len && argc <= req.argc; p += strlen(p) + 1)
+        argv[argc++] = p;
+    if (argc != req.argc + 1) {
+        fprintf(stderr, "runasuser: %s: malformed request arguments\n", who);
+        return EXIT_USAGE;
+    }
+
+    *pargv = argv;
+    *pargc = argc;
+    return 0;
+}
+
+/*
+ * Connection handler, running in a forked child of the broker.  Never
+ * returns: the exit code is sent to the client and used as _exit status.
+ */
+static void serve_client(int fd)
+{
+    fcntl(fd, F_SETFD, FD_CLOEXEC);     /* closed by a no-wait exec: its reply */
+
+    char **argv;
+    uint32_t argc;
+    int32_t code = receive_request(fd, "broker", &argv, &argc);
+    if (code != 0)
+        goto reply;
+
+    options opt;
+    int rc = parse_options((int)argc, argv, &opt);
+    if (rc >= 0 || opt.broker || opt.via_broker || opt.helper_serve) {
+        code = rc >= 0 ? rc : EXIT_USAGE;
+        goto reply;
+    }
+
+    if (g_console.status != 0) {
+        code = g_console.status;
+        fprintf(stderr, "runasuser: no interactive user session found\n");
+        goto reply;
+    }
+
+    /* Only the client's stdio came along; trace to its stderr */
+    if (opt.trace || opt.rusage)
+        trace_init(opt.trace_json, opt.trace ? STDERR_FILENO : -1);
+    code = run_as_user(&opt, (int)argc, argv, g_console.uid, &g_console.pw, fd);
+    trace_report();
+
+reply:
+    (void)write_exact(fd, &code, sizeof(code));
+    _exit(code & 0xFF);
+}
+
+static void broker_accept(CFSocketRef s, CFSocketCallBackType type,
+                          CFDataRef address, const void *data, void *info)
+{
+    (void)s; (void)address; (void)info;
+    if (type != kCFSocketAcceptCallBack)
+        return;
+
+    int fd = *(const CFSocketNativeHandle *)data;
+
+    /* Root-only: the socket mode already says so, the peer check enforces it */
+    uid_t peer_uid;
+    gid_t peer_gid;
+    if (getpeereid(fd, &peer_uid, &peer_gid) != 0 || peer_uid != 0) {
+        close(fd);
+        return;
+    }
+
+    refresh_console_user();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "runasuser: broker: fork: %s\n", strerror(errno));
+    } else if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        serve_client(fd);
+    }
+    close(fd);
+}
+
+/*
+ * Bind and listen on a root-owned 0600 Unix socket at path, replacing a
+ * stale socket from a previous run but nothing else.  Returns the
+ * descriptor, or -1 with an EXIT_* code in *code.
+ */
+static int listen_socket(const char *path, int *code)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "runasuser: socket path too long: %s\n", path);
+        *code = EXIT_USAGE;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    *code = EXIT_GENERAL;
+
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "runasuser: %s exists and is not a socket\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        fprintf(stderr, "runasuser: socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    mode_t old_mask = umask(077);       /* socket is created 0600, root-owned */
+    int rc = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc != 0 || listen(lfd, 64) != 0) {
+        fprintf(stderr, "runasuser: bind %s: %s\n", path, strerror(errno));
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+/*
+ * Serve lfd and watch State:/Users/ConsoleUser from the current run loop:
+ * on_accept gets each connection, on_change each console-user change.
+ */
+static SCDynamicStoreRef serve_socket(int lfd, CFSocketCallBack on_accept,
+                                      SCDynamicStoreCallBack on_change)
+{
+    SCDynamicStoreRef store = SCDynamicStoreCreate(NULL, CFSTR("runasuser"), on_change, NULL);
+    CFStringRef key = store ? SCDynamicStoreKeyCreateConsoleUser(NULL) : NULL;
+    CFArrayRef keys = key ? CFArrayCreate(NULL, (const void **)&key, 1,
+                                          &kCFTypeArrayCallBacks) : NULL;
+    CFRunLoopSourceRef store_src = NULL;
+    if (keys && SCDynamicStoreSetNotificationKeys(store, keys, NULL))
+        store_src = SCDynamicStoreCreateRunLoopSource(NULL, store, 0);
+    if (!store_src) {
+        fprintf(stderr, "runasuser: cannot watch the console user\n");
+        return NULL;
+    }
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), store_src, kCFRunLoopDefaultMode);
+
+    CFSocketRef sock = CFSocketCreateWithNative(NULL, lfd, kCFSocketAcceptCallBack,
+                                                on_accept, NULL);
+    CFRunLoopSourceRef sock_src = sock ? CFSocketCreateRunLoopSource(NULL, sock, 0) : NULL;
+    if (!sock_src) {
+        fprintf(stderr, "runasuser: cannot serve the socket\n");
+        return NULL;
+    }
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), sock_src, kCFRunLoopDefaultMode);
+    return store;
+}
+
+static int run_broker(const options *opt)
+{
+    int rc;
+    int lfd = listen_socket(opt->socket_path, &rc);
+    if (lfd < 0)
+        return rc;
+
+    /* Handlers are reaped automatically; each resets this after fork */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Console-user change notifications invalidate the cache */
+    g_store = serve_socket(lfd, broker_accept, console_user_changed);
+    if (!g_store) {
+        close(lfd);
+        return EXIT_GENERAL;
+    }
+
+    fprintf(stderr, "runasuser: broker listening on %s\n", opt->socket_path);
+    CFRunLoopRun();
+    return 0;
+}
+
+/* send_request() results other than an exit code */
+#define REQUEST_FAILED      (-1)    /* the reply was cut short */
+#define REQUEST_UNSENT      (-2)    /* the request could not be sent */
+#define REQUEST_UNANSWERED  (-3)    /* sent, then closed before any reply byte */
+
+/*
+ * Send one request on a connected socket: nargs arguments, the stdio
+ * descriptors and the working directory.  Returns the exit code the
+ * server replied with, or one of the REQUEST_* results.
+ */
+static int32_t send_request(int fd, char **args, uint32_t nargs, const int stdio[3])
+{
+    size_t len = 0;
+    for (uint32_t i = 0; i < nargs; i++)
+        len += strlen(args[i]) + 1;
+    broker_request req = { BROKER_MAGIC, BROKER_VERSION, nargs, (uint32_t)len };
+
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd < 0)
+        cwd = open("/", O_RDONLY | O_DIRECTORY);
+    int fds[BROKER_NFDS] = { stdio[0], stdio[1], stdio[2], cwd };
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    /* A server that has gone resets us: fail the write, don't raise SIGPIPE */
+    int on = 1;
+    (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    int ok = cwd >= 0 && sendmsg(fd, &msg, 0) == (ssize_t)sizeof(req);
+    if (cwd >= 0)
+        close(cwd);
+    for (uint32_t i = 0; ok && i < nargs; i++)
+        ok = write_exact(fd, args[i], strlen(args[i]) + 1) == 0;
+
+    if (!ok)
+        return REQUEST_UNSENT;
+
+    int32_t code;
+    ssize_t n;
+    while ((n = read(fd, &code, sizeof(code))) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return REQUEST_UNANSWERED;
+    if (n < (ssize_t)sizeof(code) &&
+        read_exact(fd, (char *)&code + n, sizeof(code) - (size_t)n) != 0)
+        return REQUEST_FAILED;
+    return code;
+}
+
+/*
+ * --via-broker: forward this invocation to the broker.  Returns the launch
+ * result, or -1 if no broker is listening (the caller launches directly).
+ */
+static int run_via_broker(const options *opt, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opt->socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "runasuser: broker not available (%s), launching directly\n",
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    /* argv[1..] minus the broker client flags */
+    uint32_t nargs = 0;
+    char **fwd = calloc((size_t)argc, sizeof(char *));
+    if (!fwd) {
+        close(fd);
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        return EXIT_GENERAL;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (i < opt->argi) {
+            if (strcmp(argv[i], "--via-broker") == 0)
+                continue;
+            if (strcmp(argv[i], "--broker-socket") == 0) {
+                i++;                    /* skip the path too */
+                continue;
+            }
+        }
+        fwd[nargs++] = argv[i];
+    }
+
+    int stdio[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int32_t code = send_request(fd, fwd, nargs, stdio);
+    free(fwd);
+    close(fd);
+    if (code == REQUEST_UNANSWERED)
+        code = 0;                       /* the handler exec'd the command */
+    if (code < 0) {
+        fprintf(stderr, "runasuser: broker request failed\n");
+        code = EXIT_GENERAL;
+    }
+    return code;
+}
+
+/*
+ * Session helper (--helper).  The broker saves the per-request setup of
+ * the calling process, but each launch still forks a root handler that
+ * drops privileges and rebuilds the environment.  A helper does that once:
+ * it is started in the user's bootstrap namespace (launchctl asuser, as for
+ * --session), binds a root-only socket, drops to the user for good and then
+ * only forks and spawns.  There is one helper per user, guarded by a lock
+ * file.  It exits when the user logs out or after its idle timeout.
+ *
+ * Requests use the broker wire format; the arguments are an optional
+ * "--wait" followed by the command.  Everything else (the console-user
+ * lookup, --stdout/--stderr) is done by the root client, whose descriptors
+ * the command gets.  Only root may connect, so security decisions stay in
+ * the root process: a helper never runs a command its caller did not send.
+ */
+static struct {
+    int      lfd;
+    int      lock_fd;
+    int      session_changed;       /* console user changed: re-check logout */
+    uint64_t last_request;          /* monotonic seconds */
+    user_env env;                   /* every command's environment */
+} g_helper;
+
+static uint64_t monotonic_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void helper_session_changed(SCDynamicStoreRef store, CFArrayRef keys, void *info)
+{
+    (void)store; (void)keys; (void)info;
+    g_helper.session_changed = 1;
+}
+
+static int helper_user_logged_in(uid_t uid)
+{
+    gui_user users[FANOUT_MAX_USERS];
+    int n = list_gui_users(users, FANOUT_MAX_USERS);
+    for (int i = 0; i < n; i++) {
+        if (users[i].uid == uid)
+            return 1;
+    }
+    return n < 0;                   /* unknown: keep serving */
+}
+
+/*
+ * Connection handler, running in a forked child of the helper, already as
+ * the user.  Never returns: the exit code is sent to the client and used
+ * as _exit status.
+ */
+static void serve_helper_client(int fd)
+{
+    char **argv;
+    uint32_t argc;
+    int32_t code = receive_request(fd, "helper", &argv, &argc);
+    if (code != 0)
+        goto reply;
+
+    int wait = strcmp(argv[1], "--wait") == 0;
+    char **cmd = &argv[1 + wait];
+    if (!cmd[0]) {
+        fprintf(stderr, "runasuser: helper: malformed request arguments\n");
+        code = EXIT_USAGE;
+        goto reply;
+    }
+
+    pid_t pid;
+    int rc = spawn_command(cmd[0], cmd, g_helper.env.envp, NULL, NULL, &pid);
+    if (rc != 0) {
+        fprintf(stderr, "runasuser: exec %s: %s\n", cmd[0], strerror(rc));
+        code = EXIT_EXEC_FAIL;
+        goto reply;
+    }
+
+    /* Without --wait the command outlives this handler, like an exec would */
+    if (wait) {
+        int status;
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
+                code = EXIT_GENERAL;
+                goto reply;
+            }
+        }
+        code = status_to_exit_code(status);
+    }
+
+reply:
+    (void)write_exact(fd, &code, sizeof(code));
+    _exit(code & 0xFF);
+}
+
+static void helper_handle(int fd)
+{
+    /* Root-only, as for the broker: the helper acts for root, not the user */
+    uid_t peer_uid;
+    gid_t peer_gid;
+    if (getpeereid(fd, &peer_uid, &peer_gid) != 0 || peer_uid != 0) {
+        close(fd);
+        return;
+    }
+
+    g_helper.last_request = monotonic_s();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "runasuser: helper: fork: %s\n", strerror(errno));
+    } else if (pid == 0) {
+        /* A handler must not keep the socket or the lock past the helper */
+        close(g_helper.lfd);
+        close(g_helper.lock_fd);
+        signal(SIGCHLD, SIG_DFL);
+        serve_helper_client(fd);
+    }
+    close(fd);
+}
+
+static void helper_accept(CFSocketRef s, CFSocketCallBackType type,
+                          CFDataRef address, const void *data, void *info)
+{
+    (void)s; (void)address; (void)info;
+    if (type == kCFSocketAcceptCallBack)
+        helper_handle(*(const CFSocketNativeHandle *)data);
+}
+
+/* --helper-serve: the helper itself, in the user's bootstrap namespace. */
+static int run_helper(const options *opt)
+{
+    struct passwd pw;
+    if (parse_resolved_user(opt->resolved_user, &pw) != 0) {
+        fprintf(stderr, "runasuser: malformed --resolved-user\n");
+        return EXIT_USAGE;
+    }
+
+    char path[PATH_MAX], lock_path[PATH_MAX];
+    snprintf(path, sizeof(path), HELPER_SOCKET_FMT, (unsigned)pw.pw_uid);
+    snprintf(lock_path, sizeof(lock_path), HELPER_LOCK_FMT, (unsigned)pw.pw_uid);
+
+    /*
+     * One helper per user: a second one finds the lock taken and leaves,
+     * unless the holder is a helper on its way out (no longer accepting).
+     */
+    g_helper.lock_fd = open(lock_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (g_helper.lock_fd < 0) {
+        fprintf(stderr, "runasuser: open %s: %s\n", lock_path, strerror(errno));
+        return EXIT_GENERAL;
+    }
+    for (int ms = 0; flock(g_helper.lock_fd, LOCK_EX | LOCK_NB) != 0; ms += 10) {
+        int fd = connect_socket(path);
+        if (fd >= 0 || ms >= HELPER_START_MS) {
+            if (fd >= 0)
+                close(fd);
+            return 0;
+        }
+        usleep(10000);
+    }
+
+    /* Bind while still root, so the socket is root-owned and 0600 */
+    int rc;
+    g_helper.lfd = listen_socket(path, &rc);
+    if (g_helper.lfd < 0)
+        return rc;
+    fcntl(g_helper.lfd, F_SETFD, FD_CLOEXEC);
+
+    if (drop_privileges(&pw, 0, 0) != 0)
+        return EXIT_PRIV_DROP;
+    if (setup_environment(&pw, &opt->env, &g_helper.env) != 0)
+        return EXIT_GENERAL;
+
+    /* Handlers are reaped automatically; each resets this after fork */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!serve_socket(g_helper.lfd, helper_accept, helper_session_changed))
+        return EXIT_GENERAL;
+
+    g_helper.last_request = monotonic_s();
+    while (monotonic_s() - g_helper.last_request < opt->helper_idle_s) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1, 1);
+        if (g_helper.session_changed) {
+            g_helper.session_changed = 0;
+            if (!helper_user_logged_in(pw.pw_uid))
+                break;
+        }
+    }
+
+    /*
+     * Serve what is already queued rather than reset it.  A client that
+     * connects after this fails to connect, or is reset by the close below,
+     * and starts a new helper; the socket file is root-owned, so it
+     * replaces it once we've gone.
+     */
+    fcntl(g_helper.lfd, F_SETFL, O_NONBLOCK);
+    int fd;
+    while ((fd = accept(g_helper.lfd, NULL, NULL)) >= 0)
+        helper_handle(fd);
+    close(g_helper.lfd);
+    close(g_helper.lock_fd);
+    return 0;
+}
+
+/*
+ * Start the user's helper through launchctl asuser and wait until it
+ * listens.  Returns a connection to it, or -1.
+ */
+static int start_helper(const options *opt, const struct passwd *pw, const char *path)
+{
+    char *self = get_self_path();
+    char *spec = format_resolved_user(pw);
+    if (!self || !spec) {
+        fprintf(stderr, "runasuser: cannot start the session helper\n");
+        free(self);
+        free(spec);
+        return -1;
+    }
+    char uid_str[16], idle[32];
+    snprintf(uid_str, sizeof(uid_str), "%u", (unsigned)pw->pw_uid);
+    snprintf(idle, sizeof(idle), "--helper=%u", opt->helper_idle_s);
+    char *args[] = { "launchctl", "asuser", uid_str, self, "--helper-serve",
+                     "--resolved-user", spec, idle, NULL };
+
+    /*
+     * The helper outlives us: detach it from our session and stdio, so it
+     * holds no pipe a caller is reading to EOF.
+     */
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        for (int i = 0; null_fd >= 0 && i < 3; i++)
+            dup2(null_fd, i);
+        if (null_fd > 2)
+            close(null_fd);
+        execvp("launchctl", args);
+        _exit(EXIT_EXEC_FAIL);
+    }
+    free(self);
+    free(spec);
+    if (pid < 0) {
+        fprintf(stderr, "runasuser: fork: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int fd = -1;
+    for (int ms = 0; ms < HELPER_START_MS && fd < 0; ms += 10) {
+        usleep(10000);
+        fd = connect_socket(path);
+    }
+    (void)waitpid(pid, NULL, WNOHANG);  /* launchctl execs; reap it if it failed */
+    if (fd < 0)
+        fprintf(stderr, "runasuser: session helper did not start\n");
+    return fd;
+}
+
+/* --helper: launch through the user's session helper, starting it if needed. */
+static int run_via_helper(const options *opt, uid_t uid)
+{
+    struct passwd *pw = getpwuid(uid);
+    if (!pw) {
+        fprintf(stderr, "runasuser: getpwuid(%u): %s\n", (unsigned)uid, strerror(errno));
+        return EXIT_GENERAL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), HELPER_SOCKET_FMT, (unsigned)uid);
+
+    uint64_t t = trace_now();
+    int fd = connect_socket(path);
+    if (fd >= 0) {
+        trace_phase("connect_helper", t);
+    } else {
+        fd = start_helper(opt, pw, path);
+        if (fd < 0)
+            return EXIT_GENERAL;
+        trace_phase("start_helper", t);
+    }
+
+    /* --stdout/--stderr are opened here, as root, and become its stdio */
+    redirects redir;
+    if (open_redirects(opt->stdout_path, opt->stderr_path, uid, &redir) != 0) {
+        close(fd);
+        return EXIT_GENERAL;
+    }
+    int stdio[3] = { STDIN_FILENO,
+                     redir.out_fd >= 0 ? redir.out_fd : STDOUT_FILENO,
+                     redir.err_fd >= 0 ? redir.err_fd : STDERR_FILENO };
+
+    uint32_t nargs = 0;
+    while (opt->cmd_argv[nargs])
+        nargs++;
+    char **args = calloc((size_t)nargs + 1, sizeof(char *));
+    if (!args) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        close_redirects(&redir);
+        close(fd);
+        return EXIT_GENERAL;
+    }
+    nargs = 0;
+    if (opt->wait)
+        args[nargs++] = "--wait";
+    for (char **a = opt->cmd_argv; *a; a++)
+        args[nargs++] = *a;
+
+    t = trace_now();
+    int32_t code = send_request(fd, args, nargs, stdio);
+    if (code == REQUEST_UNSENT || code == REQUEST_UNANSWERED) {
+        /*
+         * A helper on its way out resets the connections it never
+         * accepted, and the request never reached a handler: start a new
+         * helper and send it there.
+         */
+        close(fd);
+        fd = start_helper(opt, pw, path);
+        code = fd >= 0 ? send_request(fd, args, nargs, stdio) : REQUEST_FAILED;
+    }
+    trace_phase("helper_round_trip", t);
+    free(args);
+    close_redirects(&redir);
+    if (fd >= 0)
+        close(fd);
+    if (code < 0) {
+        fprintf(stderr, "runasuser: helper request failed\n");
+        code = EXIT_GENERAL;
+    }
+    return code;
+}
+
+/*
+ * Library API (include/runasuser.h), built with -DRUNASUSER_LIBRARY.
+ *
+ * The CLI drops privileges in its own process; a library cannot, so each
+ * spawn forks and the child drops them instead.  The host may be
+ * multithreaded, and after fork() only async-signal-safe calls are allowed,
+ * so everything that allocates or asks Directory Services (getpwuid,
+ * getgrouplist, the environment, the spawn attributes, PATH lookup) is done
+ * in the parent: runasuser_open() once, runasuser_spawn() the rest.  The
+ * child only sets the groups and IDs and calls posix_spawn() with
+ * POSIX_SPAWN_SETEXEC; a failure is reported back over a close-on-exec pipe.
+ */
+#define SPAWN_STAGE_NICE     0
+#define SPAWN_STAGE_IOPOLICY 1
+#define SPAWN_STAGE_GROUPS   2
+#define SPAWN_STAGE_SETGID   3
+#define SPAWN_STAGE_SETUID   4
+#define SPAWN_STAGE_VERIFY   5
+#define SPAWN_STAGE_EXEC     6
+
+static const char *const spawn_stage_names[] = {
+    "setpriority", "setiopolicy_np", "setgroups", "setgid", "setuid",
+    "privilege drop verification", "exec",
+};
+
+struct runasuser_context {
+    options        opt;
+    char         **args;                /* "runasuser", options..., command */
+    int            nargs;
+    struct passwd  pw;                  /* points into pwbuf */
+    char           pwbuf[4096];
+    gid_t          groups[NGROUPS_MAX];
+    int            ngroups;
+    user_env       env;
+};
+
+struct runasuser_process {
+    pid_t pid;
+    int   exit_code;                    /* -1 until reaped */
+};
+
+/* Fetch uid's passwd entry into the caller's buffer (getpwuid() is not reentrant). */
+static int lookup_user(uid_t uid, struct passwd *pw, char *buf, size_t len)
+{
+    struct passwd *found = NULL;
+    int rc = getpwuid_r(uid, pw, buf, len, &found);
+    if (!found) {
+        fprintf(stderr, "runasuser: getpwuid(%u): %s\n", (unsigned)uid,
+                rc ? strerror(rc) : "no such user");
+        return EXIT_GENERAL;
+    }
+    return 0;
+}
+
+int runasuser_find_session(runasuser_session *session)
+{
+    uid_t uid = 0;
+    int rc = detect_console_user(NULL, &uid);
+    if (rc != 0)
+        return rc;
+
+    struct passwd pw;
+    char buf[4096];
+    if ((rc = lookup_user(uid, &pw, buf, sizeof(buf))) != 0)
+        return rc;
+
+    session->id = (unsigned long)uid;
+    snprintf(session->user, sizeof(session->user), "%s", pw.pw_name);
+    return RUNASUSER_OK;
+}
+
+void runasuser_close(runasuser_context *ctx)
+{
+    if (!ctx)
+        return;
+    free(ctx->env.defaults);
+    if (ctx->args)
+        argv_free(ctx->args, ctx->nargs);
+    free(ctx);
+}
+
+int runasuser_open(const char *const *options_in, runasuser_context **out)
+{
+    *out = NULL;
+    if (getuid() != 0) {
+        fprintf(stderr, "runasuser: must be run as root\n");
+        return EXIT_GENERAL;
+    }
+
+    runasuser_context *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        return EXIT_GENERAL;
+    }
+
+    /* Parse the options as a command line, with a placeholder command */
+    int cap = 0, rc;
+    size_t nopts = 0;
+    while (options_in && options_in[nopts])
+        nopts++;
+    for (size_t i = 0; i < nopts + 2; i++) {
+        const char *arg = i == 0 ? "runasuser" : i <= nopts ? options_in[i - 1] : "/usr/bin/true";
+        char *copy = strdup(arg);
+        if (!copy || argv_push(&ctx->args, &ctx->nargs, &cap, copy) != 0) {
+            fprintf(stderr, "runasuser: memory allocation failed\n");
+            free(copy);
+            runasuser_close(ctx);
+            return EXIT_GENERAL;
+        }
+    }
+    rc = parse_options(ctx->nargs, ctx->args, &ctx->opt);
+    if (rc >= 0) {
+        runasuser_close(ctx);
+        return EXIT_USAGE;
+    }
+
+    const options *opt = &ctx->opt;
+    if (opt->argi != ctx->nargs - 1) {
+        fprintf(stderr, "runasuser: unknown option %s\n", ctx->args[opt->argi]);
+        runasuser_close(ctx);
+        return EXIT_USAGE;
+    }
+    if (opt->wait || opt->session || opt->all_sessions || opt->batch_path ||
+        opt->broker || opt->via_broker || opt->detach || opt->status_file ||
+        opt->collect_path || opt->max_output || opt->trace || opt->resolved_user ||
+        opt->helper || opt->helper_serve || opt->rusage) {
+        fprintf(stderr, "runasuser: the library takes only launch options "
+                        "(--stdout, --stderr, --qos, --nice, --io-policy, --env, "
+                        "--env-allow, --group-cache, --refresh-groups, "
+                        "--wait-for-session)\n");
+        runasuser_close(ctx);
+        return EXIT_USAGE;
+    }
+
+    /* --- Resolve the user once: passwd entry, groups, environment --- */
+    uid_t uid = 0;
+    if (opt->wait_session)
+        rc = wait_for_console_user(opt->wait_session_s, &uid);
+    else
+        rc = detect_console_user(NULL, &uid);
+    if (rc == 0)
+        rc = lookup_user(uid, &ctx->pw, ctx->pwbuf, sizeof(ctx->pwbuf));
+    if (rc != 0) {
+        runasuser_close(ctx);
+        return rc;
+    }
+
+    ctx->ngroups = resolve_groups(&ctx->pw, opt->group_cache_ttl, opt->refresh_groups,
+                                  ctx->groups);
+    if (ctx->ngroups < 0) {
+        fprintf(stderr, "runasuser: cannot resolve the groups of %s "
+                        "(more than %d, or out of memory)\n",
+                ctx->pw.pw_name, NGROUPS_MAX);
+        runasuser_close(ctx);
+        return EXIT_PRIV_DROP;
+    }
+
+    if (setup_environment(&ctx->pw, &opt->env, &ctx->env) != 0) {
+        runasuser_close(ctx);
+        return EXIT_GENERAL;
+    }
+
+    *out = ctx;
+    return RUNASUSER_OK;
+}
+
+/*
+ * The forked child: async-signal-safe calls only.  Reports {stage, errno}
+ * on err_fd and exits if anything fails, else becomes the command.
+ */
+static void spawn_child(const runasuser_context *ctx, const char *path,
+                        char *const argv[], const redirects *r,
+                        const posix_spawnattr_t *attr,
+                        const posix_spawn_file_actions_t *actions, int err_fd)
+{
+    const launch_policy *lp = &ctx->opt.policy;
+    int report[2] = { SPAWN_STAGE_NICE, 0 };
+
+    if (lp->nice_set && setpriority(PRIO_PROCESS, 0, lp->nice) != 0)
+        goto fail;
+    report[0] = SPAWN_STAGE_IOPOLICY;
+    if (lp->iopolicy >= 0 &&
+        setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, lp->iopolicy) != 0)
+        goto fail;
+    report[0] = SPAWN_STAGE_GROUPS;
+    if (setgroups(ctx->ngroups, ctx->groups) != 0)
+        goto fail;
+    report[0] = SPAWN_STAGE_SETGID;
+    if (setgid(ctx->pw.pw_gid) != 0)
+        goto fail;
+    report[0] = SPAWN_STAGE_SETUID;
+    if (setuid(ctx->pw.pw_uid) != 0)
+        goto fail;
+    report[0] = SPAWN_STAGE_VERIFY;
+    if (setuid(0) == 0) {
+        errno = EPERM;
+        goto fail;
+    }
+
+    report[0] = SPAWN_STAGE_EXEC;
+#ifdef POSIX_SPAWN_SETEXEC
+    (void)r;
+    pid_t unused;
+    errno = posix_spawn(&unused, path, actions, attr, argv, ctx->env.envp);
+#else
+    /* Without SETEXEC the attributes cannot be applied by exec; do the basics */
+    (void)attr; (void)actions;
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    apply_redirects(r);
+    execve(path, argv, ctx->env.envp);
+#endif
+
+fail:
+    report[1] = errno;
+    (void)write(err_fd, report, sizeof(report));
+    _exit(EXIT_EXEC_FAIL);
+}
+
+int runasuser_spawn(runasuser_context *ctx, const char *const *argv,
+                    runasuser_process **out)
+{
+    *out = NULL;
+    if (!argv || !argv[0]) {
+        fprintf(stderr, "runasuser: no command given\n");
+        return EXIT_USAGE;
+    }
+
+    char path[PATH_MAX];
+    int rc = resolve_command(argv[0], ctx->env.envp, path, sizeof(path));
+    if (rc != 0) {
+        fprintf(stderr, "runasuser: exec %s: %s\n", argv[0], strerror(rc));
+        return EXIT_EXEC_FAIL;
+    }
+
+    runasuser_process *proc = malloc(sizeof(*proc));
+    if (!proc) {
+        fprintf(stderr, "runasuser: memory allocation failed\n");
+        return EXIT_GENERAL;
+    }
+
+    redirects redir;
+    if (open_redirects(ctx->opt.stdout_path, ctx->opt.stderr_path, ctx->pw.pw_uid,
+                       &redir) != 0) {
+        free(proc);
+        return EXIT_GENERAL;
+    }
+
+    /* Attributes as the CLI's, plus default dispositions for the host's handlers */
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    if ((rc = prepare_spawn(&redir, &ctx->opt.policy, 1, &attr, &actions)) != 0) {
+        fprintf(stderr, "runasuser: posix_spawn attributes: %s\n", strerror(rc));
+        close_redirects(&redir);
+        free(proc);
+        return EXIT_GENERAL;
+    }
+    sigset_t all;
+    short flags = 0;
+    sigfillset(&all);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_getflags(&attr, &flags);
+    posix_spawnattr_setflags(&attr, flags | POSIX_SPAWN_SETSIGDEF);
+
+    int errfds[2] = { -1, -1 };
+    pid_t pid = -1;
+    if (pipe(errfds) != 0 ||
+        fcntl(errfds[0], F_SETFD, FD_CLOEXEC) != 0 ||
+        fcntl(errfds[1], F_SETFD, FD_CLOEXEC) != 0 ||
+        (pid = fork()) < 0) {
+        fprintf(stderr, "runasuser: fork: %s\n", strerror(errno));
+        rc = EXIT_GENERAL;
+    } else if (pid == 0) {
+        close(errfds[0]);
+        spawn_child(ctx, path, (char *const *)argv, &redir, &attr, &actions, errfds[1]);
+    } else {
+        /* EOF: the exec succeeded and closed the pipe */
+        int report[2];
+        ssize_t n;
+        close(errfds[1]);
+        errfds[1] = -1;
+        while ((n = read(errfds[0], report, sizeof(report))) == -1 && errno == EINTR)
+            ;
+        if (n == (ssize_t)sizeof(report)) {
+            fprintf(stderr, "runasuser: %s%s%s: %s\n", spawn_stage_names[report[0]],
+                    report[0] == SPAWN_STAGE_EXEC ? " " : "",
+                    report[0] == SPAWN_STAGE_EXEC ? path : "", strerror(report[1]));
+            while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+                ;
+            rc = report[0] == SPAWN_STAGE_EXEC ? EXIT_EXEC_FAIL :
+                 report[0] <= SPAWN_STAGE_IOPOLICY ? EXIT_GENERAL : EXIT_PRIV_DROP;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (errfds[i] >= 0)
+            close(errfds[i]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close_redirects(&redir);
+    if (rc != 0) {
+        free(proc);
+        return rc;
+    }
+
+    proc->pid       = pid;
+    proc->exit_code = -1;
+    *out = proc;
+    return RUNASUSER_OK;
+}
+
+unsigned long runasuser_pid(const runasuser_process *proc)
+{
+    return (unsigned long)proc->pid;
+}
+
+int runasuser_wait(runasuser_process *proc, int nohang, int *exit_code)
+{
+    if (proc->exit_code < 0) {
+        int status;
+        pid_t rc;
+        while ((rc = waitpid(proc->pid, &status, nohang ? WNOHANG : 0)) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "runasuser: waitpid: %s\n", strerror(errno));
+                return EXIT_GENERAL;
+            }
+        }
+        if (rc == 0)
+            return RUNASUSER_PENDING;
+        proc->exit_code = status_to_exit_code(status);
+    }
+    *exit_code = proc->exit_code;
+    return RUNASUSER_OK;
+}
+
+void runasuser_release(runasuser_process *proc)
+{
+    free(proc);
+}
+
+int runasuser_main(int argc, char *argv[])
+{
+    options opt;
+    int rc = parse_options(argc, argv, &opt);
+    if (rc >= 0)
+        return rc;
+
+    /* --- Reading a status file needs no privileges --- */
+    if (opt.collect_path)
+        return collect_status(opt.collect_path);
+
+    /* --- Must be root --- */
+    if (getuid() != 0) {
+        fprintf(stderr, "runasuser: must be run as root\n");
+        return EXIT_GENERAL;
+    }
+
+    if (opt.broker)
+        return run_broker(&opt);
+    if (opt.helper_serve)
+        return run_helper(&opt);
+
+    if (opt.trace && fcntl(opt.trace_fd, F_GETFD) == -1) {
+        fprintf(stderr, "runasuser: --trace-fd %d: %s\n", opt.trace_fd, strerror(errno));
+        return EXIT_USAGE;
+    }
+    if (opt.rusage && !opt.result_file && fcntl(opt.result_fd, F_GETFD) == -1) {
+        fprintf(stderr, "runasuser: --result-fd %d: %s\n", opt.result_fd, strerror(errno));
+        return EXIT_USAGE;
+    }
+    /* --rusage reports the phases, so they are collected even untraced */
+    if (opt.trace || opt.rusage)
+        trace_init(opt.trace_json, opt.trace ? opt.trace_fd : -1);
+
+    if (opt.via_broker) {
+        uint64_t t = trace_now();
+        rc = run_via_broker(&opt, argc, argv);
+        if (rc >= 0) {
+            trace_phase("broker_round_trip", t);
+            trace_report();
+            return rc;
+        }
+    }
+
+    if (opt.all_sessions) {
+        rc = run_all_sessions(&opt, argc, argv);
+        trace_report();
+        return rc;
+    }
+
+    /* --- Inside --session: the outer invocation already resolved the user --- */
+    if (opt.resolved_user) {
+        struct passwd pw;
+        if (parse_resolved_user(opt.resolved_user, &pw) != 0) {
+            fprintf(stderr, "runasuser: malformed --resolved-user\n");
+            return EXIT_USAGE;
+        }
+        rc = run_as_user(&opt, argc, argv, pw.pw_uid, &pw, -1);
+        trace_report();
+        return rc;
+    }
+
+    /* --- Detect the console (GUI-session) user --- */
+    uid_t uid = 0;
+    if (opt.wait_session)
+        rc = wait_for_console_user(opt.wait_session_s, &uid);
+    else
+        rc = detect_console_user(NULL, &uid);
+    if (rc == 0 && opt.helper)
+        rc = run_via_helper(&opt, uid);
+    else if (rc == 0)
+        rc = run_as_user(&opt, argc, argv, uid, NULL, -1);
+
+    trace_report();
+    return rc;
+}
+
+#ifndef RUNASUSER_LIBRARY
+int main(int argc, char *argv[])
+{
+    return runasuser_main(argc, argv);
 }
+#endif
@@ -15,18 +15,31 @@
  *   3              - Failed to get user token (not running as SYSTEM?)
  *   4              - Failed to create process
  *   5              - Invalid arguments / usage error
+ *   6              - One or more batch commands or sessions failed
+ *                    (--batch, --all-sessions)
+ *   7              - Timed out; the process tree was terminated (--timeout)
+ *   8              - Detached command still running (--collect)
  */
 
 #define WIN32_LEAN_AND_MEAN
 #define UNICODE
 #define _UNICODE
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601     /* Windows 7: WTSEnumerateSessionsExW */
+#endif
+
 #include <windows.h>
 #include <wtsapi32.h>
 #include <userenv.h>
+#include <sddl.h>
+#include <psapi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
+
+#include "runasuser.h"
 
 #pragma comment(lib, "wtsapi32.lib")
 #pragma comment(lib, "userenv.lib")
@@ -38,8 +51,35 @@
 #define EXIT_TOKEN_FAILURE      3
 #define EXIT_PROCESS_FAILURE    4
 #define EXIT_USAGE_ERROR        5
+#define EXIT_BATCH_FAILURE      6
+#define EXIT_TIMEOUT            7
+#define EXIT_PENDING            8
+
+#define PIPE_BUFFER_DEFAULT_KB  64      /* --pipe-buffer default */
+#define PIPE_BUFFER_MIN_KB      4
+#define PIPE_BUFFER_MAX_KB      16384
+
+#define MAX_OUTPUT_LIMIT        (1024UL * 1024 * 1024)  /* --max-output cap */
+#define KEEP_HEAD               0       /* --keep= policies for --max-output */
+#define KEEP_TAIL               1
+#define KEEP_BOTH               2
 
-#define PIPE_BUFFER_SIZE        4096
+#define WAIT_PIPES              0       /* --wait: until the output pipes close */
+#define WAIT_PROCESS            1       /* --wait=process: until the child exits */
+#define WAIT_TREE               2       /* --wait=tree: until its whole job is empty */
+
+#define ENV_FULL                0       /* --env= modes */
+#define ENV_MINIMAL             1
+#define ENV_CACHED              2
+#define ENV_OPTION_MAX          16      /* --env NAME=value and --env-allow, each */
+
+#define BROKER_SERVICE_NAME     L"runasuser"
+#define BROKER_PIPE_NAME        L"\\\\.\\pipe\\runasuser"
+
+#define HELPER_PIPE_FMT         L"\\\\.\\pipe\\runasuser-helper-%lu"   /* --helper */
+#define HELPER_DEFAULT_IDLE     600     /* seconds */
+#define HELPER_MAX_IDLE         86400
+#define HELPER_START_MS         5000
 
 /* -------------------------------------------------------------------------- */
 /*  Error reporting                                                           */
@@ -76,11 +116,155 @@ static void print_message(const WCHAR *message)
     fwprintf(stderr, L"runasuser: %ls\n", message);
 }
 
+/* -------------------------------------------------------------------------- */
+/*  Per-phase timings (--trace-timings)                                       */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Launch phases are timed with QueryPerformanceCounter and reported on
+ * stderr when the process finishes, either as one line per phase or as a
+ * single JSON object. Only a direct CLI launch is traced (the broker's
+ * request threads never enable this); --all-sessions workers record from
+ * several threads, so event slots are claimed with an interlocked counter.
+ * --rusage collects the phases without reporting them, for its record.
+ */
+#define TRACE_MAX_EVENTS 64
+
+typedef struct {
+    const WCHAR *phase;
+    LONGLONG     start;
+    LONGLONG     end;
+} TraceEvent;
+
+static struct {
+    BOOL       enabled;
+    BOOL       json;
+    BOOL       report;              /* FALSE: collect for --rusage only */
+    LONGLONG   frequency;
+    LONGLONG   origin;
+    volatile LONG count;
+    TraceEvent events[TRACE_MAX_EVENTS];
+} g_trace;
+
+static LONGLONG trace_now(void)
+{
+    LARGE_INTEGER t;
+    if (!g_trace.enabled)
+        return 0;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+static void trace_init(BOOL json, BOOL report)
+{
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    g_trace.frequency = f.QuadPart;
+    g_trace.json      = json;
+    g_trace.report    = report;
+    g_trace.enabled   = TRUE;
+    g_trace.origin    = trace_now();
+}
+
+/* Record a phase that began at start (a trace_now() value) and ends now. */
+static void trace_phase(const WCHAR *phase, LONGLONG start)
+{
+    if (!g_trace.enabled)
+        return;
+    LONG slot = InterlockedIncrement(&g_trace.count) - 1;
+    if (slot >= TRACE_MAX_EVENTS)
+        return;
+    TraceEvent *e = &g_trace.events[slot];
+    e->phase = phase;
+    e->end   = trace_now();
+    e->start = start ? start : e->end;  /* 0: a point in time */
+}
+
+static double trace_us(LONGLONG ticks)
+{
+    return (double)ticks * 1e6 / (double)g_trace.frequency;
+}
+
+static void trace_report(void)
+{
+    if (!g_trace.enabled || !g_trace.report)
+        return;
+    if (g_trace.count > TRACE_MAX_EVENTS)
+        g_trace.count = TRACE_MAX_EVENTS;
+
+    if (g_trace.json) {
+        fwprintf(stderr, L"{\"runasuser_trace\":{\"pid\":%lu,\"unit\":\"us\",\"phases\":[",
+                 (unsigned long)GetCurrentProcessId());
+        for (LONG i = 0; i < g_trace.count; i++) {
+            const TraceEvent *e = &g_trace.events[i];
+            fwprintf(stderr, L"%ls{\"phase\":\"%ls\",\"start\":%.3f,\"duration\":%.3f}",
+                     i ? L"," : L"", e->phase, trace_us(e->start - g_trace.origin),
+                     trace_us(e->end - e->start));
+        }
+        fwprintf(stderr, L"],\"total\":%.3f}}\n", trace_us(trace_now() - g_trace.origin));
+    } else {
+        for (LONG i = 0; i < g_trace.count; i++) {
+            const TraceEvent *e = &g_trace.events[i];
+            fwprintf(stderr, L"runasuser: trace: %-26ls at %10.3f us  took %10.3f us\n",
+                     e->phase, trace_us(e->start - g_trace.origin),
+                     trace_us(e->end - e->start));
+        }
+        fwprintf(stderr, L"runasuser: trace: %-26ls    %10.3f us\n", L"total",
+                 trace_us(trace_now() - g_trace.origin));
+    }
+    fflush(stderr);
+}
+
 /* -------------------------------------------------------------------------- */
 /*  Find the active user session                                              */
 /* -------------------------------------------------------------------------- */
 
-static BOOL find_active_session(DWORD *pSessionId)
+/*
+ * Rank a session as a launch candidate (lower is better), or return -1 if it
+ * cannot host the launch at all. Only sessions that report a user name are
+ * considered, so no token is requested for empty or listener sessions.
+ */
+static int session_rank(const WTS_SESSION_INFO_1W *s, DWORD consoleSessionId)
+{
+    if (s->SessionId == 0)
+        return -1;                      /* session 0 = services */
+    if (!s->pUserName || s->pUserName[0] == L'\0')
+        return -1;                      /* nobody logged in */
+
+    if (s->State == WTSActive)
+        return (s->SessionId == consoleSessionId) ? 0 : 1;
+    if (s->State == WTSDisconnected)
+        return 2;
+    return -1;
+}
+
+#define SESSION_RANK_WORST 2
+#define SESSION_USER_MAX   (256 + 1 + 256 + 1)  /* "DOMAIN\name" */
+
+/*
+ * Does the session belong to user? "DOMAIN\name" must match both parts,
+ * a bare "name" matches that account name in any domain (case-insensitive,
+ * like Windows account names).
+ */
+static BOOL session_user_matches(const WTS_SESSION_INFO_1W *s, const WCHAR *user)
+{
+    const WCHAR *sep = wcschr(user, L'\\');
+    if (!sep)
+        return _wcsicmp(s->pUserName, user) == 0;
+
+    size_t domainLen = (size_t)(sep - user);
+    return s->pDomainName && wcslen(s->pDomainName) == domainLen &&
+           _wcsnicmp(s->pDomainName, user, domainLen) == 0 &&
+           _wcsicmp(s->pUserName, sep + 1) == 0;
+}
+
+/*
+ * Find the session to launch in, optionally only among user's sessions
+ * (--user). userName (SESSION_USER_MAX) receives "DOMAIN\name" of the
+ * winner, straight from the enumeration, or "" if it is not known.
+ */
+static BOOL find_active_session(const WCHAR *user, DWORD *pSessionId, HANDLE *phToken,
+                                WCHAR *userName)
 {
     /*
      * We need to find a session that actually has a logged-in user.
@@ -89,22 +273,37 @@ static BOOL find_active_session(DWORD *pSessionId)
      * connected via RDP, or no user logged in at the console).
      *
      * Strategy:
-     *   1. Enumerate all sessions.
-     *   2. For each Active session (skip session 0 = services), try
-     *      WTSQueryUserToken to verify a user is actually present.
-     *   3. Prefer the physical console session if it works.
-     *   4. Fall back to any other active session with a valid token (RDP, etc.).
-     *   5. Try disconnected sessions (user logged in but session disconnected).
+     *   1. Enumerate all sessions once with WTSEnumerateSessionsExW, which
+     *      also reports the user name, so empty sessions are filtered out
+     *      before any token is requested.
+     *   2. Prefer the physical console session if it's Active.
+     *   3. Fall back to any other Active session (RDP, Fast User Switching).
+     *   4. Try disconnected sessions (user logged in but session disconnected).
+     *
+     * With --user, sessions of other users are skipped but the ranking is the
+     * same, so that user's console session still wins over an RDP one.
+     *
+     * The token obtained while validating the winning session is handed back
+     * to the caller (who must CloseHandle it), so the common case costs a
+     * single WTSQueryUserToken call. *phToken is NULL if no token was
+     * obtained (enumeration failed and the console session is returned blind).
      */
 
-    WTS_SESSION_INFOW *pSessions = NULL;
+    WTS_SESSION_INFO_1W *pSessions = NULL;
     DWORD count = 0;
+    DWORD level = 1;
     DWORD consoleSessionId = WTSGetActiveConsoleSessionId();
 
-    if (!WTSEnumerateSessionsW(WTS_CURRENT_SERVER_HANDLE, 0, 1,
-                               &pSessions, &count)) {
+    *phToken = NULL;
+    userName[0] = L'\0';
+
+    LONGLONG t = trace_now();
+    BOOL enumerated = WTSEnumerateSessionsExW(WTS_CURRENT_SERVER_HANDLE, &level, 0,
+                                              &pSessions, &count);
+    trace_phase(L"WTSEnumerateSessionsExW", t);
+    if (!enumerated) {
         /* Enumeration failed; last resort: try the console session blindly */
-        if (consoleSessionId != 0xFFFFFFFF) {
+        if (!user && consoleSessionId != 0xFFFFFFFF) {
             *pSessionId = consoleSessionId;
             return TRUE;
         }
@@ -112,52 +311,137 @@ static BOOL find_active_session(DWORD *pSessionId)
     }
 
     BOOL found = FALSE;
-    HANDLE hTestToken = NULL;
 
-    /* Pass 1: Prefer the console session if it's Active and has a user token */
-    if (consoleSessionId != 0xFFFFFFFF && consoleSessionId != 0) {
+    for (int rank = 0; rank <= SESSION_RANK_WORST && !found; rank++) {
         for (DWORD i = 0; i < count; i++) {
-            if (pSessions[i].SessionId == consoleSessionId &&
-                pSessions[i].State == WTSActive) {
-                if (WTSQueryUserToken(consoleSessionId, &hTestToken)) {
-                    CloseHandle(hTestToken);
-                    *pSessionId = consoleSessionId;
-                    found = TRUE;
-                }
+            if (session_rank(&pSessions[i], consoleSessionId) != rank ||
+                (user && !session_user_matches(&pSessions[i], user)))
+                continue;
+            t = trace_now();
+            BOOL gotToken = WTSQueryUserToken(pSessions[i].SessionId, phToken);
+            trace_phase(L"WTSQueryUserToken", t);
+            if (gotToken) {
+                *pSessionId = pSessions[i].SessionId;
+                _snwprintf(userName, SESSION_USER_MAX, L"%ls%ls%ls",
+                           pSessions[i].pDomainName ? pSessions[i].pDomainName : L"",
+                           pSessions[i].pDomainName ? L"\\" : L"",
+                           pSessions[i].pUserName);
+                userName[SESSION_USER_MAX - 1] = L'\0';
+                found = TRUE;
                 break;
             }
+            *phToken = NULL;
         }
     }
 
-    /* Pass 2: Any Active session (covers RDP, Fast User Switching, etc.) */
-    if (!found) {
-        for (DWORD i = 0; i < count; i++) {
-            if (pSessions[i].State == WTSActive && pSessions[i].SessionId != 0) {
-                if (WTSQueryUserToken(pSessions[i].SessionId, &hTestToken)) {
-                    CloseHandle(hTestToken);
-                    *pSessionId = pSessions[i].SessionId;
-                    found = TRUE;
-                    break;
-                }
-            }
+    WTSFreeMemoryExW(WTSTypeSessionInfoLevel1, pSessions, count);
+    return found;
+}
+
+/*
+ * --wait-for-session[=sec]: when no user session can host the launch, wait
+ * for a logon, connect or state change and look again, instead of failing
+ * with EXIT_NO_SESSION. A logon raises several of these events in turn, so
+ * the launch follows it within moments.
+ *
+ * WTSWaitSystemEvent can only be released early with WTS_EVENT_FLUSH, which
+ * would also release every other waiter in the process (broker threads), so
+ * no wait blocks in it directly. One watcher thread per process sits in it
+ * for good and counts each return in g_sessionWait.generation. A waiter
+ * notes the count before it looks, and sleeps on the condition variable only
+ * while it is unchanged: an event between the look and the sleep is seen.
+ * Each sleep is bounded by SESSION_POLL_MS and the deadline, so a missed or
+ * failed watcher costs a poll interval, never the wait.
+ *
+ * With a specific session (sessionSpecified), waits for a user token in
+ * that session instead; with user, for a session of that user. timeoutMs 0
+ * waits indefinitely.
+ */
+#define SESSION_POLL_MS  1000
+
+static struct {
+    SRWLOCK            lock;
+    CONDITION_VARIABLE changed;
+    LONG               generation;      /* session events seen */
+    volatile LONG      started;
+} g_sessionWait = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT, 0, 0 };
+
+static DWORD WINAPI session_wait_thread(LPVOID param)
+{
+    (void)param;
+    for (;;) {
+        DWORD events = 0;
+        if (!WTSWaitSystemEvent(WTS_CURRENT_SERVER_HANDLE,
+                                WTS_EVENT_LOGON | WTS_EVENT_CONNECT |
+                                WTS_EVENT_STATECHANGE, &events)) {
+            print_error(L"WTSWaitSystemEvent failed", GetLastError());
+            return 1;                   /* waiters fall back to polling */
         }
+        AcquireSRWLockExclusive(&g_sessionWait.lock);
+        g_sessionWait.generation++;
+        ReleaseSRWLockExclusive(&g_sessionWait.lock);
+        WakeAllConditionVariable(&g_sessionWait.changed);
     }
+}
 
-    /* Pass 3: Disconnected sessions (user logged in but session disconnected) */
-    if (!found) {
-        for (DWORD i = 0; i < count; i++) {
-            if (pSessions[i].State == WTSDisconnected && pSessions[i].SessionId != 0) {
-                if (WTSQueryUserToken(pSessions[i].SessionId, &hTestToken)) {
-                    CloseHandle(hTestToken);
-                    *pSessionId = pSessions[i].SessionId;
-                    found = TRUE;
-                    break;
-                }
-            }
+static LONG session_wait_generation(void)
+{
+    AcquireSRWLockExclusive(&g_sessionWait.lock);
+    LONG generation = g_sessionWait.generation;
+    ReleaseSRWLockExclusive(&g_sessionWait.lock);
+    return generation;
+}
+
+static BOOL wait_for_user_session(BOOL sessionSpecified, const WCHAR *user,
+                                  DWORD timeoutMs, DWORD *pSessionId, HANDLE *phToken,
+                                  WCHAR *userName)
+{
+    BOOL announced = FALSE;
+    BOOL found = FALSE;
+
+    LONGLONG t = trace_now();
+    ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+    if (InterlockedCompareExchange(&g_sessionWait.started, 1, 0) == 0) {
+        HANDLE hThread = CreateThread(NULL, 0, session_wait_thread, NULL, 0, NULL);
+        if (hThread)
+            CloseHandle(hThread);
+        else
+            print_error(L"cannot watch for session events; polling", GetLastError());
+    }
+
+    for (;;) {
+        LONG generation = session_wait_generation();
+        if (sessionSpecified) {
+            found = WTSQueryUserToken(*pSessionId, phToken);
+            if (!found)
+                *phToken = NULL;
+        } else {
+            found = find_active_session(user, pSessionId, phToken, userName);
         }
+
+        ULONGLONG now = GetTickCount64();
+        if (found || (timeoutMs && now >= deadline))
+            break;
+        if (!announced) {
+            print_message(L"no user session yet; waiting for one");
+            announced = TRUE;
+        }
+
+        DWORD sleepMs = SESSION_POLL_MS;
+        if (timeoutMs && deadline - now < sleepMs)
+            sleepMs = (DWORD)(deadline - now);
+        AcquireSRWLockExclusive(&g_sessionWait.lock);
+        if (g_sessionWait.generation == generation)
+            SleepConditionVariableSRW(&g_sessionWait.changed, &g_sessionWait.lock,
+                                      sleepMs, 0);
+        ReleaseSRWLockExclusive(&g_sessionWait.lock);
     }
 
-    WTSFreeMemory(pSessions);
+    if (!found)
+        fwprintf(stderr, L"runasuser: no user session within %lu s\n",
+                 (unsigned long)(timeoutMs / 1000));
+    trace_phase(L"wait_for_session", t);
     return found;
 }
 
@@ -298,378 +582,4620 @@ static WCHAR *build_command_line(int argc, wchar_t *argv[])
 }
 
 /* -------------------------------------------------------------------------- */
-/*  Pipe forwarding: read from pipe handle, write to local file handle        */
+/*  Output relay: one thread, overlapped reads on every child pipe            */
 /* -------------------------------------------------------------------------- */
 
 /*
- * Forward all data from a pipe read-end to a local output handle (stdout/stderr).
- * Reads until the pipe is broken (child process exits and closes its end).
+ * One child output stream being relayed to a local handle (stdout/stderr).
+ * The read end is an overlapped named pipe, so any number of streams can be
+ * drained from a single thread: each has one read in flight, and the relay
+ * waits on all of their completion events at once.
+ *
+ * With a limit (--max-output), at most limit bytes of the stream reach
+ * hOutput; the pipe is still drained to the end so the child never blocks:
+ *
+ *   KEEP_HEAD  the first limit bytes are relayed as they arrive
+ *   KEEP_TAIL  the last limit bytes are kept in a ring buffer and written
+ *              when the stream ends
+ *   KEEP_BOTH  half of each
+ *
+ * Where bytes were dropped, a marker line with the byte counts is written
+ * in their place.
  */
-static void forward_pipe(HANDLE hPipeRead, HANDLE hOutput)
+typedef struct {
+    HANDLE     hPipe;               /* overlapped read end */
+    HANDLE     hOutput;             /* where the data goes */
+    OVERLAPPED ov;
+    char      *buffer;
+    DWORD      bufferSize;
+    BOOL       done;                /* pipe broken (all writers closed) */
+    ULONGLONG  limit;               /* --max-output, 0 = unlimited */
+    int        keep;                /* KEEP_* */
+    ULONGLONG  total;               /* bytes read from the pipe */
+    ULONGLONG  headLeft;            /* bytes still relayed live */
+    char      *ring;                /* last ringSize bytes (tail) */
+    size_t     ringSize;
+    size_t     ringPos;             /* next write position */
+    size_t     ringLen;             /* bytes held, <= ringSize */
+} RelayStream;
+
+/* Write all of data; a caller that went away is ignored (keep draining). */
+static void relay_write(HANDLE hOutput, const char *data, DWORD len)
 {
-    char buffer[PIPE_BUFFER_SIZE];
-    DWORD bytesRead;
+    DWORD off = 0;
+    while (off < len) {
+        DWORD bytesWritten = 0;
+        if (!WriteFile(hOutput, data + off, len - off, &bytesWritten, NULL) ||
+            bytesWritten == 0)
+            break;
+        off += bytesWritten;
+    }
+}
+
+/* Pass one chunk of child output through the stream's limit. */
+static void relay_deliver(RelayStream *s, const char *data, DWORD len)
+{
+    s->total += len;
+    if (!s->limit) {
+        relay_write(s->hOutput, data, len);
+        return;
+    }
+
+    DWORD live = s->headLeft < len ? (DWORD)s->headLeft : len;
+    if (live) {
+        relay_write(s->hOutput, data, live);
+        s->headLeft -= live;
+        data += live;
+        len  -= live;
+    }
+    if (!s->ringSize)
+        return;                     /* head only: the rest is dropped */
+
+    /* Only the last ringSize bytes of this chunk can survive */
+    if (len > s->ringSize) {
+        data += len - s->ringSize;
+        len   = (DWORD)s->ringSize;
+    }
+    while (len > 0) {
+        size_t n = s->ringSize - s->ringPos;
+        if (n > len)
+            n = len;
+        memcpy(s->ring + s->ringPos, data, n);
+        s->ringPos = (s->ringPos + n) % s->ringSize;
+        s->ringLen = s->ringLen + n > s->ringSize ? s->ringSize : s->ringLen + n;
+        data += n;
+        len  -= (DWORD)n;
+    }
+}
+
+/* At the end of a limited stream: the marker, if anything was dropped, and the tail. */
+static void relay_finish(RelayStream *s)
+{
+    if (!s->limit)
+        return;
+
+    ULONGLONG kept = (s->limit - s->ringSize - s->headLeft) + s->ringLen;
+    if (kept < s->total) {
+        char marker[128];
+        int n = snprintf(marker, sizeof(marker),
+                         "\n[runasuser: output truncated, %llu of %llu bytes dropped]\n",
+                         (unsigned long long)(s->total - kept),
+                         (unsigned long long)s->total);
+        if (n > 0)
+            relay_write(s->hOutput, marker, (DWORD)n);
+    }
+
+    /* Ring contents, oldest first (until it first fills, ringPos == ringLen) */
+    if (s->ringLen < s->ringSize) {
+        relay_write(s->hOutput, s->ring, (DWORD)s->ringLen);
+    } else {
+        relay_write(s->hOutput, s->ring + s->ringPos, (DWORD)(s->ringSize - s->ringPos));
+        relay_write(s->hOutput, s->ring, (DWORD)s->ringPos);
+    }
+}
+
+/*
+ * The relay was told to stop (--wait=process|tree): pass on what is already
+ * in the pipe, then leave it, even if a process the child started still has
+ * the write end open.
+ */
+static void relay_drain(RelayStream *s)
+{
+    DWORD bytesRead = 0, avail = 0;
+    CancelIoEx(s->hPipe, &s->ov);
+    if (GetOverlappedResult(s->hPipe, &s->ov, &bytesRead, TRUE))
+        relay_deliver(s, s->buffer, bytesRead);
 
-    while (ReadFile(hPipeRead, buffer, sizeof(buffer), &bytesRead, NULL)) {
-        if (bytesRead == 0)
+    /* With data waiting, each read completes at once */
+    while (PeekNamedPipe(s->hPipe, NULL, 0, NULL, &avail, NULL) && avail > 0) {
+        ResetEvent(s->ov.hEvent);
+        if ((!ReadFile(s->hPipe, s->buffer, s->bufferSize, NULL, &s->ov) &&
+             GetLastError() != ERROR_IO_PENDING) ||
+            !GetOverlappedResult(s->hPipe, &s->ov, &bytesRead, TRUE))
             break;
-        DWORD bytesWritten;
-        WriteFile(hOutput, buffer, bytesRead, &bytesWritten, NULL);
+        relay_deliver(s, s->buffer, bytesRead);
+    }
+    s->done = TRUE;
+}
+
+/* Issue the next overlapped read; marks the stream done on EOF/error. */
+static void relay_start_read(RelayStream *s)
+{
+    ResetEvent(s->ov.hEvent);
+    if (!ReadFile(s->hPipe, s->buffer, s->bufferSize, NULL, &s->ov) &&
+        GetLastError() != ERROR_IO_PENDING)
+        s->done = TRUE;             /* ERROR_BROKEN_PIPE: child side closed */
+}
+
+/* Free what relay_prepare() allocated; safe to call more than once. */
+static void relay_release(RelayStream *streams, DWORD count)
+{
+    for (DWORD i = 0; i < count; i++) {
+        if (streams[i].ov.hEvent)
+            CloseHandle(streams[i].ov.hEvent);
+        free(streams[i].buffer);
+        free(streams[i].ring);
+        streams[i].ov.hEvent = NULL;
+        streams[i].buffer = streams[i].ring = NULL;
     }
 }
 
 /*
- * Forward pipes on two threads: stdout and stderr from the child.
- * We forward stderr on a separate thread so both streams drain concurrently
- * (preventing deadlocks when the child writes to both).
+ * Allocate each stream's buffer, ring and event. Called before the child is
+ * created: a stream that could not be relayed would fill its pipe and block
+ * the child, so a failure here fails the launch instead.
  */
-typedef struct {
-    HANDLE hPipeRead;
-    HANDLE hOutput;
-} PipeForwardArgs;
+static BOOL relay_prepare(RelayStream *streams, DWORD count)
+{
+    if (count > MAXIMUM_WAIT_OBJECTS - 1)
+        return FALSE;
+
+    for (DWORD i = 0; i < count; i++) {
+        RelayStream *s = &streams[i];
+        ZeroMemory(&s->ov, sizeof(s->ov));
+        s->done   = FALSE;
+        s->buffer = (char *)malloc(s->bufferSize);
+        s->ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        s->total = s->ringPos = s->ringLen = 0;
+        s->ringSize = !s->limit || s->keep == KEEP_HEAD ? 0
+                    : s->keep == KEEP_TAIL ? (size_t)s->limit : (size_t)(s->limit / 2);
+        s->headLeft = s->limit - s->ringSize;
+        s->ring = s->ringSize ? (char *)malloc(s->ringSize) : NULL;
+        if (!s->buffer || !s->ov.hEvent || (s->ringSize && !s->ring)) {
+            relay_release(streams, i + 1);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 
-static DWORD WINAPI pipe_forward_thread(LPVOID lpParam)
+/*
+ * Relay all streams (relay_prepare()d) until every writer has closed its
+ * end, or until hStop (if not NULL) is signalled and what the pipes already
+ * hold is passed on. Reads complete into each stream's own buffer and are
+ * written out synchronously before the next read is issued, so output order
+ * within a stream is preserved. No read is left in flight on return, and
+ * the streams are released.
+ */
+static void relay_streams(RelayStream *streams, DWORD count, HANDLE hStop)
 {
-    PipeForwardArgs *args = (PipeForwardArgs *)lpParam;
-    forward_pipe(args->hPipeRead, args->hOutput);
-    return 0;
+    HANDLE events[MAXIMUM_WAIT_OBJECTS];
+    RelayStream *active[MAXIMUM_WAIT_OBJECTS];
+    BOOL firstByte = FALSE;
+
+    for (DWORD i = 0; i < count; i++)
+        relay_start_read(&streams[i]);
+
+    for (;;) {
+        DWORD n = 0;
+        for (DWORD i = 0; i < count; i++) {
+            if (!streams[i].done) {
+                events[n] = streams[i].ov.hEvent;
+                active[n] = &streams[i];
+                n++;
+            }
+        }
+        if (n == 0)
+            break;
+        if (hStop)
+            events[n] = hStop;
+
+        DWORD w = WaitForMultipleObjects(n + (hStop != NULL), events, FALSE, INFINITE);
+        if (w == WAIT_OBJECT_0 + n && hStop) {
+            for (DWORD i = 0; i < n; i++)
+                relay_drain(active[i]);
+            break;
+        }
+        if (w >= WAIT_OBJECT_0 + n) {
+            print_error(L"relay wait failed", GetLastError());
+            /* The buffers are freed below: let each cancelled read finish first */
+            for (DWORD i = 0; i < n; i++) {
+                DWORD bytesRead = 0;
+                CancelIoEx(active[i]->hPipe, &active[i]->ov);
+                GetOverlappedResult(active[i]->hPipe, &active[i]->ov, &bytesRead, TRUE);
+            }
+            break;
+        }
+
+        /* Service every stream that is ready, not just the first one */
+        for (DWORD i = w - WAIT_OBJECT_0; i < n; i++) {
+            RelayStream *s = active[i];
+            if (WaitForSingleObject(s->ov.hEvent, 0) != WAIT_OBJECT_0)
+                continue;
+
+            DWORD bytesRead = 0;
+            if (!GetOverlappedResult(s->hPipe, &s->ov, &bytesRead, FALSE)) {
+                s->done = TRUE;     /* ERROR_BROKEN_PIPE: end of stream */
+                continue;
+            }
+            if (!firstByte && bytesRead > 0) {
+                trace_phase(L"first_output_byte", 0);
+                firstByte = TRUE;
+            }
+
+            relay_deliver(s, s->buffer, bytesRead);
+            relay_start_read(s);
+        }
+    }
+
+    for (DWORD i = 0; i < count; i++)
+        relay_finish(&streams[i]);
+    relay_release(streams, count);
 }
 
 /* -------------------------------------------------------------------------- */
-/*  Create inheritable pipe with non-inheritable read end                     */
+/*  Create an overlapped pipe with an inheritable child end                   */
 /* -------------------------------------------------------------------------- */
 
 /*
- * Creates an anonymous pipe where:
- *   - The WRITE end is inheritable (passed to the child process)
- *   - The READ end is NOT inheritable (kept by the parent)
+ * Creates a unidirectional named pipe where:
+ *   - The parent end is the overlapped server side, NOT inheritable
+ *   - The child end is a plain synchronous client handle, inheritable
+ *
+ * For an output pipe (toChild FALSE) the parent reads and the child writes;
+ * for the --stdin pipe (toChild TRUE) it is the other way round.
+ *
+ * Anonymous pipes cannot do overlapped I/O, so a uniquely-named local pipe
+ * stands in for CreatePipe. bufferSize sets the kernel pipe quota, which
+ * lets a chatty child write large chunks without waiting for the relay.
  */
-static BOOL create_pipe_pair(HANDLE *hRead, HANDLE *hWrite)
+static BOOL create_pipe_pair(HANDLE *hParent, HANDLE *hChild, DWORD bufferSize,
+                             BOOL toChild)
 {
+    static volatile LONG pipeSerial;
+    WCHAR name[96];
+
+    _snwprintf(name, 96, L"\\\\.\\pipe\\runasuser-relay-%lu-%ld",
+               (unsigned long)GetCurrentProcessId(),
+               (long)InterlockedIncrement(&pipeSerial));
+    name[95] = L'\0';
+
+    HANDLE hServer = CreateNamedPipeW(
+        name, (toChild ? PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND) |
+              FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, bufferSize, bufferSize, 0, NULL);
+    if (hServer == INVALID_HANDLE_VALUE)
+        return FALSE;
+
     SECURITY_ATTRIBUTES sa;
     sa.nLength = sizeof(sa);
-    sa.bInheritHandle = TRUE;  /* Write end will be inheritable */
+    sa.bInheritHandle = TRUE;  /* Child end will be inheritable */
     sa.lpSecurityDescriptor = NULL;
 
-    HANDLE hReadTmp, hWriteTmp;
-    if (!CreatePipe(&hReadTmp, &hWriteTmp, &sa, 0))
+    HANDLE hClient = CreateFileW(name, toChild ? GENERIC_READ : GENERIC_WRITE,
+                                 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hClient == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        CloseHandle(hServer);
+        SetLastError(err);
         return FALSE;
+    }
 
-    /* Make the read end non-inheritable so the child doesn't hold it open */
-    HANDLE hReadNonInheritable;
-    if (!DuplicateHandle(GetCurrentProcess(), hReadTmp,
-                         GetCurrentProcess(), &hReadNonInheritable,
-                         0, FALSE, DUPLICATE_SAME_ACCESS)) {
-        CloseHandle(hReadTmp);
-        CloseHandle(hWriteTmp);
+    /* The client is already connected; this just confirms it */
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    if (!ConnectNamedPipe(hServer, &ov) && GetLastError() != ERROR_PIPE_CONNECTED) {
+        DWORD err = GetLastError();
+        CloseHandle(hClient);
+        CloseHandle(hServer);
+        SetLastError(err);
         return FALSE;
     }
-    CloseHandle(hReadTmp);
 
-    *hRead = hReadNonInheritable;
-    *hWrite = hWriteTmp;
+    *hParent = hServer;
+    *hChild = hClient;
     return TRUE;
 }
 
 /* -------------------------------------------------------------------------- */
-/*  Usage                                                                     */
+/*  Limit handle inheritance to the child's own standard handles              */
 /* -------------------------------------------------------------------------- */
 
-static void print_usage(void)
+/*
+ * With bInheritHandles TRUE, CreateProcess hands the child every
+ * inheritable handle in this process. Concurrent launches (--batch -j,
+ * --all-sessions, the broker, the library) would pick up each other's
+ * relay pipe ends, and a relay would then see no EOF until unrelated
+ * children exit too. PROC_THREAD_ATTRIBUTE_HANDLE_LIST restricts it to
+ * the handles listed here.
+ */
+typedef struct {
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs;     /* NULL: nothing to inherit */
+    HANDLE handles[3];
+    DWORD  count;
+} InheritList;
+
+static void inherit_list_free(InheritList *l)
 {
-    fwprintf(stderr,
-        L"Usage: runasuser [--wait] [--session <id>] <command> [args...]\n"
-        L"\n"
-        L"Run a command as the currently logged-in user (must be run as SYSTEM).\n"
-        L"\n"
-        L"Options:\n"
-        L"  --wait          Wait for the process to exit and propagate its exit code.\n"
-        L"                  stdout/stderr from the child are piped back to the caller.\n"
-        L"  --session <id>  Target a specific session ID (default: active console)\n"
-        L"\n"
-        L"Examples:\n"
-        L"  runasuser whoami\n"
-        L"  runasuser --wait cmd /c echo hello\n"
-        L"  runasuser --session 2 notepad.exe\n"
-    );
+    if (l->attrs) {
+        DeleteProcThreadAttributeList(l->attrs);
+        free(l->attrs);
+    }
+    ZeroMemory(l, sizeof(*l));
 }
 
-/* -------------------------------------------------------------------------- */
-/*  wmain - entry point                                                       */
-/* -------------------------------------------------------------------------- */
-
-int wmain(int argc, wchar_t *argv[])
+/*
+ * Build the list from si's standard handles and attach it to si. NULL,
+ * duplicate and non-inheritable handles are skipped, since the attribute
+ * rejects them, as are Windows 7 console pseudo-handles (low bits 11),
+ * which cannot cross sessions anyway. Create the child with
+ * bInheritHandles = l->count > 0 and inherit_list_flags().
+ */
+static BOOL inherit_list_init(InheritList *l, STARTUPINFOEXW *si)
 {
-    int exitCode            = EXIT_GENERAL_FAILURE;
-    BOOL waitForChild       = FALSE;
-    BOOL sessionSpecified   = FALSE;
-    DWORD targetSessionId   = 0;
-    int cmdArgStart         = 0;
-
-    HANDLE hToken           = NULL;
-    HANDLE hDupToken        = NULL;
-    LPVOID lpEnvironment    = NULL;
-    WCHAR *cmdLine          = NULL;
-    WCHAR *sessionUser      = NULL;
-    WCHAR profileDir[MAX_PATH] = {0};
-
-    /* Pipe handles for stdout/stderr forwarding (used with --wait) */
-    HANDLE hStdoutRead      = NULL;
-    HANDLE hStdoutWrite     = NULL;
-    HANDLE hStderrRead      = NULL;
-    HANDLE hStderrWrite     = NULL;
-    HANDLE hStderrThread    = NULL;
+    HANDLE std[3] = { si->StartupInfo.hStdInput, si->StartupInfo.hStdOutput,
+                      si->StartupInfo.hStdError };
 
-    PROCESS_INFORMATION pi;
-    ZeroMemory(&pi, sizeof(pi));
+    ZeroMemory(l, sizeof(*l));
+    si->StartupInfo.cb  = sizeof(si->StartupInfo);
+    si->lpAttributeList = NULL;
+    if (!(si->StartupInfo.dwFlags & STARTF_USESTDHANDLES))
+        return TRUE;
 
-    /* ---- Parse flags ---------------------------------------------------- */
+    for (int i = 0; i < 3; i++) {
+        DWORD flags = 0;
+        BOOL seen = FALSE;
+        if (!std[i] || std[i] == INVALID_HANDLE_VALUE ||
+            ((ULONG_PTR)std[i] & 3) == 3 ||
+            !GetHandleInformation(std[i], &flags) || !(flags & HANDLE_FLAG_INHERIT))
+            continue;
+        for (DWORD k = 0; k < l->count; k++)
+            seen |= l->handles[k] == std[i];
+        if (!seen)
+            l->handles[l->count++] = std[i];
+    }
+    if (l->count == 0)
+        return TRUE;
 
-    int i = 1;
-    while (i < argc) {
-        if (wcscmp(argv[i], L"--wait") == 0) {
-            waitForChild = TRUE;
-            i++;
-        } else if (wcscmp(argv[i], L"--session") == 0) {
-            if (i + 1 >= argc) {
-                print_message(L"--session requires a session ID argument");
-                print_usage();
-                return EXIT_USAGE_ERROR;
-            }
-            WCHAR *endPtr = NULL;
-            unsigned long val = wcstoul(argv[i + 1], &endPtr, 10);
-            if (endPtr == argv[i + 1] || *endPtr != L'\0') {
-                fwprintf(stderr, L"runasuser: invalid session ID: %ls\n", argv[i + 1]);
-                return EXIT_USAGE_ERROR;
-            }
-            targetSessionId = (DWORD)val;
-            sessionSpecified = TRUE;
-            i += 2;
-        } else if (wcscmp(argv[i], L"--help") == 0 || wcscmp(argv[i], L"-h") == 0) {
-            print_usage();
-            return EXIT_SUCCESS_CODE;
-        } else {
-            break; /* first non-flag = start of command */
-        }
+    SIZE_T attrSize = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attrSize);
+    l->attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(attrSize);
+    if (!l->attrs || !InitializeProcThreadAttributeList(l->attrs, 1, 0, &attrSize)) {
+        print_error(L"failed to create the handle inheritance list", GetLastError());
+        free(l->attrs);
+        ZeroMemory(l, sizeof(*l));
+        return FALSE;
+    }
+    if (!UpdateProcThreadAttribute(l->attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                   l->handles, l->count * sizeof(HANDLE), NULL, NULL)) {
+        print_error(L"failed to set the handle inheritance list", GetLastError());
+        inherit_list_free(l);
+        return FALSE;
     }
 
-    cmdArgStart = i;
+    si->StartupInfo.cb  = sizeof(*si);
+    si->lpAttributeList = l->attrs;
+    return TRUE;
+}
 
-    if (cmdArgStart >= argc) {
-        print_message(L"no command specified");
-        print_usage();
-        return EXIT_USAGE_ERROR;
-    }
+/* Creation flags that go with inherit_list_init(). */
+static DWORD inherit_list_flags(const InheritList *l)
+{
+    return l->attrs ? EXTENDED_STARTUPINFO_PRESENT : 0;
+}
 
-    /* ---- Step 1: Find the target session -------------------------------- */
+/* -------------------------------------------------------------------------- */
+/*  Input relay (--stdin)                                                     */
+/* -------------------------------------------------------------------------- */
 
-    if (!sessionSpecified) {
-        if (!find_active_session(&targetSessionId)) {
-            print_message(L"no active user session found");
-            exitCode = EXIT_NO_SESSION;
-            goto cleanup;
-        }
-    }
+/*
+ * Copies this process's stdin into the child's stdin pipe on its own thread
+ * (a console stdin cannot be read with overlapped I/O). Each chunk is fully
+ * written before the next read, so a child that reads slowly holds the
+ * relay back once the pipe quota is full instead of it buffering without
+ * bound. Closing the pipe at EOF gives the child its end of input.
+ */
+typedef struct {
+    HANDLE hInput;                  /* this process's stdin */
+    HANDLE hPipe;                   /* overlapped write end */
+    DWORD  bufferSize;
+} StdinRelay;                       /* malloc'd; the thread frees it and hPipe */
 
-    /* Query the username for this session (informational) */
-    sessionUser = get_session_username(targetSessionId);
-    if (sessionUser && sessionUser[0] != L'\0') {
-        fwprintf(stderr, L"runasuser: targeting session %lu (user: %ls)\n",
-                 (unsigned long)targetSessionId, sessionUser);
-    } else {
-        fwprintf(stderr, L"runasuser: targeting session %lu\n",
-                 (unsigned long)targetSessionId);
-    }
+static DWORD WINAPI stdin_relay_thread(LPVOID lpParam)
+{
+    StdinRelay *r = (StdinRelay *)lpParam;
+    char *buffer = (char *)malloc(r->bufferSize);
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
 
-    /* ---- Step 2: Get the user token for the session --------------------- */
+    while (buffer && ov.hEvent) {
+        DWORD bytesRead = 0;
+        if (!ReadFile(r->hInput, buffer, r->bufferSize, &bytesRead, NULL) ||
+            bytesRead == 0)
+            break;                  /* EOF, broken pipe or cancelled */
 
-    if (!WTSQueryUserToken(targetSessionId, &hToken)) {
-        DWORD err = GetLastError();
-        if (err == ERROR_PRIVILEGE_NOT_HELD) {
-            print_message(L"privilege not held - this tool must be run as SYSTEM "
-                          L"(e.g., via PsExec -s, a Windows service, or Task Scheduler "
-                          L"running as SYSTEM)");
-        } else if (err == ERROR_NO_TOKEN) {
-            print_message(L"no user is logged into the target session");
+        DWORD off = 0;
+        while (off < bytesRead) {
+            DWORD bytesWritten = 0;
+            ResetEvent(ov.hEvent);
+            if (!WriteFile(r->hPipe, buffer + off, bytesRead - off, NULL, &ov) &&
+                GetLastError() != ERROR_IO_PENDING)
+                break;
+            if (!GetOverlappedResult(r->hPipe, &ov, &bytesWritten, TRUE) ||
+                bytesWritten == 0)
+                break;
+            off += bytesWritten;
+        }
+        if (off < bytesRead)
+            break;                  /* child closed its stdin or exited */
+    }
+
+    if (ov.hEvent)
+        CloseHandle(ov.hEvent);
+    free(buffer);
+    CloseHandle(r->hPipe);
+    free(r);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Batch manifest (--batch)                                                  */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A manifest lists many commands that all run as the same user, so session
+ * discovery, WTSQueryUserToken, DuplicateTokenEx and CreateEnvironmentBlock
+ * happen once per batch; every CreateProcessAsUserW call shares the one
+ * primary token and environment block. Two UTF-8 encodings are accepted:
+ *
+ *   JSON lines:  one JSON array of strings per line, e.g.
+ *                  ["cmd", "/c", "echo hello"]
+ *                Blank lines are ignored.
+ *   NUL-separated argv:  each argument is terminated by a NUL byte and each
+ *                command by an additional NUL (an empty argument). Empty
+ *                arguments cannot be expressed this way; use JSON lines.
+ *
+ * Any NUL byte in the input selects the NUL-separated form.
+ */
+typedef struct {
+    WCHAR **argv;
+    int     argc;
+} BatchCommand;
+
+typedef struct {
+    BatchCommand *cmds;
+    DWORD         count;
+    DWORD         cap;
+} BatchManifest;
+
+static void argv_free(WCHAR **argv, int argc)
+{
+    for (int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+static void free_manifest(BatchManifest *m)
+{
+    for (DWORD i = 0; i < m->count; i++)
+        argv_free(m->cmds[i].argv, m->cmds[i].argc);
+    free(m->cmds);
+    m->cmds = NULL;
+    m->count = m->cap = 0;
+}
+
+static BOOL manifest_add(BatchManifest *m, WCHAR **argv, int argc)
+{
+    if (m->count == m->cap) {
+        DWORD cap = m->cap ? m->cap * 2 : 16;
+        BatchCommand *cmds = (BatchCommand *)realloc(m->cmds, cap * sizeof(*cmds));
+        if (!cmds)
+            return FALSE;
+        m->cmds = cmds;
+        m->cap  = cap;
+    }
+    m->cmds[m->count].argv = argv;
+    m->cmds[m->count].argc = argc;
+    m->count++;
+    return TRUE;
+}
+
+/* Convert a UTF-8 argument to a malloc'd wide string (NULL if invalid). */
+static WCHAR *utf8_to_wide(const char *s, int len)
+{
+    int n = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, s, len, NULL, 0);
+    if (n <= 0 && len > 0)
+        return NULL;
+
+    WCHAR *w = (WCHAR *)malloc(((size_t)n + 1) * sizeof(WCHAR));
+    if (!w)
+        return NULL;
+    if (len > 0)
+        MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, s, len, w, n);
+    w[n] = L'\0';
+    return w;
+}
+
+/* Append one UTF-8 argument to a growing argv array. */
+static BOOL argv_push(WCHAR ***argv, int *argc, int *cap, const char *s, int len)
+{
+    if (*argc == *cap) {
+        int ncap = *cap ? *cap * 2 : 8;
+        WCHAR **nargv = (WCHAR **)realloc(*argv, (size_t)ncap * sizeof(WCHAR *));
+        if (!nargv)
+            return FALSE;
+        *argv = nargv;
+        *cap  = ncap;
+    }
+    WCHAR *arg = utf8_to_wide(s, len);
+    if (!arg)
+        return FALSE;
+    (*argv)[(*argc)++] = arg;
+    return TRUE;
+}
+
+static int parse_hex4(const char *p, const char *end, DWORD *out)
+{
+    if (end - p < 4)
+        return -1;
+    DWORD v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')      v |= (DWORD)(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (DWORD)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (DWORD)(c - 'A' + 10);
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/*
+ * Decode a JSON string starting at *pp (the opening quote) into buf as UTF-8.
+ * buf must hold at least (end - *pp) bytes. Advances *pp past the closing
+ * quote and returns the decoded length, or -1 on malformed input.
+ */
+static int parse_json_string(const char **pp, const char *end, char *buf)
+{
+    const char *p = *pp + 1;
+    char *dst = buf;
+
+    while (p < end && *p != '"') {
+        if ((unsigned char)*p < 0x20)
+            return -1;                  /* raw control characters not allowed */
+        if (*p != '\\') {
+            *dst++ = *p++;
+            continue;
+        }
+        if (++p >= end)
+            return -1;
+        switch (*p++) {
+        case '"':  *dst++ = '"';  break;
+        case '\\': *dst++ = '\\'; break;
+        case '/':  *dst++ = '/';  break;
+        case 'b':  *dst++ = '\b'; break;
+        case 'f':  *dst++ = '\f'; break;
+        case 'n':  *dst++ = '\n'; break;
+        case 'r':  *dst++ = '\r'; break;
+        case 't':  *dst++ = '\t'; break;
+        case 'u': {
+            DWORD cp, lo;
+            if (parse_hex4(p, end, &cp) != 0)
+                return -1;
+            p += 4;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                /* High surrogate: must be followed by \uDC00-\uDFFF */
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                    parse_hex4(p + 2, end, &lo) != 0 ||
+                    lo < 0xDC00 || lo > 0xDFFF)
+                    return -1;
+                p += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                return -1;
+            }
+            if (cp == 0)
+                return -1;              /* NUL cannot appear in an argument */
+
+            /* Re-encode as UTF-8 so every argument takes the same path */
+            if (cp < 0x80) {
+                *dst++ = (char)cp;
+            } else if (cp < 0x800) {
+                *dst++ = (char)(0xC0 | (cp >> 6));
+                *dst++ = (char)(0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                *dst++ = (char)(0xE0 | (cp >> 12));
+                *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                *dst++ = (char)(0x80 | (cp & 0x3F));
+            } else {
+                *dst++ = (char)(0xF0 | (cp >> 18));
+                *dst++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+                *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                *dst++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    if (p >= end)
+        return -1;
+
+    *pp = p + 1;
+    return (int)(dst - buf);
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+/* Parse one JSON-lines entry: an array of one or more strings. */
+static BOOL parse_json_argv(const char *p, const char *end,
+                            WCHAR ***outArgv, int *outArgc)
+{
+    WCHAR **argv = NULL;
+    int argc = 0, cap = 0;
+
+    /* Decoded strings are never longer than the line they came from */
+    char *buf = (char *)malloc((size_t)(end - p) + 1);
+    if (!buf)
+        return FALSE;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '[')
+        goto fail;
+    p = skip_ws(p + 1, end);
+
+    if (p < end && *p == ']') {
+        p++;                            /* empty array: rejected below */
+    } else {
+        for (;;) {
+            if (p >= end || *p != '"')
+                goto fail;
+            int len = parse_json_string(&p, end, buf);
+            if (len < 0 || !argv_push(&argv, &argc, &cap, buf, len))
+                goto fail;
+            p = skip_ws(p, end);
+            if (p < end && *p == ',') {
+                p = skip_ws(p + 1, end);
+                continue;
+            }
+            if (p < end && *p == ']') {
+                p++;
+                break;
+            }
+            goto fail;
+        }
+    }
+
+    if (skip_ws(p, end) != end || argc == 0)
+        goto fail;
+
+    free(buf);
+    *outArgv = argv;
+    *outArgc = argc;
+    return TRUE;
+
+fail:
+    free(buf);
+    argv_free(argv, argc);
+    return FALSE;
+}
+
+static BOOL parse_manifest(const char *data, size_t len, BatchManifest *m)
+{
+    const char *end = data + len;
+
+    if (memchr(data, '\0', len) != NULL) {
+        /* NUL-separated argv; an empty argument ends the command */
+        WCHAR **argv = NULL;
+        int argc = 0, cap = 0;
+        const char *p = data;
+
+        while (p < end) {
+            const char *nul = (const char *)memchr(p, '\0', (size_t)(end - p));
+            size_t alen = nul ? (size_t)(nul - p) : (size_t)(end - p);
+
+            if (alen == 0) {
+                if (argc > 0 && !manifest_add(m, argv, argc)) {
+                    argv_free(argv, argc);
+                    return FALSE;
+                }
+                argv = NULL;
+                argc = cap = 0;
+            } else if (!argv_push(&argv, &argc, &cap, p, (int)alen)) {
+                print_message(L"manifest contains an invalid UTF-8 argument");
+                argv_free(argv, argc);
+                return FALSE;
+            }
+            p += alen + 1;
+        }
+        /* Tolerate a missing terminator after the last command */
+        if (argc > 0 && !manifest_add(m, argv, argc)) {
+            argv_free(argv, argc);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    /* JSON lines */
+    unsigned long lineNo = 0;
+    const char *p = data;
+    while (p < end) {
+        const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+        const char *eol = nl ? nl : end;
+        lineNo++;
+
+        if (skip_ws(p, eol) != eol) {
+            WCHAR **argv;
+            int argc;
+            if (!parse_json_argv(p, eol, &argv, &argc)) {
+                fwprintf(stderr, L"runasuser: manifest line %lu: expected a "
+                                 L"JSON array of strings\n", lineNo);
+                return FALSE;
+            }
+            if (!manifest_add(m, argv, argc)) {
+                argv_free(argv, argc);
+                return FALSE;
+            }
+        }
+        p = eol + 1;
+    }
+    return TRUE;
+}
+
+/* Load a manifest from a file, or from hStdin when path is "-". */
+static BOOL load_manifest(const WCHAR *path, HANDLE hStdin, BatchManifest *m)
+{
+    BOOL fromStdin = wcscmp(path, L"-") == 0;
+    HANDLE hFile = fromStdin
+        ? hStdin
+        : CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE || hFile == NULL) {
+        fwprintf(stderr, L"runasuser: cannot open manifest %ls (error %lu)\n",
+                 path, (unsigned long)GetLastError());
+        return FALSE;
+    }
+
+    size_t cap = 65536, len = 0;
+    char *data = (char *)malloc(cap + 1);
+    BOOL ok = data != NULL;
+    DWORD bytesRead;
+
+    while (ok && ReadFile(hFile, data + len, (DWORD)(cap - len), &bytesRead, NULL) &&
+           bytesRead > 0) {
+        len += bytesRead;
+        if (len == cap) {
+            char *nbuf = (char *)realloc(data, cap * 2 + 1);
+            if (!nbuf) {
+                ok = FALSE;
+                break;
+            }
+            data = nbuf;
+            cap *= 2;
+        }
+    }
+    if (!fromStdin)
+        CloseHandle(hFile);
+
+    if (!ok) {
+        print_message(L"failed to allocate memory for manifest");
+        free(data);
+        return FALSE;
+    }
+
+    ok = parse_manifest(data, len, m);
+    free(data);
+    if (!ok)
+        free_manifest(m);
+    return ok;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Usage                                                                     */
+/* -------------------------------------------------------------------------- */
+
+static void print_usage(void)
+{
+    fwprintf(stderr,
+        L"Usage: runasuser [--wait] [--session <id> | --user <DOMAIN\\name> | --all-sessions]\n"
+        L"                 <command> [args...]\n"
+        L"       runasuser [--session <id>] --batch <manifest|-> [-j N]\n"
+        L"       runasuser --detach --status-file <path> <command> [args...]\n"
+        L"       runasuser --collect <path>\n"
+        L"       runasuser --broker [--broker-pipe <name>]\n"
+        L"       runasuser --helper[=sec] [--wait] <command> [args...]\n"
+        L"\n"
+        L"Run a command as the currently logged-in user (must be run as SYSTEM).\n"
+        L"\n"
+        L"Options:\n"
+        L"  --wait          Wait for the process to exit and propagate its exit code.\n"
+        L"                  stdout/stderr from the child are piped back to the caller.\n"
+        L"  --wait=<process|tree>\n"
+        L"                  Like --wait, but return once the process (or its whole\n"
+        L"                  process tree) has exited, even if something it started\n"
+        L"                  still holds the output pipes\n"
+        L"  --stdin         Give the command this process's stdin (requires --wait);\n"
+        L"                  a pipe or file is inherited directly, a console is\n"
+        L"                  relayed\n"
+        L"  --stdout <path|\\\\.\\pipe\\name>\n"
+        L"  --stderr <path|\\\\.\\pipe\\name>\n"
+        L"                  Hand the file (created/truncated) or existing named pipe\n"
+        L"                  straight to the child as its stdout/stderr (no relay)\n"
+        L"  --max-output <bytes>\n"
+        L"                  With --wait, relay at most this many bytes of stdout\n"
+        L"                  and of stderr; the rest is drained and dropped\n"
+        L"  --keep=<head|tail|both>\n"
+        L"                  Which part --max-output keeps (default head)\n"
+        L"  --pipe-buffer <KB>\n"
+        L"                  Pipe and relay buffer size for --wait (default %d)\n"
+        L"  --timeout <sec> Terminate the whole process tree after sec seconds and\n"
+        L"                  exit with code 7 (requires --wait; per command in --batch)\n"
+        L"  --max-memory <MB>\n"
+        L"                  Cap the committed memory of the process tree\n"
+        L"  --cpu-rate <pct>\n"
+        L"                  Hard-cap the process tree's CPU use, 1-100%% of the\n"
+        L"                  machine (Windows 8 and later)\n"
+        L"  --priority <idle|below|normal|above>\n"
+        L"                  Priority class of the command\n"
+        L"  --eco           Run the command in efficiency mode (EcoQoS power\n"
+        L"                  throttling and low memory priority)\n"
+        L"  --background    Start the command without a console or the interactive\n"
+        L"                  desktop (no conhost.exe, no window); for jobs with no UI\n"
+        L"  --env=<full|minimal|cached>\n"
+        L"                  How to build the command's environment: full\n"
+        L"                  (CreateEnvironmentBlock, default), minimal (profile\n"
+        L"                  folders, identity and machine variables only; fastest)\n"
+        L"                  or cached (reuse a full block per user and logon)\n"
+        L"  --env NAME=value\n"
+        L"                  Set NAME in the command's environment (repeatable)\n"
+        L"  --env-allow NAME\n"
+        L"                  Copy NAME from runasuser's own environment into the\n"
+        L"                  command's (repeatable)\n"
+        L"  --wait-for-session[=sec]\n"
+        L"                  If no user is logged in, wait (up to sec seconds) for\n"
+        L"                  a session instead of exiting with code 2\n"
+        L"  --detach --status-file <path>\n"
+        L"                  Return once the command is running; a supervisor waits\n"
+        L"                  for it and atomically writes its PID, exit code, times\n"
+        L"                  and peak memory to path as JSON\n"
+        L"  --collect <path>\n"
+        L"                  Print a --status-file record; exit with the command's\n"
+        L"                  exit code, or 8 while it is still running\n"
+        L"  --trace-timings[=json]\n"
+        L"                  Report how long each launch phase took on stderr,\n"
+        L"                  one line per phase or a single JSON object\n"
+        L"  --rusage        With --wait, write a JSON result record on stderr once\n"
+        L"                  the command exits: PID, session, user, exit code, wall\n"
+        L"                  and CPU time, peak working set and the launch phases\n"
+        L"  --result-file <path>\n"
+        L"                  Write the --rusage record to path (implies --rusage)\n"
+        L"  --session <id>  Target a specific session ID (default: active console)\n"
+        L"  --user <DOMAIN\\name>\n"
+        L"                  Target that user's session (console first, then other\n"
+        L"                  active sessions, then disconnected ones)\n"
+        L"  --all-sessions  Launch in every session with a logged-in user at once;\n"
+        L"                  with --wait, report each session's exit code\n"
+        L"  --batch <manifest|->\n"
+        L"                  Run every command in the manifest (or stdin) as the user,\n"
+        L"                  sharing one token and environment. One JSON array of\n"
+        L"                  strings per line, or NUL-terminated args with an empty\n"
+        L"                  arg ending each command. Reports each exit code.\n"
+        L"  -j, --jobs N    Run up to N batch commands at once (default 1, max %d)\n"
+        L"  --broker        Run as the resident launch broker (Windows service or\n"
+        L"                  foreground process) serving requests on a named pipe\n"
+        L"  --via-broker    Send this launch to a running broker; falls back to a\n"
+        L"                  direct launch if no broker is listening\n"
+        L"  --broker-pipe <name>\n"
+        L"                  Broker pipe name (default %ls)\n"
+        L"  --helper[=sec]  Launch through a helper resident in the user's session,\n"
+        L"                  starting it if needed; it exits at logoff or after sec\n"
+        L"                  idle seconds (default %d)\n"
+        L"\n"
+        L"Examples:\n"
+        L"  runasuser whoami\n"
+        L"  runasuser --wait cmd /c echo hello\n"
+        L"  runasuser --session 2 notepad.exe\n"
+        L"  runasuser --user CONTOSO\\alice --wait cmd /c echo hello\n"
+        L"  runasuser --wait --stdout C:\\logs\\inv.txt inventory.exe\n"
+        L"  runasuser --wait --timeout 600 --cpu-rate 25 inventory.exe\n"
+        L"  runasuser --wait --priority idle --eco scan.exe\n"
+        L"  runasuser --background --stdout C:\\logs\\sync.txt sync.exe\n"
+        L"  runasuser --all-sessions --wait cmd /c refresh.cmd\n"
+        L"  runasuser --batch jobs.jsonl -j 8\n"
+        L"  runasuser --via-broker --wait cmd /c echo hello\n"
+        L"  runasuser --helper --wait cmd /c echo hello\n",
+        PIPE_BUFFER_DEFAULT_KB, MAXIMUM_WAIT_OBJECTS, BROKER_PIPE_NAME,
+        HELPER_DEFAULT_IDLE
+    );
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Command-line options                                                      */
+/* -------------------------------------------------------------------------- */
+
+typedef struct {
+    BOOL         waitForChild;
+    int          waitMode;          /* --wait=process|tree (WAIT_*) */
+    BOOL         sessionSpecified;
+    DWORD        targetSessionId;
+    BOOL         allSessions;       /* --all-sessions */
+    const WCHAR *targetUser;        /* --user DOMAIN\name */
+    const WCHAR *batchPath;
+    DWORD        batchJobs;
+    BOOL         runBroker;         /* --broker */
+    BOOL         viaBroker;         /* --via-broker */
+    const WCHAR *pipeName;          /* --broker-pipe */
+    BOOL         helper;            /* --helper[=sec]: via the session helper */
+    DWORD        helperIdleMs;      /* its idle timeout */
+    BOOL         helperServe;       /* --helper-serve (internal, see start_helper) */
+    DWORD        pipeBufferSize;    /* --pipe-buffer, in bytes */
+    const WCHAR *stdoutPath;        /* --stdout */
+    const WCHAR *stderrPath;        /* --stderr */
+    DWORD        timeoutMs;         /* --timeout, 0 = none */
+    DWORD        maxMemoryMB;       /* --max-memory, 0 = none */
+    DWORD        cpuRate;           /* --cpu-rate, percent, 0 = none */
+    DWORD        priorityClass;     /* --priority, 0 = default */
+    BOOL         eco;               /* --eco */
+    BOOL         background;        /* --background */
+    BOOL         forwardStdin;      /* --stdin */
+    ULONGLONG    maxOutput;         /* --max-output, per stream, 0 = none */
+    int          keepPolicy;        /* --keep=head|tail|both (KEEP_*) */
+    int          envMode;           /* --env=full|minimal|cached (ENV_*) */
+    const WCHAR *envSet[ENV_OPTION_MAX];    /* --env NAME=value */
+    DWORD        envSetCount;
+    const WCHAR *envAllow[ENV_OPTION_MAX];  /* --env-allow NAME */
+    DWORD        envAllowCount;
+    BOOL         waitForSession;    /* --wait-for-session[=sec] */
+    DWORD        waitSessionMs;     /* its timeout, 0 = none */
+    BOOL         detach;            /* --detach */
+    const WCHAR *statusFile;        /* --status-file */
+    const WCHAR *collectPath;       /* --collect */
+    HANDLE       superviseHandle;   /* --supervise (internal, see start_supervisor) */
+    BOOL         traceTimings;      /* --trace-timings[=json] */
+    BOOL         traceJson;
+    BOOL         rusage;            /* --rusage, --result-file */
+    const WCHAR *resultFile;        /* --result-file */
+    int          cmdArgStart;       /* index of the command in argv */
+    int          cmdArgc;
+    WCHAR      **cmdArgv;
+} Options;
+
+/*
+ * Parse flags (stop at the first non-flag argument). Returns -1 if the
+ * caller should go on, otherwise the exit code to return immediately
+ * (usage error or --help).
+ */
+static int parse_options(int argc, wchar_t *argv[], Options *opts)
+{
+    ZeroMemory(opts, sizeof(*opts));
+    opts->batchJobs = 1;
+    opts->pipeName  = BROKER_PIPE_NAME;
+    opts->pipeBufferSize = PIPE_BUFFER_DEFAULT_KB * 1024;
+
+    int i = 1;
+    while (i < argc) {
+        if (wcscmp(argv[i], L"--wait") == 0) {
+            opts->waitForChild = TRUE;
+            i++;
+        } else if (wcsncmp(argv[i], L"--wait=", 7) == 0) {
+            if (wcscmp(argv[i] + 7, L"process") == 0) {
+                opts->waitMode = WAIT_PROCESS;
+            } else if (wcscmp(argv[i] + 7, L"tree") == 0) {
+                opts->waitMode = WAIT_TREE;
+            } else {
+                print_message(L"--wait= requires process or tree");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->waitForChild = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--session") == 0) {
+            if (i + 1 >= argc) {
+                print_message(L"--session requires a session ID argument");
+                print_usage();
+                return EXIT_USAGE_ERROR;
+            }
+            WCHAR *endPtr = NULL;
+            unsigned long val = wcstoul(argv[i + 1], &endPtr, 10);
+            if (endPtr == argv[i + 1] || *endPtr != L'\0') {
+                fwprintf(stderr, L"runasuser: invalid session ID: %ls\n", argv[i + 1]);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->targetSessionId = (DWORD)val;
+            opts->sessionSpecified = TRUE;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--user") == 0) {
+            if (i + 1 >= argc || argv[i + 1][0] == L'\0' ||
+                argv[i + 1][wcslen(argv[i + 1]) - 1] == L'\\') {
+                print_message(L"--user requires a user name (DOMAIN\\name or name)");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->targetUser = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"--all-sessions") == 0) {
+            opts->allSessions = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--batch") == 0) {
+            if (i + 1 >= argc) {
+                print_message(L"--batch requires a manifest path or '-'");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->batchPath = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"-j") == 0 || wcscmp(argv[i], L"--jobs") == 0) {
+            WCHAR *endPtr = NULL;
+            unsigned long val = i + 1 < argc ? wcstoul(argv[i + 1], &endPtr, 10) : 0;
+            if (i + 1 >= argc || endPtr == argv[i + 1] || *endPtr != L'\0' ||
+                val < 1 || val > MAXIMUM_WAIT_OBJECTS) {
+                fwprintf(stderr, L"runasuser: %ls requires a job count (1-%d)\n",
+                         argv[i], MAXIMUM_WAIT_OBJECTS);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->batchJobs = (DWORD)val;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--stdout") == 0 || wcscmp(argv[i], L"--stderr") == 0) {
+            if (i + 1 >= argc || argv[i + 1][0] == L'\0') {
+                fwprintf(stderr, L"runasuser: %ls requires a file path or pipe name\n",
+                         argv[i]);
+                return EXIT_USAGE_ERROR;
+            }
+            if (argv[i][5] == L'o')
+                opts->stdoutPath = argv[i + 1];
+            else
+                opts->stderrPath = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"--timeout") == 0 ||
+                   wcscmp(argv[i], L"--max-memory") == 0 ||
+                   wcscmp(argv[i], L"--cpu-rate") == 0) {
+            /* --timeout <sec>, --max-memory <MB>, --cpu-rate <percent> */
+            unsigned long maxVal = argv[i][2] == L't' ? 4294967UL
+                                 : argv[i][2] == L'm' ? 1048576UL : 100UL;
+            WCHAR *endPtr = NULL;
+            unsigned long val = i + 1 < argc ? wcstoul(argv[i + 1], &endPtr, 10) : 0;
+            if (i + 1 >= argc || endPtr == argv[i + 1] || *endPtr != L'\0' ||
+                val < 1 || val > maxVal) {
+                fwprintf(stderr, L"runasuser: %ls requires a value (1-%lu)\n",
+                         argv[i], maxVal);
+                return EXIT_USAGE_ERROR;
+            }
+            if (argv[i][2] == L't')
+                opts->timeoutMs = (DWORD)val * 1000;
+            else if (argv[i][2] == L'm')
+                opts->maxMemoryMB = (DWORD)val;
+            else
+                opts->cpuRate = (DWORD)val;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--priority") == 0) {
+            const WCHAR *level = i + 1 < argc ? argv[i + 1] : L"";
+            if (wcscmp(level, L"idle") == 0) {
+                opts->priorityClass = IDLE_PRIORITY_CLASS;
+            } else if (wcscmp(level, L"below") == 0) {
+                opts->priorityClass = BELOW_NORMAL_PRIORITY_CLASS;
+            } else if (wcscmp(level, L"normal") == 0) {
+                opts->priorityClass = NORMAL_PRIORITY_CLASS;
+            } else if (wcscmp(level, L"above") == 0) {
+                opts->priorityClass = ABOVE_NORMAL_PRIORITY_CLASS;
+            } else {
+                print_message(L"--priority requires idle, below, normal or above");
+                return EXIT_USAGE_ERROR;
+            }
+            i += 2;
+        } else if (wcsncmp(argv[i], L"--env=", 6) == 0) {
+            if (wcscmp(argv[i] + 6, L"full") == 0) {
+                opts->envMode = ENV_FULL;
+            } else if (wcscmp(argv[i] + 6, L"minimal") == 0) {
+                opts->envMode = ENV_MINIMAL;
+            } else if (wcscmp(argv[i] + 6, L"cached") == 0) {
+                opts->envMode = ENV_CACHED;
+            } else {
+                print_message(L"--env= requires full, minimal or cached");
+                return EXIT_USAGE_ERROR;
+            }
+            i++;
+        } else if (wcscmp(argv[i], L"--env") == 0) {
+            const WCHAR *var = i + 1 < argc ? argv[i + 1] : NULL;
+            if (!var || var[0] == L'=' || !wcschr(var, L'=')) {
+                print_message(L"--env requires NAME=value (or --env=<mode>)");
+                return EXIT_USAGE_ERROR;
+            }
+            if (opts->envSetCount >= ENV_OPTION_MAX) {
+                fwprintf(stderr, L"runasuser: at most %d --env options\n", ENV_OPTION_MAX);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->envSet[opts->envSetCount++] = var;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--env-allow") == 0) {
+            const WCHAR *name = i + 1 < argc ? argv[i + 1] : NULL;
+            if (!name || name[0] == L'\0' || wcschr(name, L'=')) {
+                print_message(L"--env-allow requires a variable name");
+                return EXIT_USAGE_ERROR;
+            }
+            if (opts->envAllowCount >= ENV_OPTION_MAX) {
+                fwprintf(stderr, L"runasuser: at most %d --env-allow options\n",
+                         ENV_OPTION_MAX);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->envAllow[opts->envAllowCount++] = name;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--max-output") == 0) {
+            WCHAR *endPtr = NULL;
+            unsigned long long val = i + 1 < argc ? wcstoull(argv[i + 1], &endPtr, 10) : 0;
+            if (i + 1 >= argc || endPtr == argv[i + 1] || *endPtr != L'\0' ||
+                val < 1 || val > MAX_OUTPUT_LIMIT) {
+                fwprintf(stderr, L"runasuser: --max-output requires a byte count (1-%lu)\n",
+                         (unsigned long)MAX_OUTPUT_LIMIT);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->maxOutput = val;
+            i += 2;
+        } else if (wcsncmp(argv[i], L"--keep=", 7) == 0) {
+            if (wcscmp(argv[i] + 7, L"head") == 0) {
+                opts->keepPolicy = KEEP_HEAD;
+            } else if (wcscmp(argv[i] + 7, L"tail") == 0) {
+                opts->keepPolicy = KEEP_TAIL;
+            } else if (wcscmp(argv[i] + 7, L"both") == 0) {
+                opts->keepPolicy = KEEP_BOTH;
+            } else {
+                print_message(L"--keep= requires head, tail or both");
+                return EXIT_USAGE_ERROR;
+            }
+            i++;
+        } else if (wcscmp(argv[i], L"--wait-for-session") == 0 ||
+                   wcsncmp(argv[i], L"--wait-for-session=", 19) == 0) {
+            opts->waitForSession = TRUE;
+            if (argv[i][18] == L'=') {
+                WCHAR *endPtr = NULL;
+                unsigned long val = wcstoul(argv[i] + 19, &endPtr, 10);
+                if (endPtr == argv[i] + 19 || *endPtr != L'\0' || val < 1 || val > 86400) {
+                    print_message(L"--wait-for-session= requires a timeout in "
+                                  L"seconds (1-86400)");
+                    return EXIT_USAGE_ERROR;
+                }
+                opts->waitSessionMs = (DWORD)val * 1000;
+            }
+            i++;
+        } else if (wcscmp(argv[i], L"--detach") == 0) {
+            opts->detach = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--status-file") == 0 ||
+                   wcscmp(argv[i], L"--collect") == 0) {
+            if (i + 1 >= argc || argv[i + 1][0] == L'\0') {
+                fwprintf(stderr, L"runasuser: %ls requires a path\n", argv[i]);
+                return EXIT_USAGE_ERROR;
+            }
+            if (argv[i][2] == L's')
+                opts->statusFile = argv[i + 1];
+            else
+                opts->collectPath = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"--supervise") == 0) {
+            WCHAR *endPtr = NULL;
+            unsigned long long val = i + 1 < argc ? wcstoull(argv[i + 1], &endPtr, 10) : 0;
+            if (i + 1 >= argc || endPtr == argv[i + 1] || *endPtr != L'\0' || val == 0) {
+                print_message(L"--supervise requires a handle value");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->superviseHandle = (HANDLE)(ULONG_PTR)val;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--stdin") == 0) {
+            opts->forwardStdin = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--eco") == 0) {
+            opts->eco = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--background") == 0) {
+            opts->background = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--trace-timings") == 0 ||
+                   wcscmp(argv[i], L"--trace-timings=text") == 0) {
+            opts->traceTimings = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--trace-timings=json") == 0) {
+            opts->traceTimings = TRUE;
+            opts->traceJson    = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--rusage") == 0) {
+            opts->rusage = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--result-file") == 0) {
+            if (i + 1 >= argc || argv[i + 1][0] == L'\0') {
+                print_message(L"--result-file requires a path");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->rusage     = TRUE;
+            opts->resultFile = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"--pipe-buffer") == 0) {
+            WCHAR *endPtr = NULL;
+            unsigned long val = i + 1 < argc ? wcstoul(argv[i + 1], &endPtr, 10) : 0;
+            if (i + 1 >= argc || endPtr == argv[i + 1] || *endPtr != L'\0' ||
+                val < PIPE_BUFFER_MIN_KB || val > PIPE_BUFFER_MAX_KB) {
+                fwprintf(stderr, L"runasuser: --pipe-buffer requires a size in KB (%d-%d)\n",
+                         PIPE_BUFFER_MIN_KB, PIPE_BUFFER_MAX_KB);
+                return EXIT_USAGE_ERROR;
+            }
+            opts->pipeBufferSize = (DWORD)val * 1024;
+            i += 2;
+        } else if (wcscmp(argv[i], L"--broker") == 0) {
+            opts->runBroker = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--via-broker") == 0) {
+            opts->viaBroker = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--broker-pipe") == 0) {
+            if (i + 1 >= argc || wcsncmp(argv[i + 1], L"\\\\.\\pipe\\", 9) != 0) {
+                print_message(L"--broker-pipe requires a pipe name (\\\\.\\pipe\\...)");
+                return EXIT_USAGE_ERROR;
+            }
+            opts->pipeName = argv[i + 1];
+            i += 2;
+        } else if (wcscmp(argv[i], L"--helper") == 0 ||
+                   wcsncmp(argv[i], L"--helper=", 9) == 0) {
+            opts->helper = TRUE;
+            opts->helperIdleMs = HELPER_DEFAULT_IDLE * 1000;
+            if (argv[i][8] == L'=') {
+                WCHAR *endPtr = NULL;
+                unsigned long val = wcstoul(argv[i] + 9, &endPtr, 10);
+                if (endPtr == argv[i] + 9 || *endPtr != L'\0' || val < 1 ||
+                    val > HELPER_MAX_IDLE) {
+                    fwprintf(stderr, L"runasuser: --helper= requires an idle timeout "
+                                     L"in seconds (1-%d)\n", HELPER_MAX_IDLE);
+                    return EXIT_USAGE_ERROR;
+                }
+                opts->helperIdleMs = (DWORD)val * 1000;
+            }
+            i++;
+        } else if (wcscmp(argv[i], L"--helper-serve") == 0) {
+            opts->helperServe = TRUE;
+            i++;
+        } else if (wcscmp(argv[i], L"--help") == 0 || wcscmp(argv[i], L"-h") == 0) {
+            print_usage();
+            return EXIT_SUCCESS_CODE;
         } else {
-            print_error(L"WTSQueryUserToken failed", err);
+            break; /* first non-flag = start of command */
+        }
+    }
+
+    opts->cmdArgStart = i;
+    opts->cmdArgc     = argc - i;
+    opts->cmdArgv     = &argv[i];
+
+    if (opts->runBroker) {
+        if (opts->cmdArgc > 0 || opts->batchPath || opts->viaBroker ||
+            opts->allSessions || opts->stdoutPath || opts->stderrPath ||
+            opts->traceTimings || opts->timeoutMs || opts->maxMemoryMB ||
+            opts->cpuRate || opts->priorityClass || opts->eco || opts->background ||
+            opts->envMode != ENV_FULL || opts->envSetCount || opts->envAllowCount ||
+            opts->forwardStdin || opts->maxOutput ||
+            opts->detach || opts->statusFile || opts->collectPath ||
+            opts->superviseHandle || opts->waitForSession || opts->helper ||
+            opts->helperServe || opts->rusage) {
+            print_message(L"--broker does not take a command or launch options");
+            return EXIT_USAGE_ERROR;
+        }
+    } else if (opts->helperServe) {
+        if (argc != 3 || !opts->helper) {
+            print_message(L"--helper-serve is internal to --helper");
+            return EXIT_USAGE_ERROR;
+        }
+    } else if (opts->collectPath) {
+        if (argc != 3) {
+            print_message(L"--collect takes only a status file path");
+            return EXIT_USAGE_ERROR;
+        }
+    } else if (opts->superviseHandle) {
+        if (argc != 5 || !opts->statusFile) {
+            print_message(L"--supervise is internal to --detach");
+            return EXIT_USAGE_ERROR;
+        }
+    } else if (!opts->detach != !opts->statusFile) {
+        print_message(L"--detach and --status-file go together");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->detach &&
+               (opts->waitForChild || opts->batchPath || opts->allSessions ||
+                opts->viaBroker)) {
+        print_message(L"--detach cannot be combined with --wait, --batch, "
+                      L"--all-sessions or --via-broker");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->waitForSession && (opts->allSessions || opts->viaBroker)) {
+        print_message(L"--wait-for-session cannot be combined with --all-sessions "
+                      L"or --via-broker");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->forwardStdin &&
+               (!opts->waitForChild || opts->batchPath || opts->allSessions)) {
+        print_message(L"--stdin requires --wait and a single command");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->maxOutput &&
+               (!opts->waitForChild || opts->batchPath || opts->allSessions ||
+                opts->viaBroker)) {
+        /* Only the --wait relay sees the bytes; elsewhere children write directly */
+        print_message(L"--max-output requires --wait and cannot be combined with "
+                      L"--batch, --all-sessions or --via-broker");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->rusage &&
+               (!opts->waitForChild || opts->batchPath || opts->allSessions || opts->helper)) {
+        print_message(L"--rusage requires --wait and a single command, and cannot be "
+                      L"combined with --all-sessions or --helper");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->waitMode != WAIT_PIPES &&
+               (opts->batchPath || opts->allSessions || opts->helper)) {
+        print_message(L"--wait=process and --wait=tree require a single command and "
+                      L"cannot be combined with --helper");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->envAllowCount && opts->viaBroker) {
+        /* The broker would copy from its own environment, not the caller's */
+        print_message(L"--env-allow cannot be combined with --via-broker");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->timeoutMs && !opts->waitForChild && !opts->batchPath) {
+        print_message(L"--timeout requires --wait (or --batch)");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->helper &&
+               (opts->batchPath || opts->allSessions || opts->viaBroker || opts->detach ||
+                opts->maxOutput || opts->timeoutMs || opts->maxMemoryMB || opts->cpuRate ||
+                opts->priorityClass || opts->eco || opts->background ||
+                opts->envMode != ENV_FULL || opts->envSetCount || opts->envAllowCount)) {
+        print_message(L"--helper cannot be combined with --batch, --all-sessions, "
+                      L"--via-broker, --detach, --max-output, --timeout, --max-memory, "
+                      L"--cpu-rate, --priority, --eco, --background or --env");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->targetUser && (opts->sessionSpecified || opts->allSessions)) {
+        print_message(L"--user cannot be combined with --session or --all-sessions");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->allSessions &&
+               (opts->sessionSpecified || opts->batchPath || opts->viaBroker)) {
+        print_message(L"--all-sessions cannot be combined with --session, "
+                      L"--batch or --via-broker");
+        return EXIT_USAGE_ERROR;
+    } else if (opts->batchPath) {
+        if (opts->cmdArgc > 0) {
+            print_message(L"--batch does not take a command");
+            print_usage();
+            return EXIT_USAGE_ERROR;
+        }
+    } else if (opts->cmdArgc == 0) {
+        print_message(L"no command specified");
+        print_usage();
+        return EXIT_USAGE_ERROR;
+    }
+
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Environment block modes (--env=full|minimal|cached)                       */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * CreateEnvironmentBlock loads the user's registry environment (and, on
+ * roaming or domain profiles, is often the slowest launch step); two modes
+ * avoid it:
+ *
+ *   minimal  build a small block directly: the user's identity from the
+ *            token, the profile-relative folders (USERPROFILE, APPDATA,
+ *            LOCALAPPDATA, TEMP, TMP, HOMEDRIVE, HOMEPATH) and the
+ *            machine-wide variables this process already has (PATH,
+ *            SystemRoot, ComSpec, ...). User-defined variables are absent.
+ *   cached   reuse a full block built earlier in this process for the same
+ *            user SID and logon session (useful in the broker and with
+ *            --all-sessions); a new logon session gets a new block.
+ *
+ * --env-allow NAME (copied from this process) and --env NAME=value are then
+ * merged into whichever block the mode built, replacing its NAME.
+ */
+#define ENV_MAX_VARS    32
+
+/* Machine-wide variables copied from this (SYSTEM) process for --env=minimal */
+static const WCHAR *const g_minimalEnvInherit[] = {
+    L"ALLUSERSPROFILE", L"CommonProgramFiles", L"CommonProgramFiles(x86)",
+    L"CommonProgramW6432", L"COMPUTERNAME", L"ComSpec",
+    L"NUMBER_OF_PROCESSORS", L"OS", L"Path", L"PATHEXT",
+    L"PROCESSOR_ARCHITECTURE", L"ProgramData", L"ProgramFiles",
+    L"ProgramFiles(x86)", L"ProgramW6432", L"PUBLIC", L"SystemDrive",
+    L"SystemRoot", L"windir",
+};
+
+typedef struct {
+    WCHAR *vars[ENV_MAX_VARS];      /* "NAME=value", malloc'd */
+    DWORD  count;
+} EnvBuilder;
+
+static void env_add(EnvBuilder *b, const WCHAR *name, const WCHAR *value,
+                    const WCHAR *suffix)
+{
+    if (b->count >= ENV_MAX_VARS)
+        return;
+    size_t len = wcslen(name) + 1 + wcslen(value) + (suffix ? wcslen(suffix) : 0) + 1;
+    WCHAR *var = (WCHAR *)malloc(len * sizeof(WCHAR));
+    if (!var)
+        return;
+    _snwprintf(var, len, L"%ls=%ls%ls", name, value, suffix ? suffix : L"");
+    var[len - 1] = L'\0';
+    b->vars[b->count++] = var;
+}
+
+/* Environment blocks are sorted by name, case-insensitively */
+static int env_compare(const void *a, const void *b)
+{
+    const WCHAR *x = *(const WCHAR *const *)a;
+    const WCHAR *y = *(const WCHAR *const *)b;
+    for (;; x++, y++) {
+        WCHAR cx = *x == L'=' ? L'\0' : towupper(*x);
+        WCHAR cy = *y == L'=' ? L'\0' : towupper(*y);
+        if (cx != cy || cx == L'\0')
+            return (int)cx - (int)cy;
+    }
+}
+
+/*
+ * --env=minimal: a Unicode environment block (free with free()) built from
+ * the token's account and the profile directory. Returns NULL on failure.
+ */
+static LPVOID build_minimal_environment(HANDLE hToken, const WCHAR *profileDir)
+{
+    EnvBuilder b;
+    ZeroMemory(&b, sizeof(b));
+    WCHAR value[32768];
+
+    for (size_t i = 0; i < sizeof(g_minimalEnvInherit) / sizeof(g_minimalEnvInherit[0]); i++) {
+        DWORD n = GetEnvironmentVariableW(g_minimalEnvInherit[i], value, 32768);
+        if (n > 0 && n < 32768)
+            env_add(&b, g_minimalEnvInherit[i], value, NULL);
+    }
+
+    /* Identity: the token's user account */
+    BYTE userBuf[SECURITY_MAX_SID_SIZE + sizeof(TOKEN_USER)];
+    DWORD len = 0;
+    if (GetTokenInformation(hToken, TokenUser, userBuf, sizeof(userBuf), &len)) {
+        WCHAR name[256], domain[256];
+        DWORD nameLen = 256, domainLen = 256;
+        SID_NAME_USE use;
+        if (LookupAccountSidW(NULL, ((TOKEN_USER *)userBuf)->User.Sid,
+                              name, &nameLen, domain, &domainLen, &use)) {
+            env_add(&b, L"USERNAME", name, NULL);
+            env_add(&b, L"USERDOMAIN", domain, NULL);
+        }
+    }
+
+    /* Per-user folders, relative to the profile (default folder layout) */
+    if (profileDir[0]) {
+        env_add(&b, L"USERPROFILE", profileDir, NULL);
+        env_add(&b, L"APPDATA", profileDir, L"\\AppData\\Roaming");
+        env_add(&b, L"LOCALAPPDATA", profileDir, L"\\AppData\\Local");
+        env_add(&b, L"TEMP", profileDir, L"\\AppData\\Local\\Temp");
+        env_add(&b, L"TMP", profileDir, L"\\AppData\\Local\\Temp");
+        if (profileDir[1] == L':') {
+            WCHAR drive[3] = { profileDir[0], L':', L'\0' };
+            env_add(&b, L"HOMEDRIVE", drive, NULL);
+            env_add(&b, L"HOMEPATH", profileDir + 2, NULL);
+        }
+    }
+
+    qsort(b.vars, b.count, sizeof(b.vars[0]), env_compare);
+
+    size_t total = 1;
+    for (DWORD i = 0; i < b.count; i++)
+        total += wcslen(b.vars[i]) + 1;
+    WCHAR *block = (WCHAR *)malloc(total * sizeof(WCHAR));
+    if (block) {
+        WCHAR *p = block;
+        for (DWORD i = 0; i < b.count; i++) {
+            size_t n = wcslen(b.vars[i]) + 1;
+            memcpy(p, b.vars[i], n * sizeof(WCHAR));
+            p += n;
+        }
+        *p = L'\0';
+    }
+    for (DWORD i = 0; i < b.count; i++)
+        free(b.vars[i]);
+    return block;
+}
+
+/* Whether two "NAME=value" entries name the same variable (case-insensitively). */
+static BOOL env_same_name(const WCHAR *a, const WCHAR *b)
+{
+    for (;; a++, b++) {
+        WCHAR ca = *a == L'=' ? L'\0' : towupper(*a);
+        WCHAR cb = *b == L'=' ? L'\0' : towupper(*b);
+        if (ca != cb)
+            return FALSE;
+        if (ca == L'\0')
+            return TRUE;
+    }
+}
+
+/*
+ * --env, --env-allow: a copy of block (free with free()) with the options'
+ * variables added or replaced, still sorted. Returns NULL on failure.
+ */
+static LPVOID merge_environment(const WCHAR *block, const Options *opts)
+{
+    EnvBuilder b;
+    ZeroMemory(&b, sizeof(b));
+    WCHAR value[32768];
+    for (DWORD i = 0; i < opts->envAllowCount; i++) {
+        DWORD n = GetEnvironmentVariableW(opts->envAllow[i], value, 32768);
+        if (n > 0 && n < 32768)
+            env_add(&b, opts->envAllow[i], value, NULL);
+    }
+
+    /* Overrides: the allowed variables, then --env, each replacing its name */
+    const WCHAR *over[2 * ENV_OPTION_MAX];
+    DWORD nOver = 0;
+    for (DWORD i = 0; i < b.count + opts->envSetCount; i++) {
+        const WCHAR *var = i < b.count ? b.vars[i] : opts->envSet[i - b.count];
+        DWORD k = 0;
+        while (k < nOver && !env_same_name(over[k], var))
+            k++;
+        over[k] = var;
+        if (k == nOver)
+            nOver++;
+    }
+
+    size_t nBase = 0;
+    for (const WCHAR *p = block; *p; p += wcslen(p) + 1)
+        nBase++;
+    const WCHAR **vars = (const WCHAR **)malloc((nBase + nOver) * sizeof(vars[0]));
+    WCHAR *merged = NULL;
+    if (vars) {
+        size_t count = 0, total = 1;
+        for (const WCHAR *p = block; *p; p += wcslen(p) + 1) {
+            DWORD k = 0;
+            while (k < nOver && !env_same_name(over[k], p))
+                k++;
+            if (k == nOver)
+                vars[count++] = p;
+        }
+        for (DWORD k = 0; k < nOver; k++)
+            vars[count++] = over[k];
+        qsort(vars, count, sizeof(vars[0]), env_compare);
+
+        for (size_t i = 0; i < count; i++)
+            total += wcslen(vars[i]) + 1;
+        merged = (WCHAR *)malloc(total * sizeof(WCHAR));
+        if (merged) {
+            WCHAR *p = merged;
+            for (size_t i = 0; i < count; i++) {
+                size_t n = wcslen(vars[i]) + 1;
+                memcpy(p, vars[i], n * sizeof(WCHAR));
+                p += n;
+            }
+            *p = L'\0';
+        }
+        free(vars);
+    }
+    for (DWORD i = 0; i < b.count; i++)
+        free(b.vars[i]);
+    return merged;
+}
+
+/*
+ * --env=cached: full CreateEnvironmentBlock blocks keyed by user SID and
+ * logon session (TokenStatistics.AuthenticationId). Entries are reference
+ * counted, since a replaced entry may still be in use by a launch.
+ */
+typedef struct EnvCacheEntry {
+    volatile LONG         refCount;     /* the cache's own reference + users */
+    struct EnvCacheEntry *next;
+    WCHAR                *sid;          /* string SID (LocalFree) */
+    LUID                  logonId;
+    LPVOID                lpEnvironment;
+} EnvCacheEntry;
+
+static SRWLOCK        g_envCacheLock = SRWLOCK_INIT;
+static EnvCacheEntry *g_envCache;
+
+static void release_env_entry(EnvCacheEntry *e)
+{
+    if (!e || InterlockedDecrement(&e->refCount) != 0)
+        return;
+    DestroyEnvironmentBlock(e->lpEnvironment);
+    LocalFree(e->sid);
+    free(e);
+}
+
+/*
+ * Return a referenced cache entry for hToken's user and logon session,
+ * building the block on a miss. An entry for the same SID from an older
+ * logon session is dropped. Returns NULL on failure.
+ */
+static EnvCacheEntry *get_cached_environment(HANDLE hToken)
+{
+    BYTE userBuf[SECURITY_MAX_SID_SIZE + sizeof(TOKEN_USER)];
+    TOKEN_STATISTICS stats;
+    WCHAR *sid = NULL;
+    DWORD len = 0;
+
+    if (!GetTokenInformation(hToken, TokenUser, userBuf, sizeof(userBuf), &len) ||
+        !GetTokenInformation(hToken, TokenStatistics, &stats, sizeof(stats), &len) ||
+        !ConvertSidToStringSidW(((TOKEN_USER *)userBuf)->User.Sid, &sid)) {
+        print_error(L"failed to identify the token's user", GetLastError());
+        return NULL;
+    }
+
+    AcquireSRWLockExclusive(&g_envCacheLock);
+
+    EnvCacheEntry **link = &g_envCache, *e;
+    while ((e = *link) != NULL) {
+        if (_wcsicmp(e->sid, sid) == 0) {
+            if (e->logonId.LowPart == stats.AuthenticationId.LowPart &&
+                e->logonId.HighPart == stats.AuthenticationId.HighPart)
+                break;
+            *link = e->next;            /* logon session changed: invalidate */
+            release_env_entry(e);
+            continue;
+        }
+        link = &e->next;
+    }
+
+    /* Built under the lock: concurrent misses for one user build it once */
+    if (!e && (e = (EnvCacheEntry *)calloc(1, sizeof(*e))) != NULL) {
+        if (CreateEnvironmentBlock(&e->lpEnvironment, hToken, FALSE)) {
+            e->refCount = 1;
+            e->sid      = sid;
+            e->logonId  = stats.AuthenticationId;
+            e->next     = g_envCache;
+            g_envCache  = e;
+            sid = NULL;
+        } else {
+            print_error(L"CreateEnvironmentBlock failed", GetLastError());
+            free(e);
+            e = NULL;
+        }
+    }
+    if (e)
+        InterlockedIncrement(&e->refCount);
+
+    ReleaseSRWLockExclusive(&g_envCacheLock);
+    if (sid)
+        LocalFree(sid);
+    return e;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  User context: session, primary token, environment, profile directory      */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Everything CreateProcessAsUserW needs to launch as the user. Reference
+ * counted so the broker can hand one cached context to several concurrent
+ * launches while a session change replaces it.
+ */
+typedef struct {
+    volatile LONG refCount;
+    LONG   generation;              /* broker session generation it was built in */
+    DWORD  sessionId;
+    HANDLE hToken;                  /* primary token (DuplicateTokenEx) */
+    int    envMode;                 /* ENV_*: how lpEnvironment was built */
+    BOOL   envMerged;               /* --env, --env-allow: lpEnvironment is a copy */
+    LPVOID lpEnvironment;
+    EnvCacheEntry *envEntry;        /* --env=cached: owner of lpEnvironment */
+    WCHAR  profileDir[MAX_PATH];
+    WCHAR  userName[SESSION_USER_MAX];  /* DOMAIN\name, if known */
+} UserContext;
+
+/* Free lpEnvironment the way it was built. */
+static void release_environment(UserContext *ctx)
+{
+    if (ctx->envEntry)
+        release_env_entry(ctx->envEntry);
+    else if (ctx->envMerged || ctx->envMode == ENV_MINIMAL)
+        free(ctx->lpEnvironment);
+    else if (ctx->lpEnvironment)
+        DestroyEnvironmentBlock(ctx->lpEnvironment);
+    ctx->lpEnvironment = NULL;
+    ctx->envEntry      = NULL;
+}
+
+static void release_user_context(UserContext *ctx)
+{
+    if (!ctx || InterlockedDecrement(&ctx->refCount) != 0)
+        return;
+    release_environment(ctx);
+    if (ctx->hToken)
+        CloseHandle(ctx->hToken);
+    free(ctx);
+}
+
+/*
+ * Step 1 of a launch: the session --session, --user, --wait-for-session or
+ * the default choose. *phToken receives the user token if the search
+ * already obtained one (the caller closes it), userName (SESSION_USER_MAX)
+ * the user if known. Returns an EXIT_* code.
+ */
+static int find_target_session(const Options *opts, DWORD *pSessionId, HANDLE *phToken,
+                               WCHAR *userName)
+{
+    *pSessionId = opts->targetSessionId;
+    *phToken    = NULL;
+    userName[0] = L'\0';
+
+    if (opts->waitForSession) {
+        if (!wait_for_user_session(opts->sessionSpecified, opts->targetUser,
+                                   opts->waitSessionMs, pSessionId, phToken, userName))
+            return EXIT_NO_SESSION;
+    } else if (!opts->sessionSpecified) {
+        if (!find_active_session(opts->targetUser, pSessionId, phToken, userName)) {
+            if (opts->targetUser)
+                fwprintf(stderr, L"runasuser: no session found for user %ls\n",
+                         opts->targetUser);
+            else
+                print_message(L"no active user session found");
+            return EXIT_NO_SESSION;
+        }
+    }
+    return EXIT_SUCCESS_CODE;
+}
+
+/*
+ * Steps 1-5 of a launch: find the session, obtain and duplicate the user
+ * token, look up the profile directory and build the environment block.
+ * On success *pCtx holds one reference; returns an EXIT_* code.
+ */
+static int acquire_user_context(const Options *opts, UserContext **pCtx)
+{
+    int exitCode          = EXIT_GENERAL_FAILURE;
+    DWORD targetSessionId = 0;
+    HANDLE hToken         = NULL;
+    WCHAR sessionUser[SESSION_USER_MAX];
+
+    UserContext *ctx = (UserContext *)calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        print_message(L"failed to allocate memory for user context");
+        return EXIT_GENERAL_FAILURE;
+    }
+    ctx->refCount = 1;
+
+    /* ---- Step 1: Find the target session -------------------------------- */
+
+    exitCode = find_target_session(opts, &targetSessionId, &hToken, sessionUser);
+    if (exitCode != EXIT_SUCCESS_CODE)
+        goto cleanup;
+    exitCode = EXIT_GENERAL_FAILURE;
+    ctx->sessionId = targetSessionId;
+
+    /* Enumeration already named the user; only --session needs to ask */
+    if (sessionUser[0] == L'\0') {
+        WCHAR *name = get_session_username(targetSessionId);
+        if (name) {
+            _snwprintf(sessionUser, SESSION_USER_MAX, L"%ls", name);
+            sessionUser[SESSION_USER_MAX - 1] = L'\0';
+            WTSFreeMemory(name);
+        }
+    }
+    memcpy(ctx->userName, sessionUser, sizeof(ctx->userName));
+    if (sessionUser[0] != L'\0') {
+        fwprintf(stderr, L"runasuser: targeting session %lu (user: %ls)\n",
+                 (unsigned long)targetSessionId, sessionUser);
+    } else {
+        fwprintf(stderr, L"runasuser: targeting session %lu\n",
+                 (unsigned long)targetSessionId);
+    }
+
+    /* ---- Step 2: Get the user token for the session --------------------- */
+
+    /* Session discovery already holds a validated token in the common case */
+    LONGLONG t = trace_now();
+    if (!hToken && !WTSQueryUserToken(targetSessionId, &hToken)) {
+        DWORD err = GetLastError();
+        hToken = NULL;
+        if (err == ERROR_PRIVILEGE_NOT_HELD) {
+            print_message(L"privilege not held - this tool must be run as SYSTEM "
+                          L"(e.g., via PsExec -s, a Windows service, or Task Scheduler "
+                          L"running as SYSTEM)");
+        } else if (err == ERROR_NO_TOKEN) {
+            print_message(L"no user is logged into the target session");
+        } else {
+            print_error(L"WTSQueryUserToken failed", err);
+        }
+        exitCode = EXIT_TOKEN_FAILURE;
+        goto cleanup;
+    }
+    if (opts->sessionSpecified)
+        trace_phase(L"WTSQueryUserToken", t);
+
+    /* ---- Step 3: Duplicate the token as a primary token ----------------- */
+
+    t = trace_now();
+    if (!DuplicateTokenEx(hToken, MAXIMUM_ALLOWED, NULL,
+                          SecurityIdentification, TokenPrimary, &ctx->hToken)) {
+        print_error(L"DuplicateTokenEx failed", GetLastError());
+        ctx->hToken = NULL;
+        exitCode = EXIT_TOKEN_FAILURE;
+        goto cleanup;
+    }
+    trace_phase(L"DuplicateTokenEx", t);
+
+    /* ---- Step 4: Get the user's profile directory for the working dir --- */
+
+    t = trace_now();
+    DWORD profileDirSize = MAX_PATH;
+    if (!GetUserProfileDirectoryW(ctx->hToken, ctx->profileDir, &profileDirSize)) {
+        /* Non-fatal: fall back to no specific working directory */
+        ctx->profileDir[0] = L'\0';
+    }
+    trace_phase(L"GetUserProfileDirectoryW", t);
+
+    /* ---- Step 5: Create the user's environment block -------------------- */
+
+    t = trace_now();
+    ctx->envMode = opts->envMode;
+    if (opts->envMode == ENV_MINIMAL) {
+        ctx->lpEnvironment = build_minimal_environment(ctx->hToken, ctx->profileDir);
+        if (!ctx->lpEnvironment) {
+            print_message(L"failed to allocate memory for environment block");
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        trace_phase(L"build_minimal_environment", t);
+    } else if (opts->envMode == ENV_CACHED) {
+        ctx->envEntry = get_cached_environment(ctx->hToken);
+        if (!ctx->envEntry) {
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        ctx->lpEnvironment = ctx->envEntry->lpEnvironment;
+        trace_phase(L"env_cache", t);
+    } else {
+        if (!CreateEnvironmentBlock(&ctx->lpEnvironment, ctx->hToken, FALSE)) {
+            print_error(L"CreateEnvironmentBlock failed", GetLastError());
+            ctx->lpEnvironment = NULL;
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        trace_phase(L"CreateEnvironmentBlock", t);
+    }
+
+    if (opts->envSetCount || opts->envAllowCount) {
+        t = trace_now();
+        LPVOID merged = merge_environment((const WCHAR *)ctx->lpEnvironment, opts);
+        if (!merged) {
+            print_message(L"failed to allocate memory for environment block");
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        release_environment(ctx);
+        ctx->lpEnvironment = merged;
+        ctx->envMerged     = TRUE;
+        trace_phase(L"merge_environment", t);
+    }
+
+    *pCtx = ctx;
+    ctx = NULL;
+    exitCode = EXIT_SUCCESS_CODE;
+
+cleanup:
+    release_user_context(ctx);
+    if (hToken)
+        CloseHandle(hToken);
+    return exitCode;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Direct output redirection (--stdout / --stderr)                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Inheritable handles the child writes to directly, with no relay copy.
+ * NULL means the stream is not redirected. When both options name the
+ * same target, one handle serves both streams (like 2>&1).
+ */
+typedef struct {
+    HANDLE hOutput;
+    HANDLE hError;
+} Redirects;
+
+static BOOL is_pipe_path(const WCHAR *path)
+{
+    return _wcsnicmp(path, L"\\\\.\\pipe\\", 9) == 0;
+}
+
+/*
+ * Open a redirect target: an existing named pipe (\\.\pipe\name) is
+ * connected to, anything else is created or truncated as a file. SYSTEM
+ * opens it, possibly in a directory users can write to, so a file that is
+ * a reparse point (symlink, junction, mount point) or has other hard links
+ * is refused, and it is truncated only once it is known to be neither.
+ */
+static HANDLE open_redirect(const WCHAR *path)
+{
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;   /* passed straight to the child */
+    sa.lpSecurityDescriptor = NULL;
+
+    BOOL isPipe = is_pipe_path(path);
+    HANDLE h = CreateFileW(path, GENERIC_WRITE,
+                           isPipe ? 0 : FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           &sa, isPipe ? OPEN_EXISTING : OPEN_ALWAYS,
+                           isPipe ? FILE_ATTRIBUTE_NORMAL
+                                  : FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OPEN_REPARSE_POINT,
+                           NULL);
+    DWORD err = GetLastError();
+    if (h != INVALID_HANDLE_VALUE && !isPipe && GetFileType(h) == FILE_TYPE_DISK) {
+        BY_HANDLE_FILE_INFORMATION info;
+        if (!GetFileInformationByHandle(h, &info))
+            err = GetLastError();
+        else if ((info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ||
+                 info.nNumberOfLinks > 1)
+            err = ERROR_ACCESS_DENIED;
+        else if (!SetEndOfFile(h))          /* at offset 0: truncate */
+            err = GetLastError();
+        else
+            err = ERROR_SUCCESS;
+        if (err != ERROR_SUCCESS) {
+            CloseHandle(h);
+            h = INVALID_HANDLE_VALUE;
+        }
+    }
+    if (h == INVALID_HANDLE_VALUE) {
+        WCHAR msg[MAX_PATH + 32];
+        _snwprintf(msg, MAX_PATH + 32, L"cannot open %ls", path);
+        msg[MAX_PATH + 31] = L'\0';
+        print_error(msg, err);
+        return NULL;
+    }
+    return h;
+}
+
+static void close_redirects(Redirects *r)
+{
+    if (r->hError && r->hError != r->hOutput)
+        CloseHandle(r->hError);
+    if (r->hOutput)
+        CloseHandle(r->hOutput);
+    r->hOutput = r->hError = NULL;
+}
+
+static BOOL open_redirects(const Options *opts, Redirects *r)
+{
+    r->hOutput = r->hError = NULL;
+
+    if (opts->stdoutPath && !(r->hOutput = open_redirect(opts->stdoutPath)))
+        return FALSE;
+
+    if (opts->stderrPath) {
+        if (opts->stdoutPath && _wcsicmp(opts->stdoutPath, opts->stderrPath) == 0) {
+            r->hError = r->hOutput;
+        } else if (!(r->hError = open_redirect(opts->stderrPath))) {
+            close_redirects(r);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Resource governance and scheduling                                        */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A child launched with any limit is created suspended, placed in its own
+ * Job Object and only then resumed, so the limits cover it and everything
+ * it starts from its first instruction:
+ *
+ *   --max-memory  JOB_OBJECT_LIMIT_JOB_MEMORY: committed memory of the tree
+ *   --cpu-rate    hard CPU rate cap for the tree (Windows 8 and later)
+ *   --timeout     a timer-queue timer terminates the whole job, and the job
+ *                 is killed if runasuser itself goes away (KILL_ON_JOB_CLOSE)
+ *
+ * A child that is waited for (--wait, --batch) gets a job even without
+ * limits, so that cancelling runasuser ends its whole tree: the job is
+ * KILL_ON_JOB_CLOSE while the child runs, and terminated by the console
+ * control handler below. Without --timeout the flag is cleared again before
+ * a normal close, so processes the child left behind keep running as before.
+ *
+ * With --wait=tree, the job also posts to a completion port, and a small
+ * thread sets hTreeDone on JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO, the moment
+ * the last process in the tree has exited.
+ *
+ * hJob is NULL when the launch needs no job and is unchanged.
+ */
+typedef struct JobGuard {
+    HANDLE        hJob;
+    HANDLE        hTimer;
+    volatile LONG timedOut;
+    BOOL          treeOnly;         /* no limits: only there to be cancelled */
+    BOOL          keepTree;         /* clear KILL_ON_JOB_CLOSE before closing */
+    struct JobGuard *prev, *next;   /* in g_cancel while the child runs */
+    HANDLE        hPort;            /* --wait=tree */
+    HANDLE        hTreeDone;
+    HANDLE        hTreeThread;
+} JobGuard;
+
+/*
+ * Cancellation: Ctrl+C, Ctrl+Break, closing the console, logoff, shutdown.
+ * The child runs in the user's session with a console of its own, so console
+ * control events cannot be relayed to it; every job this process is waiting
+ * on is terminated instead, which ends each tree at once with the exit code
+ * of a process stopped by Ctrl+C. A job that registers after the cancel is
+ * terminated on the spot, and --batch starts no further commands. Armed only
+ * for a CLI launch that waits; brokers and helpers keep the default handling.
+ */
+static struct {
+    CRITICAL_SECTION lock;
+    BOOL             armed;
+    volatile LONG    cancelled;
+    JobGuard        *head;
+} g_cancel;
+
+static BOOL WINAPI cancel_handler(DWORD ctrlType)
+{
+    EnterCriticalSection(&g_cancel.lock);
+    InterlockedExchange(&g_cancel.cancelled, 1);
+    for (JobGuard *g = g_cancel.head; g; g = g->next)
+        TerminateJobObject(g->hJob, STATUS_CONTROL_C_EXIT);
+    LeaveCriticalSection(&g_cancel.lock);
+
+    /* Ctrl+C/Break are handled; the others still end this process */
+    return ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT;
+}
+
+static void cancel_arm(void)
+{
+    InitializeCriticalSection(&g_cancel.lock);
+    g_cancel.armed = TRUE;
+    if (!SetConsoleCtrlHandler(cancel_handler, TRUE))
+        print_error(L"warning: SetConsoleCtrlHandler failed", GetLastError());
+}
+
+static void cancel_register(JobGuard *g)
+{
+    if (!g_cancel.armed)
+        return;
+    EnterCriticalSection(&g_cancel.lock);
+    if (g_cancel.cancelled)
+        TerminateJobObject(g->hJob, STATUS_CONTROL_C_EXIT);
+    g->prev = NULL;
+    g->next = g_cancel.head;
+    if (g_cancel.head)
+        g_cancel.head->prev = g;
+    g_cancel.head = g;
+    LeaveCriticalSection(&g_cancel.lock);
+}
+
+static void cancel_unregister(JobGuard *g)
+{
+    if (!g_cancel.armed)
+        return;
+    EnterCriticalSection(&g_cancel.lock);
+    if (g->prev)
+        g->prev->next = g->next;
+    else if (g_cancel.head == g)
+        g_cancel.head = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+    g->prev = g->next = NULL;
+    LeaveCriticalSection(&g_cancel.lock);
+}
+
+static VOID CALLBACK job_timeout_callback(PVOID lpParam, BOOLEAN timerFired)
+{
+    JobGuard *g = (JobGuard *)lpParam;
+    (void)timerFired;
+    InterlockedExchange(&g->timedOut, 1);
+    TerminateJobObject(g->hJob, (UINT)EXIT_TIMEOUT);
+}
+
+static void job_guard_close(JobGuard *g);
+
+static DWORD WINAPI job_tree_thread(LPVOID lpParam)
+{
+    JobGuard *g = (JobGuard *)lpParam;
+    DWORD msg;
+    ULONG_PTR key;
+    LPOVERLAPPED ov;
+    /* job_guard_close() posts a message with no key to stop the thread */
+    while (GetQueuedCompletionStatus(g->hPort, &msg, &key, &ov, INFINITE) && key) {
+        if (msg == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO) {
+            SetEvent(g->hTreeDone);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* --wait=tree: watch the job's process count through a completion port. */
+static BOOL job_guard_watch_tree(JobGuard *g)
+{
+    JOBOBJECT_ASSOCIATE_COMPLETION_PORT port;
+    g->hPort     = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    g->hTreeDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    port.CompletionKey  = g;
+    port.CompletionPort = g->hPort;
+    if (!g->hPort || !g->hTreeDone ||
+        !SetInformationJobObject(g->hJob, JobObjectAssociateCompletionPortInformation,
+                                 &port, sizeof(port)) ||
+        !(g->hTreeThread = CreateThread(NULL, 0, job_tree_thread, g, 0, NULL))) {
+        print_error(L"failed to watch the process tree for --wait=tree", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Create the job with the configured limits; call before CreateProcess. */
+static BOOL job_guard_create(const Options *opts, JobGuard *g)
+{
+    ZeroMemory(g, sizeof(*g));
+    BOOL waited = opts->waitForChild || opts->batchPath;
+    g->treeOnly = !opts->timeoutMs && !opts->maxMemoryMB && !opts->cpuRate;
+    if (g->treeOnly && !waited)
+        return TRUE;
+
+    g->hJob = CreateJobObjectW(NULL, NULL);
+    if (!g->hJob) {
+        print_error(L"CreateJobObjectW failed", GetLastError());
+        return FALSE;
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+    ZeroMemory(&limits, sizeof(limits));
+    if (opts->maxMemoryMB) {
+        limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limits.JobMemoryLimit = (SIZE_T)opts->maxMemoryMB * 1024 * 1024;
+    }
+    if (opts->timeoutMs || waited)
+        limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    g->keepTree = waited && !opts->timeoutMs;
+
+    if (limits.BasicLimitInformation.LimitFlags &&
+        !SetInformationJobObject(g->hJob, JobObjectExtendedLimitInformation,
+                                 &limits, sizeof(limits))) {
+        print_error(opts->maxMemoryMB ? L"failed to set job memory limit"
+                                      : L"failed to set job limits", GetLastError());
+        CloseHandle(g->hJob);
+        g->hJob = NULL;
+        return FALSE;
+    }
+
+    if (opts->cpuRate) {
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpu;
+        ZeroMemory(&cpu, sizeof(cpu));
+        cpu.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                           JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+        cpu.CpuRate = opts->cpuRate * 100;  /* units of 1/100 percent */
+        if (!SetInformationJobObject(g->hJob, JobObjectCpuRateControlInformation,
+                                     &cpu, sizeof(cpu))) {
+            print_error(L"failed to set job CPU rate (requires Windows 8 or later)",
+                        GetLastError());
+            CloseHandle(g->hJob);
+            g->hJob = NULL;
+            return FALSE;
+        }
+    }
+    if (opts->waitMode == WAIT_TREE && opts->waitForChild && !job_guard_watch_tree(g)) {
+        job_guard_close(g);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * EcoQoS (--eco): execution-speed power throttling, which lets Windows 11
+ * run the process on efficiency cores at low clock speed, plus low memory
+ * priority, so its pages are the first to be trimmed. Declared locally and
+ * resolved at run time: the SDK only exposes SetProcessInformation for
+ * _WIN32_WINNT >= 0x0602, and the binary must still load on Windows 7.
+ */
+#define RAU_ProcessMemoryPriority       0
+#define RAU_ProcessPowerThrottling      4
+#define RAU_MEMORY_PRIORITY_LOW         2
+#define RAU_POWER_THROTTLING_VERSION    1
+#define RAU_POWER_THROTTLING_EXEC_SPEED 0x1
+
+typedef struct {
+    ULONG Version;
+    ULONG ControlMask;
+    ULONG StateMask;
+} PowerThrottlingState;
+
+typedef BOOL (WINAPI *SetProcessInformationFn)(HANDLE, int, LPVOID, DWORD);
+
+/* Best effort: older systems keep running the child at normal priority. */
+static void apply_eco_mode(HANDLE hProcess)
+{
+    SetProcessInformationFn pSetProcessInformation =
+        (SetProcessInformationFn)(void (*)(void))GetProcAddress(
+            GetModuleHandleW(L"kernel32.dll"), "SetProcessInformation");
+    if (!pSetProcessInformation) {
+        print_message(L"warning: --eco requires Windows 8 or later; ignored");
+        return;
+    }
+
+    ULONG memoryPriority = RAU_MEMORY_PRIORITY_LOW;
+    if (!pSetProcessInformation(hProcess, RAU_ProcessMemoryPriority,
+                                &memoryPriority, sizeof(memoryPriority)))
+        print_error(L"warning: failed to lower memory priority", GetLastError());
+
+    PowerThrottlingState throttle;
+    throttle.Version     = RAU_POWER_THROTTLING_VERSION;
+    throttle.ControlMask = RAU_POWER_THROTTLING_EXEC_SPEED;
+    throttle.StateMask   = RAU_POWER_THROTTLING_EXEC_SPEED;
+    if (!pSetProcessInformation(hProcess, RAU_ProcessPowerThrottling,
+                                &throttle, sizeof(throttle)))
+        print_error(L"warning: failed to enable power throttling (requires "
+                    L"Windows 10 1709 or later)", GetLastError());
+}
+
+/*
+ * Creation flags for a child under opts and g: its priority class, and
+ * CREATE_SUSPENDED when start_child() has setup to do before it runs.
+ */
+static DWORD child_creation_flags(const Options *opts, const JobGuard *g)
+{
+    DWORD flags = opts->priorityClass;
+    if (g->hJob || opts->eco)
+        flags |= CREATE_SUSPENDED;
+    return flags;
+}
+
+/*
+ * Console and desktop of a child whose streams are not a console of its own.
+ * CREATE_NO_WINDOW still starts a (hidden) conhost.exe for it; --background
+ * asks for none at all (DETACHED_PROCESS) and, with an empty lpDesktop, the
+ * noninteractive window station of the user's logon session instead of
+ * winsta0\default, so nothing it does can appear on the screen.
+ */
+static DWORD child_console_flags(const Options *opts)
+{
+    return opts->background ? DETACHED_PROCESS : CREATE_NO_WINDOW;
+}
+
+static WCHAR *child_desktop(const Options *opts)
+{
+    return opts->background ? L"" : L"winsta0\\default";
+}
+
+/*
+ * Finish a child created with child_creation_flags(): apply --eco, put it
+ * in the job, arm the timeout and let it run. On failure the child is
+ * terminated, since it would otherwise run unlimited.
+ */
+static BOOL start_child(const Options *opts, JobGuard *g,
+                        const PROCESS_INFORMATION *pi)
+{
+    if (opts->eco)
+        apply_eco_mode(pi->hProcess);
+    if (!g->hJob) {
+        if (opts->eco)
+            ResumeThread(pi->hThread);
+        return TRUE;
+    }
+
+    if (!AssignProcessToJobObject(g->hJob, pi->hProcess)) {
+        if (g->treeOnly) {
+            /* Already in a job that allows no nesting (Windows 7): run as before */
+            job_guard_close(g);
+            ResumeThread(pi->hThread);
+            return TRUE;
+        }
+        print_error(L"AssignProcessToJobObject failed", GetLastError());
+        TerminateProcess(pi->hProcess, EXIT_GENERAL_FAILURE);
+        return FALSE;
+    }
+    cancel_register(g);
+    if (opts->timeoutMs &&
+        !CreateTimerQueueTimer(&g->hTimer, NULL, job_timeout_callback, g,
+                               opts->timeoutMs, 0, WT_EXECUTEONLYONCE)) {
+        print_error(L"CreateTimerQueueTimer failed", GetLastError());
+        TerminateJobObject(g->hJob, EXIT_GENERAL_FAILURE);
+        g->hTimer = NULL;
+        return FALSE;
+    }
+    ResumeThread(pi->hThread);
+    return TRUE;
+}
+
+/*
+ * Disarm the timeout (waiting out a running callback) and close the job,
+ * leaving what is still running in it alone unless --timeout is set.
+ */
+static void job_guard_close(JobGuard *g)
+{
+    if (g->hTimer)
+        DeleteTimerQueueTimer(NULL, g->hTimer, INVALID_HANDLE_VALUE);
+    if (g->hTreeThread) {
+        PostQueuedCompletionStatus(g->hPort, 0, 0, NULL);
+        WaitForSingleObject(g->hTreeThread, INFINITE);
+        CloseHandle(g->hTreeThread);
+    }
+    if (g->hPort)
+        CloseHandle(g->hPort);
+    if (g->hTreeDone)
+        CloseHandle(g->hTreeDone);
+    g->hTreeThread = g->hPort = g->hTreeDone = NULL;
+    if (g->hJob) {
+        cancel_unregister(g);
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+        if (g->keepTree &&
+            QueryInformationJobObject(g->hJob, JobObjectExtendedLimitInformation,
+                                      &limits, sizeof(limits), NULL)) {
+            limits.BasicLimitInformation.LimitFlags &= ~JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+            SetInformationJobObject(g->hJob, JobObjectExtendedLimitInformation,
+                                    &limits, sizeof(limits));
+        }
+        CloseHandle(g->hJob);
+    }
+    g->hTimer = g->hJob = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Detached launch (--detach / --status-file / --collect)                    */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * With --detach, runasuser returns as soon as the child is running. A small
+ * supervisor (this executable, started with the internal --supervise flag
+ * and nothing inherited but one handle to the child) waits for it and
+ * records the result, so a caller can come back later with --collect. The
+ * status file is always replaced atomically (written to a temporary file
+ * and moved over), so a reader sees one complete JSON record:
+ *
+ *   {"runasuser_status":{"state":"running","pid":<pid>,"started":<time>}}
+ *   {"runasuser_status":{"state":"exited","pid":<pid>,"started":<time>,
+ *    "ended":<time>,"exit_code":<code>,"user_time_us":<us>,
+ *    "system_time_us":<us>,"max_rss_bytes":<peak working set>}}
+ *
+ * Times are Unix time in seconds. state is "starting" until the child exists.
+ */
+#define FILETIME_UNIX_EPOCH     116444736000000000ULL   /* 1970 in 100 ns units */
+#define STATUS_RECORD_MAX       512
+
+static ULONGLONG filetime_ticks(FILETIME ft)
+{
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+/* Append ,"<name>":<sec>.<msec> for an absolute FILETIME. */
+static int format_unix_time(char *buf, size_t size, const char *name, FILETIME ft)
+{
+    ULONGLONG ms = (filetime_ticks(ft) - FILETIME_UNIX_EPOCH) / 10000;
+    return snprintf(buf, size, ",\"%s\":%llu.%03u", name, ms / 1000, (unsigned)(ms % 1000));
+}
+
+static BOOL write_status_file(const WCHAR *path, const char *record, DWORD len)
+{
+    WCHAR tmpPath[MAX_PATH + 32];
+    _snwprintf(tmpPath, MAX_PATH + 32, L"%ls.tmp.%lu", path,
+               (unsigned long)GetCurrentProcessId());
+    tmpPath[MAX_PATH + 31] = L'\0';
+
+    /* The directory may be writable by others: never follow or reuse a name */
+    HANDLE hFile = CreateFileW(tmpPath, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        print_error(L"cannot create the status file", GetLastError());
+        return FALSE;
+    }
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, record, len, &written, NULL) && written == len;
+    CloseHandle(hFile);
+    if (!ok || !MoveFileExW(tmpPath, path, MOVEFILE_REPLACE_EXISTING |
+                                           MOVEFILE_WRITE_THROUGH)) {
+        print_error(L"cannot write the status file", GetLastError());
+        DeleteFileW(tmpPath);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Record state for the child in hProcess (NULL while "starting"). The
+ * "exited" record adds the exit code, CPU times and peak working set.
+ */
+static BOOL write_job_status(const WCHAR *path, const char *state,
+                             HANDLE hProcess, DWORD processId)
+{
+    char record[STATUS_RECORD_MAX];
+    FILETIME created, ended, kernel, user;
+    if (!hProcess || !GetProcessTimes(hProcess, &created, &ended, &kernel, &user)) {
+        GetSystemTimeAsFileTime(&created);
+        ended = created;
+        ZeroMemory(&kernel, sizeof(kernel));
+        ZeroMemory(&user, sizeof(user));
+    }
+
+    int n = snprintf(record, sizeof(record),
+                     "{\"runasuser_status\":{\"state\":\"%s\",\"pid\":%lu",
+                     state, (unsigned long)processId);
+    n += format_unix_time(record + n, sizeof(record) - (size_t)n, "started", created);
+    if (strcmp(state, "exited") == 0) {
+        DWORD exitCode = EXIT_GENERAL_FAILURE;
+        GetExitCodeProcess(hProcess, &exitCode);
+        PROCESS_MEMORY_COUNTERS mem;
+        ZeroMemory(&mem, sizeof(mem));
+        GetProcessMemoryInfo(hProcess, &mem, sizeof(mem));
+
+        n += format_unix_time(record + n, sizeof(record) - (size_t)n, "ended", ended);
+        n += snprintf(record + n, sizeof(record) - (size_t)n,
+                      ",\"exit_code\":%lu,\"user_time_us\":%llu,"
+                      "\"system_time_us\":%llu,\"max_rss_bytes\":%llu",
+                      (unsigned long)exitCode, filetime_ticks(user) / 10,
+                      filetime_ticks(kernel) / 10,
+                      (unsigned long long)mem.PeakWorkingSetSize);
+    }
+    n += snprintf(record + n, sizeof(record) - (size_t)n, "}}\n");
+    return write_status_file(path, record, (DWORD)n);
+}
+
+/*
+ * Result record (--rusage, --result-file), written to hOutput once a --wait
+ * child has exited:
+ *
+ *   {"runasuser_result":{"pid":<pid>,"session_id":<id>,"user":"DOMAIN\\name",
+ *    "exit_code":<code>,"wall_us":<us>,"user_time_us":<us>,
+ *    "system_time_us":<us>,"max_rss_bytes":<peak working set>,"phases":[
+ *    {"phase":"<name>","start":<us>,"duration":<us>},...]}}
+ *
+ * wall_us runs from the child's creation to its exit; the phases are the
+ * ones --trace-timings=json reports (none for a broker request).
+ */
+#define RESULT_RECORD_MAX       8192
+
+static void write_result(HANDLE hOutput, const UserContext *ctx, HANDLE hProcess,
+                         DWORD processId, int exitCode)
+{
+    FILETIME created, ended, kernel, user;
+    if (!GetProcessTimes(hProcess, &created, &ended, &kernel, &user)) {
+        ZeroMemory(&created, sizeof(created));
+        ended = created;
+        kernel = user = created;
+    }
+    PROCESS_MEMORY_COUNTERS mem;
+    ZeroMemory(&mem, sizeof(mem));
+    GetProcessMemoryInfo(hProcess, &mem, sizeof(mem));
+
+    /* Names cannot contain '"'; the only backslash is DOMAIN\name's own */
+    WCHAR name[SESSION_USER_MAX * 2];
+    size_t len = 0;
+    for (const WCHAR *c = ctx->userName; *c && *c != L'"'; c++) {
+        if (*c == L'\\')
+            name[len++] = L'\\';
+        name[len++] = *c;
+    }
+    name[len] = L'\0';
+
+    /* Broker request threads write records concurrently: no static buffers */
+    WCHAR *record = (WCHAR *)malloc(RESULT_RECORD_MAX * sizeof(WCHAR));
+    char *utf8 = (char *)malloc(RESULT_RECORD_MAX * 3);
+    if (!record || !utf8) {
+        print_message(L"failed to allocate memory for the --rusage record");
+        free(record);
+        free(utf8);
+        return;
+    }
+
+    int n = _snwprintf(record, RESULT_RECORD_MAX,
+                       L"{\"runasuser_result\":{\"pid\":%lu,\"session_id\":%lu,"
+                       L"\"user\":\"%ls\",\"exit_code\":%d,\"wall_us\":%llu,"
+                       L"\"user_time_us\":%llu,\"system_time_us\":%llu,"
+                       L"\"max_rss_bytes\":%llu,\"phases\":[",
+                       (unsigned long)processId, (unsigned long)ctx->sessionId, name,
+                       exitCode, (filetime_ticks(ended) - filetime_ticks(created)) / 10,
+                       filetime_ticks(user) / 10, filetime_ticks(kernel) / 10,
+                       (unsigned long long)mem.PeakWorkingSetSize);
+    LONG count = g_trace.count < TRACE_MAX_EVENTS ? g_trace.count : TRACE_MAX_EVENTS;
+    for (LONG i = 0; g_trace.enabled && i < count && n > 0; i++) {
+        const TraceEvent *e = &g_trace.events[i];
+        int k = _snwprintf(record + n, RESULT_RECORD_MAX - (size_t)n,
+                           L"%ls{\"phase\":\"%ls\",\"start\":%.3f,\"duration\":%.3f}",
+                           i ? L"," : L"", e->phase, trace_us(e->start - g_trace.origin),
+                           trace_us(e->end - e->start));
+        n = k < 0 ? -1 : n + k;
+    }
+    if (n > 0) {
+        int k = _snwprintf(record + n, RESULT_RECORD_MAX - (size_t)n, L"]}}\n");
+        n = k < 0 ? -1 : n + k;
+    }
+    int bytes = n < 0 ? 0 : WideCharToMultiByte(CP_UTF8, 0, record, n, utf8,
+                                                RESULT_RECORD_MAX * 3, NULL, NULL);
+    DWORD written = 0;
+    if (n < 0)
+        print_message(L"the --rusage record does not fit");
+    else if (bytes <= 0 || !WriteFile(hOutput, utf8, (DWORD)bytes, &written, NULL))
+        print_error(L"cannot write the --rusage record", GetLastError());
+    free(record);
+    free(utf8);
+}
+
+/*
+ * Start the supervisor for a detached child. It inherits exactly one
+ * handle, a duplicate of hProcess, and no console or standard handles, so
+ * it holds nothing of the caller's and outlives this process.
+ */
+static BOOL start_supervisor(const Options *opts, HANDLE hProcess)
+{
+    WCHAR exePath[MAX_PATH];
+    DWORD len = GetModuleFileNameW(NULL, exePath, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) {
+        print_error(L"GetModuleFileNameW failed", GetLastError());
+        return FALSE;
+    }
+
+    HANDLE hChild = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), hProcess, GetCurrentProcess(), &hChild,
+                         SYNCHRONIZE | PROCESS_QUERY_INFORMATION | PROCESS_VM_READ,
+                         TRUE, 0)) {
+        print_error(L"DuplicateHandle failed", GetLastError());
+        return FALSE;
+    }
+
+    WCHAR handleArg[24];
+    _snwprintf(handleArg, 24, L"%llu", (unsigned long long)(ULONG_PTR)hChild);
+    handleArg[23] = L'\0';
+    wchar_t *args[] = { exePath, L"--supervise", handleArg,
+                        L"--status-file", (wchar_t *)opts->statusFile };
+    WCHAR *cmdLine = build_command_line(5, args);
+
+    SIZE_T attrSize = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attrSize);
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(attrSize);
+    BOOL ok = cmdLine && attrs &&
+              InitializeProcThreadAttributeList(attrs, 1, 0, &attrSize);
+    if (ok && !UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                         &hChild, sizeof(hChild), NULL, NULL)) {
+        DeleteProcThreadAttributeList(attrs);
+        ok = FALSE;
+    }
+
+    if (ok) {
+        STARTUPINFOEXW si;
+        ZeroMemory(&si, sizeof(si));
+        si.StartupInfo.cb      = sizeof(si);
+        si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;  /* all NULL */
+        si.lpAttributeList     = attrs;
+
+        PROCESS_INFORMATION pi;
+        DWORD flags = DETACHED_PROCESS | EXTENDED_STARTUPINFO_PRESENT;
+        /* Leave the caller's job if it may be killed with it; not every job allows it */
+        ok = CreateProcessW(NULL, cmdLine, NULL, NULL, TRUE,
+                            flags | CREATE_BREAKAWAY_FROM_JOB, NULL, NULL,
+                            &si.StartupInfo, &pi) ||
+             CreateProcessW(NULL, cmdLine, NULL, NULL, TRUE, flags, NULL, NULL,
+                            &si.StartupInfo, &pi);
+        if (ok) {
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+        } else {
+            print_error(L"failed to start the supervisor", GetLastError());
+        }
+        DeleteProcThreadAttributeList(attrs);
+    } else {
+        print_message(L"failed to prepare the supervisor");
+    }
+
+    free(attrs);
+    free(cmdLine);
+    CloseHandle(hChild);
+    return ok;
+}
+
+/* --supervise <handle>: wait for the detached child and record its result. */
+static int run_supervisor(const Options *opts)
+{
+    HANDLE hChild = opts->superviseHandle;
+    WaitForSingleObject(hChild, INFINITE);
+    BOOL ok = write_job_status(opts->statusFile, "exited", hChild, GetProcessId(hChild));
+    CloseHandle(hChild);
+    return ok ? EXIT_SUCCESS_CODE : EXIT_GENERAL_FAILURE;
+}
+
+/*
+ * --collect <path>: print the status record and return the child's exit
+ * code once it has exited, or EXIT_PENDING while it is still running.
+ */
+static int collect_status(const WCHAR *path)
+{
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        print_error(L"cannot open the status file", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+    char record[STATUS_RECORD_MAX + 1];
+    DWORD len = 0;
+    BOOL ok = ReadFile(hFile, record, STATUS_RECORD_MAX, &len, NULL);
+    CloseHandle(hFile);
+    if (!ok) {
+        print_error(L"cannot read the status file", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+    record[len] = '\0';
+
+    relay_write(GetStdHandle(STD_OUTPUT_HANDLE), record, len);
+    if (!strstr(record, "\"state\":\"exited\""))
+        return EXIT_PENDING;
+    const char *code = strstr(record, "\"exit_code\":");
+    return code ? (int)strtoul(code + 12, NULL, 10) : EXIT_GENERAL_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Launch a single command in a user context                                 */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Steps 6-8: build the command line, create the process and optionally wait.
+ *
+ * stdio selects where the child's standard handles go:
+ *   NULL      - CLI behaviour: with --wait the child's output is piped back
+ *               through this process, otherwise it gets its own console.
+ *   non-NULL  - the given inheritable handles are passed straight to the
+ *               child (used by the broker, which holds the client's handles).
+ *
+ * *pProcessId (optional) receives the child's PID and, without --wait,
+ * *phProcess (optional) its process handle, which the caller must close.
+ * Returns an EXIT_* code or, with --wait, the child's exit code.
+ */
+static int launch_command(const Options *opts, const UserContext *ctx,
+                          const HANDLE *stdio, DWORD *pProcessId, HANDLE *phProcess)
+{
+    int exitCode            = EXIT_GENERAL_FAILURE;
+    WCHAR *cmdLine          = NULL;
+
+    /* Pipe handles for stdout/stderr forwarding (used with --wait) */
+    HANDLE hStdoutRead      = NULL;
+    HANDLE hStdoutWrite     = NULL;
+    HANDLE hStderrRead      = NULL;
+    HANDLE hStderrWrite     = NULL;
+    HANDLE hStdinRead       = NULL;     /* --stdin: child end of the input pipe */
+    HANDLE hStdinWrite      = NULL;     /* parent end, until the relay owns it */
+    HANDLE hStdinThread     = NULL;
+    Redirects redir         = { NULL, NULL };
+    HANDLE hResult          = NULL;     /* --result-file */
+    JobGuard job            = { NULL, NULL, 0, FALSE, FALSE, NULL, NULL, NULL, NULL, NULL };
+    InheritList inherit     = { NULL, { NULL, NULL, NULL }, 0 };
+    RelayStream streams[2];             /* relayed stdout, stderr */
+    DWORD nStreams          = 0;
+
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&pi, sizeof(pi));
+    ZeroMemory(streams, sizeof(streams));
+
+    /* ---- Step 6: Build the command line string -------------------------- */
+
+    LONGLONG t = trace_now();
+    cmdLine = build_command_line(opts->cmdArgc, opts->cmdArgv);
+    if (!cmdLine) {
+        print_message(L"failed to allocate memory for command line");
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+    trace_phase(L"build_command_line", t);
+
+    /* ---- Step 7: Launch the process as the user ------------------------- */
+
+    if (!open_redirects(opts, &redir)) {
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+    if (opts->resultFile) {
+        if (!(hResult = open_redirect(opts->resultFile))) {
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        SetHandleInformation(hResult, HANDLE_FLAG_INHERIT, 0);  /* ours, not the child's */
+    }
+
+    /* Streams that are neither redirected nor owned by a broker client */
+    BOOL relayOut = opts->waitForChild && !stdio && !redir.hOutput;
+    BOOL relayErr = opts->waitForChild && !stdio && !redir.hError;
+
+    /*
+     * --stdin: a pipe or file stdin is inherited by the child directly, like
+     * --stdout; only a console (which cannot cross sessions) is relayed.
+     */
+    HANDLE hStdin = opts->forwardStdin && !stdio ? GetStdHandle(STD_INPUT_HANDLE) : NULL;
+    BOOL relayIn = FALSE;
+    if (hStdin == INVALID_HANDLE_VALUE) {
+        hStdin = NULL;
+    } else if (hStdin) {
+        DWORD type = GetFileType(hStdin);
+        relayIn = type != FILE_TYPE_DISK && type != FILE_TYPE_PIPE;
+        if (!relayIn)
+            SetHandleInformation(hStdin, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+
+    STARTUPINFOEXW si;
+    ZeroMemory(&si, sizeof(si));
+    si.StartupInfo.lpDesktop = child_desktop(opts);
+
+    DWORD creationFlags = CREATE_UNICODE_ENVIRONMENT;
+
+    if (stdio || opts->waitForChild || redir.hOutput || redir.hError || opts->background) {
+        /*
+         * When --wait is used, we pipe the child's stdout/stderr back through
+         * this process so the caller (e.g., a Node.js service) can capture
+         * the output. --stdout/--stderr instead hand the target straight to
+         * the child, and a broker passes its client's own handles, so those
+         * streams need no relay at all. With --background, the rest are null.
+         *
+         * Without any of these, we give the child its own console
+         * (CREATE_NEW_CONSOLE) so interactive/GUI programs work normally.
+         */
+        if (relayOut &&
+            !create_pipe_pair(&hStdoutRead, &hStdoutWrite, opts->pipeBufferSize, FALSE)) {
+            print_error(L"failed to create stdout pipe", GetLastError());
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        if (relayErr &&
+            !create_pipe_pair(&hStderrRead, &hStderrWrite, opts->pipeBufferSize, FALSE)) {
+            print_error(L"failed to create stderr pipe", GetLastError());
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+        if (relayIn &&
+            !create_pipe_pair(&hStdinWrite, &hStdinRead, opts->pipeBufferSize, TRUE)) {
+            print_error(L"failed to create stdin pipe", GetLastError());
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+
+        si.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+        /* The CLI child gets no stdin unless --stdin asks for the caller's */
+        si.StartupInfo.hStdInput  = stdio ? stdio[0] : relayIn ? hStdinRead : hStdin;
+        si.StartupInfo.hStdOutput = redir.hOutput ? redir.hOutput
+                                  : relayOut ? hStdoutWrite : stdio ? stdio[1] : NULL;
+        si.StartupInfo.hStdError  = redir.hError ? redir.hError
+                                  : relayErr ? hStderrWrite : stdio ? stdio[2] : NULL;
+
+        creationFlags |= child_console_flags(opts);    /* No visible console window */
+    } else {
+        creationFlags |= CREATE_NEW_CONSOLE;
+    }
+
+    /* The relay's buffers, before there is a child to block on a pipe without them */
+    if (relayOut) {
+        streams[nStreams].hPipe   = hStdoutRead;
+        streams[nStreams].hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        streams[nStreams].bufferSize = opts->pipeBufferSize;
+        streams[nStreams].limit   = opts->maxOutput;
+        streams[nStreams].keep    = opts->keepPolicy;
+        nStreams++;
+    }
+    if (relayErr) {
+        streams[nStreams].hPipe   = hStderrRead;
+        streams[nStreams].hOutput = GetStdHandle(STD_ERROR_HANDLE);
+        streams[nStreams].bufferSize = opts->pipeBufferSize;
+        streams[nStreams].limit   = opts->maxOutput;
+        streams[nStreams].keep    = opts->keepPolicy;
+        nStreams++;
+    }
+    if (!relay_prepare(streams, nStreams)) {
+        print_message(L"failed to allocate the output relay");
+        nStreams = 0;
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+
+    if (!job_guard_create(opts, &job)) {
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+    creationFlags |= child_creation_flags(opts, &job);
+
+    /* Only the handles chosen above, not those of concurrent launches */
+    if (!inherit_list_init(&inherit, &si)) {
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+    creationFlags |= inherit_list_flags(&inherit);
+
+    if (opts->detach && !write_job_status(opts->statusFile, "starting", NULL, 0)) {
+        exitCode = EXIT_GENERAL_FAILURE;
+        goto cleanup;
+    }
+
+    t = trace_now();
+    if (!CreateProcessAsUserW(
+            ctx->hToken,
+            NULL,                                   /* lpApplicationName */
+            cmdLine,                                /* lpCommandLine (mutable) */
+            NULL,                                   /* lpProcessAttributes */
+            NULL,                                   /* lpThreadAttributes */
+            inherit.count > 0,                      /* bInheritHandles */
+            creationFlags,
+            ctx->lpEnvironment,
+            ctx->profileDir[0] ? ctx->profileDir : NULL, /* lpCurrentDirectory */
+            &si.StartupInfo,
+            &pi))
+    {
+        DWORD err = GetLastError();
+        print_error(L"CreateProcessAsUserW failed", err);
+        if (err == ERROR_PRIVILEGE_NOT_HELD) {
+            print_message(L"hint: ensure this tool is running as SYSTEM with "
+                          L"SE_ASSIGNPRIMARYTOKEN_NAME and SE_INCREASE_QUOTA_NAME privileges");
+        }
+        exitCode = EXIT_PROCESS_FAILURE;
+        goto cleanup;
+    }
+
+    trace_phase(L"CreateProcessAsUserW", t);
+    LONGLONG tCreated = trace_now();
+
+    if (!start_child(opts, &job, &pi)) {
+        exitCode = EXIT_PROCESS_FAILURE;
+        goto cleanup;
+    }
+
+    fwprintf(stderr, L"runasuser: process created (PID %lu)\n",
+             (unsigned long)pi.dwProcessId);
+    if (pProcessId)
+        *pProcessId = pi.dwProcessId;
+
+    if (opts->detach) {
+        /* The child has its copies; keep them out of the supervisor */
+        close_redirects(&redir);
+        if (!write_job_status(opts->statusFile, "running", pi.hProcess, pi.dwProcessId) ||
+            !start_supervisor(opts, pi.hProcess)) {
+            print_message(L"the process runs, but its status will not be recorded");
+            exitCode = EXIT_GENERAL_FAILURE;
+            goto cleanup;
+        }
+    }
+
+    if (relayIn) {
+        CloseHandle(hStdinRead);    /* the child has its own copy */
+        hStdinRead = NULL;
+        StdinRelay *relay = (StdinRelay *)malloc(sizeof(*relay));
+        if (relay) {
+            relay->hInput     = hStdin;
+            relay->hPipe      = hStdinWrite;
+            relay->bufferSize = opts->pipeBufferSize;
+            hStdinThread = CreateThread(NULL, 0, stdin_relay_thread, relay, 0, NULL);
+            if (hStdinThread)
+                hStdinWrite = NULL;
+            else
+                free(relay);
+        }
+        if (!hStdinThread)
+            print_error(L"failed to start the stdin relay", GetLastError());
+    }
+
+    /* ---- Step 8: Optionally wait for the child process ------------------ */
+
+    if (opts->waitForChild) {
+        /* --wait=process|tree: stop relaying when this is signalled */
+        HANDLE hStop = opts->waitMode == WAIT_PIPES ? NULL : pi.hProcess;
+        if (opts->waitMode == WAIT_TREE) {
+            if (job.hTreeDone)
+                hStop = job.hTreeDone;
+            else
+                print_message(L"warning: --wait=tree needs a job of its own for the "
+                              L"command (Windows 8 or later); waiting for the process");
+        }
+
+        if (relayOut || relayErr) {
+            /*
+             * Close the write ends of the pipes in the parent process.
+             * This is critical: the child holds the only remaining handles to
+             * the write ends, so when it exits, the relay's reads fail with
+             * ERROR_BROKEN_PIPE and the relay returns.
+             */
+            if (hStdoutWrite) { CloseHandle(hStdoutWrite); hStdoutWrite = NULL; }
+            if (hStderrWrite) { CloseHandle(hStderrWrite); hStderrWrite = NULL; }
+
+            /*
+             * Drain the relayed streams concurrently on this thread with
+             * overlapped reads. Every stream always has a read pending, so
+             * a child writing to both can never deadlock on a full pipe.
+             */
+            relay_streams(streams, nStreams, hStop);
+        }
+
+        /* Wait for the child process (with --wait=tree, its whole tree) to exit */
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        trace_phase(L"child_exit", tCreated);
+        if (job.hTreeDone) {
+            WaitForSingleObject(job.hTreeDone, INFINITE);
+            trace_phase(L"tree_exit", tCreated);
+        }
+
+        DWORD childExitCode = 1;
+        if (job.timedOut) {
+            fwprintf(stderr, L"runasuser: timed out after %lu s; process tree terminated\n",
+                     (unsigned long)(opts->timeoutMs / 1000));
+            exitCode = EXIT_TIMEOUT;
+        } else if (GetExitCodeProcess(pi.hProcess, &childExitCode)) {
+            exitCode = (int)childExitCode;
+        } else {
+            print_error(L"GetExitCodeProcess failed", GetLastError());
+            exitCode = EXIT_GENERAL_FAILURE;
+        }
+
+        /* A broker request's record goes to its client's stderr */
+        if (opts->rusage)
+            write_result(hResult ? hResult
+                                 : stdio ? stdio[2] : GetStdHandle(STD_ERROR_HANDLE),
+                         ctx, pi.hProcess, pi.dwProcessId, exitCode);
+    } else {
+        exitCode = EXIT_SUCCESS_CODE;
+        if (phProcess) {
+            *phProcess = pi.hProcess;
+            pi.hProcess = NULL;
+        }
+    }
+
+    /* ---- Cleanup -------------------------------------------------------- */
+
+cleanup:
+    if (hStdinThread) {
+        /* The child is gone or never waited for: stop a pending stdin read */
+        CancelSynchronousIo(hStdinThread);
+        CloseHandle(hStdinThread);
+    }
+    if (hStdinWrite)
+        CloseHandle(hStdinWrite);
+    if (hStdinRead)
+        CloseHandle(hStdinRead);
+    job_guard_close(&job);
+    inherit_list_free(&inherit);
+    relay_release(streams, nStreams);
+    close_redirects(&redir);
+    if (hResult)
+        CloseHandle(hResult);
+    if (hStdoutRead)
+        CloseHandle(hStdoutRead);
+    if (hStdoutWrite)
+        CloseHandle(hStdoutWrite);
+    if (hStderrRead)
+        CloseHandle(hStderrRead);
+    if (hStderrWrite)
+        CloseHandle(hStderrWrite);
+    if (pi.hThread)
+        CloseHandle(pi.hThread);
+    if (pi.hProcess)
+        CloseHandle(pi.hProcess);
+    if (cmdLine)
+        free(cmdLine);
+
+    return exitCode;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Fan-out to every logged-in session (--all-sessions)                       */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * One launch target. Each runs on its own worker thread, so the token,
+ * environment block and profile lookups of all sessions overlap and the
+ * whole fan-out costs about one launch.
+ */
+typedef struct {
+    const Options *opts;
+    DWORD          sessionId;
+    const WCHAR   *userName;        /* from the enumeration, stays valid */
+    HANDLE         hOutput;         /* NULL: new console (no --wait) */
+    HANDLE         hError;
+    int            exitCode;        /* launch result */
+    HANDLE         hProcess;
+    DWORD          processId;
+    JobGuard       job;             /* limits of this session's tree */
+} FanoutTarget;
+
+static DWORD WINAPI fanout_launch_thread(LPVOID lpParam)
+{
+    FanoutTarget *t = (FanoutTarget *)lpParam;
+    UserContext *ctx = NULL;
+
+    Options opts = *t->opts;
+    opts.sessionSpecified = TRUE;
+    opts.targetSessionId  = t->sessionId;
+
+    t->exitCode = acquire_user_context(&opts, &ctx);
+    if (t->exitCode != EXIT_SUCCESS_CODE)
+        return 0;
+
+    WCHAR *cmdLine = build_command_line(opts.cmdArgc, opts.cmdArgv);
+    if (!cmdLine) {
+        print_message(L"failed to allocate memory for command line");
+        t->exitCode = EXIT_GENERAL_FAILURE;
+        release_user_context(ctx);
+        return 0;
+    }
+
+    STARTUPINFOEXW si;
+    ZeroMemory(&si, sizeof(si));
+    si.StartupInfo.lpDesktop = child_desktop(&opts);
+
+    DWORD creationFlags = CREATE_UNICODE_ENVIRONMENT | CREATE_NEW_CONSOLE;
+    if (t->hOutput || opts.background) {
+        si.StartupInfo.dwFlags    = STARTF_USESTDHANDLES;
+        si.StartupInfo.hStdOutput = t->hOutput;
+        si.StartupInfo.hStdError  = t->hError;
+        creationFlags = CREATE_UNICODE_ENVIRONMENT | child_console_flags(&opts);
+    }
+
+    InheritList inherit;
+    if (!inherit_list_init(&inherit, &si) || !job_guard_create(&opts, &t->job)) {
+        t->exitCode = EXIT_GENERAL_FAILURE;
+        inherit_list_free(&inherit);
+        free(cmdLine);
+        release_user_context(ctx);
+        return 0;
+    }
+    creationFlags |= child_creation_flags(&opts, &t->job) | inherit_list_flags(&inherit);
+
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&pi, sizeof(pi));
+
+    LONGLONG tCreate = trace_now();
+    BOOL created = CreateProcessAsUserW(
+        ctx->hToken, NULL, cmdLine, NULL, NULL, inherit.count > 0,
+        creationFlags, ctx->lpEnvironment,
+        ctx->profileDir[0] ? ctx->profileDir : NULL, &si.StartupInfo, &pi);
+    DWORD err = GetLastError();
+    trace_phase(L"CreateProcessAsUserW", tCreate);
+    inherit_list_free(&inherit);
+    free(cmdLine);
+    release_user_context(ctx);
+
+    if (!created) {
+        WCHAR msg[80];
+        _snwprintf(msg, 80, L"session %lu: CreateProcessAsUserW failed",
+                   (unsigned long)t->sessionId);
+        msg[79] = L'\0';
+        print_error(msg, err);
+        t->exitCode = EXIT_PROCESS_FAILURE;
+        return 0;
+    }
+
+    if (!start_child(&opts, &t->job, &pi)) {
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+        t->exitCode = EXIT_PROCESS_FAILURE;
+        return 0;
+    }
+
+    CloseHandle(pi.hThread);
+    t->hProcess  = pi.hProcess;
+    t->processId = pi.dwProcessId;
+    return 0;
+}
+
+/*
+ * Launch the command in every session that has a logged-in user (console,
+ * RDP or disconnected), from one enumeration, all at once. With --wait,
+ * children write straight to this process's stdout/stderr (no relay, as
+ * with --batch) and each session's exit code is reported as it finishes:
+ *
+ *   runasuser: session <id> (user: <name>) exit <code> (PID <pid>)
+ */
+static int run_all_sessions(const Options *opts)
+{
+    WTS_SESSION_INFO_1W *pSessions = NULL;
+    DWORD count = 0, level = 1;
+    DWORD consoleSessionId = WTSGetActiveConsoleSessionId();
+
+    LONGLONG t = trace_now();
+    if (!WTSEnumerateSessionsExW(WTS_CURRENT_SERVER_HANDLE, &level, 0,
+                                 &pSessions, &count)) {
+        print_error(L"WTSEnumerateSessionsExW failed", GetLastError());
+        return EXIT_NO_SESSION;
+    }
+    trace_phase(L"WTSEnumerateSessionsExW", t);
+
+    Redirects redir;
+    FanoutTarget *targets = (FanoutTarget *)calloc(count ? count : 1, sizeof(*targets));
+    if (!targets || !open_redirects(opts, &redir)) {
+        if (!targets)
+            print_message(L"failed to allocate memory for session list");
+        free(targets);
+        WTSFreeMemoryExW(WTSTypeSessionInfoLevel1, pSessions, count);
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    /* Same handle rules as a single launch: --wait or redirection inherits */
+    HANDLE hOut = NULL, hErr = NULL;
+    if (opts->waitForChild || redir.hOutput || redir.hError) {
+        hOut = redir.hOutput ? redir.hOutput : GetStdHandle(STD_OUTPUT_HANDLE);
+        hErr = redir.hError ? redir.hError : GetStdHandle(STD_ERROR_HANDLE);
+        SetHandleInformation(hOut, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        SetHandleInformation(hErr, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+
+    DWORD nTargets = 0;
+    for (DWORD i = 0; i < count; i++) {
+        if (session_rank(&pSessions[i], consoleSessionId) < 0)
+            continue;
+        FanoutTarget *ft = &targets[nTargets++];
+        ft->opts      = opts;
+        ft->sessionId = pSessions[i].SessionId;
+        ft->userName  = pSessions[i].pUserName;
+        ft->hOutput   = hOut;
+        ft->hError    = hErr;
+        ft->exitCode  = EXIT_GENERAL_FAILURE;
+    }
+
+    if (nTargets == 0) {
+        print_message(L"no logged-in user sessions found");
+        close_redirects(&redir);
+        free(targets);
+        WTSFreeMemoryExW(WTSTypeSessionInfoLevel1, pSessions, count);
+        return EXIT_NO_SESSION;
+    }
+
+    /* ---- Launch: one worker per session, MAXIMUM_WAIT_OBJECTS at a time -- */
+
+    for (DWORD base = 0; base < nTargets; base += MAXIMUM_WAIT_OBJECTS) {
+        HANDLE hThreads[MAXIMUM_WAIT_OBJECTS];
+        DWORD nThreads = 0;
+        for (DWORD i = base; i < nTargets && i < base + MAXIMUM_WAIT_OBJECTS; i++) {
+            HANDLE h = CreateThread(NULL, 0, fanout_launch_thread, &targets[i], 0, NULL);
+            if (h)
+                hThreads[nThreads++] = h;
+            else
+                fanout_launch_thread(&targets[i]);  /* run it inline instead */
+        }
+        if (nThreads > 0)
+            WaitForMultipleObjects(nThreads, hThreads, TRUE, INFINITE);
+        for (DWORD i = 0; i < nThreads; i++)
+            CloseHandle(hThreads[i]);
+    }
+
+    /* ---- Collect results ------------------------------------------------ */
+
+    DWORD failed = 0;
+    HANDLE hProcs[MAXIMUM_WAIT_OBJECTS];
+    DWORD  slot[MAXIMUM_WAIT_OBJECTS];
+
+    for (DWORD base = 0; base < nTargets; base += MAXIMUM_WAIT_OBJECTS) {
+        DWORD running = 0;
+        for (DWORD i = base; i < nTargets && i < base + MAXIMUM_WAIT_OBJECTS; i++) {
+            FanoutTarget *ft = &targets[i];
+            if (!ft->hProcess) {
+                fwprintf(stderr, L"runasuser: session %lu (user: %ls) launch failed (exit %d)\n",
+                         (unsigned long)ft->sessionId, ft->userName, ft->exitCode);
+                failed++;
+            } else if (!opts->waitForChild) {
+                fwprintf(stderr, L"runasuser: session %lu (user: %ls) PID %lu\n",
+                         (unsigned long)ft->sessionId, ft->userName,
+                         (unsigned long)ft->processId);
+                CloseHandle(ft->hProcess);
+            } else {
+                hProcs[running] = ft->hProcess;
+                slot[running]   = i;
+                running++;
+            }
+        }
+
+        /* Report each session as its process exits; keep the array dense */
+        while (running > 0) {
+            DWORD w = WaitForMultipleObjects(running, hProcs, FALSE, INFINITE);
+            if (w >= WAIT_OBJECT_0 + running) {
+                print_error(L"WaitForMultipleObjects failed", GetLastError());
+                for (DWORD s = 0; s < running; s++)
+                    CloseHandle(hProcs[s]);
+                failed += running;
+                break;
+            }
+
+            DWORD s = w - WAIT_OBJECT_0;
+            FanoutTarget *ft = &targets[slot[s]];
+            DWORD childExitCode = 1;
+            if (ft->job.timedOut)
+                childExitCode = EXIT_TIMEOUT;
+            else if (!GetExitCodeProcess(hProcs[s], &childExitCode))
+                childExitCode = EXIT_GENERAL_FAILURE;
+            fwprintf(stderr, L"runasuser: session %lu (user: %ls) %ls %lu (PID %lu)\n",
+                     (unsigned long)ft->sessionId, ft->userName,
+                     ft->job.timedOut ? L"timed out, exit" : L"exit",
+                     (unsigned long)childExitCode, (unsigned long)ft->processId);
+            if (childExitCode != 0)
+                failed++;
+
+            CloseHandle(hProcs[s]);
+            running--;
+            hProcs[s] = hProcs[running];
+            slot[s]   = slot[running];
+        }
+    }
+    if (opts->waitForChild)
+        trace_phase(L"child_exit", t);
+
+    fwprintf(stderr, L"runasuser: all sessions complete: %lu sessions, %lu failed\n",
+             (unsigned long)nTargets, (unsigned long)failed);
+
+    /* Without --wait the limits stay on: closing the job does not end it */
+    for (DWORD i = 0; i < nTargets; i++)
+        job_guard_close(&targets[i].job);
+    close_redirects(&redir);
+    free(targets);
+    WTSFreeMemoryExW(WTSTypeSessionInfoLevel1, pSessions, count);
+    return failed ? EXIT_BATCH_FAILURE : EXIT_SUCCESS_CODE;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Batch execution                                                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Run every manifest entry as the user, with at most maxJobs children alive
+ * at once, all sharing one primary token and environment block. Children
+ * write straight to stdio[1]/stdio[2], or this process's stdout/stderr when
+ * stdio is NULL (no relay), and each result is reported on stderr as it
+ * completes:
+ *
+ *   runasuser: [<index>] exit <code> (PID <pid>): <command>
+ *
+ * Limits (--timeout, --max-memory, --cpu-rate) apply to each command's own
+ * process tree, each in its own job.
+ */
+static int run_batch(const BatchManifest *m, const Options *opts,
+                     const UserContext *ctx, const HANDLE *stdio)
+{
+    DWORD  maxJobs = opts->batchJobs;
+    HANDLE hProcs[MAXIMUM_WAIT_OBJECTS];
+    DWORD  procIds[MAXIMUM_WAIT_OBJECTS];
+    DWORD  slotCmd[MAXIMUM_WAIT_OBJECTS];
+    JobGuard *slotJob[MAXIMUM_WAIT_OBJECTS];  /* heap: the timer holds it */
+    DWORD  running = 0, next = 0, failed = 0;
+
+    Redirects redir;
+    if (!open_redirects(opts, &redir))
+        return EXIT_GENERAL_FAILURE;
+
+    HANDLE hOut = redir.hOutput ? redir.hOutput
+                : stdio ? stdio[1] : GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE hErr = redir.hError ? redir.hError
+                : stdio ? stdio[2] : GetStdHandle(STD_ERROR_HANDLE);
+
+    /* Best effort: consoles cannot be shared across sessions, pipes/files can */
+    if (!stdio) {
+        SetHandleInformation(hOut, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        SetHandleInformation(hErr, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+
+    while (next < m->count || running > 0) {
+        /* Fill free slots */
+        while (next < m->count && running < maxJobs && !g_cancel.cancelled) {
+            const BatchCommand *cmd = &m->cmds[next];
+            WCHAR *cmdLine = build_command_line(cmd->argc, cmd->argv);
+            if (!cmdLine) {
+                print_message(L"failed to allocate memory for command line");
+                failed++;
+                next++;
+                continue;
+            }
+
+            STARTUPINFOEXW si;
+            ZeroMemory(&si, sizeof(si));
+            si.StartupInfo.lpDesktop  = child_desktop(opts);
+            si.StartupInfo.dwFlags    = STARTF_USESTDHANDLES;
+            si.StartupInfo.hStdInput  = NULL;
+            si.StartupInfo.hStdOutput = hOut;
+            si.StartupInfo.hStdError  = hErr;
+
+            PROCESS_INFORMATION pi;
+            ZeroMemory(&pi, sizeof(pi));
+
+            InheritList inherit;
+            JobGuard *job = (JobGuard *)malloc(sizeof(JobGuard));
+            if (!job || !job_guard_create(opts, job) ||
+                !inherit_list_init(&inherit, &si)) {
+                if (!job)
+                    print_message(L"failed to allocate memory for job");
+                else
+                    job_guard_close(job);
+                free(job);
+                free(cmdLine);
+                failed++;
+                next++;
+                continue;
+            }
+
+            BOOL created = CreateProcessAsUserW(
+                ctx->hToken, NULL, cmdLine, NULL, NULL, inherit.count > 0,
+                CREATE_UNICODE_ENVIRONMENT | child_console_flags(opts) |
+                    child_creation_flags(opts, job) | inherit_list_flags(&inherit),
+                ctx->lpEnvironment,
+                ctx->profileDir[0] ? ctx->profileDir : NULL, &si.StartupInfo, &pi);
+            DWORD err = GetLastError();
+            inherit_list_free(&inherit);
+            free(cmdLine);
+
+            if (!created) {
+                WCHAR msg[64];
+                _snwprintf(msg, 64, L"[%lu] CreateProcessAsUserW failed",
+                           (unsigned long)next);
+                msg[63] = L'\0';
+                print_error(msg, err);
+                job_guard_close(job);
+                free(job);
+                failed++;
+                next++;
+                continue;
+            }
+
+            if (!start_child(opts, job, &pi)) {
+                CloseHandle(pi.hThread);
+                CloseHandle(pi.hProcess);
+                job_guard_close(job);
+                free(job);
+                failed++;
+                next++;
+                continue;
+            }
+
+            CloseHandle(pi.hThread);
+            hProcs[running]  = pi.hProcess;
+            procIds[running] = pi.dwProcessId;
+            slotCmd[running] = next;
+            slotJob[running] = job;
+            running++;
+            next++;
+        }
+
+        if (running == 0)
+            break;
+
+        /* Reap whichever child finishes first */
+        DWORD w = WaitForMultipleObjects(running, hProcs, FALSE, INFINITE);
+        if (w >= WAIT_OBJECT_0 + running) {
+            print_error(L"WaitForMultipleObjects failed", GetLastError());
+            for (DWORD s = 0; s < running; s++) {
+                CloseHandle(hProcs[s]);
+                job_guard_close(slotJob[s]);
+                free(slotJob[s]);
+            }
+            close_redirects(&redir);
+            return EXIT_GENERAL_FAILURE;
+        }
+
+        DWORD s = w - WAIT_OBJECT_0;
+        DWORD childExitCode = 1;
+        if (slotJob[s]->timedOut)
+            childExitCode = EXIT_TIMEOUT;
+        else if (!GetExitCodeProcess(hProcs[s], &childExitCode))
+            childExitCode = EXIT_GENERAL_FAILURE;
+        fwprintf(stderr, L"runasuser: [%lu] %ls %lu (PID %lu): %ls\n",
+                 (unsigned long)slotCmd[s],
+                 slotJob[s]->timedOut ? L"timed out, exit" : L"exit",
+                 (unsigned long)childExitCode,
+                 (unsigned long)procIds[s], m->cmds[slotCmd[s]].argv[0]);
+        if (childExitCode != 0)
+            failed++;
+
+        /* Keep the wait array dense: move the last entry into the hole */
+        CloseHandle(hProcs[s]);
+        job_guard_close(slotJob[s]);
+        free(slotJob[s]);
+        running--;
+        hProcs[s]  = hProcs[running];
+        procIds[s] = procIds[running];
+        slotCmd[s] = slotCmd[running];
+        slotJob[s] = slotJob[running];
+    }
+
+    if (next < m->count) {
+        fwprintf(stderr, L"runasuser: batch cancelled: %lu commands not started\n",
+                 (unsigned long)(m->count - next));
+        failed += m->count - next;
+    }
+
+    fwprintf(stderr, L"runasuser: batch complete: %lu commands, %lu failed\n",
+             (unsigned long)m->count, (unsigned long)failed);
+
+    close_redirects(&redir);
+
+    return failed ? EXIT_BATCH_FAILURE : EXIT_SUCCESS_CODE;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Broker: resident launch service on a named pipe                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The broker (--broker) keeps the console session's user context (token,
+ * environment block, profile directory) cached between launches, so each
+ * request costs one pipe round trip plus CreateProcessAsUserW instead of
+ * the whole discovery pipeline. Session logon/logoff/connect/disconnect
+ * events bump g_sessionGeneration, which makes the next request rebuild the
+ * cache. Requests naming an explicit --session always build a fresh context.
+ *
+ * The pipe's DACL admits only SYSTEM, and the first instance is created
+ * with FILE_FLAG_FIRST_PIPE_INSTANCE so the name cannot be squatted.
+ *
+ * Wire format (byte-mode pipe, same machine):
+ *   client -> broker:  BrokerRequest, then argBytes of NUL-terminated
+ *                      UTF-16 arguments (the CLI argv without argv[0])
+ *   broker -> client:  BrokerReply
+ *
+ * With --wait (and --batch) the child receives the client's own standard
+ * handles, duplicated out of the client process, so output goes straight to
+ * the client without relay. Without --wait the child gets its own console,
+ * exactly as with a direct launch.
+ */
+#define BROKER_MAGIC            0x42554152  /* "RAUB" */
+#define BROKER_VERSION          1
+#define BROKER_MAX_ARG_BYTES    (1024 * 1024)
+#define BROKER_MAX_ARGS         32768
+
+typedef struct {
+    DWORD     magic;
+    DWORD     version;
+    DWORD     argc;
+    DWORD     argBytes;
+    ULONGLONG hStd[3];              /* client's stdin/stdout/stderr values */
+} BrokerRequest;
+
+typedef struct {
+    DWORD exitCode;
+    DWORD processId;                /* 0 if no process was created */
+} BrokerReply;
+
+static CRITICAL_SECTION       g_cacheLock;
+static UserContext           *g_cachedContext;
+static volatile LONG          g_sessionGeneration;
+static volatile LONG          g_cacheDisabled;
+static volatile LONG          g_brokerStopping;
+static const WCHAR           *g_brokerPipeName;
+static SERVICE_STATUS_HANDLE  g_serviceStatusHandle;
+static SERVICE_STATUS         g_serviceStatus;
+
+/*
+ * Pipe I/O that also works on overlapped handles (the session helper's):
+ * with no event, GetOverlappedResult waits on the handle itself, which is
+ * safe while this is the only operation on it.
+ */
+static BOOL read_exact(HANDLE h, void *buf, DWORD len)
+{
+    BYTE *p = (BYTE *)buf;
+    while (len > 0) {
+        OVERLAPPED ov;
+        DWORD n = 0;
+        ZeroMemory(&ov, sizeof(ov));
+        if (!ReadFile(h, p, len, &n, &ov) &&
+            (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(h, &ov, &n, TRUE)))
+            return FALSE;
+        if (n == 0)
+            return FALSE;
+        p += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static BOOL write_exact(HANDLE h, const void *buf, DWORD len)
+{
+    const BYTE *p = (const BYTE *)buf;
+    while (len > 0) {
+        OVERLAPPED ov;
+        DWORD n = 0;
+        ZeroMemory(&ov, sizeof(ov));
+        if (!WriteFile(h, p, len, &n, &ov) &&
+            (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(h, &ov, &n, TRUE)))
+            return FALSE;
+        if (n == 0)
+            return FALSE;
+        p += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+/*
+ * Read one request (see the wire format above). Returns EXIT_SUCCESS_CODE
+ * with the arguments in an argv with a dummy argv[0] (*pArgc entries plus
+ * a NULL); *pArgBuf and *pArgv are the caller's to free even on failure.
+ */
+static int receive_request(HANDLE hPipe, const WCHAR *who, BrokerRequest *req,
+                           WCHAR **pArgBuf, WCHAR ***pArgv, DWORD *pArgc)
+{
+    *pArgBuf = NULL;
+    *pArgv   = NULL;
+
+    if (!read_exact(hPipe, req, sizeof(*req)) ||
+        req->magic != BROKER_MAGIC || req->version != BROKER_VERSION ||
+        req->argc == 0 || req->argc > BROKER_MAX_ARGS ||
+        req->argBytes > BROKER_MAX_ARG_BYTES ||
+        req->argBytes % sizeof(WCHAR) != 0) {
+        fwprintf(stderr, L"runasuser: %ls: malformed request\n", who);
+        return EXIT_USAGE_ERROR;
+    }
+
+    /* Arguments arrive NUL-terminated; rebuild an argv with a dummy argv[0] */
+    WCHAR *argBuf = *pArgBuf = (WCHAR *)malloc(req->argBytes + sizeof(WCHAR));
+    WCHAR **argv  = *pArgv   = (WCHAR **)calloc((size_t)req->argc + 2, sizeof(WCHAR *));
+    if (!argBuf || !argv || !read_exact(hPipe, argBuf, req->argBytes))
+        return EXIT_GENERAL_FAILURE;
+    argBuf[req->argBytes / sizeof(WCHAR)] = L'\0';
+
+    DWORD n = 0;
+    argv[n++] = L"runasuser";
+    for (WCHAR *p = argBuf, *end = argBuf + req->argBytes / sizeof(WCHAR);
+         p < end && n <= req->argc; p += wcslen(p) + 1)
+        argv[n++] = p;
+    if (n != req->argc + 1) {
+        fwprintf(stderr, L"runasuser: %ls: malformed request arguments\n", who);
+        return EXIT_USAGE_ERROR;
+    }
+
+    *pArgc = n;
+    return EXIT_SUCCESS_CODE;
+}
+
+/*
+ * Return a referenced user context for a broker request: the cached
+ * console-session context while it is current, otherwise a freshly built one.
+ * The cached context carries a full environment block, so --env=minimal
+ * and --env NAME=value requests build their own.
+ */
+static int get_broker_context(const Options *opts, UserContext **pCtx)
+{
+    if (opts->sessionSpecified || opts->targetUser || g_cacheDisabled ||
+        opts->envMode == ENV_MINIMAL || opts->envSetCount || opts->envAllowCount)
+        return acquire_user_context(opts, pCtx);
+
+    EnterCriticalSection(&g_cacheLock);
+
+    LONG generation = g_sessionGeneration;
+    if (g_cachedContext && g_cachedContext->generation != generation) {
+        release_user_context(g_cachedContext);
+        g_cachedContext = NULL;
+    }
+
+    int exitCode = EXIT_SUCCESS_CODE;
+    if (!g_cachedContext) {
+        exitCode = acquire_user_context(opts, &g_cachedContext);
+        if (exitCode == EXIT_SUCCESS_CODE)
+            g_cachedContext->generation = generation;
+    }
+    if (exitCode == EXIT_SUCCESS_CODE) {
+        InterlockedIncrement(&g_cachedContext->refCount);
+        *pCtx = g_cachedContext;
+    }
+
+    LeaveCriticalSection(&g_cacheLock);
+    return exitCode;
+}
+
+/* Serve one connected client: parse, launch with its handles, reply. */
+static DWORD WINAPI broker_client_thread(LPVOID lpParam)
+{
+    HANDLE hPipe        = (HANDLE)lpParam;
+    HANDLE hClient      = NULL;
+    HANDLE stdio[3]     = { NULL, NULL, NULL };
+    WCHAR *argBuf       = NULL;
+    WCHAR **argv        = NULL;
+    UserContext *ctx    = NULL;
+    BatchManifest manifest = { NULL, 0, 0 };
+    BrokerReply reply   = { EXIT_GENERAL_FAILURE, 0 };
+    BrokerRequest req;
+    Options opts;
+
+    DWORD n = 0;
+    int rc = receive_request(hPipe, L"broker", &req, &argBuf, &argv, &n);
+    if (rc != EXIT_SUCCESS_CODE) {
+        reply.exitCode = (DWORD)rc;
+        goto reply;
+    }
+
+    rc = parse_options((int)n, argv, &opts);
+    if (rc >= 0 || opts.runBroker || opts.viaBroker || opts.detach ||
+        opts.collectPath || opts.superviseHandle || opts.helperServe) {
+        reply.exitCode = rc >= 0 ? (DWORD)rc : EXIT_USAGE_ERROR;
+        goto reply;
+    }
+
+    /* Take the client's standard handles out of the client process */
+    DWORD clientPid = 0;
+    if (!GetNamedPipeClientProcessId(hPipe, &clientPid) ||
+        !(hClient = OpenProcess(PROCESS_DUP_HANDLE, FALSE, clientPid))) {
+        print_error(L"broker: cannot open client process", GetLastError());
+        goto reply;
+    }
+    for (int s = 0; s < 3; s++) {
+        HANDLE h = (HANDLE)(ULONG_PTR)req.hStd[s];
+        if (h && h != INVALID_HANDLE_VALUE &&
+            !DuplicateHandle(hClient, h, GetCurrentProcess(), &stdio[s],
+                             0, TRUE, DUPLICATE_SAME_ACCESS))
+            stdio[s] = NULL;
+    }
+
+    if (opts.batchPath && !load_manifest(opts.batchPath, stdio[0], &manifest)) {
+        reply.exitCode = EXIT_USAGE_ERROR;
+        goto reply;
+    }
+
+    rc = get_broker_context(&opts, &ctx);
+    if (rc != EXIT_SUCCESS_CODE) {
+        reply.exitCode = (DWORD)rc;
+        goto reply;
+    }
+
+    if (opts.batchPath)
+        reply.exitCode = (DWORD)run_batch(&manifest, &opts, ctx, stdio);
+    else
+        reply.exitCode = (DWORD)launch_command(&opts, ctx,
+                                               opts.waitForChild ? stdio : NULL,
+                                               &reply.processId, NULL);
+
+reply:
+    write_exact(hPipe, &reply, sizeof(reply));
+    FlushFileBuffers(hPipe);
+    DisconnectNamedPipe(hPipe);
+    CloseHandle(hPipe);
+
+    release_user_context(ctx);
+    free_manifest(&manifest);
+    for (int s = 0; s < 3; s++) {
+        if (stdio[s])
+            CloseHandle(stdio[s]);
+    }
+    if (hClient)
+        CloseHandle(hClient);
+    free(argv);
+    free(argBuf);
+    return 0;
+}
+
+/* Foreground mode: invalidate the cache on WTS session events. */
+static DWORD WINAPI session_watch_thread(LPVOID lpParam)
+{
+    (void)lpParam;
+    while (!g_brokerStopping) {
+        DWORD events = 0;
+        if (!WTSWaitSystemEvent(WTS_CURRENT_SERVER_HANDLE,
+                                WTS_EVENT_LOGON | WTS_EVENT_LOGOFF |
+                                WTS_EVENT_CONNECT | WTS_EVENT_DISCONNECT |
+                                WTS_EVENT_STATECHANGE, &events)) {
+            /* No way to observe session changes: stop trusting the cache */
+            print_error(L"broker: WTSWaitSystemEvent failed, caching disabled",
+                        GetLastError());
+            InterlockedExchange(&g_cacheDisabled, 1);
+            break;
+        }
+        InterlockedIncrement(&g_sessionGeneration);
+    }
+    return 0;
+}
+
+/* Accept clients until stopped, one thread per connection. */
+static int broker_loop(const WCHAR *pipeName)
+{
+    PSECURITY_DESCRIPTOR pSD = NULL;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            L"D:P(A;;GA;;;SY)", SDDL_REVISION_1, &pSD, NULL)) {
+        print_error(L"broker: cannot build pipe security descriptor", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = pSD;
+    sa.bInheritHandle = FALSE;
+
+    fwprintf(stderr, L"runasuser: broker listening on %ls\n", pipeName);
+
+    int exitCode = EXIT_SUCCESS_CODE;
+    DWORD firstInstance = FILE_FLAG_FIRST_PIPE_INSTANCE;
+    while (!g_brokerStopping) {
+        HANDLE hPipe = CreateNamedPipeW(
+            pipeName, PIPE_ACCESS_DUPLEX | firstInstance,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, &sa);
+        if (hPipe == INVALID_HANDLE_VALUE) {
+            print_error(L"broker: CreateNamedPipeW failed", GetLastError());
+            exitCode = EXIT_GENERAL_FAILURE;
+            break;
+        }
+        firstInstance = 0;
+
+        BOOL connected = ConnectNamedPipe(hPipe, NULL) ||
+                         GetLastError() == ERROR_PIPE_CONNECTED;
+        if (g_brokerStopping || !connected) {
+            CloseHandle(hPipe);
+            continue;
+        }
+
+        HANDLE hThread = CreateThread(NULL, 0, broker_client_thread, hPipe, 0, NULL);
+        if (hThread)
+            CloseHandle(hThread);
+        else
+            CloseHandle(hPipe);
+    }
+
+    LocalFree(pSD);
+    return exitCode;
+}
+
+/* Ask broker_loop to return: set the flag, then wake ConnectNamedPipe. */
+static void stop_broker(void)
+{
+    InterlockedExchange(&g_brokerStopping, 1);
+    HANDLE h = CreateFileW(g_brokerPipeName, GENERIC_READ | GENERIC_WRITE, 0,
+                           NULL, OPEN_EXISTING, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE)
+        CloseHandle(h);
+}
+
+static void set_service_state(DWORD state, DWORD win32ExitCode)
+{
+    g_serviceStatus.dwServiceType             = SERVICE_WIN32_OWN_PROCESS;
+    g_serviceStatus.dwCurrentState            = state;
+    g_serviceStatus.dwWin32ExitCode           = win32ExitCode;
+    g_serviceStatus.dwControlsAccepted        = state == SERVICE_RUNNING
+        ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_SESSIONCHANGE
+        : 0;
+    g_serviceStatus.dwWaitHint                = state == SERVICE_STOP_PENDING ? 5000 : 0;
+    SetServiceStatus(g_serviceStatusHandle, &g_serviceStatus);
+}
+
+static DWORD WINAPI service_control_handler(DWORD control, DWORD eventType,
+                                            LPVOID eventData, LPVOID context)
+{
+    (void)eventType; (void)eventData; (void)context;
+
+    switch (control) {
+    case SERVICE_CONTROL_STOP:
+    case SERVICE_CONTROL_SHUTDOWN:
+        set_service_state(SERVICE_STOP_PENDING, NO_ERROR);
+        stop_broker();
+        return NO_ERROR;
+    case SERVICE_CONTROL_SESSIONCHANGE:
+        InterlockedIncrement(&g_sessionGeneration);
+        return NO_ERROR;
+    case SERVICE_CONTROL_INTERROGATE:
+        return NO_ERROR;
+    default:
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+}
+
+static void WINAPI service_main(DWORD argc, LPWSTR *argv)
+{
+    (void)argc; (void)argv;
+
+    g_serviceStatusHandle = RegisterServiceCtrlHandlerExW(
+        BROKER_SERVICE_NAME, service_control_handler, NULL);
+    if (!g_serviceStatusHandle)
+        return;
+
+    set_service_state(SERVICE_RUNNING, NO_ERROR);
+    int rc = broker_loop(g_brokerPipeName);
+    set_service_state(SERVICE_STOPPED,
+                      rc == EXIT_SUCCESS_CODE ? NO_ERROR : ERROR_SERVICE_SPECIFIC_ERROR);
+}
+
+/*
+ * --broker: run under the service control manager when started as a
+ * service (session changes arrive as SERVICE_CONTROL_SESSIONCHANGE), or in
+ * the foreground otherwise (session changes come from WTSWaitSystemEvent).
+ */
+static int run_broker(const Options *opts)
+{
+    g_brokerPipeName = opts->pipeName;
+    InitializeCriticalSection(&g_cacheLock);
+
+    SERVICE_TABLE_ENTRYW table[] = {
+        { (LPWSTR)BROKER_SERVICE_NAME, service_main },
+        { NULL, NULL }
+    };
+    if (StartServiceCtrlDispatcherW(table))
+        return EXIT_SUCCESS_CODE;
+    if (GetLastError() != ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
+        print_error(L"StartServiceCtrlDispatcherW failed", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    /* Not started by the SCM: serve in the foreground */
+    HANDLE hWatch = CreateThread(NULL, 0, session_watch_thread, NULL, 0, NULL);
+    if (hWatch)
+        CloseHandle(hWatch);
+    else
+        InterlockedExchange(&g_cacheDisabled, 1);
+
+    return broker_loop(opts->pipeName);
+}
+
+/*
+ * --via-broker: forward this invocation to a running broker. Returns the
+ * launch result, or -1 if no broker is listening (caller launches directly).
+ */
+static int run_via_broker(const Options *opts, int argc, wchar_t *argv[])
+{
+    HANDLE hPipe = CreateFileW(opts->pipeName, GENERIC_READ | GENERIC_WRITE, 0,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+        WaitNamedPipeW(opts->pipeName, 5000)) {
+        hPipe = CreateFileW(opts->pipeName, GENERIC_READ | GENERIC_WRITE, 0,
+                            NULL, OPEN_EXISTING, 0, NULL);
+    }
+    if (hPipe == INVALID_HANDLE_VALUE) {
+        print_error(L"broker not available, launching directly", GetLastError());
+        return -1;
+    }
+
+    /*
+     * Serialize argv[1..] minus the broker client flags. The broker opens
+     * --batch/--stdout/--stderr files itself, in its own working directory,
+     * so relative paths are made absolute here (room for MAX_PATH each).
+     */
+    size_t bytes = sizeof(BrokerRequest);
+    for (int i = 1; i < argc; i++)
+        bytes += (wcslen(argv[i]) + 1 + MAX_PATH) * sizeof(WCHAR);
+    BYTE *msg = (BYTE *)malloc(bytes);
+    if (!msg) {
+        CloseHandle(hPipe);
+        print_message(L"failed to allocate memory for broker request");
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    BrokerRequest *req = (BrokerRequest *)msg;
+    ZeroMemory(req, sizeof(*req));
+    req->magic   = BROKER_MAGIC;
+    req->version = BROKER_VERSION;
+    req->hStd[0] = (ULONGLONG)(ULONG_PTR)GetStdHandle(STD_INPUT_HANDLE);
+    req->hStd[1] = (ULONGLONG)(ULONG_PTR)GetStdHandle(STD_OUTPUT_HANDLE);
+    req->hStd[2] = (ULONGLONG)(ULONG_PTR)GetStdHandle(STD_ERROR_HANDLE);
+
+    WCHAR *dst = (WCHAR *)(msg + sizeof(*req));
+    for (int i = 1; i < argc; i++) {
+        const WCHAR *arg = argv[i];
+        WCHAR fullPath[MAX_PATH];
+
+        if (i < opts->cmdArgStart) {
+            if (wcscmp(arg, L"--via-broker") == 0)
+                continue;
+            if (wcscmp(arg, L"--broker-pipe") == 0) {
+                i++;                    /* skip the pipe name too */
+                continue;
+            }
+            const WCHAR *prev = argv[i - 1];
+            if (i > 1 && (wcscmp(prev, L"--batch") == 0 ||
+                          wcscmp(prev, L"--stdout") == 0 ||
+                          wcscmp(prev, L"--stderr") == 0 ||
+                          wcscmp(prev, L"--result-file") == 0) &&
+                wcscmp(arg, L"-") != 0 && !is_pipe_path(arg)) {
+                DWORD len = GetFullPathNameW(arg, MAX_PATH, fullPath, NULL);
+                if (len > 0 && len < MAX_PATH)
+                    arg = fullPath;
+            }
         }
-        exitCode = EXIT_TOKEN_FAILURE;
-        goto cleanup;
+        size_t len = wcslen(arg) + 1;
+        memcpy(dst, arg, len * sizeof(WCHAR));
+        dst += len;
+        req->argc++;
     }
+    req->argBytes = (DWORD)((BYTE *)dst - msg - sizeof(*req));
 
-    /* ---- Step 3: Duplicate the token as a primary token ----------------- */
+    BrokerReply reply;
+    BOOL ok = write_exact(hPipe, msg, (DWORD)((BYTE *)dst - msg)) &&
+              read_exact(hPipe, &reply, sizeof(reply));
+    DWORD err = GetLastError();
+    free(msg);
+    CloseHandle(hPipe);
 
-    if (!DuplicateTokenEx(hToken, MAXIMUM_ALLOWED, NULL,
-                          SecurityIdentification, TokenPrimary, &hDupToken)) {
-        print_error(L"DuplicateTokenEx failed", GetLastError());
-        exitCode = EXIT_TOKEN_FAILURE;
-        goto cleanup;
+    if (!ok) {
+        print_error(L"broker request failed", err);
+        return EXIT_GENERAL_FAILURE;
+    }
+    if (reply.processId) {
+        fwprintf(stderr, L"runasuser: process created (PID %lu)\n",
+                 (unsigned long)reply.processId);
     }
+    return (int)reply.exitCode;
+}
 
-    /* ---- Step 4: Create the user's environment block -------------------- */
+/* -------------------------------------------------------------------------- */
+/*  Session helper: resident launcher inside the user's session (--helper)    */
+/* -------------------------------------------------------------------------- */
 
-    if (!CreateEnvironmentBlock(&lpEnvironment, hDupToken, FALSE)) {
-        print_error(L"CreateEnvironmentBlock failed", GetLastError());
-        exitCode = EXIT_GENERAL_FAILURE;
-        goto cleanup;
-    }
+/*
+ * Even with the broker's cached context, every launch pays for
+ * CreateProcessAsUserW with a token and a full environment block. The
+ * session helper (--helper-serve) is started once per session with that
+ * context and afterwards only calls CreateProcessW: its children inherit
+ * its token, environment and desktop. It serves \\.\pipe\runasuser-helper-N
+ * (N = session ID) and exits after its idle timeout; at logoff Windows
+ * ends it with the rest of the session.
+ *
+ * The pipe's DACL admits only SYSTEM clients (the owner may just create
+ * instances), and clients connect at SecurityIdentification, so a helper
+ * can never impersonate its caller. Since the helper runs as the user, a
+ * client checks the server before sending anything: same session, same
+ * executable as itself. Handles go the other way than with the broker: the
+ * client duplicates them into the helper.
+ *
+ * Requests use the broker wire format; the arguments are an optional
+ * "--wait" followed by the command, the handles the command's stdio (with
+ * none and no --wait, it gets its own console, as a direct launch does).
+ */
+#define HELPER_TICK_MS          1000
 
-    /* ---- Step 5: Get the user's profile directory for the working dir --- */
+static volatile LONG     g_helperActive;        /* requests in progress */
+static volatile LONGLONG g_helperLastRequest;   /* GetTickCount64() at the last */
 
-    DWORD profileDirSize = MAX_PATH;
-    if (!GetUserProfileDirectoryW(hDupToken, profileDir, &profileDirSize)) {
-        /* Non-fatal: fall back to no specific working directory */
-        profileDir[0] = L'\0';
-    }
+/* Serve one connected client: start its command, optionally wait, reply. */
+static DWORD WINAPI helper_client_thread(LPVOID lpParam)
+{
+    HANDLE hPipe        = (HANDLE)lpParam;
+    HANDLE stdio[3]     = { NULL, NULL, NULL };
+    WCHAR *argBuf       = NULL;
+    WCHAR **argv        = NULL;
+    WCHAR *cmdLine      = NULL;
+    BrokerReply reply   = { EXIT_GENERAL_FAILURE, 0 };
+    BrokerRequest req;
+    InheritList inherit = { NULL, { NULL, NULL, NULL }, 0 };
 
-    /* ---- Step 6: Build the command line string -------------------------- */
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&pi, sizeof(pi));
 
-    cmdLine = build_command_line(argc - cmdArgStart, &argv[cmdArgStart]);
-    if (!cmdLine) {
-        print_message(L"failed to allocate memory for command line");
-        exitCode = EXIT_GENERAL_FAILURE;
-        goto cleanup;
+    DWORD n = 0;
+    int rc = receive_request(hPipe, L"helper", &req, &argBuf, &argv, &n);
+    if (rc != EXIT_SUCCESS_CODE) {
+        reply.exitCode = (DWORD)rc;
+        goto reply;
     }
 
-    /* ---- Step 7: Launch the process as the user ------------------------- */
+    /* Already ours: the client duplicated them into this process */
+    for (int s = 0; s < 3; s++)
+        stdio[s] = (HANDLE)(ULONG_PTR)req.hStd[s];
 
-    STARTUPINFOW si;
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    si.lpDesktop = L"winsta0\\default"; /* Interactive desktop */
+    BOOL wait = wcscmp(argv[1], L"--wait") == 0;
+    int cmdArgc = (int)n - 1 - (wait ? 1 : 0);
+    if (cmdArgc < 1 || !(cmdLine = build_command_line(cmdArgc, argv + n - cmdArgc))) {
+        reply.exitCode = cmdArgc < 1 ? EXIT_USAGE_ERROR : EXIT_GENERAL_FAILURE;
+        goto reply;
+    }
 
-    DWORD creationFlags = CREATE_UNICODE_ENVIRONMENT;
-    BOOL inheritHandles = FALSE;
+    STARTUPINFOEXW si;
+    ZeroMemory(&si, sizeof(si));
+    DWORD creationFlags = 0;
+    if (wait || stdio[0] || stdio[1] || stdio[2]) {
+        si.StartupInfo.dwFlags   |= STARTF_USESTDHANDLES;
+        si.StartupInfo.hStdInput  = stdio[0];
+        si.StartupInfo.hStdOutput = stdio[1];
+        si.StartupInfo.hStdError  = stdio[2];
+        creationFlags |= CREATE_NO_WINDOW;
+    } else {
+        creationFlags |= CREATE_NEW_CONSOLE;
+    }
 
-    if (waitForChild) {
-        /*
-         * When --wait is used, we pipe the child's stdout/stderr back through
-         * this process so the caller (e.g., a Node.js service) can capture
-         * the output. We use anonymous pipes with inheritable write ends.
-         *
-         * Without --wait, we give the child its own console (CREATE_NEW_CONSOLE)
-         * so interactive/GUI programs work normally.
-         */
-        if (!create_pipe_pair(&hStdoutRead, &hStdoutWrite)) {
-            print_error(L"failed to create stdout pipe", GetLastError());
-            exitCode = EXIT_GENERAL_FAILURE;
-            goto cleanup;
-        }
-        if (!create_pipe_pair(&hStderrRead, &hStderrWrite)) {
-            print_error(L"failed to create stderr pipe", GetLastError());
-            exitCode = EXIT_GENERAL_FAILURE;
-            goto cleanup;
-        }
+    /* Concurrent requests: each child inherits only its own client's handles */
+    if (!inherit_list_init(&inherit, &si))
+        goto reply;
+    creationFlags |= inherit_list_flags(&inherit);
 
-        si.dwFlags |= STARTF_USESTDHANDLES;
-        si.hStdInput  = NULL;         /* Child gets no stdin */
-        si.hStdOutput = hStdoutWrite;
-        si.hStdError  = hStderrWrite;
+    if (!CreateProcessW(NULL, cmdLine, NULL, NULL, inherit.count > 0, creationFlags,
+                        NULL, NULL, &si.StartupInfo, &pi)) {
+        reply.exitCode = EXIT_PROCESS_FAILURE;
+        goto reply;
+    }
+    reply.processId = pi.dwProcessId;
 
-        creationFlags |= CREATE_NO_WINDOW; /* No visible console window */
-        inheritHandles = TRUE;
+    if (wait) {
+        DWORD childExitCode = EXIT_GENERAL_FAILURE;
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        GetExitCodeProcess(pi.hProcess, &childExitCode);
+        reply.exitCode = childExitCode;
     } else {
-        creationFlags |= CREATE_NEW_CONSOLE;
+        reply.exitCode = EXIT_SUCCESS_CODE;
     }
 
-    if (!CreateProcessAsUserW(
-            hDupToken,
-            NULL,                                   /* lpApplicationName */
-            cmdLine,                                /* lpCommandLine (mutable) */
-            NULL,                                   /* lpProcessAttributes */
-            NULL,                                   /* lpThreadAttributes */
-            inheritHandles,                         /* bInheritHandles */
-            creationFlags,
-            lpEnvironment,
-            profileDir[0] ? profileDir : NULL,      /* lpCurrentDirectory */
-            &si,
-            &pi))
-    {
-        DWORD err = GetLastError();
-        print_error(L"CreateProcessAsUserW failed", err);
-        if (err == ERROR_PRIVILEGE_NOT_HELD) {
-            print_message(L"hint: ensure this tool is running as SYSTEM with "
-                          L"SE_ASSIGNPRIMARYTOKEN_NAME and SE_INCREASE_QUOTA_NAME privileges");
-        }
-        exitCode = EXIT_PROCESS_FAILURE;
-        goto cleanup;
+reply:
+    write_exact(hPipe, &reply, sizeof(reply));
+    FlushFileBuffers(hPipe);
+    DisconnectNamedPipe(hPipe);
+    CloseHandle(hPipe);
+
+    inherit_list_free(&inherit);
+    for (int s = 0; s < 3; s++) {
+        if (stdio[s])
+            CloseHandle(stdio[s]);
     }
+    if (pi.hThread)
+        CloseHandle(pi.hThread);
+    if (pi.hProcess)
+        CloseHandle(pi.hProcess);
+    free(cmdLine);
+    free(argv);
+    free(argBuf);
 
-    fwprintf(stderr, L"runasuser: process created (PID %lu)\n",
-             (unsigned long)pi.dwProcessId);
+    InterlockedExchange64(&g_helperLastRequest, (LONGLONG)GetTickCount64());
+    InterlockedDecrement(&g_helperActive);
+    return 0;
+}
 
-    /* ---- Step 8: Optionally wait for the child process ------------------ */
+/*
+ * --helper-serve: accept clients, one thread per connection, until no
+ * request has been in progress for the idle timeout.
+ */
+static int run_helper(const Options *opts)
+{
+    DWORD sessionId = 0;
+    WCHAR pipeName[64];
+    ProcessIdToSessionId(GetCurrentProcessId(), &sessionId);
+    _snwprintf(pipeName, 64, HELPER_PIPE_FMT, (unsigned long)sessionId);
+    pipeName[63] = L'\0';
 
-    if (waitForChild) {
-        /*
-         * Close the write ends of the pipes in the parent process.
-         * This is critical: the child holds the only remaining handles to the
-         * write ends, so when it exits, ReadFile in forward_pipe will see
-         * a broken pipe and return FALSE, ending the forwarding loop.
-         */
-        CloseHandle(hStdoutWrite); hStdoutWrite = NULL;
-        CloseHandle(hStderrWrite); hStderrWrite = NULL;
+    /* SYSTEM connects; the owner (this user) only creates more instances */
+    PSECURITY_DESCRIPTOR pSD = NULL;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            L"D:P(A;;GA;;;SY)(A;;0x4;;;OW)", SDDL_REVISION_1, &pSD, NULL)) {
+        print_error(L"helper: cannot build pipe security descriptor", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
 
-        /*
-         * Forward the child's stderr on a background thread so we can
-         * forward stdout on the main thread concurrently. This prevents
-         * deadlocks if the child writes to both stdout and stderr.
-         */
-        PipeForwardArgs stderrArgs = { hStderrRead, GetStdHandle(STD_ERROR_HANDLE) };
-        hStderrThread = CreateThread(NULL, 0, pipe_forward_thread, &stderrArgs, 0, NULL);
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = pSD;
+    sa.bInheritHandle = FALSE;
 
-        /* Forward stdout on the main thread */
-        forward_pipe(hStdoutRead, GetStdHandle(STD_OUTPUT_HANDLE));
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!ov.hEvent) {
+        LocalFree(pSD);
+        return EXIT_GENERAL_FAILURE;
+    }
 
-        /* Wait for the stderr thread to finish */
-        if (hStderrThread) {
-            WaitForSingleObject(hStderrThread, INFINITE);
-            CloseHandle(hStderrThread);
-            hStderrThread = NULL;
+    int exitCode = EXIT_SUCCESS_CODE;
+    DWORD firstInstance = FILE_FLAG_FIRST_PIPE_INSTANCE;
+    g_helperLastRequest = (LONGLONG)GetTickCount64();
+    for (;;) {
+        HANDLE hPipe = CreateNamedPipeW(
+            pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | firstInstance,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, &sa);
+        if (hPipe == INVALID_HANDLE_VALUE && firstInstance &&
+            GetLastError() == ERROR_ACCESS_DENIED &&
+            GetTickCount64() - (ULONGLONG)g_helperLastRequest < HELPER_START_MS) {
+            /* Another helper has the name; it may be one on its way out */
+            Sleep(10);
+            continue;
+        }
+        if (hPipe == INVALID_HANDLE_VALUE) {
+            if (!firstInstance || GetLastError() != ERROR_ACCESS_DENIED) {
+                print_error(L"helper: CreateNamedPipeW failed", GetLastError());
+                exitCode = EXIT_GENERAL_FAILURE;
+            }
+            break;
         }
+        if (firstInstance)
+            g_helperLastRequest = (LONGLONG)GetTickCount64();
+        firstInstance = 0;
 
-        /* Wait for the child process to fully exit */
-        WaitForSingleObject(pi.hProcess, INFINITE);
+        /* Wait for a client, checking the idle timeout every tick */
+        BOOL idle = FALSE;
+        DWORD bytes = 0;
+        ResetEvent(ov.hEvent);
+        BOOL connected = ConnectNamedPipe(hPipe, &ov);
+        if (!connected && GetLastError() == ERROR_IO_PENDING) {
+            while (WaitForSingleObject(ov.hEvent, HELPER_TICK_MS) == WAIT_TIMEOUT) {
+                if (g_helperActive == 0 &&
+                    GetTickCount64() - (ULONGLONG)g_helperLastRequest >= opts->helperIdleMs) {
+                    idle = TRUE;
+                    CancelIo(hPipe);
+                    break;
+                }
+            }
+            /* A client that connected after all is still served */
+            connected = GetOverlappedResult(hPipe, &ov, &bytes, TRUE);
+        } else if (!connected) {
+            connected = GetLastError() == ERROR_PIPE_CONNECTED;
+        }
+        if (!connected) {
+            CloseHandle(hPipe);
+            if (idle)
+                break;
+            continue;
+        }
 
-        DWORD childExitCode = 1;
-        if (GetExitCodeProcess(pi.hProcess, &childExitCode)) {
-            exitCode = (int)childExitCode;
+        InterlockedIncrement(&g_helperActive);
+        HANDLE hThread = CreateThread(NULL, 0, helper_client_thread, hPipe, 0, NULL);
+        if (hThread) {
+            CloseHandle(hThread);
         } else {
-            print_error(L"GetExitCodeProcess failed", GetLastError());
-            exitCode = EXIT_GENERAL_FAILURE;
+            InterlockedDecrement(&g_helperActive);
+            CloseHandle(hPipe);
         }
+    }
+
+    CloseHandle(ov.hEvent);
+    LocalFree(pSD);
+    return exitCode;
+}
+
+/*
+ * Connect to the session's helper and check that it is one: a process in
+ * that session running this executable. Returns the pipe and, in
+ * *phServer, the helper process (for handle duplication), or
+ * INVALID_HANDLE_VALUE with ERROR_FILE_NOT_FOUND if there is no helper.
+ */
+static HANDLE connect_helper(const WCHAR *pipeName, DWORD sessionId, HANDLE *phServer)
+{
+    /* Identification only: the helper must not act as its SYSTEM caller */
+    DWORD access = GENERIC_READ | GENERIC_WRITE;
+    DWORD sqos   = SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION;
+    HANDLE hPipe = CreateFileW(pipeName, access, 0, NULL, OPEN_EXISTING, sqos, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+        WaitNamedPipeW(pipeName, 5000))
+        hPipe = CreateFileW(pipeName, access, 0, NULL, OPEN_EXISTING, sqos, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return INVALID_HANDLE_VALUE;
+
+    ULONG serverPid = 0;
+    DWORD serverSession = 0;
+    WCHAR selfPath[MAX_PATH], serverPath[MAX_PATH];
+    DWORD serverLen = MAX_PATH;
+    DWORD selfLen = GetModuleFileNameW(NULL, selfPath, MAX_PATH);
+    HANDLE hServer = GetNamedPipeServerProcessId(hPipe, &serverPid)
+        ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_DUP_HANDLE, FALSE, serverPid)
+        : NULL;
+    if (!hServer || selfLen == 0 || selfLen >= MAX_PATH ||
+        !ProcessIdToSessionId(serverPid, &serverSession) || serverSession != sessionId ||
+        !QueryFullProcessImageNameW(hServer, 0, serverPath, &serverLen) ||
+        _wcsicmp(serverPath, selfPath) != 0) {
+        fwprintf(stderr, L"runasuser: %ls is not served by a runasuser helper\n", pipeName);
+        if (hServer)
+            CloseHandle(hServer);
+        CloseHandle(hPipe);
+        SetLastError(ERROR_ACCESS_DENIED);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    *phServer = hServer;
+    return hPipe;
+}
+
+/*
+ * Start the session's helper with a full user context and wait until it
+ * serves its pipe. Returns the connection, as connect_helper does.
+ */
+static HANDLE start_helper(const Options *opts, DWORD sessionId, const WCHAR *pipeName,
+                           HANDLE *phServer)
+{
+    /* The session is known; what is left is its token and environment */
+    Options ctxOpts         = *opts;
+    ctxOpts.sessionSpecified = TRUE;
+    ctxOpts.targetSessionId  = sessionId;
+    ctxOpts.targetUser       = NULL;
+    ctxOpts.waitForSession   = FALSE;
+
+    UserContext *ctx = NULL;
+    if (acquire_user_context(&ctxOpts, &ctx) != EXIT_SUCCESS_CODE)
+        return INVALID_HANDLE_VALUE;
+
+    WCHAR exePath[MAX_PATH];
+    WCHAR idleArg[24];
+    DWORD len = GetModuleFileNameW(NULL, exePath, MAX_PATH);
+    _snwprintf(idleArg, 24, L"--helper=%lu", (unsigned long)(opts->helperIdleMs / 1000));
+    idleArg[23] = L'\0';
+    wchar_t *args[] = { exePath, L"--helper-serve", idleArg };
+    WCHAR *cmdLine = len > 0 && len < MAX_PATH ? build_command_line(3, args) : NULL;
+
+    STARTUPINFOW si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb        = sizeof(si);
+    si.lpDesktop = L"winsta0\\default";
+
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&pi, sizeof(pi));
+    /* It outlives us: leave the caller's job if it may be killed with it */
+    DWORD flags = CREATE_UNICODE_ENVIRONMENT | CREATE_NO_WINDOW;
+    const WCHAR *dir = ctx->profileDir[0] ? ctx->profileDir : NULL;
+    BOOL ok = cmdLine &&
+              (CreateProcessAsUserW(ctx->hToken, NULL, cmdLine, NULL, NULL, FALSE,
+                                    flags | CREATE_BREAKAWAY_FROM_JOB,
+                                    ctx->lpEnvironment, dir, &si, &pi) ||
+               CreateProcessAsUserW(ctx->hToken, NULL, cmdLine, NULL, NULL, FALSE,
+                                    flags, ctx->lpEnvironment, dir, &si, &pi));
+    if (!ok)
+        print_error(L"failed to start the session helper", GetLastError());
+    free(cmdLine);
+    release_user_context(ctx);
+    if (!ok)
+        return INVALID_HANDLE_VALUE;
+    CloseHandle(pi.hThread);
+
+    /* Exit code 0 means another helper won the race: keep trying its pipe */
+    HANDLE hPipe = INVALID_HANDLE_VALUE;
+    DWORD helperExitCode = STILL_ACTIVE;
+    for (DWORD ms = 0; ms < HELPER_START_MS && hPipe == INVALID_HANDLE_VALUE; ms += 10) {
+        hPipe = connect_helper(pipeName, sessionId, phServer);
+        if (hPipe != INVALID_HANDLE_VALUE || GetLastError() == ERROR_ACCESS_DENIED)
+            break;
+        if (GetExitCodeProcess(pi.hProcess, &helperExitCode) &&
+            helperExitCode != STILL_ACTIVE && helperExitCode != EXIT_SUCCESS_CODE)
+            break;
+        Sleep(10);
+    }
+    CloseHandle(pi.hProcess);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        print_message(L"session helper did not start");
+    return hPipe;
+}
+
+/* --helper: launch through the session's helper, starting it if needed. */
+static int run_via_helper(const Options *opts)
+{
+    DWORD sessionId = 0;
+    HANDLE hToken = NULL;
+    WCHAR sessionUser[SESSION_USER_MAX];
+    int exitCode = find_target_session(opts, &sessionId, &hToken, sessionUser);
+    if (hToken)
+        CloseHandle(hToken);
+    if (exitCode != EXIT_SUCCESS_CODE)
+        return exitCode;
+
+    WCHAR pipeName[64];
+    _snwprintf(pipeName, 64, HELPER_PIPE_FMT, (unsigned long)sessionId);
+    pipeName[63] = L'\0';
+
+    HANDLE hServer = NULL;
+    LONGLONG t = trace_now();
+    HANDLE hPipe = connect_helper(pipeName, sessionId, &hServer);
+    if (hPipe != INVALID_HANDLE_VALUE) {
+        trace_phase(L"connect_helper", t);
+    } else if (GetLastError() == ERROR_FILE_NOT_FOUND) {
+        hPipe = start_helper(opts, sessionId, pipeName, &hServer);
+        if (hPipe == INVALID_HANDLE_VALUE)
+            return EXIT_GENERAL_FAILURE;
+        trace_phase(L"start_helper", t);
     } else {
-        exitCode = EXIT_SUCCESS_CODE;
+        print_error(L"cannot connect to the session helper", GetLastError());
+        return EXIT_GENERAL_FAILURE;
     }
 
-    /* ---- Cleanup -------------------------------------------------------- */
+    /* The command's stdio, as a direct launch would hand it over */
+    Redirects redir = { NULL, NULL };
+    if (!open_redirects(opts, &redir)) {
+        CloseHandle(hServer);
+        CloseHandle(hPipe);
+        return EXIT_GENERAL_FAILURE;
+    }
+    HANDLE stdio[3] = {
+        opts->forwardStdin ? GetStdHandle(STD_INPUT_HANDLE) : NULL,
+        redir.hOutput ? redir.hOutput
+                      : opts->waitForChild ? GetStdHandle(STD_OUTPUT_HANDLE) : NULL,
+        redir.hError ? redir.hError
+                     : opts->waitForChild ? GetStdHandle(STD_ERROR_HANDLE) : NULL,
+    };
 
-cleanup:
-    if (hStderrThread)
-        CloseHandle(hStderrThread);
-    if (hStdoutRead)
-        CloseHandle(hStdoutRead);
-    if (hStdoutWrite)
-        CloseHandle(hStdoutWrite);
-    if (hStderrRead)
-        CloseHandle(hStderrRead);
-    if (hStderrWrite)
-        CloseHandle(hStderrWrite);
-    if (pi.hThread)
-        CloseHandle(pi.hThread);
-    if (pi.hProcess)
-        CloseHandle(pi.hProcess);
-    if (cmdLine)
-        free(cmdLine);
-    if (lpEnvironment)
-        DestroyEnvironmentBlock(lpEnvironment);
-    if (hDupToken)
-        CloseHandle(hDupToken);
+    size_t bytes = sizeof(BrokerRequest) + sizeof(L"--wait");
+    for (int i = 0; i < opts->cmdArgc; i++)
+        bytes += (wcslen(opts->cmdArgv[i]) + 1) * sizeof(WCHAR);
+    BYTE *msg = (BYTE *)malloc(bytes);
+    if (!msg) {
+        close_redirects(&redir);
+        CloseHandle(hServer);
+        CloseHandle(hPipe);
+        print_message(L"failed to allocate memory for helper request");
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    BrokerRequest *req = (BrokerRequest *)msg;
+    ZeroMemory(req, sizeof(*req));
+    req->magic   = BROKER_MAGIC;
+    req->version = BROKER_VERSION;
+    for (int s = 0; s < 3; s++) {
+        HANDLE hRemote = NULL;
+        if (stdio[s] && stdio[s] != INVALID_HANDLE_VALUE &&
+            DuplicateHandle(GetCurrentProcess(), stdio[s], hServer, &hRemote,
+                            0, TRUE, DUPLICATE_SAME_ACCESS))
+            req->hStd[s] = (ULONGLONG)(ULONG_PTR)hRemote;
+    }
+    close_redirects(&redir);
+
+    WCHAR *dst = (WCHAR *)(msg + sizeof(*req));
+    for (int i = -1; i < opts->cmdArgc; i++) {
+        if (i < 0 && !opts->waitForChild)
+            continue;
+        const WCHAR *arg = i < 0 ? L"--wait" : opts->cmdArgv[i];
+        size_t len = wcslen(arg) + 1;
+        memcpy(dst, arg, len * sizeof(WCHAR));
+        dst += len;
+        req->argc++;
+    }
+    req->argBytes = (DWORD)((BYTE *)dst - msg - sizeof(*req));
+
+    BrokerReply reply;
+    t = trace_now();
+    BOOL ok = write_exact(hPipe, msg, (DWORD)((BYTE *)dst - msg)) &&
+              read_exact(hPipe, &reply, sizeof(reply));
+    DWORD err = GetLastError();
+    trace_phase(L"helper_round_trip", t);
+    free(msg);
+    CloseHandle(hServer);
+    CloseHandle(hPipe);
+
+    if (!ok) {
+        print_error(L"helper request failed", err);
+        return EXIT_GENERAL_FAILURE;
+    }
+    if (reply.processId) {
+        fwprintf(stderr, L"runasuser: process created (PID %lu)\n",
+                 (unsigned long)reply.processId);
+    } else if (reply.exitCode == EXIT_PROCESS_FAILURE) {
+        print_message(L"the session helper could not create the process");
+    }
+    return (int)reply.exitCode;
+}
+
+/* -------------------------------------------------------------------------- */
+/*  Library API (include/runasuser.h, built with -DRUNASUSER_LIBRARY)         */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A context is the CLI's Options plus one UserContext, acquired at open
+ * and never changed, so launch_command() can run on it from any number of
+ * threads at once. Options and argv arrive as UTF-8 and are converted once.
+ */
+struct runasuser_context {
+    Options      opts;
+    WCHAR      **args;              /* L"runasuser", options..., command */
+    int          nargs;
+    UserContext *user;
+};
+
+struct runasuser_process {
+    HANDLE hProcess;
+    DWORD  processId;
+};
+
+/* Convert a NULL-terminated UTF-8 vector, after an optional first element. */
+static BOOL convert_args(const char *first, const char *const *in, const char *last,
+                         WCHAR ***pArgv, int *pArgc)
+{
+    WCHAR **argv = NULL;
+    int argc = 0, cap = 0;
+    BOOL ok = !first || argv_push(&argv, &argc, &cap, first, (int)strlen(first));
+    for (size_t i = 0; ok && in && in[i]; i++)
+        ok = argv_push(&argv, &argc, &cap, in[i], (int)strlen(in[i]));
+    if (ok && last)
+        ok = argv_push(&argv, &argc, &cap, last, (int)strlen(last));
+    if (!ok) {
+        print_message(L"invalid UTF-8 argument or out of memory");
+        argv_free(argv, argc);
+        return FALSE;
+    }
+    *pArgv = argv;
+    *pArgc = argc;
+    return TRUE;
+}
+
+int runasuser_find_session(runasuser_session *session)
+{
+    DWORD sessionId = 0;
+    HANDLE hToken = NULL;
+    WCHAR userName[SESSION_USER_MAX];
+
+    if (!find_active_session(NULL, &sessionId, &hToken, userName)) {
+        print_message(L"no active user session found");
+        return EXIT_NO_SESSION;
+    }
     if (hToken)
         CloseHandle(hToken);
-    if (sessionUser)
-        WTSFreeMemory(sessionUser);
 
+    WCHAR *queried = userName[0] ? NULL : get_session_username(sessionId);
+    const WCHAR *name = queried ? queried : userName;
+    session->id = sessionId;
+    if (!WideCharToMultiByte(CP_UTF8, 0, name, -1, session->user,
+                             (int)sizeof(session->user), NULL, NULL))
+        session->user[0] = '\0';
+    if (queried)
+        WTSFreeMemory(queried);
+    return EXIT_SUCCESS_CODE;
+}
+
+void runasuser_close(runasuser_context *ctx)
+{
+    if (!ctx)
+        return;
+    release_user_context(ctx->user);
+    argv_free(ctx->args, ctx->nargs);
+    free(ctx);
+}
+
+int runasuser_open(const char *const *options, runasuser_context **pCtx)
+{
+    *pCtx = NULL;
+    runasuser_context *ctx = (runasuser_context *)calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        print_message(L"failed to allocate memory for the context");
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    /* Parse the options as a command line, with a placeholder command */
+    if (!convert_args("runasuser", options, "cmd.exe", &ctx->args, &ctx->nargs)) {
+        free(ctx);
+        return EXIT_USAGE_ERROR;
+    }
+    int exitCode = parse_options(ctx->nargs, ctx->args, &ctx->opts);
+    if (exitCode >= 0) {
+        runasuser_close(ctx);
+        return EXIT_USAGE_ERROR;
+    }
+
+    const Options *opts = &ctx->opts;
+    if (opts->cmdArgc != 1) {
+        fwprintf(stderr, L"runasuser: unknown option %ls\n", opts->cmdArgv[0]);
+        runasuser_close(ctx);
+        return EXIT_USAGE_ERROR;
+    }
+    if (opts->waitForChild || opts->allSessions || opts->batchPath ||
+        opts->runBroker || opts->viaBroker || opts->detach || opts->statusFile ||
+        opts->collectPath || opts->superviseHandle || opts->forwardStdin ||
+        opts->maxOutput || opts->traceTimings || opts->helper || opts->helperServe ||
+        opts->rusage) {
+        print_message(L"the library takes only launch options (--session, --user, "
+                      L"--stdout, --stderr, --max-memory, --cpu-rate, --priority, "
+                      L"--eco, --background, --env, --wait-for-session)");
+        runasuser_close(ctx);
+        return EXIT_USAGE_ERROR;
+    }
+
+    exitCode = acquire_user_context(opts, &ctx->user);
+    if (exitCode != EXIT_SUCCESS_CODE) {
+        ctx->user = NULL;
+        runasuser_close(ctx);
+        return exitCode;
+    }
+
+    *pCtx = ctx;
+    return EXIT_SUCCESS_CODE;
+}
+
+int runasuser_spawn(runasuser_context *ctx, const char *const *argv,
+                    runasuser_process **pProc)
+{
+    *pProc = NULL;
+    if (!argv || !argv[0]) {
+        print_message(L"no command specified");
+        return EXIT_USAGE_ERROR;
+    }
+
+    runasuser_process *proc = (runasuser_process *)calloc(1, sizeof(*proc));
+    if (!proc) {
+        print_message(L"failed to allocate memory for the process");
+        return EXIT_GENERAL_FAILURE;
+    }
+
+    /* The context's options with this command */
+    Options opts = ctx->opts;
+    if (!convert_args(NULL, argv, NULL, &opts.cmdArgv, &opts.cmdArgc)) {
+        free(proc);
+        return EXIT_USAGE_ERROR;
+    }
+
+    int exitCode = launch_command(&opts, ctx->user, NULL, &proc->processId,
+                                  &proc->hProcess);
+    argv_free(opts.cmdArgv, opts.cmdArgc);
+    if (exitCode != EXIT_SUCCESS_CODE) {
+        free(proc);
+        return exitCode;
+    }
+
+    *pProc = proc;
+    return EXIT_SUCCESS_CODE;
+}
+
+unsigned long runasuser_pid(const runasuser_process *proc)
+{
+    return (unsigned long)proc->processId;
+}
+
+int runasuser_wait(runasuser_process *proc, int nohang, int *exitCode)
+{
+    DWORD rc = WaitForSingleObject(proc->hProcess, nohang ? 0 : INFINITE);
+    if (rc == WAIT_TIMEOUT)
+        return EXIT_PENDING;
+    DWORD childExitCode;
+    if (rc != WAIT_OBJECT_0 || !GetExitCodeProcess(proc->hProcess, &childExitCode)) {
+        print_error(L"failed to wait for the process", GetLastError());
+        return EXIT_GENERAL_FAILURE;
+    }
+    *exitCode = (int)childExitCode;
+    return EXIT_SUCCESS_CODE;
+}
+
+void runasuser_release(runasuser_process *proc)
+{
+    if (!proc)
+        return;
+    if (proc->hProcess)
+        CloseHandle(proc->hProcess);
+    free(proc);
+}
+
+/* -------------------------------------------------------------------------- */
+/*  wmain - entry point                                                       */
+/* -------------------------------------------------------------------------- */
+
+int runasuser_main(int argc, wchar_t *argv[])
+{
+    Options opts;
+    int exitCode = parse_options(argc, argv, &opts);
+    if (exitCode >= 0)
+        return exitCode;
+
+    if (opts.collectPath)
+        return collect_status(opts.collectPath);
+    if (opts.superviseHandle)
+        return run_supervisor(&opts);
+
+    if (opts.runBroker)
+        return run_broker(&opts);
+    if (opts.helperServe)
+        return run_helper(&opts);
+
+    /* --rusage reports the phases, so they are collected even untraced */
+    if (opts.traceTimings || opts.rusage)
+        trace_init(opts.traceJson, opts.traceTimings);
+
+    if (opts.helper) {
+        exitCode = run_via_helper(&opts);
+        trace_report();
+        return exitCode;
+    }
+
+    if (opts.viaBroker) {
+        LONGLONG t = trace_now();
+        exitCode = run_via_broker(&opts, argc, argv);
+        if (exitCode >= 0) {
+            trace_phase(L"broker_round_trip", t);
+            trace_report();
+            return exitCode;
+        }
+    }
+
+    if (opts.waitForChild || opts.batchPath)
+        cancel_arm();
+
+    if (opts.allSessions) {
+        exitCode = run_all_sessions(&opts);
+        trace_report();
+        return exitCode;
+    }
+
+    /* Read the whole manifest up front so a bad one fails before any launch */
+    BatchManifest manifest = { NULL, 0, 0 };
+    LONGLONG t = trace_now();
+    if (opts.batchPath &&
+        !load_manifest(opts.batchPath, GetStdHandle(STD_INPUT_HANDLE), &manifest))
+        return EXIT_USAGE_ERROR;
+    if (opts.batchPath)
+        trace_phase(L"load_manifest", t);
+
+    UserContext *ctx = NULL;
+    exitCode = acquire_user_context(&opts, &ctx);
+    if (exitCode == EXIT_SUCCESS_CODE) {
+        if (opts.batchPath) {
+            t = trace_now();
+            exitCode = run_batch(&manifest, &opts, ctx, NULL);
+            trace_phase(L"batch", t);
+        } else
+            exitCode = launch_command(&opts, ctx, NULL, NULL, NULL);
+        release_user_context(ctx);
+    }
+
+    free_manifest(&manifest);
+    trace_report();
     return exitCode;
 }
+
+#ifndef RUNASUSER_LIBRARY
+int wmain(int argc, wchar_t *argv[])
+{
+    return runasuser_main(argc, argv);
+}
+#endif